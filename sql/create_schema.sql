@@ -18,7 +18,8 @@ INSERT INTO order_states (state_name) VALUES
 CREATE TABLE orders (
     order_id SERIAL PRIMARY KEY,
     order_date TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
-    state_id INTEGER REFERENCES order_states(state_id)
+    state_id INTEGER REFERENCES order_states(state_id),
+    journal_seq BIGINT UNIQUE   -- sequence number of the order in the order journal of shop_server
 );
 
 CREATE TABLE order_items (
@@ -29,3 +30,70 @@ CREATE TABLE order_items (
     unit_price INTEGER NOT NULL,
     CONSTRAINT unique_order_item_order_id UNIQUE (order_id, order_item_id)
 );
+
+-- Version counter of the item catalog. It is incremented on every change of the items table
+-- so that servers can check if their catalog snapshot file is still up to date.
+CREATE TABLE catalog_version (
+    version BIGINT NOT NULL
+);
+
+INSERT INTO catalog_version (version) VALUES (1);
+
+CREATE FUNCTION bump_catalog_version() RETURNS trigger AS $$
+BEGIN
+    UPDATE catalog_version SET version = version + 1;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER items_catalog_version
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON items
+    FOR EACH STATEMENT EXECUTE FUNCTION bump_catalog_version();
+
+-- Notifies shop servers about changed orders so that they can invalidate their order cache.
+-- The payload is the ID of the changed order or empty if any order may have changed.
+CREATE FUNCTION notify_orders_changed() RETURNS trigger AS $$
+BEGIN
+    IF TG_LEVEL = 'STATEMENT' THEN
+        PERFORM pg_notify('orders_changed', '');
+    ELSIF TG_OP = 'DELETE' THEN
+        PERFORM pg_notify('orders_changed', OLD.order_id::text);
+    ELSE
+        IF TG_OP = 'UPDATE' AND OLD.order_id <> NEW.order_id THEN
+            PERFORM pg_notify('orders_changed', OLD.order_id::text);
+        END IF;
+        PERFORM pg_notify('orders_changed', NEW.order_id::text);
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER orders_changed
+    AFTER UPDATE OR DELETE ON orders
+    FOR EACH ROW EXECUTE FUNCTION notify_orders_changed();
+
+CREATE TRIGGER order_items_changed
+    AFTER INSERT OR UPDATE OR DELETE ON order_items
+    FOR EACH ROW EXECUTE FUNCTION notify_orders_changed();
+
+CREATE TRIGGER orders_truncated
+    AFTER TRUNCATE ON orders
+    FOR EACH STATEMENT EXECUTE FUNCTION notify_orders_changed();
+
+CREATE TRIGGER order_items_truncated
+    AFTER TRUNCATE ON order_items
+    FOR EACH STATEMENT EXECUTE FUNCTION notify_orders_changed();
+
+-- cached orders contain the names of their items
+CREATE TRIGGER items_orders_changed
+    AFTER UPDATE OR DELETE OR TRUNCATE ON items
+    FOR EACH STATEMENT EXECUTE FUNCTION notify_orders_changed();
+
+-- Stock of the items. Items without a row are not limited. shop_server reserves stock in memory
+-- and subtracts the reserved quantities from this table in batches, changes made by others,
+-- e.g. restocking with UPDATE stock SET available = available + 100, are picked up with the
+-- next batch.
+CREATE TABLE stock (
+    item_id INTEGER PRIMARY KEY REFERENCES items(item_id),
+    available INTEGER NOT NULL
+);
@@ -15,3 +15,8 @@ INSERT INTO order_items (order_id, item_id, quantity, unit_price) VALUES
     (1, 2, 1, 7500),   -- Order 1 contains 1 unit of Product B
     (2, 2, 3, 7500),   -- Order 2 contains 3 units of Product B
     (2, 3, 1, 5000);   -- Order 2 contains 1 unit of Product C
+
+-- Insert test data into stock, Product C is not limited
+INSERT INTO stock (item_id, available) VALUES
+    (1, 1000),
+    (2, 500);
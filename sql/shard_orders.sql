@@ -0,0 +1,8 @@
+-- Stripes the order IDs of one order shard, run it on every shard including the primary:
+--   psql -v shards=<amount of shards> -v shard=<number of the shard> -f sql/shard_orders.sql
+-- Shard k of n shards generates the IDs k, k + n, k + 2n, ... above the IDs it already has,
+-- so the ID of an order tells the server its shard. The primary is shard 0.
+SELECT format('ALTER SEQUENCE orders_order_id_seq INCREMENT BY %s START WITH %s RESTART WITH %s',
+        :shards, first_id, first_id)
+FROM (SELECT :shard + :shards * (coalesce(max(order_id), 0) / :shards + 1) AS first_id FROM orders) s
+\gexec
@@ -3,20 +3,36 @@
 
 #include <stdint.h>
 
+#include "types.h"
+
 #define API_MAGIC_NUM 64
+#define API_VERSION 2
 #define MAX_PAYLOAD_SIZE 1024*1024*20
 
+// flags of request and response headers
+#define HEADER_FLAG_ACCEPT_COMPRESSION  0x01    // request: client can decode compressed response payloads
+#define HEADER_FLAG_COMPRESSED          0x02    // payload is compressed, see compression.h
+
 typedef struct
 {
     uint8_t magicnum;
     uint8_t version;
     uint16_t request_id;
     uint32_t payload_size;
+    uint32_t flags;
 } RequestHeader;
 
 typedef enum
 {
-    REQUEST_DISPLAY_ORDERS
+    REQUEST_DISPLAY_ORDERS,
+    REQUEST_LIST_ITEMS,
+    REQUEST_ADD_ORDER,          // payload is an AddOrderRequest
+    REQUEST_EXPORT_ORDERS,      // answered with RESPONSE_ORDERS_CHUNK frames and RESPONSE_END_OF_STREAM
+    REQUEST_GET_ORDER,          // payload is a GetOrderRequest
+    REQUEST_STATS,              // no payload
+    REQUEST_BATCH,              // payload is a BatchRequest
+    REQUEST_ATTACH_RING,        // no payload, only on Unix sockets, see shm_transport.h
+    REQUEST_SUBSCRIBE_ORDERS,   // no payload, answered with RESPONSE_SUBSCRIBE_ORDERS and RESPONSE_ORDERS_DELTA frames until the connection is closed
 } RequestId;
 
 typedef struct
@@ -25,12 +41,139 @@ typedef struct
     uint8_t version;
     uint16_t response_id;
     uint32_t payload_size;
+    uint32_t flags;
 } ResponseHeader;
 
 typedef enum
 {
     RESPONSE_ERROR,
     RESPONSE_DISPLAY_ORDERS,
+    RESPONSE_LIST_ITEMS,        // payload is an array of CatalogItem
+    RESPONSE_ADD_ORDER,         // payload is an AddOrderResponse
+    RESPONSE_ORDERS_CHUNK,      // payload is an array of at most ORDERS_CHUNK_ITEMS FullOrderItem
+    RESPONSE_END_OF_STREAM,     // last frame of a streamed response, no payload
+    RESPONSE_GET_ORDER,         // payload is a GetOrderResponse
+    RESPONSE_STATS,             // payload is a StatsResponse
+    RESPONSE_BATCH,             // payload is a BatchResponse
+    RESPONSE_ATTACH_RING,       // payload is an AttachRingResponse
+    RESPONSE_SUBSCRIBE_ORDERS,  // no payload, changes made afterwards are pushed as RESPONSE_ORDERS_DELTA
+    RESPONSE_ORDERS_DELTA,      // payload is an OrdersDeltaResponse, pushed without a request
 } ResponseId;
 
+#define ORDERS_CHUNK_ITEMS 256
+
+#define MAX_ORDER_ITEMS 100
+
+/// @brief Item and quantity of an order to add
+typedef struct
+{
+    int32_t item_id;
+    int32_t quantity;
+} AddOrderItem;
+
+/// @brief Payload of REQUEST_ADD_ORDER
+typedef struct
+{
+    uint32_t item_count;        // amount of items, at most MAX_ORDER_ITEMS
+    AddOrderItem items[];
+} AddOrderRequest;
+
+/// @brief Payload of RESPONSE_ADD_ORDER
+typedef struct
+{
+    int32_t order_id;           // ID of the new order, 0 if the order was written into the journal
+    uint32_t reserved;
+    uint64_t journal_seq;       // sequence number in the order journal, 0 if the order was stored directly
+} AddOrderResponse;
+
+/// @brief Payload of REQUEST_GET_ORDER
+typedef struct
+{
+    int32_t order_id;
+} GetOrderRequest;
+
+/// @brief Payload of RESPONSE_GET_ORDER
+typedef struct
+{
+    Order order;
+    uint32_t item_count;        // amount of items, at most MAX_ORDER_ITEMS
+    OrderItem items[];
+} GetOrderResponse;
+
+/// @brief Payload of RESPONSE_STATS, counters since the start of the server
+typedef struct
+{
+    uint64_t order_cache_hits;          // REQUEST_GET_ORDER answered from the cache
+    uint64_t order_cache_misses;        // REQUEST_GET_ORDER answered from the database
+    uint64_t order_cache_evictions;     // orders dropped to stay below the memory limit
+    uint64_t order_cache_invalidations; // orders dropped because they changed
+    uint64_t order_cache_entries;       // orders currently cached
+    uint64_t order_cache_bytes;         // memory used by cached orders
+    uint64_t order_cache_max_bytes;     // memory limit of the cache, 0 if the cache is disabled
+    uint64_t order_feed_subscribers;    // connections subscribed to changed orders
+    uint64_t order_feed_updates;        // changed orders pushed to subscribers
+    uint64_t order_feed_coalesced;      // changes merged into a change of the same order which was not sent yet
+    uint64_t order_feed_resyncs;        // subscribers told to reload all orders
+    uint64_t rate_limited_connections;  // connections closed because their address exceeded limit.connections
+    uint64_t rate_limited_requests;     // requests answered with an error because they exceeded their limit
+    uint64_t rate_limit_overflows;      // checks passed because the bucket table had no free slot
+    uint64_t captured_records;          // records written to the capture file, see server.capture_path
+    uint64_t capture_dropped;           // records dropped because the capture buffer was full
+} StatsResponse;
+
+/// @brief Payload of RESPONSE_ATTACH_RING. The memfd of the shared memory is passed with
+///        SCM_RIGHTS, all further frames of the connection go through its rings.
+typedef struct
+{
+    uint32_t ring_size;         // capacity of each ring
+    uint32_t reserved;
+} AttachRingResponse;
+
+#define ORDERS_DELTA_RESYNC 0x01    // changes were lost, the subscriber has to reload all orders
+
+/// @brief Payload of RESPONSE_ORDERS_DELTA, followed by order_count OrderDelta with their lines
+typedef struct
+{
+    uint32_t flags;             // ORDERS_DELTA_RESYNC
+    uint32_t order_count;       // amount of changed orders
+} OrdersDeltaResponse;
+
+/// @brief Current state of a changed order, followed by item_count FullOrderItem. An order
+///        without items was deleted.
+typedef struct
+{
+    int32_t order_id;
+    uint32_t item_count;        // amount of items, at most MAX_ORDER_ITEMS
+} OrderDelta;
+
+#define MAX_BATCH_REQUESTS 64
+#define BATCH_ALIGNMENT 8
+#define BATCH_PADDED_SIZE(size) (((size) + BATCH_ALIGNMENT - 1) & ~(uint32_t)(BATCH_ALIGNMENT - 1))
+
+/// @brief Sub-request or sub-response of a batch, followed by its payload which is padded
+///        with zeros to BATCH_PADDED_SIZE(payload_size)
+typedef struct
+{
+    uint16_t id;                // RequestId or ResponseId
+    uint16_t reserved;
+    uint32_t payload_size;      // size of the payload without padding
+} BatchEntry;
+
+/// @brief Payload of REQUEST_BATCH, followed by request_count BatchEntry with their payloads.
+///        Streamed and nested requests are not allowed in a batch.
+typedef struct
+{
+    uint32_t request_count;     // amount of sub-requests, at most MAX_BATCH_REQUESTS
+    uint32_t reserved;
+} BatchRequest;
+
+/// @brief Payload of RESPONSE_BATCH, followed by a BatchEntry with payload for every
+///        sub-request in the order of the request. A failed sub-request is answered with
+///        RESPONSE_ERROR, the other sub-requests are not affected.
+typedef struct
+{
+    uint32_t response_count;    // amount of sub-responses
+    uint32_t reserved;
+} BatchResponse;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,265 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CAPTURE_ENTRY_PADDING   0x80000000U     // state of the unused end of the buffer before a wrap
+
+/// @brief Record in the ring buffer, followed by the padded payload
+typedef struct {
+    atomic_uint     state;      // 0 while the record is written, afterwards the size of the entry
+    uint32_t        reserved;
+    CaptureRecord   record;     // record as it is written to the file
+} CaptureEntry;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// @brief Releases the space of an entry for the producers, the buffer has to be zero so an
+///        entry which is reserved but not published yet is recognized
+/// @param entry written entry
+/// @param size size of the entry
+static void clear_entry(CaptureEntry *entry, uint32_t size) {
+    atomic_store_explicit(&entry->state, 0, memory_order_relaxed);
+    memset((uint8_t *)entry + sizeof(entry->state), 0, size - sizeof(entry->state));
+}
+
+/// @brief Writes all published entries into the file
+/// @param capture started capture
+/// @return amount of written entries
+static int drain_entries(Capture *capture) {
+    uint64_t position = atomic_load_explicit(&capture->written, memory_order_relaxed);
+    uint64_t end = atomic_load_explicit(&capture->reserved, memory_order_acquire);
+    int drained = 0;
+    while (position < end) {
+        CaptureEntry *entry = (CaptureEntry *)(capture->data + (position & capture->mask));
+        uint32_t state = atomic_load_explicit(&entry->state, memory_order_acquire);
+        if (state == 0) {
+            // the producer is still copying, the entries behind it wait for the next round
+            break;
+        }
+        uint32_t size = state & ~CAPTURE_ENTRY_PADDING;
+        if (!(state & CAPTURE_ENTRY_PADDING)) {
+            // the padding of the payload is zero like the whole free buffer
+            if (capture->file && fwrite(&entry->record, size - offsetof(CaptureEntry, record), 1, capture->file) != 1) {
+                char errmsg[512];
+                strerror_r(errno, errmsg, sizeof(errmsg));
+                fprintf(stderr, "ERROR: cannot write capture file, capturing stopped: %s\r\n", errmsg);
+                fclose(capture->file);
+                capture->file = NULL;
+            }
+            atomic_fetch_add_explicit(capture->file ? &capture->records : &capture->dropped, 1, memory_order_relaxed);
+            drained++;
+        }
+        clear_entry(entry, size);
+        position += size;
+        atomic_store_explicit(&capture->written, position, memory_order_release);
+    }
+    if (drained > 0 && capture->file) {
+        fflush(capture->file);
+    }
+    return drained;
+}
+
+/// @brief Main loop of the writer thread
+/// @param arg capture
+/// @return NULL
+static void *writer_loop(void *arg) {
+    Capture *capture = arg;
+    struct timespec delay = {
+        .tv_sec = CAPTURE_FLUSH_MS / 1000,
+        .tv_nsec = (CAPTURE_FLUSH_MS % 1000) * 1000000L
+    };
+    while (1) {
+        // the writer only sleeps while the buffer is empty, so a burst does not fill it
+        if (drain_entries(capture) == 0) {
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+/// @brief Appends a record to the ring buffer, the record is dropped if the buffer is full
+/// @param capture initialized capture
+/// @param connection ID of the connection
+/// @param kind kind of the record
+/// @param header header of the frame, NULL for other kinds
+/// @param payload payload of the frame
+static void append_record(Capture *capture, uint32_t connection, CaptureKind kind, const FrameHeader *header, const uint8_t *payload) {
+    uint64_t time_ns = clock_ns(CLOCK_MONOTONIC) - capture->start_ns;
+    uint32_t payload_size = header ? header->payload_size : 0;
+    uint64_t size = sizeof(CaptureEntry) + CAPTURE_PADDED_SIZE((uint64_t)payload_size);
+    // a single frame must not take over the buffer
+    if (size > capture->capacity / 4) {
+        atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uint64_t position = atomic_load_explicit(&capture->reserved, memory_order_relaxed);
+    uint64_t padding;
+    do {
+        // an entry never wraps, the rest of the buffer is skipped instead
+        uint64_t offset = position & capture->mask;
+        padding = capture->capacity - offset < size ? capture->capacity - offset : 0;
+        // a stale position lies behind the current one, so it never looks like a full buffer
+        if (position + padding + size > atomic_load_explicit(&capture->written, memory_order_acquire) + capture->capacity) {
+            atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&capture->reserved, &position, position + padding + size,
+            memory_order_relaxed, memory_order_relaxed));
+
+    if (padding > 0) {
+        CaptureEntry *skipped = (CaptureEntry *)(capture->data + (position & capture->mask));
+        atomic_store_explicit(&skipped->state, (uint32_t)padding | CAPTURE_ENTRY_PADDING, memory_order_release);
+    }
+    CaptureEntry *entry = (CaptureEntry *)(capture->data + ((position + padding) & capture->mask));
+    entry->record.time_ns = time_ns;
+    entry->record.connection = connection;
+    entry->record.kind = kind;
+    if (header) {
+        entry->record.header = *header;
+    }
+    if (payload_size > 0) {
+        memcpy(entry + 1, payload, payload_size);
+    }
+    atomic_store_explicit(&entry->state, (uint32_t)size, memory_order_release);
+}
+
+int capture_init(Capture *capture, const char *path, int buffer_size, Error *error) {
+    memset(capture, 0, sizeof(*capture));
+    if (path[0] == '\0') {
+        return EXIT_SUCCESS;
+    }
+    if (buffer_size < CAPTURE_MIN_BUFFER_SIZE || buffer_size > CAPTURE_MAX_BUFFER_SIZE
+            || (buffer_size & (buffer_size - 1)) != 0) {
+        error_write(error, "invalid capture buffer size %d", buffer_size);
+        return EXIT_FAILURE;
+    }
+    capture->file = fopen(path, "wb");
+    if (!capture->file) {
+        char errmsg[256];
+        strerror_r(errno, errmsg, sizeof(errmsg));
+        error_write(error, "cannot create capture file %s: %s", path, errmsg);
+        return EXIT_FAILURE;
+    }
+    // zero pages, since a state of 0 marks entries which are not published yet
+    capture->data = calloc(1, buffer_size);
+    if (!capture->data) {
+        error_write(error, "cannot allocate %d bytes of capture buffer", buffer_size);
+        fclose(capture->file);
+        capture->file = NULL;
+        return EXIT_FAILURE;
+    }
+    capture->capacity = buffer_size;
+    capture->mask = buffer_size - 1;
+    capture->start_ns = clock_ns(CLOCK_MONOTONIC);
+    CaptureFileHeader header = {
+        .magic = CAPTURE_MAGIC,
+        .version = CAPTURE_VERSION,
+        .start_time_ns = clock_ns(CLOCK_REALTIME)
+    };
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1 || fflush(capture->file) != 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        fclose(capture->file);
+        free(capture->data);
+        memset(capture, 0, sizeof(*capture));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int capture_start(Capture *capture, Error *error) {
+    if (!capture->data) {
+        return EXIT_SUCCESS;
+    }
+    int result = pthread_create(&capture->thread, NULL, writer_loop, capture);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void capture_event(Capture *capture, uint32_t connection, CaptureKind kind) {
+    if (capture->data) {
+        append_record(capture, connection, kind, NULL, NULL);
+    }
+}
+
+void capture_frame(Capture *capture, uint32_t connection, const FrameHeader *header, const uint8_t *payload) {
+    if (capture->data) {
+        append_record(capture, connection, CAPTURE_FRAME, header, payload);
+    }
+}
+
+void capture_stats(Capture *capture, CaptureStats *stats) {
+    stats->records = atomic_load_explicit(&capture->records, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&capture->dropped, memory_order_relaxed);
+}
+
+int capture_log_open(CaptureLog *log, const char *path, Error *error) {
+    memset(log, 0, sizeof(*log));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if ((size_t)st.st_size < sizeof(CaptureFileHeader)) {
+        error_write(error, "%s is not a capture file", path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    const CaptureFileHeader *header = mapping;
+    if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION) {
+        error_write(error, "%s is not a capture file of version %d", path, CAPTURE_VERSION);
+        munmap(mapping, st.st_size);
+        return EXIT_FAILURE;
+    }
+    log->data = mapping;
+    log->size = st.st_size;
+    log->header = header;
+    return EXIT_SUCCESS;
+}
+
+const CaptureRecord *capture_log_next(const CaptureLog *log, size_t *offset, const uint8_t **payload) {
+    size_t position = *offset > sizeof(CaptureFileHeader) ? *offset : sizeof(CaptureFileHeader);
+    if (log->size - position < sizeof(CaptureRecord)) {
+        return NULL;
+    }
+    const CaptureRecord *record = (const CaptureRecord *)(log->data + position);
+    uint64_t size = sizeof(CaptureRecord) + CAPTURE_PADDED_SIZE((uint64_t)record->header.payload_size);
+    if (log->size - position < size) {
+        return NULL;
+    }
+    *payload = (const uint8_t *)(record + 1);
+    *offset = position + size;
+    return record;
+}
+
+void capture_log_close(CaptureLog *log) {
+    if (log->data) {
+        munmap(log->data, log->size);
+    }
+    memset(log, 0, sizeof(*log));
+}
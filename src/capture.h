@@ -0,0 +1,133 @@
+#ifndef __CAPTURE_H_
+#define __CAPTURE_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "error.h"
+#include "frame.h"
+
+#define CAPTURE_MAGIC               0x50414353      // "SCAP"
+#define CAPTURE_VERSION             1
+#define CAPTURE_MAX_PATH            256
+#define CAPTURE_DEFAULT_BUFFER_SIZE (16 * 1024 * 1024)
+#define CAPTURE_MIN_BUFFER_SIZE     (64 * 1024)
+#define CAPTURE_MAX_BUFFER_SIZE     (1024 * 1024 * 1024)
+#define CAPTURE_FLUSH_MS            10              // how often an idle writer checks the buffer for new records
+#define CAPTURE_ALIGNMENT           8
+#define CAPTURE_PADDED_SIZE(size)   (((size) + CAPTURE_ALIGNMENT - 1) & ~(uint64_t)(CAPTURE_ALIGNMENT - 1))
+
+/// @brief Kind of a captured event
+typedef enum {
+    CAPTURE_OPEN = 1,   // a connection was accepted
+    CAPTURE_FRAME,      // a frame was received, the record is followed by its payload
+    CAPTURE_CLOSE,      // a connection was closed
+} CaptureKind;
+
+/// @brief Start of a capture file, followed by the records
+typedef struct {
+    uint32_t    magic;          // CAPTURE_MAGIC
+    uint32_t    version;        // CAPTURE_VERSION
+    uint64_t    start_time_ns;  // wall clock time of the start of the capture
+} CaptureFileHeader;
+
+/// @brief Record of a capture file. A frame record is followed by the payload of the frame,
+///        padded with zeros to CAPTURE_PADDED_SIZE(payload_size), so every record is aligned.
+typedef struct {
+    uint64_t    time_ns;        // time since the start of the capture
+    uint32_t    connection;     // ID of the connection, unique within the capture
+    uint32_t    kind;           // CaptureKind
+    FrameHeader header;         // header of the frame, zero for other kinds
+    uint32_t    reserved;
+} CaptureRecord;
+
+/// @brief Records incoming frames into a binary file. Any thread appends records to a
+///        lock-free multi-producer ring buffer by reserving space with a compare and swap
+///        and publishing the record with a release store of its state, so the threads
+///        decoding requests never wait for each other or for the disk. A writer thread
+///        moves the published records into the file in the order of their reservation.
+///        Records which do not fit into the buffer are dropped and counted.
+typedef struct {
+    uint8_t             *data;          // ring buffer, NULL if capturing is disabled
+    uint64_t            capacity;       // size of the ring buffer, a power of two
+    uint64_t            mask;           // capacity - 1
+    uint64_t            start_ns;       // monotonic time of the start of the capture
+    FILE                *file;          // capture file
+    pthread_t           thread;         // writer thread
+    _Alignas(64)
+    atomic_ullong       reserved;       // bytes reserved by producers
+    _Alignas(64)
+    atomic_ullong       written;        // bytes released by the writer
+    _Alignas(64)
+    atomic_ullong       records;        // records written to the file
+    atomic_ullong       dropped;        // records dropped because the buffer was full
+} Capture;
+
+/// @brief Counters of a capture
+typedef struct {
+    uint64_t    records;    // records written to the file
+    uint64_t    dropped;    // records dropped because the buffer was full
+} CaptureStats;
+
+/// @brief Mapped capture file for reading its records
+typedef struct {
+    uint8_t                 *data;      // mapped file
+    size_t                  size;       // size of the file
+    const CaptureFileHeader *header;    // start of the file
+} CaptureLog;
+
+/// @brief Creates the capture file and allocates the buffer
+/// @param capture capture to initialize
+/// @param path path of the capture file, empty to disable capturing
+/// @param buffer_size size of the ring buffer, a power of two between CAPTURE_MIN_BUFFER_SIZE and CAPTURE_MAX_BUFFER_SIZE
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int capture_init(Capture *capture, const char *path, int buffer_size, Error *error);
+
+/// @brief Starts the writer thread, does nothing if capturing is disabled
+/// @param capture initialized capture
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int capture_start(Capture *capture, Error *error);
+
+/// @brief Records an event of a connection without a frame
+/// @param capture initialized capture
+/// @param connection ID of the connection
+/// @param kind CAPTURE_OPEN or CAPTURE_CLOSE
+void capture_event(Capture *capture, uint32_t connection, CaptureKind kind);
+
+/// @brief Records a received frame
+/// @param capture initialized capture
+/// @param connection ID of the connection
+/// @param header header of the frame
+/// @param payload payload of the frame, may be NULL if payload_size is 0
+void capture_frame(Capture *capture, uint32_t connection, const FrameHeader *header, const uint8_t *payload);
+
+/// @brief Reads the counters of a capture
+/// @param capture initialized capture
+/// @param stats address to save the counters
+void capture_stats(Capture *capture, CaptureStats *stats);
+
+/// @brief Maps a capture file
+/// @param log log to initialize
+/// @param path path of the capture file
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int capture_log_open(CaptureLog *log, const char *path, Error *error);
+
+/// @brief Returns the next record of a capture file. A record which was only partially
+///        written, e.g. because the server was killed, ends the file.
+/// @param log mapped capture file
+/// @param offset offset of the record in the file, 0 for the first one, advanced to the next record
+/// @param payload address to save the start of the payload of a frame
+/// @return the record or NULL at the end of the file
+const CaptureRecord *capture_log_next(const CaptureLog *log, size_t *offset, const uint8_t **payload);
+
+/// @brief Unmaps a capture file
+/// @param log mapped capture file
+void capture_log_close(CaptureLog *log);
+
+#endif
@@ -0,0 +1,257 @@
+#include "catalog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "database.h"
+#include "types.h"
+
+_Static_assert(sizeof(CatalogSnapshotHeader) == CATALOG_CACHE_LINE, "snapshot header must fill one cache line");
+_Static_assert(sizeof(CatalogItem) % CATALOG_CACHE_LINE == 0, "catalog items must be cache line aligned");
+
+/// @brief Calculates the 64 bit FNV-1a hash of a buffer
+/// @param data start of the buffer
+/// @param size size of the buffer in bytes
+/// @return checksum
+static uint64_t checksum_fnv1a(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/// @brief Checks the structure and checksum of a mapped snapshot
+/// @param mapping start of the mapped file
+/// @param size size of the mapped file
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS if the snapshot is intact
+static int validate_snapshot(const void *mapping, size_t size, Error *error) {
+    const CatalogSnapshotHeader *header = mapping;
+    if (size < sizeof(*header)) {
+        error_write(error, "snapshot too small (%zu bytes)", size);
+        return EXIT_FAILURE;
+    }
+    if (header->magic != CATALOG_SNAPSHOT_MAGIC || header->format != CATALOG_SNAPSHOT_FORMAT) {
+        error_write(error, "%s", "unknown snapshot format");
+        return EXIT_FAILURE;
+    }
+    if (header->items_offset % CATALOG_CACHE_LINE != 0
+            || header->items_offset + (uint64_t)header->item_count * sizeof(CatalogItem) != size) {
+        error_write(error, "%s", "snapshot size does not match its header");
+        return EXIT_FAILURE;
+    }
+    const uint8_t *items = (const uint8_t *)mapping + header->items_offset;
+    if (checksum_fnv1a(items, size - header->items_offset) != header->checksum) {
+        error_write(error, "%s", "snapshot checksum mismatch");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Maps a snapshot file read only into memory and validates it
+/// @param catalog catalog which is initialized on success
+/// @param path path of the snapshot file
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int map_snapshot(Catalog *catalog, const char *path, Error *error) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if ((size_t)st.st_size < sizeof(CatalogSnapshotHeader)) {
+        error_write(error, "snapshot too small (%zu bytes)", (size_t)st.st_size);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    // a shared mapping lets all server processes on the host use the same page cache pages
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    if (validate_snapshot(mapping, st.st_size, error) != EXIT_SUCCESS) {
+        munmap(mapping, st.st_size);
+        return EXIT_FAILURE;
+    }
+    catalog->mapping = mapping;
+    catalog->mapping_size = st.st_size;
+    catalog->header = mapping;
+    catalog->items = (const CatalogItem *)((const uint8_t *)mapping + catalog->header->items_offset);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Writes the whole buffer into a file
+/// @param fd file descriptor
+/// @param data start of the buffer
+/// @param size size of the buffer
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int write_all(int fd, const uint8_t *data, size_t size, Error *error) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            strerror_r(errno, error->msg, sizeof(error->msg));
+            return EXIT_FAILURE;
+        }
+        data += n;
+        size -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+int catalog_write_snapshot(const char *path, PGconn *conn, Error *error) {
+    // read version and items from the same database snapshot
+    if (db_begin_snapshot_transaction(conn, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    int64_t version;
+    Item *items = NULL;
+    int items_length = 0;
+    if (db_get_catalog_version(conn, &version, error) != EXIT_SUCCESS
+            || db_get_items(conn, &items, &items_length, error) != EXIT_SUCCESS) {
+        PQclear(PQexec(conn, "ROLLBACK"));
+        return EXIT_FAILURE;
+    }
+    if (db_commit_transaction(conn, error) != EXIT_SUCCESS) {
+        free(items);
+        return EXIT_FAILURE;
+    }
+
+    size_t items_size = (size_t)items_length * sizeof(CatalogItem);
+    size_t image_size = sizeof(CatalogSnapshotHeader) + items_size;
+    // zeroed image, so that padding bytes are deterministic for the checksum
+    uint8_t *image = aligned_alloc(CATALOG_CACHE_LINE, image_size);
+    if (!image) {
+        error_write(error, "cannot allocate snapshot of %zu bytes", image_size);
+        free(items);
+        return EXIT_FAILURE;
+    }
+    memset(image, 0, image_size);
+    CatalogItem *entries = (CatalogItem *)(image + sizeof(CatalogSnapshotHeader));
+    for (int i = 0; i < items_length; i++) {
+        entries[i].id = items[i].id;
+        entries[i].price = items[i].price;
+        entries[i].name_count = snprintf(entries[i].name, sizeof(entries[i].name), "%s", items[i].name);
+    }
+    free(items);
+
+    CatalogSnapshotHeader *header = (CatalogSnapshotHeader *)image;
+    header->magic = CATALOG_SNAPSHOT_MAGIC;
+    header->format = CATALOG_SNAPSHOT_FORMAT;
+    header->item_count = items_length;
+    header->catalog_version = version;
+    header->items_offset = sizeof(CatalogSnapshotHeader);
+    header->checksum = checksum_fnv1a(entries, items_size);
+
+    // write into a temporary file and replace the snapshot atomically
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        free(image);
+        return EXIT_FAILURE;
+    }
+    int result = write_all(fd, image, image_size, error);
+    free(image);
+    if (result == EXIT_SUCCESS && fsync(fd) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        result = EXIT_FAILURE;
+    }
+    close(fd);
+    if (result == EXIT_SUCCESS && rename(tmp_path, path) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        result = EXIT_FAILURE;
+    }
+    if (result != EXIT_SUCCESS) {
+        unlink(tmp_path);
+        return EXIT_FAILURE;
+    }
+    printf("INFO: wrote catalog snapshot version %" PRId64 " with %d items\r\n", version, items_length);
+    return EXIT_SUCCESS;
+}
+
+int catalog_load(Catalog *catalog, const char *path, PGconn *conn, Error *error) {
+    memset(catalog, 0, sizeof(*catalog));
+    Error map_error = {0};
+    int mapped = map_snapshot(catalog, path, &map_error) == EXIT_SUCCESS;
+
+    int64_t db_version;
+    int db_result;
+    if (PQstatus(conn) != CONNECTION_OK) {
+        error_write(error, "%s", PQerrorMessage(conn));
+        db_result = EXIT_FAILURE;
+    } else {
+        db_result = db_get_catalog_version(conn, &db_version, error);
+    }
+    if (db_result != EXIT_SUCCESS) {
+        if (mapped) {
+            fprintf(stderr, "WARNING: cannot validate catalog snapshot version: %s\r\n", error->msg);
+            return EXIT_SUCCESS;
+        }
+        return EXIT_FAILURE;
+    }
+    if (mapped) {
+        if (catalog->header->catalog_version == db_version) {
+            printf("INFO: using catalog snapshot version %" PRId64 "\r\n", db_version);
+            return EXIT_SUCCESS;
+        }
+        printf("INFO: catalog snapshot version %" PRId64 " is outdated, database has version %" PRId64 "\r\n",
+                catalog->header->catalog_version, db_version);
+        catalog_close(catalog);
+    } else {
+        printf("INFO: cannot use catalog snapshot: %s\r\n", map_error.msg);
+    }
+
+    if (catalog_write_snapshot(path, conn, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    return map_snapshot(catalog, path, error);
+}
+
+const CatalogItem *catalog_find_item(const Catalog *catalog, int32_t item_id) {
+    if (!catalog->header) {
+        return NULL;
+    }
+    size_t low = 0;
+    size_t high = catalog->header->item_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (catalog->items[mid].id < item_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < catalog->header->item_count && catalog->items[low].id == item_id) {
+        return &catalog->items[low];
+    }
+    return NULL;
+}
+
+void catalog_close(Catalog *catalog) {
+    if (catalog->mapping) {
+        munmap(catalog->mapping, catalog->mapping_size);
+    }
+    memset(catalog, 0, sizeof(*catalog));
+}
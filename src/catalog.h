@@ -0,0 +1,72 @@
+#ifndef __CATALOG_H_
+#define __CATALOG_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <libpq-fe.h>
+
+#include "error.h"
+
+#define CATALOG_SNAPSHOT_MAGIC   0x544f48534c544143ULL  // "CATLSHOT" in little endian
+#define CATALOG_SNAPSHOT_FORMAT  1
+#define CATALOG_CACHE_LINE       64
+
+/// @brief Item entry of a catalog snapshot. Each entry starts on its own cache line.
+typedef struct {
+    _Alignas(CATALOG_CACHE_LINE)
+    int32_t     id;         // item id
+    int32_t     price;      // price of a single item
+    uint32_t    name_count; // length of name
+    char        name[256];  // null terminated item name
+} CatalogItem;
+
+/// @brief Header at the beginning of a catalog snapshot file, occupies exactly one cache line
+typedef struct {
+    uint64_t    magic;              // CATALOG_SNAPSHOT_MAGIC
+    uint32_t    format;             // CATALOG_SNAPSHOT_FORMAT
+    uint32_t    item_count;         // amount of items in the snapshot
+    int64_t     catalog_version;    // version of the catalog in the database
+    uint64_t    checksum;           // FNV-1a checksum over all item entries
+    uint64_t    items_offset;       // file offset of the first item entry
+    uint8_t     reserved[24];
+} CatalogSnapshotHeader;
+
+/// @brief Read only view on a memory mapped catalog snapshot. The pages of the snapshot
+///        are shared between all processes which map the same file.
+typedef struct {
+    void                        *mapping;       // start of the mapped file
+    size_t                      mapping_size;   // size of the mapped file
+    const CatalogSnapshotHeader *header;        // header of the snapshot
+    const CatalogItem           *items;         // items ordered by their ID
+} Catalog;
+
+/// @brief Maps the snapshot file into memory and validates it against the catalog version
+///        of the database. If the snapshot is missing, corrupted or outdated, a new snapshot
+///        is written from the items table and mapped afterwards. If the database cannot be
+///        reached, a snapshot with a valid checksum is used regardless of its version.
+/// @param catalog catalog which is initialized on success
+/// @param path path of the snapshot file
+/// @param conn connection to the database
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int catalog_load(Catalog *catalog, const char *path, PGconn *conn, Error *error);
+
+/// @brief Writes a new snapshot of the items table. The file is replaced atomically so
+///        that processes which still map the old snapshot are not affected.
+/// @param path path of the snapshot file
+/// @param conn connection to the database
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int catalog_write_snapshot(const char *path, PGconn *conn, Error *error);
+
+/// @brief Looks up an item by its ID
+/// @param catalog loaded catalog
+/// @param item_id ID of the item
+/// @return address of the item or NULL if the item does not exist
+const CatalogItem *catalog_find_item(const Catalog *catalog, int32_t item_id);
+
+/// @brief Unmaps the snapshot
+/// @param catalog loaded catalog
+void catalog_close(Catalog *catalog);
+
+#endif
@@ -3,107 +3,244 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "api.h"
 #include "types.h"
+#include "catalog.h"
+#include "compression.h"
+#include "error.h"
+#include "frame.h"
+#include "shm_transport.h"
 
 // TODO: configure server connection
 #define SERVER "localhost"
 #define PORT 8080
 
-/// @brief Executes a request
-/// @param req_header address of the request header to be sent
-/// @param res_header adress of the response header which will be set on success
-/// @param payload_cb callback function for handling payload data, returns EXIT_SUCCESS on success
+/// @brief Connection to the server. Frames go through the shared memory rings once they are
+///        attached, otherwise through the socket.
+typedef struct {
+    int fd;                 // TCP or Unix socket
+    ShmTransport ring;      // attached rings, ring.shared is NULL if not used
+} ServerConnection;
+
+static const char *unix_path = NULL;    // connect to the Unix socket instead of the TCP port
+static int use_ring = 0;                // use the shared memory transport of the Unix socket
+
+/// @brief Connects to the server
+/// @param conn address to save the connection
 /// @return EXIT_SUCCESS on success
-int exec_request(RequestHeader *req_header, ResponseHeader *res_header, int (*payload_cb)(uint8_t *payload, u_int32_t payload_size)) {
+int connect_to_server(ServerConnection *conn) {
+    memset(conn, 0, sizeof(*conn));
     // create socket
-    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int client_fd = socket(unix_path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if (client_fd < 0)
     {
         perror("ERROR: creating socket");
         return EXIT_FAILURE;
     }
     // Connect to server
-    struct sockaddr_in server_address;
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(PORT);
-    if (connect(client_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    int connected;
+    if (unix_path)
+    {
+        struct sockaddr_un server_address = { .sun_family = AF_UNIX };
+        snprintf(server_address.sun_path, sizeof(server_address.sun_path), "%s", unix_path);
+        connected = connect(client_fd, (struct sockaddr *)&server_address, sizeof(server_address));
+    }
+    else
+    {
+        struct sockaddr_in server_address;
+        memset(&server_address, 0, sizeof(server_address));
+        server_address.sin_family = AF_INET;
+        server_address.sin_port = htons(PORT);
+        connected = connect(client_fd, (struct sockaddr *)&server_address, sizeof(server_address));
+    }
+    if (connected < 0)
     {
         perror("ERROR: connecting to server");
         close(client_fd);
         return EXIT_FAILURE;
     }
-
-    // Send message to server
-    if (send(client_fd, req_header, sizeof(req_header), 0) < 0)
+    conn->fd = client_fd;
+    if (use_ring)
     {
-        perror("ERROR: sending message");
-        close(client_fd);
-        return EXIT_FAILURE;
+        Error error = {0};
+        if (shm_client_attach(&conn->ring, client_fd, &error) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "WARNING: using the socket, shared memory transport failed: %s\r\n", error.msg);
+        }
     }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Closes the connection to the server
+/// @param conn connected connection
+void disconnect_from_server(ServerConnection *conn) {
+    shm_transport_close(&conn->ring);
+    close(conn->fd);
+}
 
-    // Receive message from server
-    int n;
-    if ((n = recv(client_fd, res_header, sizeof(res_header), 0)) > 0)
+/// @brief Sends a request
+/// @param conn connection to the server
+/// @param req_header address of the request header to be sent
+/// @param req_payload payload of the request with req_header->payload_size bytes, may be NULL if there is no payload
+/// @return EXIT_SUCCESS on success
+int send_request(ServerConnection *conn, RequestHeader *req_header, const void *req_payload) {
+    if (conn->ring.shared)
     {
-        if (n != sizeof(res_header))
+        struct iovec parts[] = {
+            { .iov_base = req_header, .iov_len = sizeof(*req_header) },
+            { .iov_base = (void *)req_payload, .iov_len = req_header->payload_size }
+        };
+        if (shm_client_writev(&conn->ring, conn->fd, parts, 2) != EXIT_SUCCESS)
         {
-            fprintf(stderr, "ERROR: received incorrect data, expected %ld bytes, but got %d\r\n", sizeof(res_header), n);
-            close(client_fd);
+            fprintf(stderr, "ERROR: server closed connection\r\n");
             return EXIT_FAILURE;
         }
-        if (res_header->magicnum != API_MAGIC_NUM)
-        {
-            fprintf(stderr, "ERROR: received invalid magic number, expected %d, but got %d\r\n", API_MAGIC_NUM, res_header->magicnum);
-            close(client_fd);
-            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+    int client_fd = conn->fd;
+    if (send(client_fd, req_header, sizeof(*req_header), 0) < 0)
+    {
+        perror("ERROR: sending message");
+        return EXIT_FAILURE;
+    }
+    if (req_header->payload_size > 0 && send(client_fd, req_payload, req_header->payload_size, 0) < 0)
+    {
+        perror("ERROR: sending payload");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Receives a frame from the response ring
+/// @param conn connection with attached rings
+/// @param decoder frame decoder of the connection
+/// @param header address to save the header of the frame
+/// @param payload address to save the start of the payload
+/// @param error address of error object to set an error message on FRAME_ERROR
+/// @return status of the decoder
+FrameStatus read_ring_frame(ServerConnection *conn, FrameDecoder *decoder, FrameHeader *header, const uint8_t **payload, Error *error) {
+    while (1) {
+        FrameStatus status = frame_decoder_next(decoder, header, payload, error);
+        if (status != FRAME_INCOMPLETE) {
+            return status;
         }
-        printf("DEBUG: response id: %d\r\n", res_header->response_id);
-        printf("DEBUG: response payload: %d\r\n", res_header->payload_size);
-        // always handle error response
-        if (res_header->response_id == RESPONSE_ERROR) {
-            fprintf(stderr, "ERROR: received error response from server\r\n");
-            if (res_header->payload_size > 0) {
-                char server_err_msg[res_header->payload_size / sizeof(char)];
-                if ((n = recv(client_fd, server_err_msg, res_header->payload_size, 0)) > 0)
-                {
-                    fprintf(stderr, "ERROR: %s\r\n", server_err_msg);
-                }
-            }
-            close(client_fd);
-            return EXIT_FAILURE;
-        } else {
-            // handle response payload
-            if (res_header->payload_size > 0) {
-                uint8_t payload_buffer[res_header->payload_size];
-                if ((n = recv(client_fd, payload_buffer, res_header->payload_size, 0)) < 0)
-                {
-                    perror("ERROR: cannot receive payload");
-                    close(client_fd);
-                    return EXIT_FAILURE;
-                }
-                if (payload_cb) {
-                    if (payload_cb(payload_buffer, res_header->payload_size) != EXIT_SUCCESS) {
-                        close(client_fd);
-                        return EXIT_FAILURE;
-                    }
-                }
-            } else if (res_header->payload_size >= MAX_PAYLOAD_SIZE) {
-                fprintf(stderr, "ERROR: payload too large\r\n");
-                close(client_fd);
-                return EXIT_FAILURE;
-            }
+        size_t size;
+        uint8_t *space = frame_decoder_space(decoder, &size, error);
+        if (!space) {
+            return FRAME_ERROR;
+        }
+        size_t n = shm_client_read(&conn->ring, conn->fd, space, size);
+        if (n == 0) {
+            return FRAME_CLOSED;
+        }
+        frame_decoder_commit(decoder, n);
+    }
+}
+
+/// @brief Receives a single response frame and passes its payload to the callback.
+///        Compressed payloads are decompressed first, error responses are printed.
+/// @param conn connection to the server
+/// @param decoder frame decoder of the connection
+/// @param res_header adress of the response header which will be set on success
+/// @param payload_cb callback function for handling payload data, returns EXIT_SUCCESS on success
+/// @return EXIT_SUCCESS on success
+int recv_response(ServerConnection *conn, FrameDecoder *decoder, ResponseHeader *res_header, int (*payload_cb)(uint8_t *payload, u_int32_t payload_size)) {
+    Error error = {0};
+    FrameHeader frame_header;
+    const uint8_t *payload;
+    FrameStatus status = conn->ring.shared
+        ? read_ring_frame(conn, decoder, &frame_header, &payload, &error)
+        : frame_decoder_read(decoder, conn->fd, &frame_header, &payload, &error);
+    if (status == FRAME_CLOSED)
+    {
+        fprintf(stderr, "ERROR: server closed connection\r\n");
+        return EXIT_FAILURE;
+    }
+    if (status != FRAME_COMPLETE)
+    {
+        fprintf(stderr, "ERROR: received incorrect data: %s\r\n", error.msg);
+        return EXIT_FAILURE;
+    }
+    memcpy(res_header, &frame_header, sizeof(*res_header));
+    printf("DEBUG: response id: %d\r\n", res_header->response_id);
+    printf("DEBUG: response payload: %d\r\n", res_header->payload_size);
+
+    // always handle error response
+    if (res_header->response_id == RESPONSE_ERROR) {
+        fprintf(stderr, "ERROR: received error response from server\r\n");
+        if (res_header->payload_size > 0) {
+            fprintf(stderr, "ERROR: %.*s\r\n", (int)res_header->payload_size, (const char *)payload);
         }
+        return EXIT_FAILURE;
     }
 
-    close(client_fd);
+    // handle response payload
+    uint32_t payload_size = res_header->payload_size;
+    if (payload_size > 0 && (res_header->flags & HEADER_FLAG_COMPRESSED)) {
+        if (compression_decompress(payload, res_header->payload_size, &payload, &payload_size, MAX_PAYLOAD_SIZE, &error) != EXIT_SUCCESS) {
+            fprintf(stderr, "ERROR: %s\r\n", error.msg);
+            return EXIT_FAILURE;
+        }
+        printf("DEBUG: decompressed payload: %d\r\n", payload_size);
+    }
+    if (payload_size > 0 && payload_cb) {
+        return payload_cb((uint8_t *)payload, payload_size);
+    }
     return EXIT_SUCCESS;
 }
 
+/// @brief Executes a request
+/// @param req_header address of the request header to be sent
+/// @param req_payload payload of the request with req_header->payload_size bytes, may be NULL if there is no payload
+/// @param res_header adress of the response header which will be set on success
+/// @param payload_cb callback function for handling payload data, returns EXIT_SUCCESS on success
+/// @return EXIT_SUCCESS on success
+int exec_request(RequestHeader *req_header, const void *req_payload, ResponseHeader *res_header, int (*payload_cb)(uint8_t *payload, u_int32_t payload_size)) {
+    ServerConnection conn;
+    if (connect_to_server(&conn) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    FrameDecoder decoder;
+    frame_decoder_init(&decoder);
+    int result = send_request(&conn, req_header, req_payload);
+    if (result == EXIT_SUCCESS) {
+        result = recv_response(&conn, &decoder, res_header, payload_cb);
+    }
+    frame_decoder_free(&decoder);
+    disconnect_from_server(&conn);
+    return result;
+}
+
+/// @brief Executes a request which is answered with a stream of response frames. The payload of
+///        every frame is passed to the callback until the server sends RESPONSE_END_OF_STREAM.
+/// @param req_header address of the request header to be sent
+/// @param req_payload payload of the request with req_header->payload_size bytes, may be NULL if there is no payload
+/// @param res_header adress of the response header which will be set on success
+/// @param payload_cb callback function for handling payload data of each frame, returns EXIT_SUCCESS on success
+/// @return EXIT_SUCCESS on success
+int exec_stream_request(RequestHeader *req_header, const void *req_payload, ResponseHeader *res_header, int (*payload_cb)(uint8_t *payload, u_int32_t payload_size)) {
+    ServerConnection conn;
+    if (connect_to_server(&conn) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    FrameDecoder decoder;
+    frame_decoder_init(&decoder);
+    int result = send_request(&conn, req_header, req_payload);
+    while (result == EXIT_SUCCESS) {
+        result = recv_response(&conn, &decoder, res_header, payload_cb);
+        if (res_header->response_id == RESPONSE_END_OF_STREAM) {
+            break;
+        }
+    }
+    frame_decoder_free(&decoder);
+    disconnect_from_server(&conn);
+    return result;
+}
+
 int handle_display_order_response(uint8_t *payload, uint32_t payload_size) {
     size_t order_items_count = payload_size / sizeof(FullOrderItem);
     FullOrderItem *order_items = (FullOrderItem*)payload;
@@ -131,27 +268,388 @@ int send_display_order_request()
 {
     RequestHeader req_header = {
         .magicnum = API_MAGIC_NUM,
-        .version = 1,
+        .version = API_VERSION,
         .request_id = REQUEST_DISPLAY_ORDERS,
-        .payload_size = 0
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
     };
     ResponseHeader res_header = {0};
-    if (exec_request(&req_header, &res_header, handle_display_order_response) != EXIT_SUCCESS) {
+    if (exec_request(&req_header, NULL, &res_header, handle_display_order_response) != EXIT_SUCCESS) {
         fprintf(stderr, "ERROR: display order request failed\r\n");
         return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
 }
 
+int handle_export_orders_response(uint8_t *payload, uint32_t payload_size) {
+    size_t order_items_count = payload_size / sizeof(FullOrderItem);
+    FullOrderItem *order_items = (FullOrderItem*)payload;
+    for (size_t i = 0; i < order_items_count; i++) {
+        printf("%-20d", order_items[i].order.id);
+        printf("%-20s", order_items[i].order.date);
+        printf("%-20s", order_items[i].order.status);
+        printf("%-20d", order_items[i].order_item.id);
+        printf("%-20s", order_items[i].order_item.name);
+        printf("%-20d", order_items[i].order_item.count);
+        printf("%-20d", order_items[i].order_item.price);
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+int send_export_orders_request()
+{
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_EXPORT_ORDERS,
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    if (exec_stream_request(&req_header, NULL, &res_header, handle_export_orders_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: export orders request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_orders_delta_response(uint8_t *payload, uint32_t payload_size) {
+    OrdersDeltaResponse response;
+    if (payload_size < sizeof(response)) {
+        fprintf(stderr, "ERROR: invalid changed orders\r\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(&response, payload, sizeof(response));
+    if (response.flags & ORDERS_DELTA_RESYNC) {
+        printf("changes were lost, reload the orders with \"order list\"\n");
+    }
+    uint32_t offset = sizeof(response);
+    for (uint32_t i = 0; i < response.order_count; i++) {
+        OrderDelta delta;
+        if (payload_size - offset < sizeof(delta)) {
+            fprintf(stderr, "ERROR: invalid changed orders\r\n");
+            return EXIT_FAILURE;
+        }
+        memcpy(&delta, payload + offset, sizeof(delta));
+        offset += sizeof(delta);
+        if (delta.item_count > (payload_size - offset) / sizeof(FullOrderItem)) {
+            fprintf(stderr, "ERROR: invalid changed orders\r\n");
+            return EXIT_FAILURE;
+        }
+        if (delta.item_count == 0) {
+            printf("order %d deleted\n", delta.order_id);
+        }
+        FullOrderItem *order_items = (FullOrderItem*)(payload + offset);
+        for (uint32_t j = 0; j < delta.item_count; j++) {
+            printf("%-20d", order_items[j].order.id);
+            printf("%-20s", order_items[j].order.date);
+            printf("%-20s", order_items[j].order.status);
+            printf("%-20d", order_items[j].order_item.id);
+            printf("%-20s", order_items[j].order_item.name);
+            printf("%-20d", order_items[j].order_item.count);
+            printf("%-20d", order_items[j].order_item.price);
+            printf("\n");
+        }
+        offset += delta.item_count * sizeof(FullOrderItem);
+    }
+    fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+int send_watch_orders_request()
+{
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_SUBSCRIBE_ORDERS,
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    // changed orders are pushed until the connection is closed
+    if (exec_stream_request(&req_header, NULL, &res_header, handle_orders_delta_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: watch orders request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_list_items_response(uint8_t *payload, uint32_t payload_size) {
+    size_t items_count = payload_size / sizeof(CatalogItem);
+    CatalogItem *items = (CatalogItem*)payload;
+    printf("DEBUG: received list items response with %ld items\r\n", items_count);
+    printf("%-20s", "item_id");
+    printf("%-20s", "item_name");
+    printf("%-20s", "price");
+    printf("\n");
+    for (size_t i = 0; i < items_count; i++) {
+        printf("%-20d", items[i].id);
+        printf("%-20s", items[i].name);
+        printf("%-20d", items[i].price);
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+int send_list_items_request()
+{
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_LIST_ITEMS,
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    if (exec_request(&req_header, NULL, &res_header, handle_list_items_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: list items request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_add_order_response(uint8_t *payload, uint32_t payload_size) {
+    if (payload_size != sizeof(AddOrderResponse)) {
+        fprintf(stderr, "ERROR: invalid add order response\r\n");
+        return EXIT_FAILURE;
+    }
+    AddOrderResponse *response = (AddOrderResponse*)payload;
+    if (response->journal_seq > 0) {
+        printf("Order accepted with journal sequence number %" PRIu64 "\n", response->journal_seq);
+    } else {
+        printf("Order ID: %d\n", response->order_id);
+    }
+    return EXIT_SUCCESS;
+}
+
+int send_add_order_request(int argc, char *argv[])
+{
+    uint8_t payload[sizeof(AddOrderRequest) + MAX_ORDER_ITEMS * sizeof(AddOrderItem)];
+    AddOrderRequest *request = (AddOrderRequest*)payload;
+    request->item_count = 0;
+    for (int i = 0; i < argc; i++) {
+        if ((strcmp(argv[i], "--item") != 0 && strcmp(argv[i], "-i") != 0) || i + 1 >= argc) {
+            fprintf(stderr, "ERROR: unexpected argument \"%s\"\r\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        int32_t item_id = atoi(argv[++i]);
+        // ordering the same item multiple times increases its quantity
+        uint32_t j = 0;
+        while (j < request->item_count && request->items[j].item_id != item_id) {
+            j++;
+        }
+        if (j == request->item_count) {
+            if (request->item_count >= MAX_ORDER_ITEMS) {
+                fprintf(stderr, "ERROR: too many items\r\n");
+                return EXIT_FAILURE;
+            }
+            request->items[j].item_id = item_id;
+            request->items[j].quantity = 0;
+            request->item_count++;
+        }
+        request->items[j].quantity++;
+    }
+    if (request->item_count == 0) {
+        printf("Usage: order add --item <id> [--item <id> ...]\r\n");
+        return EXIT_FAILURE;
+    }
+
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_ADD_ORDER,
+        .payload_size = sizeof(AddOrderRequest) + request->item_count * sizeof(AddOrderItem),
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    if (exec_request(&req_header, payload, &res_header, handle_add_order_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: add order request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_get_order_response(uint8_t *payload, uint32_t payload_size) {
+    GetOrderResponse *response = (GetOrderResponse*)payload;
+    if (payload_size < sizeof(GetOrderResponse)
+            || payload_size != sizeof(GetOrderResponse) + response->item_count * sizeof(OrderItem)) {
+        fprintf(stderr, "ERROR: invalid get order response\r\n");
+        return EXIT_FAILURE;
+    }
+    printf("Order %d, %s, %s\n", response->order.id, response->order.status, response->order.date);
+    printf("%-20s", "item_id");
+    printf("%-20s", "item_name");
+    printf("%-20s", "quantity");
+    printf("%-20s", "unit_price");
+    printf("\n");
+    for (uint32_t i = 0; i < response->item_count; i++) {
+        printf("%-20d", response->items[i].id);
+        printf("%-20s", response->items[i].name);
+        printf("%-20d", response->items[i].count);
+        printf("%-20d", response->items[i].price);
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_batch_get_order_response(uint8_t *payload, uint32_t payload_size) {
+    BatchResponse response;
+    if (payload_size < sizeof(response)) {
+        fprintf(stderr, "ERROR: invalid batch response\r\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(&response, payload, sizeof(response));
+    int result = EXIT_SUCCESS;
+    uint32_t offset = sizeof(response);
+    for (uint32_t i = 0; i < response.response_count; i++) {
+        BatchEntry entry;
+        if (payload_size - offset < sizeof(entry)) {
+            fprintf(stderr, "ERROR: invalid batch response\r\n");
+            return EXIT_FAILURE;
+        }
+        memcpy(&entry, payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+        // the padded size wraps around for sizes close to UINT32_MAX
+        if (entry.payload_size > payload_size - offset
+                || BATCH_PADDED_SIZE(entry.payload_size) > payload_size - offset) {
+            fprintf(stderr, "ERROR: invalid batch response\r\n");
+            return EXIT_FAILURE;
+        }
+        if (entry.id == RESPONSE_ERROR) {
+            fprintf(stderr, "ERROR: %.*s\r\n", (int)entry.payload_size, (const char *)payload + offset);
+            result = EXIT_FAILURE;
+        }
+        else if (entry.id != RESPONSE_GET_ORDER || handle_get_order_response(payload + offset, entry.payload_size) != EXIT_SUCCESS) {
+            result = EXIT_FAILURE;
+        }
+        printf("\n");
+        offset += BATCH_PADDED_SIZE(entry.payload_size);
+    }
+    return result;
+}
+
+/// @brief Requests several orders at once in a single batch request
+/// @param argc amount of order ids
+/// @param argv order ids
+/// @return EXIT_SUCCESS if all orders were received
+int send_batch_get_order_request(int argc, char *argv[])
+{
+    if (argc > MAX_BATCH_REQUESTS) {
+        printf("At most %d orders can be requested at once\r\n", MAX_BATCH_REQUESTS);
+        return EXIT_FAILURE;
+    }
+    uint32_t entry_size = sizeof(BatchEntry) + BATCH_PADDED_SIZE(sizeof(GetOrderRequest));
+    uint32_t payload_size = sizeof(BatchRequest) + argc * entry_size;
+    uint8_t *payload = calloc(1, payload_size);
+    if (!payload) {
+        fprintf(stderr, "ERROR: cannot allocate batch request\r\n");
+        return EXIT_FAILURE;
+    }
+    BatchRequest request = { .request_count = argc };
+    memcpy(payload, &request, sizeof(request));
+    for (int i = 0; i < argc; i++) {
+        uint8_t *entry_payload = payload + sizeof(request) + i * entry_size;
+        BatchEntry entry = { .id = REQUEST_GET_ORDER, .payload_size = sizeof(GetOrderRequest) };
+        GetOrderRequest get_order = { .order_id = atoi(argv[i]) };
+        memcpy(entry_payload, &entry, sizeof(entry));
+        memcpy(entry_payload + sizeof(entry), &get_order, sizeof(get_order));
+    }
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_BATCH,
+        .payload_size = payload_size,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    int result = exec_request(&req_header, payload, &res_header, handle_batch_get_order_response);
+    free(payload);
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: get order request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int send_get_order_request(int argc, char *argv[])
+{
+    if (argc < 1) {
+        printf("Usage: order get <id> [<id> ...]\r\n");
+        return EXIT_FAILURE;
+    }
+    if (argc > 1) {
+        return send_batch_get_order_request(argc, argv);
+    }
+    GetOrderRequest request = { .order_id = atoi(argv[0]) };
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_GET_ORDER,
+        .payload_size = sizeof(request),
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    if (exec_request(&req_header, &request, &res_header, handle_get_order_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: get order request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int handle_stats_response(uint8_t *payload, uint32_t payload_size) {
+    if (payload_size != sizeof(StatsResponse)) {
+        fprintf(stderr, "ERROR: invalid stats response\r\n");
+        return EXIT_FAILURE;
+    }
+    StatsResponse *stats = (StatsResponse*)payload;
+    uint64_t lookups = stats->order_cache_hits + stats->order_cache_misses;
+    printf("order cache hits:          %" PRIu64 " (%.1f%%)\n", stats->order_cache_hits,
+            lookups > 0 ? 100.0 * stats->order_cache_hits / lookups : 0.0);
+    printf("order cache misses:        %" PRIu64 "\n", stats->order_cache_misses);
+    printf("order cache evictions:     %" PRIu64 "\n", stats->order_cache_evictions);
+    printf("order cache invalidations: %" PRIu64 "\n", stats->order_cache_invalidations);
+    printf("order cache entries:       %" PRIu64 "\n", stats->order_cache_entries);
+    printf("order cache memory:        %" PRIu64 " of %" PRIu64 " bytes\n", stats->order_cache_bytes, stats->order_cache_max_bytes);
+    printf("order feed subscribers:    %" PRIu64 "\n", stats->order_feed_subscribers);
+    printf("order feed updates:        %" PRIu64 "\n", stats->order_feed_updates);
+    printf("order feed coalesced:      %" PRIu64 "\n", stats->order_feed_coalesced);
+    printf("order feed resyncs:        %" PRIu64 "\n", stats->order_feed_resyncs);
+    printf("rate limited connections:  %" PRIu64 "\n", stats->rate_limited_connections);
+    printf("rate limited requests:     %" PRIu64 "\n", stats->rate_limited_requests);
+    printf("rate limit overflows:      %" PRIu64 "\n", stats->rate_limit_overflows);
+    printf("captured records:          %" PRIu64 "\n", stats->captured_records);
+    printf("capture dropped:           %" PRIu64 "\n", stats->capture_dropped);
+    return EXIT_SUCCESS;
+}
+
+int send_stats_request()
+{
+    RequestHeader req_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_STATS,
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
+    };
+    ResponseHeader res_header = {0};
+    if (exec_request(&req_header, NULL, &res_header, handle_stats_response) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: stats request failed\r\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
 int send_invalid_request() {
     RequestHeader req_header = {
         .magicnum = 0, // invalid magic number
-        .version = 1,
+        .version = API_VERSION,
         .request_id = REQUEST_DISPLAY_ORDERS,
-        .payload_size = 0
+        .payload_size = 0,
+        .flags = HEADER_FLAG_ACCEPT_COMPRESSION
     };
     ResponseHeader res_header = {0};
-    if (exec_request(&req_header, &res_header, NULL) != EXIT_SUCCESS) {
+    if (exec_request(&req_header, NULL, &res_header, NULL) != EXIT_SUCCESS) {
         fprintf(stderr, "ERROR: request failed\r\n");
         return EXIT_FAILURE;
     }
@@ -160,10 +658,35 @@ int send_invalid_request() {
 
 int main(int argc, char *argv[])
 {
+    // global options stop at the first command
+    int opt;
+    while ((opt = getopt(argc, argv, "+u:r")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'r':
+            use_ring = 1;
+            break;
+        default:
+            printf("Usage: %s [-u unix_path [-r]] [order, item, stats, error, help]\r\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (use_ring && !unix_path)
+    {
+        fprintf(stderr, "ERROR: the shared memory transport (-r) requires the Unix socket (-u)\r\n");
+        return EXIT_FAILURE;
+    }
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc < 2)
     {
-        printf("Usage: [order, error, help]\r\n");
+        printf("Usage: [order, item, stats, error, help]\r\n");
         return EXIT_FAILURE;
     }
 
@@ -171,7 +694,7 @@ int main(int argc, char *argv[])
     {
         if (argc <= 2)
         {
-            printf("Usage: order [list]\r\n");
+            printf("Usage: order [list, get, add, export, watch]\r\n");
             return EXIT_FAILURE;
         }
         if (argc > 2)
@@ -180,6 +703,22 @@ int main(int argc, char *argv[])
             {
                 return send_display_order_request();
             }
+            else if (strcmp(argv[2], "get") == 0)
+            {
+                return send_get_order_request(argc - 3, argv + 3);
+            }
+            else if (strcmp(argv[2], "export") == 0)
+            {
+                return send_export_orders_request();
+            }
+            else if (strcmp(argv[2], "watch") == 0)
+            {
+                return send_watch_orders_request();
+            }
+            else if (strcmp(argv[2], "add") == 0)
+            {
+                return send_add_order_request(argc - 3, argv + 3);
+            }
             else
             {
                 fprintf(stderr, "ERROR: unknown order command \"%s\"\r\n", argv[2]);
@@ -187,6 +726,19 @@ int main(int argc, char *argv[])
             }
         }
     }
+    else if (strcmp(argv[1], "item") == 0)
+    {
+        if (argc <= 2 || strcmp(argv[2], "list") != 0)
+        {
+            printf("Usage: item [list]\r\n");
+            return EXIT_FAILURE;
+        }
+        return send_list_items_request();
+    }
+    else if (strcmp(argv[1], "stats") == 0)
+    {
+        return send_stats_request();
+    }
     else if (strcmp(argv[1], "error") == 0) 
     {
         return send_invalid_request();
@@ -194,8 +746,13 @@ int main(int argc, char *argv[])
     else if (strcmp(argv[1], "help") == 0) {
         printf("== Help ==\r\n");
         printf("%s order - CRUD operations for orders\r\n", argv[0]);
+        printf("%s item  - list the item catalog\r\n", argv[0]);
+        printf("%s stats - counters of the server\r\n", argv[0]);
         printf("%s error - execute an invalid request\r\n", argv[0]);
         printf("%s help  - usage information\r\n", argv[0]);
+        printf("options before the command:\r\n");
+        printf("  -u path - connect to the Unix socket of the server instead of TCP\r\n");
+        printf("  -r      - exchange frames over shared memory rings, requires -u\r\n");
         return EXIT_SUCCESS;
     }
     else
@@ -0,0 +1,158 @@
+#include "compression.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define SIZE_PREFIX sizeof(uint32_t)
+
+/// @brief Buffers and zlib streams of a single thread, reused for every payload
+typedef struct {
+    z_stream    deflate_stream;
+    int         deflate_ready;
+    z_stream    inflate_stream;
+    int         inflate_ready;
+    uint8_t     *deflate_buffer;
+    size_t      deflate_capacity;
+    uint8_t     *inflate_buffer;
+    size_t      inflate_capacity;
+} CompressionContext;
+
+static pthread_key_t context_key;
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+/// @brief Releases the compression context when its thread terminates
+/// @param arg compression context
+static void free_context(void *arg) {
+    CompressionContext *ctx = arg;
+    if (ctx->deflate_ready) {
+        deflateEnd(&ctx->deflate_stream);
+    }
+    if (ctx->inflate_ready) {
+        inflateEnd(&ctx->inflate_stream);
+    }
+    free(ctx->deflate_buffer);
+    free(ctx->inflate_buffer);
+    free(ctx);
+}
+
+static void create_context_key(void) {
+    pthread_key_create(&context_key, free_context);
+}
+
+/// @brief Returns the compression context of the calling thread, creates it on first use
+/// @return context or NULL if out of memory
+static CompressionContext *get_context(void) {
+    pthread_once(&context_key_once, create_context_key);
+    CompressionContext *ctx = pthread_getspecific(context_key);
+    if (!ctx) {
+        ctx = calloc(1, sizeof(*ctx));
+        if (ctx) {
+            pthread_setspecific(context_key, ctx);
+        }
+    }
+    return ctx;
+}
+
+/// @brief Grows a buffer to at least the requested capacity
+/// @param buffer address of the buffer
+/// @param capacity address of the current capacity
+/// @param size requested capacity
+/// @return EXIT_SUCCESS on success
+static int reserve(uint8_t **buffer, size_t *capacity, size_t size) {
+    if (*capacity >= size) {
+        return EXIT_SUCCESS;
+    }
+    uint8_t *grown = realloc(*buffer, size);
+    if (!grown) {
+        return EXIT_FAILURE;
+    }
+    *buffer = grown;
+    *capacity = size;
+    return EXIT_SUCCESS;
+}
+
+int compression_compress(const uint8_t *src, uint32_t src_size, const uint8_t **dst, uint32_t *dst_size, Error *error) {
+    CompressionContext *ctx = get_context();
+    if (!ctx) {
+        error_write(error, "%s", "cannot allocate compression context");
+        return EXIT_FAILURE;
+    }
+    if (!ctx->deflate_ready) {
+        if (deflateInit(&ctx->deflate_stream, COMPRESSION_LEVEL) != Z_OK) {
+            error_write(error, "cannot initialize deflate: %s", ctx->deflate_stream.msg ? ctx->deflate_stream.msg : "unknown");
+            return EXIT_FAILURE;
+        }
+        ctx->deflate_ready = 1;
+    } else {
+        deflateReset(&ctx->deflate_stream);
+    }
+
+    size_t bound = SIZE_PREFIX + deflateBound(&ctx->deflate_stream, src_size);
+    if (reserve(&ctx->deflate_buffer, &ctx->deflate_capacity, bound) != EXIT_SUCCESS) {
+        error_write(error, "cannot allocate compression buffer of %zu bytes", bound);
+        return EXIT_FAILURE;
+    }
+    memcpy(ctx->deflate_buffer, &src_size, SIZE_PREFIX);
+
+    z_stream *stream = &ctx->deflate_stream;
+    stream->next_in = (Bytef *)src;
+    stream->avail_in = src_size;
+    stream->next_out = ctx->deflate_buffer + SIZE_PREFIX;
+    stream->avail_out = bound - SIZE_PREFIX;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        error_write(error, "cannot compress payload: %s", stream->msg ? stream->msg : "unknown");
+        return EXIT_FAILURE;
+    }
+    *dst = ctx->deflate_buffer;
+    *dst_size = SIZE_PREFIX + stream->total_out;
+    return EXIT_SUCCESS;
+}
+
+int compression_decompress(const uint8_t *src, uint32_t src_size, const uint8_t **dst, uint32_t *dst_size, uint32_t max_size, Error *error) {
+    if (src_size < SIZE_PREFIX) {
+        error_write(error, "compressed payload too small (%u bytes)", src_size);
+        return EXIT_FAILURE;
+    }
+    uint32_t size;
+    memcpy(&size, src, SIZE_PREFIX);
+    if (size > max_size) {
+        error_write(error, "decompressed payload too large (%u bytes)", size);
+        return EXIT_FAILURE;
+    }
+
+    CompressionContext *ctx = get_context();
+    if (!ctx) {
+        error_write(error, "%s", "cannot allocate compression context");
+        return EXIT_FAILURE;
+    }
+    if (!ctx->inflate_ready) {
+        if (inflateInit(&ctx->inflate_stream) != Z_OK) {
+            error_write(error, "cannot initialize inflate: %s", ctx->inflate_stream.msg ? ctx->inflate_stream.msg : "unknown");
+            return EXIT_FAILURE;
+        }
+        ctx->inflate_ready = 1;
+    } else {
+        inflateReset(&ctx->inflate_stream);
+    }
+    // reserve at least one byte, so that an empty payload has a valid buffer
+    if (reserve(&ctx->inflate_buffer, &ctx->inflate_capacity, size > 0 ? size : 1) != EXIT_SUCCESS) {
+        error_write(error, "cannot allocate decompression buffer of %u bytes", size);
+        return EXIT_FAILURE;
+    }
+
+    z_stream *stream = &ctx->inflate_stream;
+    stream->next_in = (Bytef *)src + SIZE_PREFIX;
+    stream->avail_in = src_size - SIZE_PREFIX;
+    stream->next_out = ctx->inflate_buffer;
+    stream->avail_out = size;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->total_out != size) {
+        error_write(error, "cannot decompress payload: %s", stream->msg ? stream->msg : "corrupted data");
+        return EXIT_FAILURE;
+    }
+    *dst = ctx->inflate_buffer;
+    *dst_size = size;
+    return EXIT_SUCCESS;
+}
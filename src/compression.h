@@ -0,0 +1,35 @@
+#ifndef __COMPRESSION_H_
+#define __COMPRESSION_H_
+
+#include <inttypes.h>
+
+#include "error.h"
+
+#define COMPRESSION_THRESHOLD   4096    // payloads below this size are always sent uncompressed
+#define COMPRESSION_LEVEL       1       // zlib level, favours speed over ratio
+
+/// @brief Compresses a payload with zlib. The compressed payload starts with the uncompressed
+///        size as 32 bit integer followed by the zlib stream.
+///        The result is stored in a buffer owned by the calling thread which is reused by the
+///        next call to compression_compress() on the same thread.
+/// @param src payload to compress
+/// @param src_size size of the payload
+/// @param dst address to save the start of the compressed payload
+/// @param dst_size address to save the size of the compressed payload
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int compression_compress(const uint8_t *src, uint32_t src_size, const uint8_t **dst, uint32_t *dst_size, Error *error);
+
+/// @brief Decompresses a payload created by compression_compress(). The result is stored in a
+///        buffer owned by the calling thread which is reused by the next call to
+///        compression_decompress() on the same thread.
+/// @param src compressed payload
+/// @param src_size size of the compressed payload
+/// @param dst address to save the start of the decompressed payload
+/// @param dst_size address to save the size of the decompressed payload
+/// @param max_size maximum allowed size of the decompressed payload
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int compression_decompress(const uint8_t *src, uint32_t src_size, const uint8_t **dst, uint32_t *dst_size, uint32_t max_size, Error *error);
+
+#endif
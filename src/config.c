@@ -0,0 +1,297 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "api.h"
+#include "database.h"
+#include "order_cache.h"
+#include "order_feed.h"
+#include "stock.h"
+
+void config_init(Config *config) {
+    memset(config, 0, sizeof(*config));
+    snprintf(config->db_primary, sizeof(config->db_primary), "%s", DB_DEFAULT_CONNINFO);
+    config->db_max_replica_lag = 16 * 1024 * 1024;
+    config->db_catalog_sync_ms = DB_DEFAULT_CATALOG_SYNC_MS;
+    server_options_init(&config->server);
+    config->order_cache_max_bytes = ORDER_CACHE_DEFAULT_MAX_BYTES;
+    config->stock_reconcile_ms = STOCK_DEFAULT_RECONCILE_MS;
+    config->feed_queue_length = ORDER_FEED_DEFAULT_QUEUE_LENGTH;
+}
+
+/// @brief Removes leading and trailing whitespace
+/// @param text null terminated text, modified in place
+/// @return start of the trimmed text
+static char *trim(char *text) {
+    while (isspace((unsigned char)*text)) {
+        text++;
+    }
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return text;
+}
+
+/// @brief Parses an unsigned integer setting
+/// @param value text of the value
+/// @param result address to save the parsed value
+/// @return EXIT_SUCCESS if the value is a valid number
+static int parse_uint64(const char *value, uint64_t *result) {
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || value[0] == '-') {
+        return EXIT_FAILURE;
+    }
+    *result = parsed;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Parses an integer setting within a range
+/// @param value text of the value
+/// @param min smallest valid value
+/// @param max largest valid value
+/// @param result address to save the parsed value
+/// @return EXIT_SUCCESS if the value is a valid number within the range
+static int parse_int(const char *value, int min, int max, int *result) {
+    uint64_t parsed;
+    if (parse_uint64(value, &parsed) != EXIT_SUCCESS || parsed < (uint64_t)min || parsed > (uint64_t)max) {
+        return EXIT_FAILURE;
+    }
+    *result = (int)parsed;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Applies a timeout setting in milliseconds, 0 disables the timeout
+/// @param key name of the setting
+/// @param value value of the setting
+/// @param timeout address to save the timeout
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int apply_timeout(const char *key, const char *value, int *timeout, Error *error) {
+    if (parse_int(value, 0, INT_MAX, timeout) != EXIT_SUCCESS) {
+        error_write(error, "invalid value \"%s\" for %s, expected milliseconds or 0 to disable", value, key);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Requests which can be limited with "limit.<name>"
+static const struct {
+    const char  *name;
+    int         id;
+} limited_requests[] = {
+    { "display_orders", REQUEST_DISPLAY_ORDERS },
+    { "list_items", REQUEST_LIST_ITEMS },
+    { "add_order", REQUEST_ADD_ORDER },
+    { "export_orders", REQUEST_EXPORT_ORDERS },
+    { "get_order", REQUEST_GET_ORDER },
+    { "stats", REQUEST_STATS },
+    { "batch", REQUEST_BATCH },
+    { "subscribe_orders", REQUEST_SUBSCRIBE_ORDERS }
+};
+
+/// @brief Applies a rate limit setting of the form "<rate per second> <burst>"
+/// @param key name of the setting
+/// @param value value of the setting, a rate of 0 disables the limit
+/// @param rule address to save the limit
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int apply_rate_limit(const char *key, const char *value, RateLimitRule *rule, Error *error) {
+    char rate[64];
+    snprintf(rate, sizeof(rate), "%s", value);
+    char *burst = strpbrk(rate, " \t");
+    if (burst) {
+        *burst = '\0';
+        burst = trim(burst + 1);
+    }
+    uint64_t rate_value;
+    uint64_t burst_value = 0;
+    if (parse_uint64(rate, &rate_value) != EXIT_SUCCESS || rate_value > RATE_LIMIT_MAX_RATE
+            || (rate_value > 0 && (!burst || parse_uint64(burst, &burst_value) != EXIT_SUCCESS
+                || burst_value < 1 || burst_value > RATE_LIMIT_MAX_BURST))) {
+        error_write(error, "invalid value \"%s\" for %s, expected \"<per second> <burst>\" up to %d or 0 to disable",
+                value, key, RATE_LIMIT_MAX_RATE);
+        return EXIT_FAILURE;
+    }
+    rule->rate = (uint32_t)rate_value;
+    rule->burst = (uint32_t)burst_value;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Applies a single setting to the configuration
+/// @param config configuration
+/// @param key name of the setting
+/// @param value value of the setting
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int apply_setting(Config *config, const char *key, const char *value, Error *error) {
+    if (strcmp(key, "db.primary") == 0) {
+        snprintf(config->db_primary, sizeof(config->db_primary), "%s", value);
+    } else if (strcmp(key, "db.standby") == 0) {
+        if (config->db_standbys_length >= CONFIG_MAX_STANDBYS) {
+            error_write(error, "too many standbys, at most %d are supported", CONFIG_MAX_STANDBYS);
+            return EXIT_FAILURE;
+        }
+        snprintf(config->db_standbys[config->db_standbys_length++], CONFIG_MAX_CONNINFO, "%s", value);
+    } else if (strcmp(key, "db.shard") == 0) {
+        if (config->db_shards_length >= CONFIG_MAX_SHARDS - 1) {
+            error_write(error, "too many shards, at most %d are supported", CONFIG_MAX_SHARDS);
+            return EXIT_FAILURE;
+        }
+        snprintf(config->db_shards[config->db_shards_length++], CONFIG_MAX_CONNINFO, "%s", value);
+    } else if (strcmp(key, "db.catalog_sync_ms") == 0) {
+        if (parse_int(value, 0, INT_MAX, &config->db_catalog_sync_ms) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected milliseconds", value, key);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "db.max_replica_lag") == 0) {
+        if (parse_uint64(value, &config->db_max_replica_lag) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s", value, key);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "server.io_threads") == 0) {
+        if (parse_int(value, 1, SERVER_MAX_IO_THREADS, &config->server.io_threads) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected 1 to %d", value, key, SERVER_MAX_IO_THREADS);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "server.min_workers") == 0) {
+        if (parse_int(value, 1, EXECUTOR_MAX_WORKERS, &config->server.min_workers) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected 1 to %d", value, key, EXECUTOR_MAX_WORKERS);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "server.max_workers") == 0) {
+        if (parse_int(value, 1, EXECUTOR_MAX_WORKERS, &config->server.max_workers) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected 1 to %d", value, key, EXECUTOR_MAX_WORKERS);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "server.idle_timeout_ms") == 0) {
+        return apply_timeout(key, value, &config->server.idle_timeout_ms, error);
+    } else if (strcmp(key, "server.read_timeout_ms") == 0) {
+        return apply_timeout(key, value, &config->server.read_timeout_ms, error);
+    } else if (strcmp(key, "server.write_timeout_ms") == 0) {
+        return apply_timeout(key, value, &config->server.write_timeout_ms, error);
+    } else if (strcmp(key, "server.request_timeout_ms") == 0) {
+        return apply_timeout(key, value, &config->server.request_timeout_ms, error);
+    } else if (strcmp(key, "server.unix_path") == 0) {
+        if (strlen(value) >= sizeof(config->server.unix_path)) {
+            error_write(error, "invalid value \"%s\" for %s, expected at most %zu characters", value, key, sizeof(config->server.unix_path) - 1);
+            return EXIT_FAILURE;
+        }
+        snprintf(config->server.unix_path, sizeof(config->server.unix_path), "%s", value);
+    } else if (strcmp(key, "server.ring_size") == 0) {
+        if (parse_int(value, 0, SHM_MAX_RING_SIZE, &config->server.ring_size) != EXIT_SUCCESS
+                || (config->server.ring_size != 0
+                    && (config->server.ring_size < SHM_MIN_RING_SIZE || (config->server.ring_size & (config->server.ring_size - 1)) != 0))) {
+            error_write(error, "invalid value \"%s\" for %s, expected a power of two from %d to %d or 0 to disable",
+                    value, key, SHM_MIN_RING_SIZE, SHM_MAX_RING_SIZE);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "server.capture_path") == 0) {
+        if (strlen(value) >= sizeof(config->server.capture_path)) {
+            error_write(error, "invalid value \"%s\" for %s, expected at most %zu characters", value, key, sizeof(config->server.capture_path) - 1);
+            return EXIT_FAILURE;
+        }
+        snprintf(config->server.capture_path, sizeof(config->server.capture_path), "%s", value);
+    } else if (strcmp(key, "server.capture_buffer_size") == 0) {
+        if (parse_int(value, CAPTURE_MIN_BUFFER_SIZE, CAPTURE_MAX_BUFFER_SIZE, &config->server.capture_buffer_size) != EXIT_SUCCESS
+                || (config->server.capture_buffer_size & (config->server.capture_buffer_size - 1)) != 0) {
+            error_write(error, "invalid value \"%s\" for %s, expected a power of two from %d to %d",
+                    value, key, CAPTURE_MIN_BUFFER_SIZE, CAPTURE_MAX_BUFFER_SIZE);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "cache.order_max_bytes") == 0) {
+        if (parse_uint64(value, &config->order_cache_max_bytes) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected bytes or 0 to disable", value, key);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "stock.hot_item") == 0) {
+        if (config->stock_hot_items_length >= CONFIG_MAX_HOT_ITEMS) {
+            error_write(error, "too many hot items, at most %d are supported", CONFIG_MAX_HOT_ITEMS);
+            return EXIT_FAILURE;
+        }
+        int item_id;
+        if (parse_int(value, 1, INT_MAX, &item_id) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected an item ID", value, key);
+            return EXIT_FAILURE;
+        }
+        config->stock_hot_items[config->stock_hot_items_length++] = item_id;
+    } else if (strcmp(key, "stock.reconcile_ms") == 0) {
+        if (parse_int(value, 1, INT_MAX, &config->stock_reconcile_ms) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected milliseconds", value, key);
+            return EXIT_FAILURE;
+        }
+    } else if (strcmp(key, "limit.connections") == 0) {
+        return apply_rate_limit(key, value, &config->server.limits.connect, error);
+    } else if (strcmp(key, "limit.requests") == 0) {
+        // sets every request, limits of single requests which follow override it
+        for (size_t i = 0; i < sizeof(limited_requests) / sizeof(limited_requests[0]); i++) {
+            if (apply_rate_limit(key, value, &config->server.limits.requests[limited_requests[i].id], error) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+    } else if (strcmp(key, "limit.table_size") == 0) {
+        if (parse_int(value, RATE_LIMIT_MIN_TABLE_SIZE, RATE_LIMIT_MAX_TABLE_SIZE, &config->server.limits.table_size) != EXIT_SUCCESS
+                || (config->server.limits.table_size & (config->server.limits.table_size - 1)) != 0) {
+            error_write(error, "invalid value \"%s\" for %s, expected a power of two from %d to %d", value, key,
+                    RATE_LIMIT_MIN_TABLE_SIZE, RATE_LIMIT_MAX_TABLE_SIZE);
+            return EXIT_FAILURE;
+        }
+    } else if (strncmp(key, "limit.", 6) == 0) {
+        for (size_t i = 0; i < sizeof(limited_requests) / sizeof(limited_requests[0]); i++) {
+            if (strcmp(key + 6, limited_requests[i].name) == 0) {
+                return apply_rate_limit(key, value, &config->server.limits.requests[limited_requests[i].id], error);
+            }
+        }
+        error_write(error, "unknown setting \"%s\"", key);
+        return EXIT_FAILURE;
+    } else if (strcmp(key, "feed.queue_length") == 0) {
+        if (parse_int(value, 0, ORDER_FEED_MAX_PENDING, &config->feed_queue_length) != EXIT_SUCCESS) {
+            error_write(error, "invalid value \"%s\" for %s, expected 1 to %d or 0 to disable", value, key, ORDER_FEED_MAX_PENDING);
+            return EXIT_FAILURE;
+        }
+    } else {
+        error_write(error, "unknown setting \"%s\"", key);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int config_load(Config *config, const char *path, Error *error) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *text = trim(line);
+        if (text[0] == '\0' || text[0] == '#') {
+            continue;
+        }
+        char *separator = strchr(text, '=');
+        if (!separator) {
+            error_write(error, "%.255s:%d: expected \"key = value\"", path, line_number);
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+        *separator = '\0';
+        Error setting_error = {0};
+        if (apply_setting(config, trim(text), trim(separator + 1), &setting_error) != EXIT_SUCCESS) {
+            error_write(error, "%.200s:%d: %.200s", path, line_number, setting_error.msg);
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+    }
+    fclose(file);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+#ifndef __CONFIG_H_
+#define __CONFIG_H_
+
+#include <inttypes.h>
+
+#include "error.h"
+#include "server.h"
+
+#define CONFIG_MAX_CONNINFO     512
+#define CONFIG_MAX_STANDBYS     8
+#define CONFIG_MAX_SHARDS       16      // order shards including the primary
+#define CONFIG_MAX_HOT_ITEMS    64
+
+/// @brief Settings of the shop server. The configuration file consists of "key = value" lines,
+///        empty lines and lines starting with '#' are ignored.
+typedef struct {
+    char        db_primary[CONFIG_MAX_CONNINFO];                        // db.primary: connection string of the primary
+    char        db_standbys[CONFIG_MAX_STANDBYS][CONFIG_MAX_CONNINFO];  // db.standby: connection strings of hot standbys, repeatable
+    int         db_standbys_length;                                     // amount of standbys
+    uint64_t    db_max_replica_lag;                                     // db.max_replica_lag: maximum lag of a standby in bytes of WAL
+    char        db_shards[CONFIG_MAX_SHARDS - 1][CONFIG_MAX_CONNINFO];  // db.shard: connection strings of further order shards, repeatable, the primary is shard 0
+    int         db_shards_length;                                       // amount of further shards
+    int         db_catalog_sync_ms;                                     // db.catalog_sync_ms: interval of reloading a changed catalog and copying it to the shards, 0 only loads it on startup
+    ServerOptions server;                                               // server.*: thread counts and timeouts
+    uint64_t    order_cache_max_bytes;                                  // cache.order_max_bytes: memory limit of the order cache, 0 disables it
+    int32_t     stock_hot_items[CONFIG_MAX_HOT_ITEMS];                  // stock.hot_item: items with sharded stock counters, repeatable
+    int         stock_hot_items_length;                                 // amount of hot items
+    int         stock_reconcile_ms;                                     // stock.reconcile_ms: interval of writing reservations to the database
+    int         feed_queue_length;                                      // feed.queue_length: changed orders queued per subscriber, 0 disables subscriptions
+} Config;
+
+/// @brief Initializes the configuration with default values
+/// @param config configuration to initialize
+void config_init(Config *config);
+
+/// @brief Reads settings from a configuration file. Settings which are not contained in the
+///        file keep their current value.
+/// @param config initialized configuration
+/// @param path path of the configuration file
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int config_load(Config *config, const char *path, Error *error);
+
+#endif
@@ -1,4 +1,7 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
 
 #include "database.h"
 #include "error.h"
@@ -92,13 +95,342 @@ int db_commit_transaction(PGconn *conn, Error *error) {
     return EXIT_SUCCESS;
 }
 
+/// @brief Runs a query which returns a single WAL position
+/// @param conn Connection to the database
+/// @param query query with a pg_lsn result
+/// @param lsn address to save the WAL position
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int get_wal_lsn(PGconn *conn, const char *query, uint64_t *lsn, Error *error) {
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    if (PQntuples(res) == 0 || PQgetisnull(res, 0, 0)) {
+        error_write(error, "%s", "no WAL position available");
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    // WAL positions are formatted as two hexadecimal 32 bit numbers, e.g. "16/B374D848"
+    unsigned int high, low;
+    if (sscanf(PQgetvalue(res, 0, 0), "%X/%X", &high, &low) != 2) {
+        error_write(error, "invalid WAL position \"%s\"", PQgetvalue(res, 0, 0));
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *lsn = ((uint64_t)high << 32) | low;
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_get_current_wal_lsn(PGconn *conn, uint64_t *lsn, Error *error) {
+    return get_wal_lsn(conn, "SELECT pg_current_wal_lsn()", lsn, error);
+}
+
+int db_get_replay_wal_lsn(PGconn *conn, uint64_t *lsn, Error *error) {
+    return get_wal_lsn(conn, "SELECT pg_last_wal_replay_lsn()", lsn, error);
+}
+
+int db_begin_snapshot_transaction(PGconn *conn, Error *error) {
+    PGresult *res = PQexec(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_export_snapshot(PGconn *conn, char *snapshot, size_t snapshot_size, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT pg_export_snapshot()");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    snprintf(snapshot, snapshot_size, "%s", PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_import_snapshot(PGconn *conn, const char *snapshot, Error *error) {
+    char *literal = PQescapeLiteral(conn, snapshot, strlen(snapshot));
+    if (!literal) {
+        error_write(error, "%s", PQerrorMessage(conn));
+        return EXIT_FAILURE;
+    }
+    char query[256];
+    snprintf(query, sizeof(query), "SET TRANSACTION SNAPSHOT %s", literal);
+    PQfreemem(literal);
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_get_catalog_version(PGconn *conn, int64_t *version, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT version FROM catalog_version");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    if (PQntuples(res) == 0) {
+        error_write(error, "%s", "catalog version not found");
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *version = atoll(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_get_items(PGconn *conn, Item **items, int *items_length, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT item_id, name, price FROM items ORDER BY item_id");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    int rows = PQntuples(res);
+    Item *result = calloc(rows > 0 ? rows : 1, sizeof(Item));
+    if (!result) {
+        error_write(error, "cannot allocate %d items", rows);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < rows; i++) {
+        result[i].id = atol(PQgetvalue(res, i, 0));
+        size_t name_count = snprintf(result[i].name, 255, "%s", PQgetvalue(res, i, 1));
+        result[i].name_count = name_count;
+        result[i].price = atol(PQgetvalue(res, i, 2));
+    }
+    *items = result;
+    *items_length = rows;
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Formats a field of all rows as PostgreSQL array literal, e.g. "{1,2,3}"
+/// @param rows array of rows
+/// @param row_size size of a row
+/// @param rows_length amount of rows
+/// @param field offset of the field within a row
+/// @param field_size size of the field, either an int32_t or an int64_t
+/// @return newly allocated literal which must be freed by the caller, NULL if out of memory
+static char *format_array_literal(const void *rows, size_t row_size, int rows_length, size_t field, size_t field_size) {
+    size_t capacity = (size_t)rows_length * 21 + 3;
+    char *literal = malloc(capacity);
+    if (!literal) {
+        return NULL;
+    }
+    size_t length = 0;
+    literal[length++] = '{';
+    for (int i = 0; i < rows_length; i++) {
+        const char *row = (const char *)rows + i * row_size;
+        long long value = field_size == sizeof(int64_t)
+                ? *(const int64_t *)(row + field)
+                : *(const int32_t *)(row + field);
+        length += snprintf(literal + length, capacity - length, i > 0 ? ",%lld" : "%lld", value);
+    }
+    literal[length++] = '}';
+    literal[length] = '\0';
+    return literal;
+}
+
+int db_insert_journal_orders(PGconn *conn, const JournalOrderLine *lines, int lines_length, Error *error) {
+    char *param_seqs = format_array_literal(lines, sizeof(*lines), lines_length,
+            offsetof(JournalOrderLine, journal_seq), sizeof(lines->journal_seq));
+    char *param_item_ids = format_array_literal(lines, sizeof(*lines), lines_length,
+            offsetof(JournalOrderLine, item_id), sizeof(lines->item_id));
+    char *param_quantities = format_array_literal(lines, sizeof(*lines), lines_length,
+            offsetof(JournalOrderLine, quantity), sizeof(lines->quantity));
+    if (!param_seqs || !param_item_ids || !param_quantities) {
+        error_write(error, "cannot allocate parameters for %d order lines", lines_length);
+        free(param_seqs);
+        free(param_item_ids);
+        free(param_quantities);
+        return EXIT_FAILURE;
+    }
+    const char *insert_params[] = { param_seqs, param_item_ids, param_quantities };
+    // the counts are checked before the commit, so an order is never stored without some of its lines
+    if (db_begin_transaction(conn, error) != EXIT_SUCCESS) {
+        free(param_seqs);
+        free(param_item_ids);
+        free(param_quantities);
+        return EXIT_FAILURE;
+    }
+    PGresult *res = PQexecParams(conn, "WITH lines AS ("
+        "  SELECT * FROM unnest($1::bigint[], $2::integer[], $3::integer[]) AS l(journal_seq, item_id, quantity)"
+        " ), new_orders AS ("
+        "  INSERT INTO orders (state_id, journal_seq)"
+        "  SELECT 1, journal_seq FROM lines GROUP BY journal_seq ORDER BY journal_seq"
+        "  ON CONFLICT (journal_seq) DO NOTHING"
+        "  RETURNING order_id, journal_seq"
+        " ), new_lines AS ("
+        // an unknown item leaves the price NULL, which fails the insert instead of dropping the line
+        "  INSERT INTO order_items (order_id, item_id, quantity, unit_price)"
+        "  SELECT n.order_id, l.item_id, l.quantity, i.price"
+        "  FROM lines l"
+        "  JOIN new_orders n ON n.journal_seq = l.journal_seq"
+        "  LEFT JOIN items i ON i.item_id = l.item_id"
+        "  RETURNING 1"
+        " )"
+        " SELECT (SELECT COUNT(*) FROM lines l JOIN new_orders n ON n.journal_seq = l.journal_seq),"
+        "  (SELECT COUNT(*) FROM new_lines)", 3, NULL, insert_params, NULL, NULL, 0);
+    free(param_seqs);
+    free(param_item_ids);
+    free(param_quantities);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        // class 23 are integrity constraint violations, e.g. the NULL price of an unknown item
+        const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        int result = sqlstate && strncmp(sqlstate, "23", 2) == 0 ? DB_REJECTED : EXIT_FAILURE;
+        db_set_error(error, res);
+        PQclear(res);
+        PQclear(PQexec(conn, "ROLLBACK"));
+        return result;
+    }
+    long long expected = atoll(PQgetvalue(res, 0, 0));
+    long long inserted = atoll(PQgetvalue(res, 0, 1));
+    PQclear(res);
+    if (inserted != expected) {
+        error_write(error, "stored %lld of %lld order lines of %d journaled lines", inserted, expected, lines_length);
+        PQclear(PQexec(conn, "ROLLBACK"));
+        return DB_REJECTED;
+    }
+    return db_commit_transaction(conn, error);
+}
+
+int db_get_max_journal_seq(PGconn *conn, uint64_t *journal_seq, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT COALESCE(MAX(journal_seq), 0) FROM orders");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *journal_seq = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+int db_get_max_item_id(PGconn *conn, int32_t *item_id, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT COALESCE(MAX(item_id), 0) FROM items");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *item_id = atol(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Copies the rows of a query returning item_id and quantity into stock levels
+/// @param res result of the query
+/// @param levels address to save a newly allocated array of stock levels
+/// @param levels_length address to save the amount of stock levels
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int get_stock_levels(PGresult *res, StockLevel **levels, int *levels_length, Error *error) {
+    int rows = PQntuples(res);
+    StockLevel *result = calloc(rows > 0 ? rows : 1, sizeof(StockLevel));
+    if (!result) {
+        error_write(error, "cannot allocate %d stock levels", rows);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < rows; i++) {
+        result[i].item_id = atol(PQgetvalue(res, i, 0));
+        result[i].quantity = atoll(PQgetvalue(res, i, 1));
+    }
+    *levels = result;
+    *levels_length = rows;
+    return EXIT_SUCCESS;
+}
+
+int db_get_stock(PGconn *conn, StockLevel **levels, int *levels_length, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT item_id, available FROM stock");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    int result = get_stock_levels(res, levels, levels_length, error);
+    PQclear(res);
+    return result;
+}
+
+int db_reconcile_stock(PGconn *conn, const StockLevel *reserved, int reserved_length, StockLevel **levels, int *levels_length, Error *error) {
+    char *param_item_ids = format_array_literal(reserved, sizeof(*reserved), reserved_length,
+            offsetof(StockLevel, item_id), sizeof(reserved->item_id));
+    char *param_quantities = format_array_literal(reserved, sizeof(*reserved), reserved_length,
+            offsetof(StockLevel, quantity), sizeof(reserved->quantity));
+    if (!param_item_ids || !param_quantities) {
+        error_write(error, "cannot allocate parameters for %d stock levels", reserved_length);
+        free(param_item_ids);
+        free(param_quantities);
+        return EXIT_FAILURE;
+    }
+    const char *update_params[] = { param_item_ids, param_quantities };
+    // the plain SELECT sees the stock before the update, so updated rows are taken from RETURNING
+    PGresult *res = PQexecParams(conn, "WITH reserved AS ("
+        "  SELECT * FROM unnest($1::integer[], $2::bigint[]) AS r(item_id, quantity)"
+        " ), updated AS ("
+        "  UPDATE stock s SET available = s.available - r.quantity"
+        "  FROM reserved r WHERE s.item_id = r.item_id"
+        "  RETURNING s.item_id, s.available"
+        " )"
+        " SELECT item_id, available FROM updated"
+        " UNION ALL"
+        " SELECT item_id, available FROM stock WHERE item_id NOT IN (SELECT item_id FROM updated)",
+        2, NULL, update_params, NULL, NULL, 0);
+    free(param_item_ids);
+    free(param_quantities);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    int result = get_stock_levels(res, levels, levels_length, error);
+    PQclear(res);
+    return result;
+}
+
+int db_get_order(PGconn *conn, int32_t order_id, Order *order, int *found, Error *error) {
+    char param_order_id[11];
+    snprintf(param_order_id, 11, "%d", order_id);
+
+    const char *select_query_params[] = { param_order_id };
+
+    PGresult *res = PQexecParams(conn, "SELECT o.order_id, o.order_date, os.state_name FROM orders o LEFT JOIN order_states os ON os.state_id = o.state_id WHERE o.order_id = $1", 1, NULL, select_query_params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *found = PQntuples(res) > 0;
+    if (*found) {
+        order->id = atol(PQgetvalue(res, 0, 0));
+        snprintf(order->date, 32, "%s", PQgetvalue(res, 0, 1));
+        snprintf(order->status, 50, "%s", PQgetvalue(res, 0, 2));
+    }
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
 int db_get_order_item_by_order_id(PGconn *conn, int32_t order_id, OrderItem *order_items, int *order_items_length, int max_order_items, Error *error) {
     char param_order_id[11];
     snprintf(param_order_id, 11, "%d", order_id);
 
     const char *select_query_params[] = { param_order_id };
 
-    PGresult *res = PQexecParams(conn, "SELECT oi.item_id, i.name, oi.quantity, i.price FROM order_items oi JOIN items i ON oi.item_id = i.item_id WHERE oi.order_id = $1", 1, NULL, select_query_params, NULL, NULL, 0);
+    PGresult *res = PQexecParams(conn, "SELECT oi.item_id, i.name, oi.quantity, oi.unit_price FROM order_items oi JOIN items i ON oi.item_id = i.item_id WHERE oi.order_id = $1 ORDER BY oi.order_item_id", 1, NULL, select_query_params, NULL, NULL, 0);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         db_set_error(error, res);
         PQclear(res);
@@ -118,44 +450,582 @@ int db_get_order_item_by_order_id(PGconn *conn, int32_t order_id, OrderItem *ord
     return EXIT_SUCCESS;
 }
 
-int db_get_order_items_latest(PGconn *conn, FullOrderItem *items, int max_item_count, Error *error) {
-    char stmt[512];
-    snprintf(stmt, 512, "SELECT"
-        "  o.order_id,"
-        "  o.order_date,"
-        "  os.state_name AS order_status,"
-        "  oi.order_item_id,"
-        "  i.name AS item_name,"
-        "  oi.quantity,"
-        "  oi.unit_price"
-        " FROM orders o"
-        " JOIN order_items oi ON oi.order_id = o.order_id"
-        " JOIN order_states os ON os.state_id = o.state_id"
+int db_listen(PGconn *conn, const char *channel, Error *error) {
+    char *identifier = PQescapeIdentifier(conn, channel, strlen(channel));
+    if (!identifier) {
+        error_write(error, "%s", PQerrorMessage(conn));
+        return EXIT_FAILURE;
+    }
+    char query[256];
+    snprintf(query, sizeof(query), "LISTEN %s", identifier);
+    PQfreemem(identifier);
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+#define SELECT_FULL_ORDER_ITEMS_FROM "SELECT" \
+        "  o.order_id," \
+        "  o.order_date," \
+        "  os.state_name AS order_status," \
+        "  oi.order_item_id," \
+        "  i.name AS item_name," \
+        "  oi.quantity," \
+        "  oi.unit_price" \
+        " FROM orders o" \
+        " JOIN order_items oi ON oi.order_id = o.order_id" \
+        " JOIN order_states os ON os.state_id = o.state_id" \
         " JOIN items i ON i.item_id = oi.item_id"
-        " ORDER BY o.order_date DESC"
-        " LIMIT %d;", max_item_count);
-    PGresult *res = PQexec(conn, stmt);
 
-    // Check if the query was successful
+// latest first, the order of db_merge_order_items(), which returns order_date as an additional column
+#define SELECT_MERGED_ORDER_ITEMS "SELECT f.*, (extract(epoch FROM f.order_date - TIMESTAMP '2000-01-01') * 1000000)::bigint" \
+        " FROM (" SELECT_FULL_ORDER_ITEMS_FROM ") f" \
+        " ORDER BY f.order_date DESC, f.order_id DESC, f.order_item_id"
+
+/// @brief Copies a row of a SELECT_FULL_ORDER_ITEMS_FROM result into an order item
+/// @param res result of the query
+/// @param row row number
+/// @param item destination order item
+static void get_full_order_item(PGresult *res, int row, FullOrderItem *item) {
+    item->order.id = atol(PQgetvalue(res, row, 0));
+    snprintf(item->order.date, 32, "%s", PQgetvalue(res, row, 1));
+    snprintf(item->order.status, 50, "%s", PQgetvalue(res, row, 2));
+    item->order_item.id = atol(PQgetvalue(res, row, 3));
+    size_t name_count = snprintf(item->order_item.name, 255, "%s", PQgetvalue(res, row, 4));
+    item->order_item.name_count = name_count;
+    item->order_item.count = atol(PQgetvalue(res, row, 5));
+    item->order_item.price = atol(PQgetvalue(res, row, 6));
+}
+
+int db_get_order_items_by_ids(PGconn *conn, const int32_t *order_ids, int order_ids_length,
+        int (*row_cb)(void *ctx, const FullOrderItem *item), void *ctx, Error *error) {
+    char *param_order_ids = format_array_literal(order_ids, sizeof(*order_ids), order_ids_length, 0, sizeof(*order_ids));
+    if (!param_order_ids) {
+        error_write(error, "cannot allocate parameters for %d orders", order_ids_length);
+        return EXIT_FAILURE;
+    }
+
+    const char *params[] = { param_order_ids };
+    PGresult *res = PQexecParams(conn, SELECT_FULL_ORDER_ITEMS_FROM " WHERE o.order_id = ANY($1::int[]) ORDER BY o.order_id, oi.order_item_id",
+            1, NULL, params, NULL, NULL, 0);
+    free(param_order_ids);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         db_set_error(error, res);
         PQclear(res);
-        return -1;
+        return EXIT_FAILURE;
     }
-
+    int result = EXIT_SUCCESS;
     int rows = PQntuples(res);
+    for (int i = 0; i < rows && result == EXIT_SUCCESS; i++) {
+        FullOrderItem item;
+        get_full_order_item(res, i, &item);
+        result = row_cb(ctx, &item);
+    }
+    PQclear(res);
+    if (result != EXIT_SUCCESS) {
+        error_write(error, "%s", "reading order items aborted");
+    }
+    return result;
+}
 
-    for (int i = 0; i < rows; i++) {
-        items[i].order.id = atol(PQgetvalue(res, i, 0));
-        snprintf(items[i].order.date, 32, "%s", PQgetvalue(res, i, 1));
-        snprintf(items[i].order.status, 50, "%s", PQgetvalue(res, i, 2));
-        items[i].order_item.id = atol(PQgetvalue(res, i, 3));
-        size_t name_count = snprintf(items[i].order_item.name, 255, "%s", PQgetvalue(res, i, 4));
-        items[i].order_item.name_count = name_count;
-        items[i].order_item.count = atol(PQgetvalue(res, i, 5));
-        items[i].order_item.price = atol(PQgetvalue(res, i, 6));
+/// @brief Order items of one database while they are merged
+typedef struct {
+    PGconn          *conn;      // connection running the query
+    FullOrderItem   item;       // current row
+    int64_t         date_key;   // order date of the current row, INT64_MAX if the order has no date
+    int             done;       // all results of the query were consumed
+} MergeSource;
+
+/// @brief Tells whether the current row of a source comes before the one of another source,
+///        in the order of SELECT_MERGED_ORDER_ITEMS
+static int merge_before(const MergeSource *a, const MergeSource *b) {
+    if (a->date_key != b->date_key) {
+        return a->date_key > b->date_key;
     }
+    if (a->item.order.id != b->item.order.id) {
+        return a->item.order.id > b->item.order.id;
+    }
+    return a->item.order_item.id < b->item.order_item.id;
+}
 
+/// @brief Moves the source at a position of the heap down until the heap is ordered again
+static void merge_sift_down(MergeSource **heap, int heap_length, int pos) {
+    while (1) {
+        int first = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < heap_length && merge_before(heap[left], heap[first])) {
+            first = left;
+        }
+        if (right < heap_length && merge_before(heap[right], heap[first])) {
+            first = right;
+        }
+        if (first == pos) {
+            return;
+        }
+        MergeSource *swap = heap[pos];
+        heap[pos] = heap[first];
+        heap[first] = swap;
+        pos = first;
+    }
+}
+
+/// @brief Receives the next row of a source. Waits only for the database of the source, the
+///        rows of the others are buffered meanwhile.
+/// @param source source with a running query
+/// @param error address of error object to set an error message on failure
+/// @return 1 if a row was received, 0 at the end of the rows, -1 on failure
+static int merge_next(MergeSource *source, Error *error) {
+    int result = 0;
+    PGresult *res;
+    // every row arrives in its own result, followed by an empty PGRES_TUPLES_OK result
+    while ((res = PQgetResult(source->conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_SINGLE_TUPLE) {
+            get_full_order_item(res, 0, &source->item);
+            source->date_key = PQgetisnull(res, 0, 7) ? INT64_MAX : atoll(PQgetvalue(res, 0, 7));
+            PQclear(res);
+            return 1;
+        }
+        if (status != PGRES_TUPLES_OK && result == 0) {
+            db_set_error(error, res);
+            result = -1;
+        }
+        PQclear(res);
+    }
+    source->done = 1;
+    return result;
+}
+
+/// @brief Stops the queries of all sources which still run and consumes their results
+static void merge_abort(MergeSource *sources, int sources_length) {
+    for (int i = 0; i < sources_length; i++) {
+        if (sources[i].done) {
+            continue;
+        }
+        PGcancel *cancel = PQgetCancel(sources[i].conn);
+        if (cancel) {
+            char errbuf[256];
+            PQcancel(cancel, errbuf, sizeof(errbuf));
+            PQfreeCancel(cancel);
+        }
+    }
+    for (int i = 0; i < sources_length; i++) {
+        PGresult *res;
+        while (!sources[i].done && (res = PQgetResult(sources[i].conn)) != NULL) {
+            PQclear(res);
+        }
+        sources[i].done = 1;
+    }
+}
+
+int db_merge_order_items(PGconn *const *conns, int conns_length, int limit,
+        int (*row_cb)(void *ctx, const FullOrderItem *item), void *ctx, Error *error) {
+    MergeSource *sources = calloc(conns_length, sizeof(MergeSource));
+    MergeSource **heap = calloc(conns_length, sizeof(MergeSource *));
+    if (!sources || !heap) {
+        error_write(error, "cannot allocate the merge of %d databases", conns_length);
+        free(sources);
+        free(heap);
+        return EXIT_FAILURE;
+    }
+    char query[1024];
+    if (limit > 0) {
+        snprintf(query, sizeof(query), SELECT_MERGED_ORDER_ITEMS " LIMIT %d", limit);
+    } else {
+        snprintf(query, sizeof(query), "%s", SELECT_MERGED_ORDER_ITEMS);
+    }
+
+    // all queries are sent before the first row is read, so the databases work concurrently
+    for (int i = 0; i < conns_length; i++) {
+        sources[i].conn = conns[i];
+        sources[i].done = 1;
+    }
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < conns_length; i++) {
+        if (!PQsendQuery(conns[i], query)) {
+            error_write(error, "%s", PQerrorMessage(conns[i]));
+            result = EXIT_FAILURE;
+            break;
+        }
+        sources[i].done = 0;
+        if (!PQsetSingleRowMode(conns[i])) {
+            error_write(error, "%s", PQerrorMessage(conns[i]));
+            result = EXIT_FAILURE;
+            break;
+        }
+    }
+    int heap_length = 0;
+    for (int i = 0; i < conns_length && result == EXIT_SUCCESS; i++) {
+        int received = merge_next(&sources[i], error);
+        if (received < 0) {
+            result = EXIT_FAILURE;
+        } else if (received > 0) {
+            heap[heap_length++] = &sources[i];
+        }
+    }
+    for (int i = heap_length / 2 - 1; i >= 0; i--) {
+        merge_sift_down(heap, heap_length, i);
+    }
+
+    int rows = 0;
+    while (result == EXIT_SUCCESS && heap_length > 0 && (limit <= 0 || rows < limit)) {
+        MergeSource *first = heap[0];
+        if (row_cb(ctx, &first->item) != EXIT_SUCCESS) {
+            error_write(error, "%s", "merging order items aborted");
+            result = EXIT_FAILURE;
+            break;
+        }
+        rows++;
+        int received = merge_next(first, error);
+        if (received < 0) {
+            result = EXIT_FAILURE;
+        } else if (received == 0) {
+            heap[0] = heap[--heap_length];
+        }
+        merge_sift_down(heap, heap_length, 0);
+    }
+    merge_abort(sources, conns_length);
+    free(sources);
+    free(heap);
+    return result;
+}
+
+int db_get_order_id_sequence(PGconn *conn, int64_t *start, int64_t *increment, Error *error) {
+    PGresult *res = PQexec(conn, "SELECT seqstart, seqincrement FROM pg_sequence"
+            " WHERE seqrelid = pg_get_serial_sequence('orders', 'order_id')::regclass");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    if (PQntuples(res) == 0) {
+        error_write(error, "%s", "orders.order_id has no sequence");
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    *start = atoll(PQgetvalue(res, 0, 0));
+    *increment = atoll(PQgetvalue(res, 0, 1));
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Runs a statement which returns no rows
+/// @param conn Connection to the database
+/// @param query statement
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int exec_command(PGconn *conn, const char *query, Error *error) {
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
     PQclear(res);
-    return rows;
-}
\ No newline at end of file
+    return EXIT_SUCCESS;
+}
+
+/// @brief Expects the result of starting a COPY
+/// @param res result of the COPY statement, cleared by the call
+/// @param status expected status
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int expect_copy(PGresult *res, ExecStatusType status, Error *error) {
+    int result = EXIT_SUCCESS;
+    if (PQresultStatus(res) != status) {
+        db_set_error(error, res);
+        result = EXIT_FAILURE;
+    }
+    PQclear(res);
+    return result;
+}
+
+/// @brief Consumes the remaining results of a finished or failed COPY
+/// @param conn Connection to the database
+/// @param error address of error object to set an error message on failure, unless one is set
+/// @param result result of the COPY so far
+/// @return EXIT_SUCCESS if the COPY and all results succeeded
+static int finish_copy(PGconn *conn, Error *error, int result) {
+    PGresult *res;
+    while ((res = PQgetResult(conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && result == EXIT_SUCCESS) {
+            db_set_error(error, res);
+            result = EXIT_FAILURE;
+        }
+        PQclear(res);
+    }
+    return result;
+}
+
+int db_replicate_items(PGconn *from, PGconn *to, Error *error) {
+    if (exec_command(to, "BEGIN", error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (exec_command(to, "CREATE TEMPORARY TABLE items_replica (LIKE items) ON COMMIT DROP", error) != EXIT_SUCCESS
+            || expect_copy(PQexec(to, "COPY items_replica FROM STDIN"), PGRES_COPY_IN, error) != EXIT_SUCCESS) {
+        PQclear(PQexec(to, "ROLLBACK"));
+        return EXIT_FAILURE;
+    }
+    // the rows are passed on as they arrive, in the text format both sides agree on
+    int result = expect_copy(PQexec(from, "COPY items TO STDOUT"), PGRES_COPY_OUT, error);
+    if (result == EXIT_SUCCESS) {
+        char *buffer;
+        int size;
+        while ((size = PQgetCopyData(from, &buffer, 0)) > 0) {
+            if (result == EXIT_SUCCESS && PQputCopyData(to, buffer, size) != 1) {
+                error_write(error, "%s", PQerrorMessage(to));
+                result = EXIT_FAILURE;
+            }
+            PQfreemem(buffer);
+        }
+        if (size == -2 && result == EXIT_SUCCESS) {
+            error_write(error, "%s", PQerrorMessage(from));
+            result = EXIT_FAILURE;
+        }
+        result = finish_copy(from, error, result);
+    }
+    if (PQputCopyEnd(to, result == EXIT_SUCCESS ? NULL : "reading the items failed") != 1 && result == EXIT_SUCCESS) {
+        error_write(error, "%s", PQerrorMessage(to));
+        result = EXIT_FAILURE;
+    }
+    result = finish_copy(to, error, result);
+    // items which were deleted from the primary are only deleted if no order of the shard refers to them
+    if (result != EXIT_SUCCESS
+            || exec_command(to, "INSERT INTO items SELECT * FROM items_replica"
+                " ON CONFLICT (item_id) DO UPDATE SET name = EXCLUDED.name, price = EXCLUDED.price, description = EXCLUDED.description"
+                " WHERE (items.name, items.price, items.description) IS DISTINCT FROM (EXCLUDED.name, EXCLUDED.price, EXCLUDED.description)", error) != EXIT_SUCCESS
+            || exec_command(to, "DELETE FROM items i WHERE NOT EXISTS (SELECT 1 FROM items_replica r WHERE r.item_id = i.item_id)"
+                " AND NOT EXISTS (SELECT 1 FROM order_items oi WHERE oi.item_id = i.item_id)", error) != EXIT_SUCCESS
+            || exec_command(to, "COMMIT", error) != EXIT_SUCCESS) {
+        PQclear(PQexec(to, "ROLLBACK"));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int db_get_order_date_range(PGconn *conn, int64_t *first, int64_t *last, Error *error) {
+    PGresult *res = PQexec(conn,
+            "SELECT (extract(epoch FROM min(order_date) - TIMESTAMP '2000-01-01') * 1000000)::bigint,"
+            "       (extract(epoch FROM max(order_date) - TIMESTAMP '2000-01-01') * 1000000)::bigint"
+            " FROM orders");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    if (PQgetisnull(res, 0, 0)) {
+        *first = 1;
+        *last = 0;
+    } else {
+        *first = atoll(PQgetvalue(res, 0, 0));
+        *last = atoll(PQgetvalue(res, 0, 1));
+    }
+    PQclear(res);
+    return EXIT_SUCCESS;
+}
+
+#define COPY_SIGNATURE      "PGCOPY\n\377\r\n"    // followed by a null byte
+#define COPY_SIGNATURE_SIZE 11
+#define COPY_ORDER_FIELDS   8
+
+/// @brief Position within a CopyData message of a binary COPY
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+} CopyReader;
+
+/// @brief Reads a big endian integer of 1, 2, 4 or 8 bytes
+/// @return EXIT_FAILURE if the message is too short
+static int copy_read_int(CopyReader *reader, size_t size, int64_t *value) {
+    if ((size_t)(reader->end - reader->pos) < size) {
+        return EXIT_FAILURE;
+    }
+    uint64_t result = 0;
+    for (size_t i = 0; i < size; i++) {
+        result = (result << 8) | reader->pos[i];
+    }
+    reader->pos += size;
+    // sign extend
+    int shift = 64 - 8 * (int)size;
+    *value = shift > 0 ? (int64_t)(result << shift) >> shift : (int64_t)result;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Reads the next field of a row
+/// @param reader position within the message
+/// @param data address to save the start of the field, NULL if the field is NULL
+/// @param length address to save the length of the field
+/// @return EXIT_FAILURE if the message is too short
+static int copy_read_field(CopyReader *reader, const uint8_t **data, uint32_t *length) {
+    int64_t field_length;
+    if (copy_read_int(reader, 4, &field_length) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (field_length < 0) {
+        *data = NULL;
+        *length = 0;
+        return EXIT_SUCCESS;
+    }
+    if (reader->end - reader->pos < field_length) {
+        return EXIT_FAILURE;
+    }
+    *data = reader->pos;
+    *length = (uint32_t)field_length;
+    reader->pos += field_length;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Reads an integer field which must not be NULL
+/// @param reader position within the message
+/// @param size expected size of the field
+/// @param value address to save the value
+/// @return EXIT_FAILURE if the field is NULL or has an unexpected size
+static int copy_read_int_field(CopyReader *reader, uint32_t size, int64_t *value) {
+    const uint8_t *data;
+    uint32_t length;
+    if (copy_read_field(reader, &data, &length) != EXIT_SUCCESS || !data || length != size) {
+        return EXIT_FAILURE;
+    }
+    CopyReader field = { data, data + length };
+    return copy_read_int(&field, size, value);
+}
+
+/// @brief Decodes the next order line of a binary COPY
+/// @param reader position within the message
+/// @param line address to save the order line
+/// @return 1 if a line was decoded, 0 at the end of the data, -1 if the data is invalid
+static int copy_read_order_line(CopyReader *reader, ExportOrderLine *line) {
+    int64_t fields, order_id, order_item_id, item_id, quantity, unit_price;
+    if (copy_read_int(reader, 2, &fields) != EXIT_SUCCESS) {
+        return -1;
+    }
+    if (fields == -1) {
+        return 0;
+    }
+    const uint8_t *date, *status, *item_name;
+    uint32_t date_length;
+    if (fields != COPY_ORDER_FIELDS
+            || copy_read_int_field(reader, 4, &order_id) != EXIT_SUCCESS
+            || copy_read_field(reader, &date, &date_length) != EXIT_SUCCESS
+            || (date && date_length != 8)
+            || copy_read_field(reader, &status, &line->status_length) != EXIT_SUCCESS
+            || copy_read_int_field(reader, 4, &order_item_id) != EXIT_SUCCESS
+            || copy_read_int_field(reader, 4, &item_id) != EXIT_SUCCESS
+            || copy_read_field(reader, &item_name, &line->item_name_length) != EXIT_SUCCESS
+            || copy_read_int_field(reader, 4, &quantity) != EXIT_SUCCESS
+            || copy_read_int_field(reader, 4, &unit_price) != EXIT_SUCCESS) {
+        return -1;
+    }
+    line->order_id = (int32_t)order_id;
+    line->order_date = ORDER_DATE_NULL;
+    if (date) {
+        CopyReader date_reader = { date, date + 8 };
+        copy_read_int(&date_reader, 8, &line->order_date);
+    }
+    line->status = status ? (const char *)status : "";
+    line->order_item_id = (int32_t)order_item_id;
+    line->item_id = (int32_t)item_id;
+    line->item_name = item_name ? (const char *)item_name : "";
+    line->quantity = (int32_t)quantity;
+    line->unit_price = (int32_t)unit_price;
+    return 1;
+}
+
+/// @brief Skips the file header of a binary COPY
+/// @return EXIT_FAILURE if the header is invalid
+static int copy_read_header(CopyReader *reader) {
+    int64_t flags, extension_length;
+    if ((size_t)(reader->end - reader->pos) < COPY_SIGNATURE_SIZE
+            || memcmp(reader->pos, COPY_SIGNATURE, COPY_SIGNATURE_SIZE) != 0) {
+        return EXIT_FAILURE;
+    }
+    reader->pos += COPY_SIGNATURE_SIZE;
+    if (copy_read_int(reader, 4, &flags) != EXIT_SUCCESS
+            || copy_read_int(reader, 4, &extension_length) != EXIT_SUCCESS
+            || extension_length < 0 || reader->end - reader->pos < extension_length) {
+        return EXIT_FAILURE;
+    }
+    reader->pos += extension_length;
+    return EXIT_SUCCESS;
+}
+
+int db_copy_order_lines(PGconn *conn, int64_t from, int64_t to, int include_undated,
+        int (*row_cb)(void *ctx, const ExportOrderLine *line), void *ctx, Error *error) {
+    char query[1024];
+    snprintf(query, sizeof(query),
+            "COPY (SELECT o.order_id, o.order_date, os.state_name, oi.order_item_id,"
+            "             oi.item_id, i.name, oi.quantity, oi.unit_price"
+            "      FROM orders o"
+            "      JOIN order_items oi ON oi.order_id = o.order_id"
+            "      JOIN order_states os ON os.state_id = o.state_id"
+            "      JOIN items i ON i.item_id = oi.item_id"
+            "      WHERE (o.order_date >= TIMESTAMP '2000-01-01' + %" PRId64 " * INTERVAL '1 microsecond'"
+            "         AND o.order_date < TIMESTAMP '2000-01-01' + %" PRId64 " * INTERVAL '1 microsecond')%s)"
+            " TO STDOUT (FORMAT binary)",
+            from, to, include_undated ? " OR o.order_date IS NULL" : "");
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_COPY_OUT) {
+        db_set_error(error, res);
+        PQclear(res);
+        return EXIT_FAILURE;
+    }
+    PQclear(res);
+
+    int result = EXIT_SUCCESS;
+    int header_read = 0;
+    int finished = 0;
+    char *buffer;
+    int size;
+    // every CopyData message holds whole rows, the first one starts with the file header
+    while ((size = PQgetCopyData(conn, &buffer, 0)) > 0) {
+        CopyReader reader = { (const uint8_t *)buffer, (const uint8_t *)buffer + size };
+        if (result == EXIT_SUCCESS && !header_read) {
+            if (copy_read_header(&reader) != EXIT_SUCCESS) {
+                error_write(error, "%s", "invalid binary COPY header");
+                result = EXIT_FAILURE;
+            }
+            header_read = 1;
+        }
+        while (result == EXIT_SUCCESS && !finished && reader.pos < reader.end) {
+            ExportOrderLine line;
+            int decoded = copy_read_order_line(&reader, &line);
+            if (decoded < 0) {
+                error_write(error, "%s", "invalid binary COPY row");
+                result = EXIT_FAILURE;
+            } else if (decoded == 0) {
+                finished = 1;
+            } else if (row_cb(ctx, &line) != EXIT_SUCCESS) {
+                error_write(error, "%s", "order line export aborted");
+                result = EXIT_FAILURE;
+            }
+            if (result != EXIT_SUCCESS) {
+                // stop the COPY, the remaining data still has to be consumed
+                PGcancel *cancel = PQgetCancel(conn);
+                if (cancel) {
+                    char errbuf[256];
+                    PQcancel(cancel, errbuf, sizeof(errbuf));
+                    PQfreeCancel(cancel);
+                }
+            }
+        }
+        PQfreemem(buffer);
+    }
+    if (size == -2 && result == EXIT_SUCCESS) {
+        error_write(error, "%s", PQerrorMessage(conn));
+        result = EXIT_FAILURE;
+    }
+    while ((res = PQgetResult(conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK && result == EXIT_SUCCESS) {
+            db_set_error(error, res);
+            result = EXIT_FAILURE;
+        }
+        PQclear(res);
+    }
+    return result;
+}
@@ -7,7 +7,20 @@
 #include "types.h"
 #include "error.h"
 
+// default of the db.primary setting, see config.h
+#define DB_DEFAULT_CONNINFO "dbname=shopdb user=shopuser password=shopuser host=localhost port=5432"
+#define DB_DEFAULT_CATALOG_SYNC_MS 1000     // interval of reloading a changed catalog and copying it to the order shards
+#define DB_REJECTED 2                       // result of a statement which fails on its data, retrying it fails again
+
+/// @brief Kind of a query, decides which database server runs it. The kind of each query
+///        function is noted in its description.
+typedef enum {
+    DB_READ,    // read only query, may run on a hot standby
+    DB_WRITE,   // query which modifies data or must see the latest data, runs on the primary
+} DbQueryKind;
+
 /// @brief Returns price from an item
+///        Query kind: DB_READ
 /// @param conn Connection to the database
 /// @param item_id ID of an item
 /// @param price address to save the resulting price
@@ -16,6 +29,7 @@
 int db_get_price_from_item(PGconn *conn, int32_t item_id, int32_t *price, Error *error);
 
 /// @brief Inserts a new order and returns the order id
+///        Query kind: DB_WRITE
 /// @param conn Connection to the database
 /// @param order_id address to save the order ID of the new order
 /// @param error address of error object to set an error message on failure
@@ -23,6 +37,7 @@ int db_get_price_from_item(PGconn *conn, int32_t item_id, int32_t *price, Error
 int db_insert_order(PGconn *conn, int32_t *order_id, Error *error);
 
 /// @brief Adds an item to an existing order
+///        Query kind: DB_WRITE
 /// @param conn Connection to the database
 /// @param order_id ID of the order
 /// @param item_id  ID of the item
@@ -36,7 +51,126 @@ int db_begin_transaction(PGconn *conn, Error *error);
 
 int db_commit_transaction(PGconn *conn, Error *error);
 
-/// @brief Get all items of an order.
+/// @brief Returns the current WAL write position of a primary.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the primary
+/// @param lsn address to save the WAL position
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_current_wal_lsn(PGconn *conn, uint64_t *lsn, Error *error);
+
+/// @brief Returns the WAL position a hot standby has replayed.
+///        Query kind: DB_READ
+/// @param conn Connection to the standby
+/// @param lsn address to save the WAL position
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the server is not a standby
+int db_get_replay_wal_lsn(PGconn *conn, uint64_t *lsn, Error *error);
+
+/// @brief Starts a read only transaction which sees a consistent snapshot of the database
+///        for all of its queries.
+/// @param conn Connection to the database
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_begin_snapshot_transaction(PGconn *conn, Error *error);
+
+/// @brief Exports the snapshot of the current snapshot transaction, so that other connections
+///        can see exactly the same data. The snapshot is valid until the transaction ends.
+/// @param conn Connection with a running snapshot transaction
+/// @param snapshot buffer to save the snapshot identifier
+/// @param snapshot_size size of the buffer
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_export_snapshot(PGconn *conn, char *snapshot, size_t snapshot_size, Error *error);
+
+/// @brief Switches a snapshot transaction to a snapshot exported by another connection.
+///        Must be called before the first query of the transaction.
+/// @param conn Connection with a new snapshot transaction
+/// @param snapshot snapshot identifier returned by db_export_snapshot
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_import_snapshot(PGconn *conn, const char *snapshot, Error *error);
+
+/// @brief Returns the current version of the item catalog. The version is incremented
+///        whenever the items table changes.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param version address to save the catalog version
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_catalog_version(PGconn *conn, int64_t *version, Error *error);
+
+/// @brief Get all items of the catalog ordered by their ID.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param items address to save a newly allocated array of items, must be freed by the caller
+/// @param items_length address to save the amount of items in the array
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_items(PGconn *conn, Item **items, int *items_length, Error *error);
+
+/// @brief Stores a batch of journaled orders with a single statement. Every distinct journal
+///        sequence number becomes one order, orders whose sequence number is already stored
+///        are skipped. Items are added with their current price. The batch is rolled back
+///        if a line of a new order cannot be stored, e.g. because its item does not exist.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param lines order lines of all orders of the batch
+/// @param lines_length amount of order lines
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success, DB_REJECTED if a line cannot be stored
+int db_insert_journal_orders(PGconn *conn, const JournalOrderLine *lines, int lines_length, Error *error);
+
+/// @brief Returns the highest journal sequence number of the stored orders
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param journal_seq address to save the highest sequence number, 0 if no journaled order is stored
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_max_journal_seq(PGconn *conn, uint64_t *journal_seq, Error *error);
+
+/// @brief Get the highest ID of all items.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param item_id address to save the highest item ID, 0 if there are no items
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_max_item_id(PGconn *conn, int32_t *item_id, Error *error);
+
+/// @brief Get the available quantity of all items with a row in the stock table.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param levels address to save a newly allocated array of stock levels, must be freed by the caller
+/// @param levels_length address to save the amount of stock levels
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_stock(PGconn *conn, StockLevel **levels, int *levels_length, Error *error);
+
+/// @brief Subtracts reserved quantities from the stock table with a single statement and
+///        returns the available quantity of all items afterwards, including changes made
+///        by others since the last call.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param reserved quantities reserved since the last call, at most one per item, negative to return stock
+/// @param reserved_length amount of reserved quantities
+/// @param levels address to save a newly allocated array of stock levels, must be freed by the caller
+/// @param levels_length address to save the amount of stock levels
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_reconcile_stock(PGconn *conn, const StockLevel *reserved, int reserved_length, StockLevel **levels, int *levels_length, Error *error);
+
+/// @brief Get an order with the name of its state.
+///        Query kind: DB_READ
+/// @param conn Connection to the database
+/// @param order_id ID of the order
+/// @param order address to save the order
+/// @param found address to save 1 if the order exists, otherwise 0
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_order(PGconn *conn, int32_t order_id, Order *order, int *found, Error *error);
+
+/// @brief Get all items of an order with the price they were ordered at.
+///        Query kind: DB_READ
 /// @param conn Connection to the database
 /// @param order_id ID of the order
 /// @param order_items address of an array to store order items
@@ -46,12 +180,83 @@ int db_commit_transaction(PGconn *conn, Error *error);
 /// @return EXIT_SUCCESS on success
 int db_get_order_item_by_order_id(PGconn *conn, int32_t order_id, OrderItem *order_items, int *order_items_length, int max_order_items, Error *error);
 
-/// @brief Get the latest order items and their orders.
+/// @brief Subscribes the connection to notifications of a channel, see PQnotifies()
+/// @param conn Connection to the database, must not be shared with other queries
+/// @param channel name of the channel
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_listen(PGconn *conn, const char *channel, Error *error);
+
+/// @brief Gets the items of the given orders, ordered by order ID. Orders without items are
+///        not contained in the result.
+///        Query kind: DB_READ
 /// @param conn Connection to the database
-/// @param order_items address of an array to store order items
-/// @param max_order_items maximum amount of order items to copy into the destination array
+/// @param order_ids IDs of the orders
+/// @param order_ids_length amount of order IDs
+/// @param row_cb callback for each order item, reading stops if it does not return EXIT_SUCCESS
+/// @param ctx context passed to row_cb
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_order_items_by_ids(PGconn *conn, const int32_t *order_ids, int order_ids_length,
+        int (*row_cb)(void *ctx, const FullOrderItem *item), void *ctx, Error *error);
+
+/// @brief Streams the order items of several databases, e.g. of all order shards, latest first
+///        to a callback. The query runs on all databases at once and their rows are merged with
+///        a heap on the order date while they arrive, so the merge takes about as long as the
+///        slowest database. Only a single row per database is held in memory.
+///        Query kind: DB_READ
+/// @param conns connections to the databases, idle
+/// @param conns_length amount of connections
+/// @param limit maximum amount of order items, 0 for all of them
+/// @param row_cb callback for each order item, the queries are cancelled if it does not return EXIT_SUCCESS
+/// @param ctx context passed to row_cb
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_merge_order_items(PGconn *const *conns, int conns_length, int limit,
+        int (*row_cb)(void *ctx, const FullOrderItem *item), void *ctx, Error *error);
+
+/// @brief Returns the start value and the increment of the sequence generating order IDs,
+///        see DbRouter for the IDs of shards.
+///        Query kind: DB_WRITE
+/// @param conn Connection to the database
+/// @param start address to save the first value of the sequence
+/// @param increment address to save the increment of the sequence
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_order_id_sequence(PGconn *conn, int64_t *start, int64_t *increment, Error *error);
+
+/// @brief Copies all items of one database into another in a single transaction. Changed
+///        items are updated, items which do not exist in the source anymore are deleted
+///        unless an order refers to them.
+///        Query kind: DB_WRITE for both connections
+/// @param from Connection to the database with the items, e.g. the primary
+/// @param to Connection to the database receiving the items, e.g. an order shard
 /// @param error address of error object to set an error message on failure
-/// @return -1 on error or actual number of order items written to the order_items
-int db_get_order_items_latest(PGconn *conn, FullOrderItem *order_items, int max_order_items, Error *error);
+/// @return EXIT_SUCCESS on success
+int db_replicate_items(PGconn *from, PGconn *to, Error *error);
+
+/// @brief Returns the dates of the first and the last order, see ExportOrderLine.order_date.
+///        first is greater than last if there are no orders with a date.
+///        Query kind: DB_READ
+/// @param conn Connection to the database
+/// @param first address to save the date of the first order
+/// @param last address to save the date of the last order
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_get_order_date_range(PGconn *conn, int64_t *first, int64_t *last, Error *error);
+
+/// @brief Exports all order lines of orders dated within [from, to) with a binary COPY. The
+///        rows are decoded while they are received, without building a result set.
+///        Query kind: DB_READ
+/// @param conn Connection to the database
+/// @param from first order date, see ExportOrderLine.order_date
+/// @param to order date after the last one
+/// @param include_undated also export lines of orders without date
+/// @param row_cb callback for each order line, the export is aborted if it does not return EXIT_SUCCESS
+/// @param ctx context passed to row_cb
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_copy_order_lines(PGconn *conn, int64_t from, int64_t to, int include_undated,
+        int (*row_cb)(void *ctx, const ExportOrderLine *line), void *ctx, Error *error);
 
 #endif
\ No newline at end of file
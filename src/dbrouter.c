@@ -0,0 +1,239 @@
+#include "dbrouter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// @brief Returns the time of a monotonic clock in milliseconds
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief Initializes a database server without opening a connection
+/// @param endpoint endpoint to initialize
+/// @param conninfo connection string
+static void endpoint_init(DbEndpoint *endpoint, const char *conninfo) {
+    memset(endpoint, 0, sizeof(*endpoint));
+    snprintf(endpoint->conninfo, sizeof(endpoint->conninfo), "%s", conninfo);
+    pthread_mutex_init(&endpoint->lock, NULL);
+}
+
+/// @brief Takes an idle connection from the pool or opens a new one
+/// @param endpoint database server
+/// @param error address of error object to set an error message on failure
+/// @return connection or NULL on failure
+static PGconn *endpoint_get(DbEndpoint *endpoint, Error *error) {
+    pthread_mutex_lock(&endpoint->lock);
+    if (endpoint->idle_length > 0) {
+        PGconn *conn = endpoint->idle[--endpoint->idle_length];
+        pthread_mutex_unlock(&endpoint->lock);
+        return conn;
+    }
+    pthread_mutex_unlock(&endpoint->lock);
+
+    PGconn *conn = PQconnectdb(endpoint->conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        error_write(error, "%s", PQerrorMessage(conn));
+        PQfinish(conn);
+        pthread_mutex_lock(&endpoint->lock);
+        endpoint->unhealthy_until = now_ms() + DB_RETRY_UNHEALTHY_MS;
+        pthread_mutex_unlock(&endpoint->lock);
+        return NULL;
+    }
+    return conn;
+}
+
+/// @brief Returns a connection to the pool or closes it if it is broken or the pool is full
+/// @param endpoint database server
+/// @param conn connection of the server
+static void endpoint_put(DbEndpoint *endpoint, PGconn *conn) {
+    if (PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) == PQTRANS_IDLE) {
+        pthread_mutex_lock(&endpoint->lock);
+        if (endpoint->idle_length < DB_POOL_MAX_IDLE) {
+            endpoint->idle[endpoint->idle_length++] = conn;
+            conn = NULL;
+        }
+        pthread_mutex_unlock(&endpoint->lock);
+    }
+    PQfinish(conn);
+}
+
+/// @brief Returns the WAL position of a server. The position is queried on the given
+///        connection if the last known position is older than DB_LSN_REFRESH_MS or older
+///        than the required position.
+/// @param endpoint database server
+/// @param conn connection of the server
+/// @param required WAL position the caller needs to see
+/// @param standby query the replay position of a standby instead of the write position
+/// @return WAL position, 0 if it is unknown
+static uint64_t endpoint_lsn(DbEndpoint *endpoint, PGconn *conn, uint64_t required, int standby) {
+    int64_t now = now_ms();
+    pthread_mutex_lock(&endpoint->lock);
+    uint64_t lsn = endpoint->lsn;
+    int stale = now - endpoint->lsn_checked_at > DB_LSN_REFRESH_MS || lsn < required;
+    pthread_mutex_unlock(&endpoint->lock);
+    if (!stale) {
+        return lsn;
+    }
+
+    Error error = {0};
+    int result = standby ? db_get_replay_wal_lsn(conn, &lsn, &error) : db_get_current_wal_lsn(conn, &lsn, &error);
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "WARNING: cannot query WAL position: %s\r\n", error.msg);
+        return 0;
+    }
+    pthread_mutex_lock(&endpoint->lock);
+    if (lsn > endpoint->lsn) {
+        endpoint->lsn = lsn;
+    }
+    endpoint->lsn_checked_at = now;
+    pthread_mutex_unlock(&endpoint->lock);
+    return lsn;
+}
+
+/// @brief Returns the WAL write position of the primary, refreshed at most every DB_LSN_REFRESH_MS
+/// @param router initialized router
+/// @return WAL position, 0 if it is unknown
+static uint64_t primary_lsn(DbRouter *router) {
+    DbEndpoint *primary = &router->primary;
+    pthread_mutex_lock(&primary->lock);
+    uint64_t lsn = primary->lsn;
+    int stale = now_ms() - primary->lsn_checked_at > DB_LSN_REFRESH_MS;
+    pthread_mutex_unlock(&primary->lock);
+    if (!stale) {
+        return lsn;
+    }
+    Error error = {0};
+    PGconn *conn = endpoint_get(primary, &error);
+    if (!conn) {
+        return lsn;
+    }
+    lsn = endpoint_lsn(primary, conn, 0, 0);
+    endpoint_put(primary, conn);
+    return lsn;
+}
+
+void db_router_init(DbRouter *router, const Config *config) {
+    endpoint_init(&router->primary, config->db_primary);
+    router->standbys_length = config->db_standbys_length;
+    for (int i = 0; i < router->standbys_length; i++) {
+        endpoint_init(&router->standbys[i], config->db_standbys[i]);
+    }
+    router->max_lag = config->db_max_replica_lag;
+    atomic_init(&router->next_standby, 0);
+    router->shards_length = 1 + config->db_shards_length;
+    for (int i = 0; i < config->db_shards_length; i++) {
+        endpoint_init(&router->shards[i], config->db_shards[i]);
+    }
+    atomic_init(&router->next_shard, 0);
+}
+
+/// @brief Borrows a connection of a standby which is not lagging behind
+/// @param router initialized router
+/// @param session read-your-writes state of the client, may be NULL
+/// @param lease address to save the borrowed connection
+/// @return EXIT_SUCCESS if a standby qualified
+static int acquire_standby(DbRouter *router, const DbSession *session, DbLease *lease) {
+    uint64_t required = session ? session->write_lsn : 0;
+    uint64_t current = router->max_lag > 0 ? primary_lsn(router) : 0;
+    unsigned int start = atomic_fetch_add_explicit(&router->next_standby, 1, memory_order_relaxed);
+    for (int i = 0; i < router->standbys_length; i++) {
+        DbEndpoint *standby = &router->standbys[(start + i) % router->standbys_length];
+        pthread_mutex_lock(&standby->lock);
+        int unhealthy = standby->unhealthy_until > now_ms();
+        pthread_mutex_unlock(&standby->lock);
+        if (unhealthy) {
+            continue;
+        }
+        Error error = {0};
+        PGconn *conn = endpoint_get(standby, &error);
+        if (!conn) {
+            fprintf(stderr, "WARNING: standby not available: %s\r\n", error.msg);
+            continue;
+        }
+        uint64_t replayed = endpoint_lsn(standby, conn, required, 1);
+        if (replayed == 0 || replayed < required || (current > replayed && current - replayed > router->max_lag)) {
+            endpoint_put(standby, conn);
+            continue;
+        }
+        lease->endpoint = standby;
+        lease->conn = conn;
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+int db_router_acquire(DbRouter *router, DbQueryKind kind, const DbSession *session, DbLease *lease, Error *error) {
+    if (kind == DB_READ && router->standbys_length > 0 && acquire_standby(router, session, lease) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+    PGconn *conn = endpoint_get(&router->primary, error);
+    if (!conn) {
+        return EXIT_FAILURE;
+    }
+    lease->endpoint = &router->primary;
+    lease->conn = conn;
+    return EXIT_SUCCESS;
+}
+
+int db_router_acquire_shard(DbRouter *router, int shard, DbQueryKind kind, const DbSession *session, DbLease *lease, Error *error) {
+    if (shard == 0) {
+        return db_router_acquire(router, kind, session, lease, error);
+    }
+    DbEndpoint *endpoint = &router->shards[shard - 1];
+    PGconn *conn = endpoint_get(endpoint, error);
+    if (!conn) {
+        return EXIT_FAILURE;
+    }
+    lease->endpoint = endpoint;
+    lease->conn = conn;
+    return EXIT_SUCCESS;
+}
+
+int db_router_shard_of(const DbRouter *router, uint64_t key) {
+    return (int)(key % (uint64_t)router->shards_length);
+}
+
+int db_router_next_shard(DbRouter *router) {
+    if (router->shards_length == 1) {
+        return 0;
+    }
+    return (int)(atomic_fetch_add_explicit(&router->next_shard, 1, memory_order_relaxed) % (unsigned int)router->shards_length);
+}
+
+const char *db_router_shard_conninfo(const DbRouter *router, int shard) {
+    return shard == 0 ? router->primary.conninfo : router->shards[shard - 1].conninfo;
+}
+
+void db_router_release(DbRouter *router, DbLease *lease) {
+    (void)router;
+    if (lease->conn) {
+        endpoint_put(lease->endpoint, lease->conn);
+    }
+    lease->conn = NULL;
+    lease->endpoint = NULL;
+}
+
+void db_router_note_write(DbRouter *router, DbSession *session, DbLease *lease) {
+    if (router->standbys_length == 0 || lease->endpoint != &router->primary) {
+        return;
+    }
+    Error error = {0};
+    uint64_t lsn;
+    if (db_get_current_wal_lsn(lease->conn, &lsn, &error) != EXIT_SUCCESS) {
+        // without the position the session has to read from the primary
+        fprintf(stderr, "WARNING: cannot query WAL position after write: %s\r\n", error.msg);
+        lsn = UINT64_MAX;
+    }
+    if (lsn > session->write_lsn) {
+        session->write_lsn = lsn;
+    }
+    pthread_mutex_lock(&router->primary.lock);
+    if (lsn != UINT64_MAX && lsn > router->primary.lsn) {
+        router->primary.lsn = lsn;
+    }
+    pthread_mutex_unlock(&router->primary.lock);
+}
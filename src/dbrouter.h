@@ -0,0 +1,112 @@
+#ifndef __DBROUTER_H_
+#define __DBROUTER_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libpq-fe.h>
+
+#include "config.h"
+#include "database.h"
+#include "error.h"
+
+#define DB_POOL_MAX_IDLE        16      // idle connections kept open per database server
+#define DB_LSN_REFRESH_MS       100     // how long a known WAL position is considered current
+#define DB_RETRY_UNHEALTHY_MS   1000    // how long an unreachable database server is skipped
+
+/// @brief Database server with a pool of idle connections
+typedef struct {
+    char            conninfo[CONFIG_MAX_CONNINFO];  // connection string
+    pthread_mutex_t lock;                           // protects all fields below
+    PGconn          *idle[DB_POOL_MAX_IDLE];        // idle connections
+    int             idle_length;                    // amount of idle connections
+    uint64_t        lsn;                            // last known WAL position, replay position of standbys
+    int64_t         lsn_checked_at;                 // time of the last WAL position query in ms
+    int64_t         unhealthy_until;                // time in ms until which the server is skipped
+} DbEndpoint;
+
+/// @brief Routes queries to the primary or to hot standbys. Reads are spread round robin over
+///        the standbys which are not lagging more than the configured amount of WAL behind the
+///        primary. A read falls back to the primary if no standby qualifies.
+///        Orders may be split over several shards. The primary is shard 0 and holds everything
+///        which is not an order, the other shards only hold orders and a copy of the items.
+///        Every shard generates order IDs which are congruent to its number modulo the amount
+///        of shards, so the ID of an order tells its shard.
+typedef struct {
+    DbEndpoint      primary;                            // primary server for writes, shard 0
+    DbEndpoint      standbys[CONFIG_MAX_STANDBYS];      // hot standbys of the primary for reads
+    int             standbys_length;                    // amount of standbys
+    uint64_t        max_lag;                            // maximum lag of a standby in bytes
+    atomic_uint     next_standby;                       // round robin counter
+    DbEndpoint      shards[CONFIG_MAX_SHARDS - 1];      // order shards besides the primary, without standbys
+    int             shards_length;                      // amount of shards including the primary
+    atomic_uint     next_shard;                         // round robin counter for new orders
+} DbRouter;
+
+/// @brief Read-your-writes state of a client connection
+typedef struct {
+    uint64_t        write_lsn;  // WAL position after the last write of the client, 0 if there was none
+} DbSession;
+
+/// @brief Connection borrowed from the router
+typedef struct {
+    DbEndpoint      *endpoint;  // server the connection belongs to
+    PGconn          *conn;      // connection to run queries on
+} DbLease;
+
+/// @brief Initializes the router from the configuration. Connections are opened on demand.
+/// @param router router to initialize
+/// @param config configuration with primary and standbys
+void db_router_init(DbRouter *router, const Config *config);
+
+/// @brief Borrows a connection for a query of the given kind. Reads only go to a standby which
+///        has replayed the last write of the session.
+/// @param router initialized router
+/// @param kind kind of the query
+/// @param session read-your-writes state of the client, may be NULL
+/// @param lease address to save the borrowed connection
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_router_acquire(DbRouter *router, DbQueryKind kind, const DbSession *session, DbLease *lease, Error *error);
+
+/// @brief Borrows a connection to a shard. Shard 0 is the primary, whose reads may go to its
+///        standbys like with db_router_acquire().
+/// @param router initialized router
+/// @param shard number of the shard, see db_router_shard_of()
+/// @param kind kind of the query
+/// @param session read-your-writes state of the client, may be NULL
+/// @param lease address to save the borrowed connection
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int db_router_acquire_shard(DbRouter *router, int shard, DbQueryKind kind, const DbSession *session, DbLease *lease, Error *error);
+
+/// @brief Returns the shard holding an order or a journaled order
+/// @param router initialized router
+/// @param key order ID or journal sequence number
+/// @return number of the shard
+int db_router_shard_of(const DbRouter *router, uint64_t key);
+
+/// @brief Picks the shard for a new order, round robin over all shards
+/// @param router initialized router
+/// @return number of the shard
+int db_router_next_shard(DbRouter *router);
+
+/// @brief Returns the connection string of a shard
+/// @param router initialized router
+/// @param shard number of the shard
+/// @return connection string
+const char *db_router_shard_conninfo(const DbRouter *router, int shard);
+
+/// @brief Returns a borrowed connection to its pool. Broken connections are closed.
+/// @param router initialized router
+/// @param lease borrowed connection
+void db_router_release(DbRouter *router, DbLease *lease);
+
+/// @brief Remembers the WAL position after a committed write, so that later reads of the
+///        session see the write. Must be called with the lease of the write.
+/// @param router initialized router
+/// @param session read-your-writes state of the client
+/// @param lease borrowed connection of the write
+void db_router_note_write(DbRouter *router, DbSession *session, DbLease *lease);
+
+#endif
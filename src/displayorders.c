@@ -1,73 +1,181 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <libpq-fe.h>
 
-void printResults(PGresult *result) {
-    int rows, cols, i, j;
+#include "database.h"
+#include "order_export.h"
 
-    rows = PQntuples(result);
-    cols = PQnfields(result);
+void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s                      print the latest order items\n"
+        "       %s -e <file> [options]  export all order lines\n"
+        "Export options:\n"
+        "  -f csv|columnar   output format (default: csv)\n"
+        "  -j <parts>        split the order dates of every shard into parts exported in\n"
+        "                    parallel into <file>.0, <file>.1, ... (default: 1)\n"
+        "  -d                write with O_DIRECT\n"
+        "Options:\n"
+        "  -c <conninfo>     database connection string, repeat it for every order shard\n",
+        program, program);
+}
+
+/// @brief Exports all order lines and prints the throughput
+/// @param options export settings
+/// @return 0 on success
+int run_export(const ExportOptions *options) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ExportStats stats;
+    Error error = {0};
+    if (export_orders(options, &stats, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "Export failed: %s\n", error.msg);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("exported %" PRIu64 " order lines, %.1f MB in %.2f s (%.0f lines/s, %.1f MB/s)\n",
+            stats.lines, stats.bytes / 1e6, seconds,
+            seconds > 0 ? stats.lines / seconds : 0.0, seconds > 0 ? stats.bytes / 1e6 / seconds : 0.0);
+    return 0;
+}
+
+/// @brief Prints the latest rows of the results of all shards
+/// @param results results of all shards, each sorted by order date descending
+/// @param results_length amount of shards
+/// @param limit maximum amount of printed rows
+void printResults(PGresult **results, int results_length, int limit) {
+    int rows[EXPORT_MAX_SHARDS] = {0};
+    int cols, i, j;
+
+    cols = PQnfields(results[0]);
 
     // Print column headers
     for (i = 0; i < cols; i++) {
-        printf("%-20s", PQfname(result, i));
+        printf("%-20s", PQfname(results[0], i));
     }
     printf("\n");
 
-    // Print rows
-    for (i = 0; i < rows; i++) {
+    // Print rows, the ISO dates of the second column sort like text
+    for (int printed = 0; printed < limit; printed++) {
+        int latest = -1;
+        for (i = 0; i < results_length; i++) {
+            if (rows[i] < PQntuples(results[i]) && (latest < 0
+                    || strcmp(PQgetvalue(results[i], rows[i], 1), PQgetvalue(results[latest], rows[latest], 1)) > 0)) {
+                latest = i;
+            }
+        }
+        if (latest < 0) {
+            break;
+        }
         for (j = 0; j < cols; j++) {
-            printf("%-20s", PQgetvalue(result, i, j));
+            printf("%-20s", PQgetvalue(results[latest], rows[latest], j));
         }
         printf("\n");
+        rows[latest]++;
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     PGconn *conn;
-    PGresult *result;
-
-    // Connect to the PostgreSQL database
-    conn = PQconnectdb("dbname=shopdb user=shopuser password=shopuser host=localhost port=5432");
+    PGresult *results[EXPORT_MAX_SHARDS];
+    ExportOptions options = {
+        .shards = 0,
+        .path = NULL,
+        .format = EXPORT_CSV,
+        .direct = 0,
+        .parts = 1
+    };
 
-    // Check if the connection was successful
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        return 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:f:j:dc:")) != -1) {
+        switch (opt) {
+        case 'e':
+            options.path = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                options.format = EXPORT_CSV;
+            } else if (strcmp(optarg, "columnar") == 0) {
+                options.format = EXPORT_COLUMNAR;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'j':
+            options.parts = atoi(optarg);
+            break;
+        case 'd':
+            options.direct = 1;
+            break;
+        case 'c':
+            if (options.shards == EXPORT_MAX_SHARDS) {
+                fprintf(stderr, "At most %d order shards are supported\n", EXPORT_MAX_SHARDS);
+                return 1;
+            }
+            options.conninfos[options.shards++] = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.shards == 0) {
+        options.conninfos[options.shards++] = DB_DEFAULT_CONNINFO;
     }
+    if (options.path) {
+        return run_export(&options);
+    }
+
+    // the latest orders of every shard, merged afterwards
+    for (int shard = 0; shard < options.shards; shard++) {
+        // Connect to the PostgreSQL database
+        conn = PQconnectdb(options.conninfos[shard]);
 
-    // Execute the SQL query
-    result = PQexec(conn,
-        "SELECT"
-        "  o.order_id,"
-        "  o.order_date,"
-        "  os.state_name AS order_status,"
-        "  oi.order_item_id,"
-        "  i.name AS item_name,"
-        "  oi.quantity,"
-        "  oi.unit_price"
-        " FROM orders o"
-        " JOIN order_items oi ON oi.order_id = o.order_id"
-        " JOIN order_states os ON os.state_id = o.state_id"
-        " JOIN items i ON i.item_id = oi.item_id"
-        " ORDER BY o.order_date DESC"
-        " LIMIT 10;");
-
-    // Check if the query was successful
-    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Query failed: %s", PQresultErrorMessage(result));
-        PQclear(result);
+        // Check if the connection was successful
+        if (PQstatus(conn) != CONNECTION_OK) {
+            fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
+            PQfinish(conn);
+            return 1;
+        }
+
+        // Execute the SQL query
+        results[shard] = PQexec(conn,
+            "SELECT"
+            "  o.order_id,"
+            "  o.order_date,"
+            "  os.state_name AS order_status,"
+            "  oi.order_item_id,"
+            "  i.name AS item_name,"
+            "  oi.quantity,"
+            "  oi.unit_price"
+            " FROM orders o"
+            " JOIN order_items oi ON oi.order_id = o.order_id"
+            " JOIN order_states os ON os.state_id = o.state_id"
+            " JOIN items i ON i.item_id = oi.item_id"
+            " ORDER BY o.order_date DESC"
+            " LIMIT 10;");
+
+        // Check if the query was successful
+        if (PQresultStatus(results[shard]) != PGRES_TUPLES_OK) {
+            fprintf(stderr, "Query failed: %s", PQresultErrorMessage(results[shard]));
+            PQclear(results[shard]);
+            PQfinish(conn);
+            return 1;
+        }
         PQfinish(conn);
-        return 1;
     }
 
     // Print the query results
-    printResults(result);
+    printResults(results, options.shards, 10);
 
-    // Free the result and close the connection
-    PQclear(result);
-    PQfinish(conn);
+    // Free the results
+    for (int shard = 0; shard < options.shards; shard++) {
+        PQclear(results[shard]);
+    }
 
     return 0;
 }
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include "echo.h"
+#include "server.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define ECHO_EPOLL_EVENTS 64
+
+/// @brief What a connection waits for after it was served
+typedef enum {
+    ECHO_WAIT_READ,         // the socket has no more data
+    ECHO_WAIT_WRITE,        // the send buffer of the socket is full
+    ECHO_WAIT_COMPLETION,   // all buffers wait for zerocopy completions, reported with EPOLLERR
+    ECHO_CLOSED,            // the client closed the connection or it failed
+} EchoStatus;
+
+/// @brief Thread of the raw echo loop with its own epoll instance
+typedef struct {
+    pthread_t           thread;
+    int                 epoll_fd;
+    int                 server_socket;
+    const EchoOptions   *options;
+} EchoThread;
+
+static const char *mode_names[] = {
+    [ECHO_FRAMED] = "framed",
+    [ECHO_COPY] = "copy",
+    [ECHO_SPLICE] = "splice",
+    [ECHO_ZEROCOPY] = "zerocopy",
+    [ECHO_BATCH] = "batch",
+};
+
+int echo_mode_parse(const char *name, EchoMode *mode)
+{
+    for (size_t i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++)
+    {
+        if (strcmp(name, mode_names[i]) == 0)
+        {
+            *mode = (EchoMode)i;
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+const char *echo_mode_name(EchoMode mode)
+{
+    return mode_names[mode];
+}
+
+/// @brief Prints a failed system call of a connection unless the client just disconnected
+/// @param call name of the system call
+static void print_errno(const char *call)
+{
+    if (errno == ECONNRESET || errno == EPIPE)
+    {
+        return;
+    }
+    char errmsg[512];
+    fprintf(stderr, "ERROR %s: %s\r\n", call, strerror_r(errno, errmsg, sizeof(errmsg)));
+}
+
+/// @brief Echoes with a single buffer, see ECHO_COPY
+/// @param conn connection
+/// @param options options of the loop
+/// @return what the connection waits for
+static EchoStatus echo_copy(EchoConnection *conn, const EchoOptions *options)
+{
+    for (int round = 0; round < ECHO_MAX_ROUNDS; round++)
+    {
+        while (conn->start < conn->end)
+        {
+            ssize_t n = send(conn->fd, conn->buffer + conn->start, conn->end - conn->start, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return ECHO_WAIT_WRITE;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                print_errno("send");
+                return ECHO_CLOSED;
+            }
+            conn->start += n;
+        }
+        ssize_t n = recv(conn->fd, conn->buffer, options->buffer_size, 0);
+        if (n == 0)
+        {
+            return ECHO_CLOSED;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return ECHO_WAIT_READ;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("recv");
+            return ECHO_CLOSED;
+        }
+        conn->start = 0;
+        conn->end = n;
+    }
+    // the received data is sent as soon as the socket is reported writable again
+    return conn->start < conn->end ? ECHO_WAIT_WRITE : ECHO_WAIT_READ;
+}
+
+/// @brief Echoes through a pipe without copying the data to user space, see ECHO_SPLICE
+/// @param conn connection
+/// @param options options of the loop
+/// @return what the connection waits for
+static EchoStatus echo_splice(EchoConnection *conn, const EchoOptions *options)
+{
+    for (int round = 0; round < ECHO_MAX_ROUNDS; round++)
+    {
+        while (conn->piped > 0)
+        {
+            ssize_t n = splice(conn->pipe[0], NULL, conn->fd, NULL, conn->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return ECHO_WAIT_WRITE;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                print_errno("splice");
+                return ECHO_CLOSED;
+            }
+            conn->piped -= n;
+        }
+        ssize_t n = splice(conn->fd, NULL, conn->pipe[1], NULL, options->buffer_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+        {
+            return ECHO_CLOSED;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return ECHO_WAIT_READ;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("splice");
+            return ECHO_CLOSED;
+        }
+        conn->piped = n;
+    }
+    return conn->piped > 0 ? ECHO_WAIT_WRITE : ECHO_WAIT_READ;
+}
+
+/// @brief Reads the zerocopy completions from the error queue of the socket and releases
+///        the buffers whose sends are completed
+/// @param conn connection
+/// @return EXIT_SUCCESS on success
+static int read_completions(EchoConnection *conn)
+{
+    while (1)
+    {
+        char control[128];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("recvmsg");
+            return EXIT_FAILURE;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                    || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            // TCP completes the sends in order, ee_data is the last completed send of the range
+            if ((int32_t)(err.ee_data + 1 - conn->completed) > 0)
+            {
+                conn->completed = err.ee_data + 1;
+            }
+        }
+    }
+    while (conn->released != conn->sent
+            && (int32_t)(conn->last_send[conn->released % ECHO_ZEROCOPY_BUFFERS] - conn->completed) < 0)
+    {
+        conn->released++;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Echoes with MSG_ZEROCOPY, see ECHO_ZEROCOPY. A buffer may not be received into
+///        before the kernel completed all sends of it.
+/// @param conn connection
+/// @param options options of the loop
+/// @return what the connection waits for
+static EchoStatus echo_zerocopy(EchoConnection *conn, const EchoOptions *options)
+{
+    if (read_completions(conn) != EXIT_SUCCESS)
+    {
+        return ECHO_CLOSED;
+    }
+    for (int round = 0; round < ECHO_MAX_ROUNDS; round++)
+    {
+        while (conn->sent != conn->filled)
+        {
+            uint32_t index = conn->sent % ECHO_ZEROCOPY_BUFFERS;
+            uint8_t *buffer = conn->buffer + index * options->buffer_size;
+            ssize_t n = send(conn->fd, buffer + conn->offset, conn->lengths[index] - conn->offset, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return ECHO_WAIT_WRITE;
+                }
+                if (errno == ENOBUFS)
+                {
+                    // the socket exceeded its option memory for pending notifications
+                    return ECHO_WAIT_COMPLETION;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                print_errno("send");
+                return ECHO_CLOSED;
+            }
+            conn->last_send[index] = conn->sends++;
+            conn->offset += n;
+            if (conn->offset == conn->lengths[index])
+            {
+                conn->offset = 0;
+                conn->sent++;
+            }
+        }
+        if (conn->filled - conn->released == ECHO_ZEROCOPY_BUFFERS)
+        {
+            return ECHO_WAIT_COMPLETION;
+        }
+        uint32_t index = conn->filled % ECHO_ZEROCOPY_BUFFERS;
+        ssize_t n = recv(conn->fd, conn->buffer + index * options->buffer_size, options->buffer_size, 0);
+        if (n == 0)
+        {
+            return ECHO_CLOSED;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return ECHO_WAIT_READ;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("recv");
+            return ECHO_CLOSED;
+        }
+        conn->lengths[index] = n;
+        conn->filled++;
+    }
+    return conn->sent != conn->filled ? ECHO_WAIT_WRITE : ECHO_WAIT_READ;
+}
+
+/// @brief Echoes with batched reads and writes, see ECHO_BATCH
+/// @param conn connection
+/// @param options options of the loop
+/// @return what the connection waits for
+static EchoStatus echo_batch(EchoConnection *conn, const EchoOptions *options)
+{
+    size_t message_size = options->buffer_size / ECHO_BATCH_MESSAGES;
+    for (int round = 0; round < ECHO_MAX_ROUNDS; round++)
+    {
+        while (conn->pending_length > 0)
+        {
+            struct msghdr msg = {
+                .msg_iov = conn->pending + ECHO_BATCH_MESSAGES - conn->pending_length,
+                .msg_iovlen = conn->pending_length
+            };
+            ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return ECHO_WAIT_WRITE;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                print_errno("sendmsg");
+                return ECHO_CLOSED;
+            }
+            while (conn->pending_length > 0 && (size_t)n >= msg.msg_iov->iov_len)
+            {
+                n -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                conn->pending_length--;
+            }
+            if (conn->pending_length > 0)
+            {
+                msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= n;
+            }
+        }
+        struct mmsghdr messages[ECHO_BATCH_MESSAGES];
+        struct iovec iov[ECHO_BATCH_MESSAGES];
+        for (int i = 0; i < ECHO_BATCH_MESSAGES; i++)
+        {
+            iov[i].iov_base = conn->buffer + i * message_size;
+            iov[i].iov_len = message_size;
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(conn->fd, messages, ECHO_BATCH_MESSAGES, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return ECHO_WAIT_READ;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("recvmmsg");
+            return ECHO_CLOSED;
+        }
+        // the received iovecs are kept at the end of pending, so the send loop can advance over them
+        int received = 0;
+        for (int i = 0; i < n && messages[i].msg_len > 0; i++)
+        {
+            received++;
+        }
+        if (received == 0)
+        {
+            return ECHO_CLOSED;
+        }
+        for (int i = 0; i < received; i++)
+        {
+            conn->pending[ECHO_BATCH_MESSAGES - received + i].iov_base = iov[i].iov_base;
+            conn->pending[ECHO_BATCH_MESSAGES - received + i].iov_len = messages[i].msg_len;
+        }
+        conn->pending_length = received;
+    }
+    return conn->pending_length > 0 ? ECHO_WAIT_WRITE : ECHO_WAIT_READ;
+}
+
+/// @brief Closes a connection and releases its state
+/// @param conn connection
+static void echo_close(EchoConnection *conn)
+{
+    close(conn->fd);
+    if (conn->pipe[0] >= 0)
+    {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    free(conn->buffer);
+    free(conn);
+}
+
+/// @brief Creates the state of an accepted connection for the mode
+/// @param fd non-blocking client socket
+/// @param options options of the loop
+/// @return new connection or NULL on failure
+static EchoConnection *echo_open(int fd, const EchoOptions *options)
+{
+    EchoConnection *conn = calloc(1, sizeof(EchoConnection));
+    if (!conn)
+    {
+        fprintf(stderr, "ERROR: cannot allocate connection\r\n");
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->pipe[0] = -1;
+    conn->pipe[1] = -1;
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    size_t buffers = options->mode == ECHO_ZEROCOPY ? ECHO_ZEROCOPY_BUFFERS : 1;
+    if (options->mode != ECHO_SPLICE)
+    {
+        conn->buffer = malloc(buffers * options->buffer_size);
+        if (!conn->buffer)
+        {
+            fprintf(stderr, "ERROR: cannot allocate connection buffer\r\n");
+            echo_close(conn);
+            return NULL;
+        }
+    }
+    if (options->mode == ECHO_SPLICE)
+    {
+        if (pipe2(conn->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        {
+            print_errno("pipe2");
+            echo_close(conn);
+            return NULL;
+        }
+        // a pipe holds 64 KiB by default, larger buffers need a larger pipe
+        if ((size_t)fcntl(conn->pipe[1], F_GETPIPE_SZ) < options->buffer_size)
+        {
+            fcntl(conn->pipe[1], F_SETPIPE_SZ, (int)options->buffer_size);
+        }
+    }
+    if (options->mode == ECHO_ZEROCOPY && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0)
+    {
+        print_errno("setsockopt SO_ZEROCOPY");
+        echo_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/// @brief Accepts all pending connections and registers them with the epoll instance of the thread
+/// @param thread thread which accepts the connections
+static void echo_accept(EchoThread *thread)
+{
+    while (1)
+    {
+        int fd = accept4(thread->server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                print_errno("accept");
+            }
+            return;
+        }
+        EchoConnection *conn = echo_open(fd, thread->options);
+        if (!conn)
+        {
+            close(fd);
+            continue;
+        }
+        conn->events = EPOLLIN;
+        struct epoll_event event = { .events = conn->events, .data.ptr = conn };
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            print_errno("epoll_ctl");
+            echo_close(conn);
+        }
+    }
+}
+
+/// @brief Serves a ready connection and updates the events it waits for
+/// @param thread thread of the connection
+/// @param conn connection
+static void echo_serve(EchoThread *thread, EchoConnection *conn)
+{
+    EchoStatus status;
+    switch (thread->options->mode)
+    {
+    case ECHO_SPLICE:
+        status = echo_splice(conn, thread->options);
+        break;
+    case ECHO_ZEROCOPY:
+        status = echo_zerocopy(conn, thread->options);
+        break;
+    case ECHO_BATCH:
+        status = echo_batch(conn, thread->options);
+        break;
+    default:
+        status = echo_copy(conn, thread->options);
+        break;
+    }
+    if (status == ECHO_CLOSED)
+    {
+        // closing the socket removes it from the epoll instance
+        echo_close(conn);
+        return;
+    }
+    // EPOLLERR is always reported, it signals zerocopy completions
+    uint32_t events = status == ECHO_WAIT_READ ? EPOLLIN : status == ECHO_WAIT_WRITE ? EPOLLOUT : 0;
+    if (events != conn->events)
+    {
+        conn->events = events;
+        struct epoll_event event = { .events = events, .data.ptr = conn };
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0)
+        {
+            print_errno("epoll_ctl");
+            echo_close(conn);
+        }
+    }
+}
+
+/// @brief Event loop of a thread
+/// @param arg thread
+/// @return NULL if epoll fails
+static void *echo_thread_loop(void *arg)
+{
+    EchoThread *thread = arg;
+    struct epoll_event events[ECHO_EPOLL_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(thread->epoll_fd, events, ECHO_EPOLL_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_errno("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                echo_accept(thread);
+            }
+            else
+            {
+                echo_serve(thread, events[i].data.ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+Error echo_loop(const EchoOptions *options, uint16_t port)
+{
+    Error error = {0};
+    if (options->mode == ECHO_FRAMED)
+    {
+        snprintf(error.msg, sizeof(error.msg), "%s", "framed mode is served by server.c");
+        return error;
+    }
+    if (options->threads < 1 || options->threads > ECHO_MAX_THREADS)
+    {
+        snprintf(error.msg, sizeof(error.msg), "invalid amount of threads %d", options->threads);
+        return error;
+    }
+    if (options->buffer_size < ECHO_BATCH_MESSAGES || options->buffer_size > INT32_MAX)
+    {
+        snprintf(error.msg, sizeof(error.msg), "invalid buffer size %zu", options->buffer_size);
+        return error;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_socket;
+    if (setup_listening_socket(port, &server_socket, &error) != EXIT_SUCCESS)
+    {
+        return error;
+    }
+    printf("echo server listening on port %d in %s mode\n", port, echo_mode_name(options->mode));
+
+    EchoThread threads[ECHO_MAX_THREADS];
+    for (int i = 0; i < options->threads; i++)
+    {
+        EchoThread *thread = &threads[i];
+        thread->server_socket = server_socket;
+        thread->options = options;
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (thread->epoll_fd < 0)
+        {
+            error_from_errno(&error, errno);
+            return error;
+        }
+        // every thread accepts, EPOLLEXCLUSIVE wakes only one of them per connection
+        struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) < 0)
+        {
+            error_from_errno(&error, errno);
+            return error;
+        }
+        int result = pthread_create(&thread->thread, NULL, echo_thread_loop, thread);
+        if (result != 0)
+        {
+            error_from_errno(&error, result);
+            return error;
+        }
+    }
+    for (int i = 0; i < options->threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    snprintf(error.msg, sizeof(error.msg), "%s", "all threads failed");
+    return error;
+}
@@ -0,0 +1,74 @@
+#ifndef __ECHO_H_
+#define __ECHO_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "error.h"
+
+#define ECHO_MAX_THREADS            16
+#define ECHO_DEFAULT_THREADS        2
+#define ECHO_DEFAULT_BUFFER_SIZE    (64 * 1024)
+#define ECHO_ZEROCOPY_BUFFERS       8       // buffers of a connection which may wait for their zerocopy completion
+#define ECHO_BATCH_MESSAGES         16      // buffers filled by a single recvmmsg call
+#define ECHO_MAX_ROUNDS             16      // reads of a connection before the next connection is served
+
+/// @brief How a connection moves the received bytes back to the client. Except for
+///        ECHO_FRAMED, the bytes are echoed without decoding frames, so the modes measure
+///        the network stack alone.
+typedef enum {
+    ECHO_FRAMED,        // frames are decoded and sent back by server.c
+    ECHO_COPY,          // recv into a buffer and send it back
+    ECHO_SPLICE,        // splice from the socket into a pipe and from the pipe back into the socket
+    ECHO_ZEROCOPY,      // send with MSG_ZEROCOPY, buffers are reused after the kernel completed them
+    ECHO_BATCH,         // recvmmsg into several buffers, all of them are sent with a single sendmsg
+} EchoMode;
+
+/// @brief Options of the raw echo loop
+typedef struct {
+    EchoMode    mode;           // any mode except ECHO_FRAMED
+    int         threads;        // threads accepting and serving connections, each with its own epoll instance
+    size_t      buffer_size;    // bytes received at once by a connection
+} EchoOptions;
+
+/// @brief Connection of the raw echo loop, only the fields of its mode are used
+typedef struct {
+    int         fd;                     // non-blocking client socket
+    uint32_t    events;                 // epoll events the connection waits for
+    uint8_t     *buffer;                // received data of ECHO_COPY, buffers of ECHO_ZEROCOPY and ECHO_BATCH
+    size_t      start;                  // ECHO_COPY: first byte which is not sent yet
+    size_t      end;                    // ECHO_COPY: end of the received data
+    int         pipe[2];                // ECHO_SPLICE: pipe between the receiving and the sending splice
+    size_t      piped;                  // ECHO_SPLICE: bytes in the pipe
+    uint32_t    lengths[ECHO_ZEROCOPY_BUFFERS]; // ECHO_ZEROCOPY: received bytes of each buffer
+    uint32_t    last_send[ECHO_ZEROCOPY_BUFFERS]; // ECHO_ZEROCOPY: number of the last zerocopy send of each buffer
+    uint32_t    filled;                 // ECHO_ZEROCOPY: buffers which were received into
+    uint32_t    sent;                   // ECHO_ZEROCOPY: buffers which were sent completely
+    uint32_t    released;               // ECHO_ZEROCOPY: buffers whose sends were completed by the kernel
+    size_t      offset;                 // ECHO_ZEROCOPY: sent bytes of the first buffer which is not sent completely
+    uint32_t    sends;                  // ECHO_ZEROCOPY: number of the next zerocopy send
+    uint32_t    completed;              // ECHO_ZEROCOPY: zerocopy sends before this number are completed
+    struct iovec pending[ECHO_BATCH_MESSAGES]; // ECHO_BATCH: received data which is not sent yet
+    int         pending_length;         // ECHO_BATCH: amount of pending iovecs
+} EchoConnection;
+
+/// @brief Parses the name of a mode, e.g. "splice"
+/// @param name name of the mode
+/// @param mode address to save the mode
+/// @return EXIT_SUCCESS if the name is known
+int echo_mode_parse(const char *name, EchoMode *mode);
+
+/// @brief Returns the name of a mode
+/// @param mode mode
+/// @return static name of the mode
+const char *echo_mode_name(EchoMode mode);
+
+/// @brief Echoes all bytes received on the port until the process is interrupted. Every thread
+///        accepts connections and serves them without any further threads or locks.
+/// @param options mode, thread count and buffer size
+/// @param port listening port
+/// @return Error description, the function only returns on failure
+Error echo_loop(const EchoOptions *options, uint16_t port);
+
+#endif
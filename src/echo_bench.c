@@ -0,0 +1,486 @@
+#include "frame.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_PORT          8080
+#define BENCH_DEFAULT_CONNECTIONS   "1,16,64"
+#define BENCH_DEFAULT_SIZES         "64,1024,16384"
+#define BENCH_DEFAULT_DURATION_S    3
+#define BENCH_DEFAULT_SERVER        "./echo_server"
+#define BENCH_MAX_VALUES            16          // entries of a comma separated list
+#define BENCH_MAX_CONNECTIONS       1024
+#define BENCH_RECV_BUFFER_SIZE      (64 * 1024)
+#define BENCH_POLL_MS               100         // how often a waiting connection checks for the end of the run
+#define BENCH_STARTUP_MS            5000        // time a started server may take until it accepts connections
+
+typedef struct {
+    const char  *host;
+    uint16_t    port;
+    int         connections[BENCH_MAX_VALUES];
+    int         connections_length;
+    int         sizes[BENCH_MAX_VALUES];
+    int         sizes_length;
+    int         duration_s;                 // duration of every run
+    int         depth;                      // messages in flight per connection
+    const char  *modes[BENCH_MAX_VALUES];   // modes of the started echo_server, none to use a running server
+    int         modes_length;
+    const char  *server_path;               // echo_server binary which is started for every mode
+    const char  *server_threads;            // threads of the started server, NULL for its default
+} BenchOptions;
+
+/// @brief Parameters of a single run, shared by all connections
+typedef struct {
+    const BenchOptions  *options;
+    int                 size;       // payload size of the messages
+    pthread_barrier_t   start;      // all connections are established
+    atomic_int          stop;       // the duration of the run elapsed
+} BenchRun;
+
+/// @brief Connection of a run and its measurements
+typedef struct {
+    pthread_t   thread;
+    BenchRun    *run;
+    uint64_t    messages;           // echoed messages
+    Histogram   latency;            // round trip time of the messages
+    int         failed;             // the connection failed during the run
+} BenchConnection;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// @brief Connects to the echo server
+/// @param options options with host and port
+/// @param quiet do not print an error if the server does not accept connections
+/// @return non-blocking socket or -1 on failure
+static int bench_connect(const BenchOptions *options, int quiet)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("ERROR socket");
+        return -1;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(options->port) };
+    if (inet_pton(AF_INET, options->host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "ERROR: invalid address %s\r\n", options->host);
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (!quiet)
+        {
+            perror("ERROR connect");
+        }
+        close(fd);
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/// @brief Sends frames with the payload size of the run and measures the time until each
+///        frame was echoed completely. Up to depth frames are in flight at once.
+/// @param conn connection to measure
+/// @param fd non-blocking socket of the connection
+static void bench_exchange(BenchConnection *conn, int fd)
+{
+    BenchRun *run = conn->run;
+    int depth = run->options->depth;
+    size_t message_size = sizeof(FrameHeader) + run->size;
+    uint8_t *message = calloc(1, message_size);
+    uint8_t *buffer = malloc(BENCH_RECV_BUFFER_SIZE);
+    uint64_t *sent_at = calloc(depth, sizeof(uint64_t));
+    if (!message || !buffer || !sent_at)
+    {
+        fprintf(stderr, "ERROR: cannot allocate buffers\r\n");
+        conn->failed = 1;
+        goto out;
+    }
+    FrameHeader header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = 0,
+        .payload_size = run->size,
+        .flags = 0
+    };
+    memcpy(message, &header, sizeof(header));
+
+    int oldest = 0;             // index of the oldest message in flight
+    int in_flight = 0;          // messages sent at least partially but not echoed completely
+    size_t send_offset = 0;     // sent bytes of the newest message
+    int sending = 0;            // the newest message is not sent completely
+    size_t received = 0;        // received bytes of the oldest message
+    // a partially sent message is completed, so the server does not see a truncated frame
+    while (sending || !atomic_load_explicit(&run->stop, memory_order_relaxed))
+    {
+        if (!sending && in_flight < depth && !atomic_load_explicit(&run->stop, memory_order_relaxed))
+        {
+            sent_at[(oldest + in_flight) % depth] = now_ns();
+            in_flight++;
+            sending = 1;
+            send_offset = 0;
+        }
+        int progress = 0;
+        if (sending)
+        {
+            ssize_t n = send(fd, message + send_offset, message_size - send_offset, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("ERROR send");
+                conn->failed = 1;
+                break;
+            }
+            if (n > 0)
+            {
+                progress = 1;
+                send_offset += n;
+                sending = send_offset < message_size;
+            }
+        }
+        ssize_t n = recv(fd, buffer, BENCH_RECV_BUFFER_SIZE, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            fprintf(stderr, "ERROR: connection closed by the server\r\n");
+            conn->failed = 1;
+            break;
+        }
+        if (n > 0)
+        {
+            progress = 1;
+            received += n;
+            uint64_t now = now_ns();
+            while (received >= message_size && in_flight > 0)
+            {
+                histogram_record(&conn->latency, now - sent_at[oldest]);
+                conn->messages++;
+                oldest = (oldest + 1) % depth;
+                in_flight--;
+                received -= message_size;
+            }
+        }
+        if (!progress)
+        {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN | (sending ? POLLOUT : 0) };
+            poll(&pfd, 1, BENCH_POLL_MS);
+        }
+    }
+out:
+    free(message);
+    free(buffer);
+    free(sent_at);
+}
+
+static void *bench_connection_loop(void *arg)
+{
+    BenchConnection *conn = arg;
+    int fd = bench_connect(conn->run->options, 0);
+    conn->failed = fd < 0;
+    pthread_barrier_wait(&conn->run->start);
+    if (fd >= 0)
+    {
+        bench_exchange(conn, fd);
+        // receive the remaining echoes, closing with unread data would reset the connection
+        shutdown(fd, SHUT_WR);
+        uint8_t buffer[4096];
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        while (poll(&pfd, 1, BENCH_POLL_MS) > 0 && recv(fd, buffer, sizeof(buffer), 0) > 0)
+        {
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/// @brief Runs a benchmark with a connection count and message size and prints a result line
+/// @param options benchmark options
+/// @param label name of the server mode
+/// @param connections amount of concurrent connections
+/// @param size payload size of the messages
+/// @return EXIT_SUCCESS if all connections succeeded
+static int bench_run(const BenchOptions *options, const char *label, int connections, int size)
+{
+    BenchRun run = { .options = options, .size = size };
+    atomic_init(&run.stop, 0);
+    BenchConnection *conns = calloc(connections, sizeof(BenchConnection));
+    if (!conns)
+    {
+        fprintf(stderr, "ERROR: cannot allocate connections\r\n");
+        return EXIT_FAILURE;
+    }
+    pthread_barrier_init(&run.start, NULL, connections + 1);
+    int started = 0;
+    for (; started < connections; started++)
+    {
+        conns[started].run = &run;
+        if (pthread_create(&conns[started].thread, NULL, bench_connection_loop, &conns[started]) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot start connection thread\r\n");
+            break;
+        }
+    }
+    if (started < connections)
+    {
+        // the barrier cannot be passed anymore
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_wait(&run.start);
+    uint64_t start = now_ns();
+    struct timespec duration = { .tv_sec = options->duration_s };
+    nanosleep(&duration, NULL);
+    atomic_store(&run.stop, 1);
+    uint64_t elapsed = now_ns() - start;
+
+    Histogram latency = {0};
+    uint64_t messages = 0;
+    int failed = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        pthread_join(conns[i].thread, NULL);
+        histogram_merge(&latency, &conns[i].latency);
+        messages += conns[i].messages;
+        failed |= conns[i].failed;
+    }
+    pthread_barrier_destroy(&run.start);
+    free(conns);
+
+    double seconds = elapsed / 1e9;
+    double message_size = sizeof(FrameHeader) + size;
+    printf("%-10s %6d %8d %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f%s\n",
+            label, connections, size,
+            messages / seconds,
+            messages * message_size / seconds / (1024 * 1024),
+            histogram_percentile(&latency, 50) / 1e3,
+            histogram_percentile(&latency, 99) / 1e3,
+            histogram_percentile(&latency, 99.9) / 1e3,
+            latency.max_ns / 1e3,
+            failed ? " (failed)" : "");
+    fflush(stdout);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/// @brief Starts echo_server in a mode and waits until it accepts connections
+/// @param options benchmark options
+/// @param mode mode of the server
+/// @return process id of the server or -1 on failure
+static pid_t start_server(const BenchOptions *options, const char *mode)
+{
+    char port[8];
+    snprintf(port, sizeof(port), "%u", options->port);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("ERROR fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        if (options->server_threads)
+        {
+            execl(options->server_path, options->server_path, "-m", mode, "-t", options->server_threads, port, (char *)NULL);
+        }
+        else
+        {
+            execl(options->server_path, options->server_path, "-m", mode, port, (char *)NULL);
+        }
+        perror("ERROR exec");
+        _exit(EXIT_FAILURE);
+    }
+    for (int waited = 0; waited < BENCH_STARTUP_MS; waited += 10)
+    {
+        int fd = bench_connect(options, 1);
+        if (fd >= 0)
+        {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            fprintf(stderr, "ERROR: %s exited\r\n", options->server_path);
+            return -1;
+        }
+        usleep(10 * 1000);
+    }
+    fprintf(stderr, "ERROR: %s does not accept connections\r\n", options->server_path);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/// @brief Runs all combinations of connection counts and message sizes against the server
+/// @param options benchmark options
+/// @param label name of the server mode
+/// @return EXIT_SUCCESS if all runs succeeded
+static int bench_mode(const BenchOptions *options, const char *label)
+{
+    int result = EXIT_SUCCESS;
+    for (int c = 0; c < options->connections_length; c++)
+    {
+        for (int s = 0; s < options->sizes_length; s++)
+        {
+            if (bench_run(options, label, options->connections[c], options->sizes[s]) != EXIT_SUCCESS)
+            {
+                result = EXIT_FAILURE;
+            }
+        }
+    }
+    return result;
+}
+
+/// @brief Parses a comma separated list of numbers
+/// @param list list to parse
+/// @param values array of BENCH_MAX_VALUES numbers
+/// @param min smallest allowed number
+/// @param max largest allowed number
+/// @return amount of numbers or -1 if the list is invalid
+static int parse_values(const char *list, int *values, int min, int max)
+{
+    int length = 0;
+    while (*list)
+    {
+        char *end;
+        long value = strtol(list, &end, 10);
+        if (end == list || value < min || value > max || length == BENCH_MAX_VALUES || (*end && *end != ','))
+        {
+            return -1;
+        }
+        values[length++] = value;
+        list = *end ? end + 1 : end;
+    }
+    return length > 0 ? length : -1;
+}
+
+/// @brief Splits a comma separated list of modes in place
+/// @param list list to split
+/// @param modes array of BENCH_MAX_VALUES modes
+/// @return amount of modes or -1 if there are too many
+static int parse_modes(char *list, const char **modes)
+{
+    int length = 0;
+    for (char *mode = strtok(list, ","); mode; mode = strtok(NULL, ","))
+    {
+        if (length == BENCH_MAX_VALUES)
+        {
+            return -1;
+        }
+        modes[length++] = mode;
+    }
+    return length;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections,...] [-s sizes,...] [-d seconds] [-w depth]\r\n", program);
+    fprintf(stderr, "       [-m framed,copy,splice,zerocopy,batch] [-e echo_server] [-t server_threads]\r\n");
+    fprintf(stderr, "Without -m the server running on host and port is measured, otherwise echo_server is\r\n");
+    fprintf(stderr, "started on the port in every mode.\r\n");
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = {
+        .host = "127.0.0.1",
+        .port = BENCH_DEFAULT_PORT,
+        .duration_s = BENCH_DEFAULT_DURATION_S,
+        .depth = 1,
+        .server_path = BENCH_DEFAULT_SERVER
+    };
+    options.connections_length = parse_values(BENCH_DEFAULT_CONNECTIONS, options.connections, 1, BENCH_MAX_CONNECTIONS);
+    options.sizes_length = parse_values(BENCH_DEFAULT_SIZES, options.sizes, 0, MAX_PAYLOAD_SIZE);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:s:d:w:m:e:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = (uint16_t)atoi(optarg);
+            break;
+        case 'c':
+            options.connections_length = parse_values(optarg, options.connections, 1, BENCH_MAX_CONNECTIONS);
+            break;
+        case 's':
+            options.sizes_length = parse_values(optarg, options.sizes, 0, MAX_PAYLOAD_SIZE);
+            break;
+        case 'd':
+            options.duration_s = atoi(optarg);
+            break;
+        case 'w':
+            options.depth = atoi(optarg);
+            break;
+        case 'm':
+            options.modes_length = parse_modes(optarg, options.modes);
+            break;
+        case 'e':
+            options.server_path = optarg;
+            break;
+        case 't':
+            options.server_threads = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.connections_length < 0 || options.sizes_length < 0 || options.modes_length < 0
+            || options.duration_s < 1 || options.depth < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-10s %6s %8s %12s %10s %10s %10s %10s %10s\n",
+            "mode", "conns", "size", "msgs/s", "MiB/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    if (options.modes_length == 0)
+    {
+        return bench_mode(&options, "server");
+    }
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < options.modes_length; i++)
+    {
+        pid_t pid = start_server(&options, options.modes[i]);
+        if (pid < 0)
+        {
+            result = EXIT_FAILURE;
+            continue;
+        }
+        if (bench_mode(&options, options.modes[i]) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+    return result;
+}
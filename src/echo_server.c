@@ -1,5 +1,5 @@
-
 #include "server.h"
+#include "echo.h"
 
 #include <stdio.h>
 #include <sys/socket.h>
@@ -14,51 +14,86 @@
 #define DEFAULT_SERVER_PORT 8080
 
 
-void handle_client_echo(int client_socket) {
-    char input[512];
-
-    /*
-     * Setup a timeout on recv() on the client socket
-     * */
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    while (1) {
-        ssize_t n = recv(client_socket, input, sizeof(input), 0);
-
-        if (n < 0) {
-            char errmsg[512];
-            strerror_r(errno, errmsg, sizeof(errmsg));
-            fprintf(stderr, "ERROR recv: %s\r\n", errmsg);
-            close(client_socket);
-            return;
-        } else if (n == 0) {
-            printf("DEBUG: client closed connection\r\n");
-            close(client_socket);
-            return;
-        }
-        printf("DEBUG: received %ld bytes from client\r\n", n);
-        send(client_socket, input, n, 0);
+/// @brief sends every received frame back to the client, see ServerRequestCallback
+int handle_client_echo(Connection *client, const FrameHeader *header, const uint8_t *payload)
+{
+    if (connection_send_frame(client, header, payload) != EXIT_SUCCESS)
+    {
+        char errmsg[512];
+        strerror_r(errno, errmsg, sizeof(errmsg));
+        fprintf(stderr, "ERROR send: %s\r\n", errmsg);
+        return EXIT_FAILURE;
     }
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-m framed|copy|splice|zerocopy|batch] [-t threads] [-b buffer_size] [-u unix_path] [port]\r\n", program);
 }
 
 int main(int argc, char *argv[])
 {
     u_int16_t server_port;
+    EchoOptions echo_options = {
+        .mode = ECHO_FRAMED,
+        .threads = ECHO_DEFAULT_THREADS,
+        .buffer_size = ECHO_DEFAULT_BUFFER_SIZE
+    };
 
-    if (argc > 1)
-      server_port = (u_int16_t)atoi(argv[1]); // TODO: handle possible overflow
+    const char *unix_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:b:u:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (echo_mode_parse(optarg, &echo_options.mode) != EXIT_SUCCESS) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            echo_options.threads = atoi(optarg);
+            break;
+        case 'b':
+            echo_options.buffer_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc)
+      server_port = (u_int16_t)atoi(argv[optind]); // TODO: handle possible overflow
     else
       server_port = DEFAULT_SERVER_PORT;
 
+    Error error = {0};
+    if (echo_options.mode != ECHO_FRAMED) {
+        error = echo_loop(&echo_options, server_port);
+        fprintf(stderr, "ERROR: cannot run echo loop: %s\r\n", error.msg);
+        return 1;
+    }
+
     Server server;
-    if (server_init(&server, handle_client_echo) != 0) {
-        printf("ERROR: cannot initalize mutex\r\n");
+    ServerOptions options;
+    server_options_init(&options);
+    options.io_threads = echo_options.threads;
+    if (unix_path) {
+        if (strlen(unix_path) >= sizeof(options.unix_path)) {
+            fprintf(stderr, "ERROR: Unix socket path too long\r\n");
+            return 1;
+        }
+        strcpy(options.unix_path, unix_path);
+    }
+    if (server_init(&server, &options, handle_client_echo, 0, &error) != 0) {
+        fprintf(stderr, "ERROR: cannot initialize server: %s\r\n", error.msg);
         return 1;
     }
-    Error error = server_loop(&server, server_port);
+    error = server_loop(&server, server_port);
     fprintf(stderr, "ERROR: cannot enter server loop: %s\r\n", error.msg);
     return 1;
-}
\ No newline at end of file
+}
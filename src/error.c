@@ -0,0 +1,9 @@
+#include "error.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void error_from_errno(Error *error, int errnum) {
+    // without _GNU_SOURCE strerror_r() fills the buffer, see the XSI version
+    strerror_r(errnum, error->msg, sizeof(error->msg));
+}
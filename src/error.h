@@ -11,4 +11,9 @@ typedef struct {
 /// @return amount of bytes actually written into the error message field
 #define error_write(error, text, ...) snprintf(error->msg, sizeof(error->msg), text, __VA_ARGS__)
 
+/// @brief Sets the description of an error number as error message
+/// @param error address of error object to set the error message
+/// @param errnum error number, e.g. errno or the result of a pthread function
+void error_from_errno(Error *error, int errnum);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,343 @@
+#include "executor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define DEQUE_MASK (EXECUTOR_DEQUE_CAPACITY - 1)
+
+/// @brief worker slot of the calling thread, NULL if it is not a worker
+static _Thread_local WorkerSlot *current_slot;
+
+/// @brief Pushes a task to the bottom of the deque, only called by the owner
+/// @return EXIT_FAILURE if the deque is full
+static int deque_push(WorkDeque *deque, Task *task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= EXECUTOR_DEQUE_CAPACITY) {
+        return EXIT_FAILURE;
+    }
+    atomic_store_explicit(&deque->slots[bottom & DEQUE_MASK], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Counts the tasks in the deque, only called by the owner
+/// @return amount of tasks which were not taken or stolen yet
+static long deque_length(WorkDeque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    return bottom - top;
+}
+
+/// @brief Takes the most recently pushed task from the bottom of the deque, only called by the owner
+/// @return task or NULL if the deque is empty
+static Task *deque_take(WorkDeque *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    Task *task = atomic_load_explicit(&deque->slots[bottom & DEQUE_MASK], memory_order_relaxed);
+    if (top == bottom) {
+        // last task, race against thieves
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/// @brief Steals the oldest task from the top of the deque, called by other workers
+/// @return task or NULL if the deque is empty or another thread won the race
+static Task *deque_steal(WorkDeque *deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    Task *task = atomic_load_explicit(&deque->slots[top & DEQUE_MASK], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+/// @brief Takes the first task of the injection queue, the executor lock must be held
+/// @return task or NULL if the queue is empty
+static Task *queue_pop(Executor *executor) {
+    Task *task = executor->queue_head;
+    if (task) {
+        executor->queue_head = task->next;
+        if (!executor->queue_head) {
+            executor->queue_tail = NULL;
+        }
+        executor->queue_length--;
+        task->next = NULL;
+    }
+    return task;
+}
+
+/// @brief Steals a task from the deque of another worker, starting at a random victim
+/// @param executor executor of the worker
+/// @param self slot of the calling worker
+/// @param seed state of the random number generator of the worker
+/// @return task or NULL if no task could be stolen
+static Task *steal_task(Executor *executor, WorkerSlot *self, unsigned int *seed) {
+    int slots_used = atomic_load_explicit(&executor->slots_used, memory_order_acquire);
+    if (slots_used <= 1) {
+        return NULL;
+    }
+    int start = rand_r(seed) % slots_used;
+    for (int i = 0; i < slots_used; i++) {
+        WorkerSlot *victim = &executor->slots[(start + i) % slots_used];
+        if (victim == self) {
+            continue;
+        }
+        Task *task = deque_steal(&victim->deque);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/// @brief Finds the next task for a worker: own deque first, then the injection queue,
+///        then the deques of other workers
+/// @return task or NULL if there is no work
+static Task *find_task(Executor *executor, WorkerSlot *self, unsigned int *seed) {
+    Task *task = deque_take(&self->deque);
+    if (task) {
+        return task;
+    }
+    pthread_mutex_lock(&executor->lock);
+    task = queue_pop(executor);
+    pthread_mutex_unlock(&executor->lock);
+    if (task) {
+        return task;
+    }
+    return steal_task(executor, self, seed);
+}
+
+/// @brief Main loop of a worker thread
+/// @param arg slot of the worker
+static void *worker_loop(void *arg) {
+    WorkerSlot *self = arg;
+    Executor *executor = self->executor;
+    unsigned int seed = (unsigned int)(self - executor->slots) * 2654435761u;
+    current_slot = self;
+
+    while (1) {
+        Task *task = find_task(executor, self, &seed);
+        if (task) {
+            task->run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&executor->lock);
+        if (executor->queue_length > 0) {
+            pthread_mutex_unlock(&executor->lock);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += EXECUTOR_IDLE_TIMEOUT_MS / 1000;
+        deadline.tv_nsec += (EXECUTOR_IDLE_TIMEOUT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        atomic_fetch_add(&executor->idle_workers, 1);
+        int result = pthread_cond_timedwait(&executor->wakeup, &executor->lock, &deadline);
+        atomic_fetch_sub(&executor->idle_workers, 1);
+        if (result == ETIMEDOUT && executor->queue_length == 0 && executor->workers > executor->min_workers) {
+            // the own deque is empty, otherwise find_task would have returned a task
+            int workers = --executor->workers;
+            self->active = 0;
+            pthread_mutex_unlock(&executor->lock);
+            printf("DEBUG: executor shrinks to %d workers\r\n", workers);
+            current_slot = NULL;
+            return NULL;
+        }
+        pthread_mutex_unlock(&executor->lock);
+    }
+}
+
+/// @brief Starts a worker in a free slot, the executor lock must be held
+/// @param executor initialized executor
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int spawn_worker(Executor *executor, Error *error) {
+    WorkerSlot *slot = NULL;
+    int slots_used = atomic_load_explicit(&executor->slots_used, memory_order_relaxed);
+    for (int i = 0; i < EXECUTOR_MAX_WORKERS && !slot; i++) {
+        if (!executor->slots[i].active) {
+            slot = &executor->slots[i];
+            if (i >= slots_used) {
+                atomic_store_explicit(&executor->slots_used, i + 1, memory_order_release);
+            }
+        }
+    }
+    if (!slot) {
+        error_write(error, "all %d worker slots are in use", EXECUTOR_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int result = pthread_create(&thread, &attr, worker_loop, slot);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    slot->active = 1;
+    executor->workers++;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Adds a worker if more tasks are waiting than workers are idle, the executor lock
+///        must be held
+/// @param executor started executor
+/// @param pending amount of waiting tasks
+/// @param idle amount of idle workers
+static void grow_if_busy(Executor *executor, long pending, int idle) {
+    if (pending > idle && executor->workers < executor->max_workers) {
+        // all workers are busy, e.g. blocked on the database
+        Error error = {0};
+        if (spawn_worker(executor, &error) == EXIT_SUCCESS) {
+            printf("DEBUG: executor grows to %d workers\r\n", executor->workers);
+        } else {
+            fprintf(stderr, "WARNING: cannot add worker: %s\r\n", error.msg);
+        }
+    }
+}
+
+int executor_init(Executor *executor, int min_workers, int max_workers, Error *error) {
+    if (min_workers < 1 || max_workers < min_workers || max_workers > EXECUTOR_MAX_WORKERS) {
+        error_write(error, "invalid worker limits %d..%d", min_workers, max_workers);
+        return EXIT_FAILURE;
+    }
+    memset(executor, 0, sizeof(*executor));
+    executor->slots = aligned_alloc(_Alignof(WorkerSlot), EXECUTOR_MAX_WORKERS * sizeof(WorkerSlot));
+    if (!executor->slots) {
+        error_write(error, "cannot allocate %d worker slots", EXECUTOR_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < EXECUTOR_MAX_WORKERS; i++) {
+        WorkerSlot *slot = &executor->slots[i];
+        atomic_init(&slot->deque.top, 0);
+        atomic_init(&slot->deque.bottom, 0);
+        slot->executor = executor;
+        slot->active = 0;
+    }
+    atomic_init(&executor->slots_used, 0);
+    atomic_init(&executor->idle_workers, 0);
+    executor->min_workers = min_workers;
+    executor->max_workers = max_workers;
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->wakeup, NULL);
+    return EXIT_SUCCESS;
+}
+
+int executor_start(Executor *executor, Error *error) {
+    pthread_mutex_lock(&executor->lock);
+    while (executor->workers < executor->min_workers) {
+        if (spawn_worker(executor, error) != EXIT_SUCCESS) {
+            pthread_mutex_unlock(&executor->lock);
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_mutex_unlock(&executor->lock);
+    return EXIT_SUCCESS;
+}
+
+void executor_submit(Executor *executor, Task *task) {
+    task->next = NULL;
+    WorkerSlot *self = current_slot;
+    if (self && self->executor == executor && deque_push(&self->deque, task) == EXIT_SUCCESS) {
+        // the worker runs the task itself unless a sleeping worker steals it first
+        int idle = atomic_load_explicit(&executor->idle_workers, memory_order_relaxed);
+        if (idle > 0) {
+            pthread_cond_signal(&executor->wakeup);
+        }
+        // the worker may block on the current task, so its deque counts like the queue
+        long pending = deque_length(&self->deque);
+        if (pending > idle) {
+            pthread_mutex_lock(&executor->lock);
+            grow_if_busy(executor, pending, idle);
+            pthread_mutex_unlock(&executor->lock);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    if (executor->queue_tail) {
+        executor->queue_tail->next = task;
+    } else {
+        executor->queue_head = task;
+    }
+    executor->queue_tail = task;
+    executor->queue_length++;
+    int idle = atomic_load_explicit(&executor->idle_workers, memory_order_relaxed);
+    if (idle > 0) {
+        pthread_cond_signal(&executor->wakeup);
+    }
+    grow_if_busy(executor, executor->queue_length, idle);
+    pthread_mutex_unlock(&executor->lock);
+}
+
+void task_group_init(TaskGroup *group) {
+    atomic_init(&group->pending, 0);
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+void task_group_destroy(TaskGroup *group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->done);
+}
+
+void executor_fork(Executor *executor, TaskGroup *group, Task *task) {
+    atomic_fetch_add(&group->pending, 1);
+    executor_submit(executor, task);
+}
+
+void task_group_done(TaskGroup *group) {
+    pthread_mutex_lock(&group->lock);
+    if (atomic_fetch_sub(&group->pending, 1) == 1) {
+        pthread_cond_broadcast(&group->done);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
+
+void executor_join(Executor *executor, TaskGroup *group) {
+    WorkerSlot *self = current_slot;
+    while (self && self->executor == executor && atomic_load(&group->pending) > 0) {
+        Task *task = deque_take(&self->deque);
+        if (!task) {
+            // the remaining tasks were stolen and are running on other workers
+            break;
+        }
+        task->run(task);
+    }
+    // the last task may still hold the lock after its decrement, the group is only
+    // released by the caller after it was unlocked
+    pthread_mutex_lock(&group->lock);
+    while (atomic_load(&group->pending) > 0) {
+        pthread_cond_wait(&group->done, &group->lock);
+    }
+    pthread_mutex_unlock(&group->lock);
+}
@@ -0,0 +1,109 @@
+#ifndef __EXECUTOR_H_
+#define __EXECUTOR_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "error.h"
+
+#define EXECUTOR_MAX_WORKERS        512     // upper limit of the configurable worker count
+#define EXECUTOR_DEQUE_CAPACITY     1024    // tasks per worker deque, must be a power of two
+#define EXECUTOR_IDLE_TIMEOUT_MS    5000    // idle time after which a worker above the minimum exits
+
+/// @brief Unit of work. Tasks are embedded into the structure they work on, so submitting a
+///        task does not allocate memory. A task must not be submitted again before it started running.
+typedef struct Task {
+    void (*run)(struct Task *task);     // called on a worker thread
+    struct Task *next;                  // link in the injection queue
+} Task;
+
+/// @brief Tasks forked by a worker which are joined before the worker continues. Every forked
+///        task has to call task_group_done() as the last step of its run function.
+typedef struct {
+    atomic_int      pending;    // forked tasks which did not finish yet
+    pthread_mutex_t lock;       // protects the wake up of the joining thread
+    pthread_cond_t  done;       // signalled when the last task finished
+} TaskGroup;
+
+/// @brief Chase-Lev deque of a worker. The owning worker pushes and takes tasks at the bottom,
+///        other workers steal from the top.
+typedef struct {
+    _Alignas(64) atomic_long top;                       // next task to steal
+    _Alignas(64) atomic_long bottom;                    // next free slot of the owner
+    _Atomic(Task *) slots[EXECUTOR_DEQUE_CAPACITY];     // circular buffer of tasks
+} WorkDeque;
+
+/// @brief Slot of a worker thread. Slots are reused when workers exit and start again.
+typedef struct {
+    WorkDeque       deque;      // tasks submitted by the worker itself
+    struct Executor *executor;  // executor the slot belongs to
+    int             active;     // a worker thread owns the slot, protected by the executor lock
+} WorkerSlot;
+
+/// @brief Work stealing thread pool. Tasks submitted by workers go to the deque of the
+///        submitting worker, all other tasks go to a shared injection queue. Idle workers
+///        steal from the other deques before they go to sleep.
+///        The pool is elastic: a worker is added whenever queued tasks are waiting and no
+///        worker is idle, e.g. because all workers block on database queries. Workers above
+///        the minimum exit after being idle for EXECUTOR_IDLE_TIMEOUT_MS.
+typedef struct Executor {
+    WorkerSlot      *slots;             // EXECUTOR_MAX_WORKERS worker slots
+    atomic_int      slots_used;         // slots which were ever active, limits stealing
+    int             min_workers;        // workers kept alive while idle
+    int             max_workers;        // upper limit of workers
+    pthread_mutex_t lock;               // protects all fields below
+    pthread_cond_t  wakeup;             // signalled when tasks are queued
+    Task            *queue_head;        // injection queue of tasks submitted by other threads
+    Task            *queue_tail;
+    int             queue_length;       // amount of tasks in the injection queue
+    int             workers;            // amount of running workers
+    atomic_int      idle_workers;       // amount of sleeping workers
+} Executor;
+
+/// @brief Initializes the executor without starting workers
+/// @param executor executor to initialize
+/// @param min_workers amount of workers which are always running, at least 1
+/// @param max_workers upper limit of workers, at most EXECUTOR_MAX_WORKERS
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int executor_init(Executor *executor, int min_workers, int max_workers, Error *error);
+
+/// @brief Starts the minimum amount of workers
+/// @param executor initialized executor
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int executor_start(Executor *executor, Error *error);
+
+/// @brief Queues a task. The task runs on the calling worker or is stolen by another one if
+///        it is submitted from a worker thread, otherwise any worker picks it up.
+/// @param executor started executor
+/// @param task task to run
+void executor_submit(Executor *executor, Task *task);
+
+/// @brief Initializes an empty task group
+/// @param group group to initialize
+void task_group_init(TaskGroup *group);
+
+/// @brief Releases the resources of a joined task group
+/// @param group joined group
+void task_group_destroy(TaskGroup *group);
+
+/// @brief Submits a task of a group, see executor_submit()
+/// @param executor started executor
+/// @param group initialized group
+/// @param task task to run, must call task_group_done() when it finished
+void executor_fork(Executor *executor, TaskGroup *group, Task *task);
+
+/// @brief Marks a forked task as finished, the task must not be accessed afterwards
+/// @param group group of the task
+void task_group_done(TaskGroup *group);
+
+/// @brief Waits until all tasks of the group finished. A worker runs the tasks of its own
+///        deque meanwhile, so forked tasks which were not stolen by idle workers run on the
+///        joining worker instead of waiting for a free one.
+/// @param executor started executor
+/// @param group group whose tasks were forked
+void executor_join(Executor *executor, TaskGroup *group);
+
+#endif
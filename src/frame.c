@@ -0,0 +1,153 @@
+#include "frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+_Static_assert(sizeof(FrameHeader) == sizeof(RequestHeader), "frame header must match request header");
+_Static_assert(sizeof(FrameHeader) == sizeof(ResponseHeader), "frame header must match response header");
+
+void frame_decoder_init(FrameDecoder *decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+void frame_decoder_free(FrameDecoder *decoder) {
+    free(decoder->buffer);
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+/// @brief Makes room for at least size bytes starting at decoder->start. Buffered data is
+///        moved to the front of the buffer before the buffer is grown.
+/// @param decoder initialized decoder
+/// @param size required amount of bytes
+/// @return EXIT_SUCCESS on success
+static int reserve(FrameDecoder *decoder, size_t size) {
+    if (decoder->capacity - decoder->start >= size) {
+        return EXIT_SUCCESS;
+    }
+    if (decoder->start > 0) {
+        memmove(decoder->buffer, decoder->buffer + decoder->start, decoder->end - decoder->start);
+        decoder->end -= decoder->start;
+        decoder->start = 0;
+    }
+    if (decoder->capacity >= size) {
+        return EXIT_SUCCESS;
+    }
+    uint8_t *grown = realloc(decoder->buffer, size);
+    if (!grown) {
+        return EXIT_FAILURE;
+    }
+    decoder->buffer = grown;
+    decoder->capacity = size;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Releases the last decoded frame. Large buffers which were grown for a single frame
+///        are freed once they are empty.
+/// @param decoder initialized decoder
+static void release_consumed(FrameDecoder *decoder) {
+    decoder->start += decoder->consumed;
+    decoder->consumed = 0;
+    if (decoder->start == decoder->end) {
+        decoder->start = 0;
+        decoder->end = 0;
+        if (decoder->capacity > 4 * FRAME_DECODER_INITIAL_CAPACITY) {
+            free(decoder->buffer);
+            decoder->buffer = NULL;
+            decoder->capacity = 0;
+        }
+    }
+}
+
+FrameStatus frame_decoder_next(FrameDecoder *decoder, FrameHeader *header, const uint8_t **payload, Error *error) {
+    release_consumed(decoder);
+    size_t available = decoder->end - decoder->start;
+    if (available < sizeof(FrameHeader)) {
+        return FRAME_INCOMPLETE;
+    }
+    memcpy(header, decoder->buffer + decoder->start, sizeof(FrameHeader));
+    if (header->magicnum != API_MAGIC_NUM) {
+        error_write(error, "Invalid magic number %d", header->magicnum);
+        return FRAME_ERROR;
+    }
+    if (header->version != API_VERSION) {
+        error_write(error, "Invalid version %d", header->version);
+        return FRAME_ERROR;
+    }
+    if (header->payload_size > MAX_PAYLOAD_SIZE) {
+        error_write(error, "Payload too large (%u bytes)", header->payload_size);
+        return FRAME_ERROR;
+    }
+    size_t frame_size = sizeof(FrameHeader) + header->payload_size;
+    if (available < frame_size) {
+        // make sure the rest of the frame can be received in place
+        if (reserve(decoder, frame_size) != EXIT_SUCCESS) {
+            error_write(error, "cannot allocate %zu bytes for frame", frame_size);
+            return FRAME_ERROR;
+        }
+        return FRAME_INCOMPLETE;
+    }
+    *payload = decoder->buffer + decoder->start + sizeof(FrameHeader);
+    decoder->consumed = frame_size;
+    return FRAME_COMPLETE;
+}
+
+uint8_t *frame_decoder_space(FrameDecoder *decoder, size_t *size, Error *error) {
+    if (decoder->end == decoder->capacity) {
+        size_t buffered = decoder->end - decoder->start;
+        size_t required = buffered < FRAME_DECODER_INITIAL_CAPACITY / 2 ? FRAME_DECODER_INITIAL_CAPACITY : buffered * 2;
+        if (reserve(decoder, required) != EXIT_SUCCESS) {
+            error_write(error, "cannot allocate %zu bytes for frame", required);
+            return NULL;
+        }
+    }
+    *size = decoder->capacity - decoder->end;
+    return decoder->buffer + decoder->end;
+}
+
+void frame_decoder_commit(FrameDecoder *decoder, size_t size) {
+    decoder->end += size;
+}
+
+FrameStatus frame_decoder_fill(FrameDecoder *decoder, int fd, Error *error) {
+    size_t size;
+    uint8_t *space = frame_decoder_space(decoder, &size, error);
+    if (!space) {
+        return FRAME_ERROR;
+    }
+    ssize_t n;
+    do {
+        n = recv(fd, space, size, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        frame_decoder_commit(decoder, n);
+        return FRAME_INCOMPLETE;
+    }
+    if (n == 0) {
+        return FRAME_CLOSED;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return FRAME_WOULD_BLOCK;
+    }
+    strerror_r(errno, error->msg, sizeof(error->msg));
+    return FRAME_ERROR;
+}
+
+FrameStatus frame_decoder_read(FrameDecoder *decoder, int fd, FrameHeader *header, const uint8_t **payload, Error *error) {
+    while (1) {
+        FrameStatus status = frame_decoder_next(decoder, header, payload, error);
+        if (status != FRAME_INCOMPLETE) {
+            return status;
+        }
+        status = frame_decoder_fill(decoder, fd, error);
+        if (status != FRAME_INCOMPLETE) {
+            if (status == FRAME_CLOSED && decoder->end > decoder->start) {
+                error_write(error, "connection closed within a frame (%zu bytes buffered)", decoder->end - decoder->start);
+                return FRAME_ERROR;
+            }
+            return status;
+        }
+    }
+}
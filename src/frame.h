@@ -0,0 +1,90 @@
+#ifndef __FRAME_H_
+#define __FRAME_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "api.h"
+#include "error.h"
+
+#define FRAME_DECODER_INITIAL_CAPACITY  (64 * 1024)
+
+/// @brief Common layout of RequestHeader and ResponseHeader
+typedef struct
+{
+    uint8_t magicnum;
+    uint8_t version;
+    uint16_t id;            // request or response id
+    uint32_t payload_size;
+    uint32_t flags;
+} FrameHeader;
+
+typedef enum
+{
+    FRAME_COMPLETE,         // a whole frame was decoded
+    FRAME_INCOMPLETE,       // more data is needed to decode the frame
+    FRAME_WOULD_BLOCK,      // non-blocking socket has no data available
+    FRAME_CLOSED,           // the peer closed the connection
+    FRAME_ERROR,            // invalid frame or socket error, the connection cannot be used anymore
+} FrameStatus;
+
+/// @brief Incremental decoder for frames of the shop protocol. Data is received into a growable
+///        buffer and frames are decoded from it as soon as they are complete, independent of
+///        how the data was split into segments. The payload of a decoded frame points into the
+///        buffer and stays valid until the next call to the decoder.
+typedef struct
+{
+    uint8_t *buffer;        // received data
+    size_t capacity;        // size of the buffer
+    size_t start;           // start of data which is not decoded yet
+    size_t end;             // end of the received data
+    size_t consumed;        // size of the last decoded frame, released on the next call
+} FrameDecoder;
+
+/// @brief Initializes an empty decoder
+/// @param decoder decoder to initialize
+void frame_decoder_init(FrameDecoder *decoder);
+
+/// @brief Releases the buffer of the decoder
+/// @param decoder initialized decoder
+void frame_decoder_free(FrameDecoder *decoder);
+
+/// @brief Decodes the next frame from the data which was already received
+/// @param decoder initialized decoder
+/// @param header address to save the header of the frame
+/// @param payload address to save the start of the payload, valid until the next call to the decoder
+/// @param error address of error object to set an error message on FRAME_ERROR
+/// @return FRAME_COMPLETE, FRAME_INCOMPLETE or FRAME_ERROR if the header is invalid
+FrameStatus frame_decoder_next(FrameDecoder *decoder, FrameHeader *header, const uint8_t **payload, Error *error);
+
+/// @brief Returns the free space at the end of the buffer, the buffer is grown if it is full.
+///        Data copied into the space is added with frame_decoder_commit().
+/// @param decoder initialized decoder
+/// @param size address to save the size of the space
+/// @param error address of error object to set an error message on failure
+/// @return start of the space or NULL if the buffer cannot be grown
+uint8_t *frame_decoder_space(FrameDecoder *decoder, size_t *size, Error *error);
+
+/// @brief Adds data which was copied into the space returned by frame_decoder_space()
+/// @param decoder initialized decoder
+/// @param size amount of bytes copied into the space
+void frame_decoder_commit(FrameDecoder *decoder, size_t size);
+
+/// @brief Receives available data from the socket once
+/// @param decoder initialized decoder
+/// @param fd socket to receive data from
+/// @param error address of error object to set an error message on FRAME_ERROR
+/// @return FRAME_INCOMPLETE if data was received, FRAME_WOULD_BLOCK, FRAME_CLOSED or FRAME_ERROR
+FrameStatus frame_decoder_fill(FrameDecoder *decoder, int fd, Error *error);
+
+/// @brief Receives data until a whole frame was decoded. Returns FRAME_WOULD_BLOCK if the
+///        socket is non-blocking and has no more data available.
+/// @param decoder initialized decoder
+/// @param fd socket to receive data from
+/// @param header address to save the header of the frame
+/// @param payload address to save the start of the payload, valid until the next call to the decoder
+/// @param error address of error object to set an error message on FRAME_ERROR
+/// @return status of the decoder
+FrameStatus frame_decoder_read(FrameDecoder *decoder, int fd, FrameHeader *header, const uint8_t **payload, Error *error);
+
+#endif
@@ -0,0 +1,45 @@
+#include "histogram.h"
+
+void histogram_record(Histogram *histogram, uint64_t ns) {
+    int bucket;
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        bucket = ns;
+    } else {
+        int msb = 63 - __builtin_clzll(ns);
+        int sub = (ns >> (msb - HISTOGRAM_SUB_BUCKETS_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        bucket = (msb - HISTOGRAM_SUB_BUCKETS_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+    histogram->counts[bucket]++;
+    histogram->total++;
+    if (ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
+
+void histogram_merge(Histogram *target, const Histogram *source) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        target->counts[i] += source->counts[i];
+    }
+    target->total += source->total;
+    if (source->max_ns > target->max_ns) {
+        target->max_ns = source->max_ns;
+    }
+}
+
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t)(histogram->total * percentile / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            if (i < HISTOGRAM_SUB_BUCKETS) {
+                return i;
+            }
+            int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+            uint64_t lower = (uint64_t)(HISTOGRAM_SUB_BUCKETS + i % HISTOGRAM_SUB_BUCKETS) << shift;
+            uint64_t upper = lower + ((uint64_t)1 << shift) - 1;
+            return upper < histogram->max_ns ? upper : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
@@ -0,0 +1,33 @@
+#ifndef __HISTOGRAM_H_
+#define __HISTOGRAM_H_
+
+#include <inttypes.h>
+
+#define HISTOGRAM_SUB_BUCKETS_BITS  3
+#define HISTOGRAM_SUB_BUCKETS       (1 << HISTOGRAM_SUB_BUCKETS_BITS)
+#define HISTOGRAM_BUCKETS           ((64 - HISTOGRAM_SUB_BUCKETS_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/// @brief Latency histogram with 8 buckets per power of two, i.e. a relative error below 12.5%
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t max_ns;
+} Histogram;
+
+/// @brief Counts a latency
+/// @param histogram zero initialized histogram
+/// @param ns latency in nanoseconds
+void histogram_record(Histogram *histogram, uint64_t ns);
+
+/// @brief Adds the counts of a histogram to another one
+/// @param target histogram receiving the counts
+/// @param source histogram whose counts are added
+void histogram_merge(Histogram *target, const Histogram *source);
+
+/// @brief Returns the upper bound of the bucket containing the percentile
+/// @param histogram histogram
+/// @param percentile percentile between 0 and 100
+/// @return latency in nanoseconds
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+
+#endif
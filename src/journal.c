@@ -0,0 +1,422 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define DRAIN_READ_SIZE (1024 * 1024)   // bytes read from the journal at once by the drainer
+
+/// @brief Reads exactly size bytes at the given offset
+/// @param fd file descriptor
+/// @param buffer destination buffer
+/// @param size amount of bytes to read
+/// @param offset file offset
+/// @return amount of bytes read, less than size at the end of the file, -1 on error
+static ssize_t pread_all(int fd, void *buffer, size_t size, off_t offset) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = pread(fd, (uint8_t *)buffer + total, size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+/// @brief Checks if a buffer starts with a complete and intact record
+/// @param data start of the buffer
+/// @param size size of the buffer
+/// @param record address to save the record
+/// @return size of the record including its header, 0 if the record is incomplete, -1 if it is corrupted
+static ssize_t parse_record(const uint8_t *data, size_t size, JournalRecord *record) {
+    JournalRecordHeader header;
+    if (size < sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != JOURNAL_RECORD_MAGIC) {
+        return -1;
+    }
+    if (size - sizeof(header) < header.size) {
+        return 0;
+    }
+    const uint8_t *payload = data + sizeof(header);
+    if (crc32(0L, payload, header.size) != header.checksum) {
+        return -1;
+    }
+    record->seq = header.seq;
+    record->payload = payload;
+    record->size = header.size;
+    return sizeof(header) + header.size;
+}
+
+/// @brief Scans the journal file for intact records and cuts off a torn record at the end
+/// @param journal journal with opened file
+/// @param last_seq address to save the sequence number of the last intact record
+/// @param end address to save the end of the last intact record
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int recover(Journal *journal, uint64_t *last_seq, off_t *end, Error *error) {
+    struct stat st;
+    if (fstat(journal->fd, &st) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    uint8_t *buffer = NULL;
+    size_t capacity = 0;
+    off_t offset = 0;
+    *last_seq = 0;
+    while (offset < st.st_size) {
+        JournalRecordHeader header;
+        if (pread_all(journal->fd, &header, sizeof(header), offset) != sizeof(header)
+                || header.magic != JOURNAL_RECORD_MAGIC
+                || header.size > st.st_size - offset - sizeof(header)) {
+            break;
+        }
+        size_t record_size = sizeof(header) + header.size;
+        if (record_size > capacity) {
+            uint8_t *grown = realloc(buffer, record_size);
+            if (!grown) {
+                free(buffer);
+                error_write(error, "cannot allocate %zu bytes for journal record", record_size);
+                return EXIT_FAILURE;
+            }
+            buffer = grown;
+            capacity = record_size;
+        }
+        JournalRecord record;
+        if (pread_all(journal->fd, buffer, record_size, offset) != (ssize_t)record_size
+                || parse_record(buffer, record_size, &record) <= 0) {
+            break;
+        }
+        *last_seq = record.seq;
+        offset += record_size;
+    }
+    free(buffer);
+
+    if (offset < st.st_size) {
+        fprintf(stderr, "WARNING: cutting off %lld bytes of a torn journal record\r\n", (long long)(st.st_size - offset));
+        if (ftruncate(journal->fd, offset) < 0 || fdatasync(journal->fd) < 0) {
+            strerror_r(errno, error->msg, sizeof(error->msg));
+            return EXIT_FAILURE;
+        }
+    }
+    *end = offset;
+    return EXIT_SUCCESS;
+}
+
+int journal_open(Journal *journal, const char *path, uint64_t stored_seq, JournalDrainCallback drain_cb, void *drain_ctx, Error *error) {
+    memset(journal, 0, sizeof(*journal));
+    journal->drain_cb = drain_cb;
+    journal->drain_ctx = drain_ctx;
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal->fd < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+
+    char dead_path[4096];
+    snprintf(dead_path, sizeof(dead_path), "%s.dead", path);
+    journal->dead_fd = open(dead_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal->dead_fd < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        close(journal->fd);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t last_seq;
+    off_t end;
+    if (recover(journal, &last_seq, &end, error) != EXIT_SUCCESS) {
+        close(journal->fd);
+        close(journal->dead_fd);
+        return EXIT_FAILURE;
+    }
+    // sequence numbers have to grow across restarts even if the journal was truncated,
+    // a reused one would be skipped by the drain as already stored
+    journal->next_seq = (last_seq > stored_seq ? last_seq : stored_seq) + 1;
+    journal->written_seq = last_seq;
+    journal->durable_seq = last_seq;
+    journal->written_offset = end;
+    journal->durable_offset = end;
+    journal->drained_offset = 0;
+    if (end > 0) {
+        printf("INFO: replaying %lld bytes of the order journal\r\n", (long long)end);
+    }
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->durable_cond, NULL);
+    pthread_cond_init(&journal->drain_cond, NULL);
+    return EXIT_SUCCESS;
+}
+
+int journal_append(Journal *journal, const void *payload, uint32_t size, uint64_t *seq, Error *error) {
+    JournalRecordHeader header = {
+        .magic = JOURNAL_RECORD_MAGIC,
+        .size = size,
+        .checksum = crc32(0L, payload, size),
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)payload, .iov_len = size },
+    };
+    ssize_t record_size = sizeof(header) + size;
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->failed) {
+        pthread_mutex_unlock(&journal->lock);
+        error_write(error, "%s", "journal is not writable");
+        return EXIT_FAILURE;
+    }
+    header.seq = journal->next_seq++;
+    ssize_t n;
+    do {
+        n = writev(journal->fd, iov, 2);
+    } while (n < 0 && errno == EINTR);
+    if (n != record_size) {
+        // a partially written record cannot be removed safely anymore
+        if (n < 0) {
+            strerror_r(errno, error->msg, sizeof(error->msg));
+        } else {
+            error_write(error, "short write of %zd bytes into journal", n);
+        }
+        journal->failed = 1;
+        pthread_cond_broadcast(&journal->durable_cond);
+        pthread_mutex_unlock(&journal->lock);
+        return EXIT_FAILURE;
+    }
+    journal->written_seq = header.seq;
+    journal->written_offset += record_size;
+
+    // group commit: one thread syncs all records written so far, the others wait for it
+    while (journal->durable_seq < header.seq && !journal->failed) {
+        if (journal->syncing) {
+            pthread_cond_wait(&journal->durable_cond, &journal->lock);
+            continue;
+        }
+        journal->syncing = 1;
+        uint64_t target_seq = journal->written_seq;
+        off_t target_offset = journal->written_offset;
+        pthread_mutex_unlock(&journal->lock);
+        int result = fdatasync(journal->fd);
+        int sync_errno = errno;
+        pthread_mutex_lock(&journal->lock);
+        journal->syncing = 0;
+        if (result < 0) {
+            // the state of the page cache is unknown after a failed sync
+            strerror_r(sync_errno, error->msg, sizeof(error->msg));
+            journal->failed = 1;
+        } else {
+            journal->durable_seq = target_seq;
+            journal->durable_offset = target_offset;
+            pthread_cond_signal(&journal->drain_cond);
+        }
+        pthread_cond_broadcast(&journal->durable_cond);
+    }
+    int durable = journal->durable_seq >= header.seq;
+    pthread_mutex_unlock(&journal->lock);
+
+    if (!durable) {
+        if (error->msg[0] == '\0') {
+            error_write(error, "%s", "journal sync failed");
+        }
+        return EXIT_FAILURE;
+    }
+    *seq = header.seq;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Finds the start of the next record behind a corrupted one
+/// @param data start of the buffer, begins with the corrupted record
+/// @param size size of the buffer
+/// @param complete the buffer reaches up to the end of the durable records
+/// @return amount of bytes to skip
+static size_t skip_corrupted(const uint8_t *data, size_t size, int complete) {
+    for (size_t skip = 1; skip + sizeof(JournalRecordHeader) <= size; skip++) {
+        JournalRecord record;
+        // an incomplete record is only checked once more of it was read
+        if (parse_record(data + skip, size - skip, &record) >= 0) {
+            return skip;
+        }
+    }
+    // a header might start in the last bytes, unless they are the last durable bytes
+    if (complete || size <= sizeof(JournalRecordHeader)) {
+        return size;
+    }
+    return size - sizeof(JournalRecordHeader) + 1;
+}
+
+/// @brief Appends a rejected record to the dead letter file and waits until it is durable
+/// @param journal opened journal
+/// @param data start of the record including its header
+/// @param size size of the record
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS once the record is durable
+static int write_dead_letter(Journal *journal, const uint8_t *data, size_t size, Error *error) {
+    while (size > 0) {
+        ssize_t n = write(journal->dead_fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            strerror_r(errno, error->msg, sizeof(error->msg));
+            return EXIT_FAILURE;
+        }
+        data += n;
+        size -= n;
+    }
+    if (fdatasync(journal->dead_fd) < 0) {
+        strerror_r(errno, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Marks the records up to an offset as drained and truncates the file once
+///        everything is drained
+/// @param journal opened journal
+/// @param offset end of the last drained record
+static void finish_drain(Journal *journal, off_t offset) {
+    pthread_mutex_lock(&journal->lock);
+    journal->drained_offset = offset;
+    if (journal->drained_offset == journal->written_offset && !journal->syncing) {
+        // everything is stored in the database, start over with an empty file
+        if (ftruncate(journal->fd, 0) == 0) {
+            journal->written_offset = 0;
+            journal->durable_offset = 0;
+            journal->drained_offset = 0;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/// @brief Passes all durable records in batches to the drain callback. Failed batches are
+///        retried until they succeed. The records of a rejected batch are passed one by one,
+///        the rejected ones are moved into the dead letter file.
+/// @param arg journal
+/// @return NULL
+static void *drain_loop(void *arg) {
+    Journal *journal = arg;
+    size_t capacity = DRAIN_READ_SIZE;
+    uint8_t *buffer = malloc(capacity);
+    JournalRecord *records = malloc(JOURNAL_DRAIN_BATCH * sizeof(JournalRecord));
+    if (!buffer || !records) {
+        fprintf(stderr, "ERROR: cannot allocate journal drain buffers\r\n");
+        free(buffer);
+        free(records);
+        return NULL;
+    }
+
+    // records before this offset belong to a rejected batch and are drained one by one
+    off_t rejected_end = 0;
+    while (1) {
+        pthread_mutex_lock(&journal->lock);
+        while (journal->drained_offset >= journal->durable_offset) {
+            pthread_cond_wait(&journal->drain_cond, &journal->lock);
+        }
+        off_t start = journal->drained_offset;
+        off_t end = journal->durable_offset;
+        pthread_mutex_unlock(&journal->lock);
+
+        size_t size = (size_t)(end - start) < capacity ? (size_t)(end - start) : capacity;
+        ssize_t read_size = pread_all(journal->fd, buffer, size, start);
+        if (read_size != (ssize_t)size) {
+            char errmsg[256];
+            if (read_size < 0) {
+                strerror_r(errno, errmsg, sizeof(errmsg));
+            } else {
+                snprintf(errmsg, sizeof(errmsg), "read %zd of %zu bytes", read_size, size);
+            }
+            fprintf(stderr, "ERROR: cannot read journal: %s\r\n", errmsg);
+            sleep(1);
+            continue;
+        }
+        int batch_limit = start < rejected_end ? 1 : JOURNAL_DRAIN_BATCH;
+        int records_length = 0;
+        size_t offset = 0;
+        ssize_t n = 0;
+        while (records_length < batch_limit) {
+            n = parse_record(buffer + offset, size - offset, &records[records_length]);
+            if (n <= 0) {
+                break;
+            }
+            offset += n;
+            records_length++;
+        }
+        if (records_length == 0 && n == 0) {
+            // the next record does not fit into the buffer, unless it claims more than is durable
+            JournalRecordHeader header = {0};
+            memcpy(&header, buffer, sizeof(header) < size ? sizeof(header) : size);
+            size_t grown_capacity = sizeof(header) + header.size;
+            if (size >= sizeof(header) && grown_capacity <= (size_t)(end - start)) {
+                uint8_t *grown = realloc(buffer, grown_capacity);
+                if (!grown) {
+                    fprintf(stderr, "ERROR: cannot allocate %zu bytes for journal record\r\n", grown_capacity);
+                    sleep(1);
+                    continue;
+                }
+                buffer = grown;
+                capacity = grown_capacity;
+                continue;
+            }
+        }
+        if (records_length == 0) {
+            // the acknowledged records behind a corrupted one are still drained
+            size_t skipped = skip_corrupted(buffer, size, start + (off_t)size == end);
+            fprintf(stderr, "ERROR: skipping %zu bytes of a corrupted journal record at offset %lld\r\n",
+                    skipped, (long long)start);
+            finish_drain(journal, start + skipped);
+            continue;
+        }
+
+        Error error = {0};
+        int result = journal->drain_cb(journal->drain_ctx, records, records_length, &error);
+        if (result == JOURNAL_DRAIN_REJECTED && records_length > 1) {
+            fprintf(stderr, "WARNING: draining %d rejected journal records one by one: %s\r\n", records_length, error.msg);
+            rejected_end = start + offset;
+            continue;
+        }
+        if (result == JOURNAL_DRAIN_REJECTED) {
+            Error dead_error = {0};
+            if (write_dead_letter(journal, buffer, offset, &dead_error) != EXIT_SUCCESS) {
+                fprintf(stderr, "ERROR: cannot write journal record %" PRIu64 " into the dead letter file: %s\r\n",
+                        records[0].seq, dead_error.msg);
+                sleep(1);
+                continue;
+            }
+            fprintf(stderr, "ERROR: moved journal record %" PRIu64 " into the dead letter file: %s\r\n",
+                    records[0].seq, error.msg);
+        } else if (result != EXIT_SUCCESS) {
+            fprintf(stderr, "ERROR: cannot drain %d journal records: %s\r\n", records_length, error.msg);
+            sleep(1);
+            continue;
+        }
+        if (start + (off_t)offset >= rejected_end) {
+            // the offsets start over after the file was truncated
+            rejected_end = 0;
+        }
+        finish_drain(journal, start + offset);
+    }
+    return NULL;
+}
+
+int journal_start_drainer(Journal *journal, Error *error) {
+    int result = pthread_create(&journal->drainer, NULL, drain_loop, journal);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#ifndef __JOURNAL_H_
+#define __JOURNAL_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "error.h"
+
+#define JOURNAL_RECORD_MAGIC    0x4c4e524a  // "JRNL" in little endian
+#define JOURNAL_DRAIN_BATCH     1000        // maximum amount of records per drained batch
+#define JOURNAL_DRAIN_REJECTED  2           // result of a drain callback which can never store a record of the batch
+
+/// @brief Header of a single journal record, followed by the payload
+typedef struct {
+    uint32_t    magic;      // JOURNAL_RECORD_MAGIC
+    uint32_t    size;       // size of the payload
+    uint64_t    seq;        // sequence number of the record
+    uint32_t    checksum;   // CRC32 of the payload
+    uint32_t    reserved;
+} JournalRecordHeader;
+
+/// @brief Record read back from the journal
+typedef struct {
+    uint64_t        seq;        // sequence number of the record
+    const uint8_t   *payload;   // payload of the record
+    uint32_t        size;       // size of the payload
+} JournalRecord;
+
+/// @brief Callback which stores a batch of durable records, must be idempotent because
+///        records are drained again after a restart
+/// @return EXIT_SUCCESS if all records were stored, JOURNAL_DRAIN_REJECTED if a record can never
+///         be stored, the batch is retried otherwise
+typedef int (*JournalDrainCallback)(void *ctx, const JournalRecord *records, int records_length, Error *error);
+
+/// @brief Append only journal of requests which are acknowledged to clients before they are
+///        stored in the database. Appended records are made durable with group committed
+///        fdatasync() calls: the first waiting thread syncs the file for all records which
+///        were written so far while the other threads wait for its result.
+///        A drainer thread passes durable records in batches to a callback which stores them
+///        in the database. Once everything is drained the file is truncated. Records which the
+///        callback rejects are moved into a dead letter file with the format of the journal,
+///        corrupted records are skipped.
+typedef struct {
+    int             fd;                 // journal file opened in append mode
+    int             dead_fd;            // dead letter file of rejected records, opened in append mode
+    JournalDrainCallback drain_cb;      // stores drained records
+    void            *drain_ctx;         // context of drain_cb
+    pthread_mutex_t lock;               // protects all fields below
+    pthread_cond_t  durable_cond;       // signalled when durable_seq advances or the journal fails
+    pthread_cond_t  drain_cond;         // signalled when new records are durable
+    uint64_t        next_seq;           // sequence number of the next record
+    uint64_t        written_seq;        // sequence number of the last written record
+    uint64_t        durable_seq;        // sequence number of the last synced record
+    off_t           written_offset;     // end of the last written record
+    off_t           durable_offset;     // end of the last synced record
+    off_t           drained_offset;     // end of the last record stored in the database
+    int             syncing;            // a thread is currently calling fdatasync()
+    int             failed;             // journal cannot be used anymore after a failed write or sync
+    pthread_t       drainer;            // thread which passes durable records to drain_cb
+} Journal;
+
+/// @brief Opens or creates the journal file. Records which are left over from a previous
+///        run are kept and drained again, so the drain callback has to skip records which
+///        were already stored. A torn record at the end of the file is cut off.
+///        Sequence numbers continue after the last record of the file and after stored_seq,
+///        since the file is empty again once everything was drained. Rejected records are
+///        appended to the dead letter file path.dead.
+/// @param journal journal to initialize
+/// @param path path of the journal file
+/// @param stored_seq highest sequence number which was already stored in the database
+/// @param drain_cb callback which stores batches of durable records
+/// @param drain_ctx context passed to drain_cb
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int journal_open(Journal *journal, const char *path, uint64_t stored_seq, JournalDrainCallback drain_cb, void *drain_ctx, Error *error);
+
+/// @brief Starts the drainer thread
+/// @param journal opened journal
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int journal_start_drainer(Journal *journal, Error *error);
+
+/// @brief Appends a record and waits until it is durable on local disk
+/// @param journal opened journal
+/// @param payload payload of the record
+/// @param size size of the payload
+/// @param seq address to save the sequence number of the record
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS once the record is durable
+int journal_append(Journal *journal, const void *payload, uint32_t size, uint64_t *seq, Error *error);
+
+#endif
@@ -0,0 +1,365 @@
+#include "order_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <libpq-fe.h>
+
+#include "database.h"
+
+_Static_assert(sizeof(OrderCacheShard) % ORDER_CACHE_CACHE_LINE == 0, "shards must not share cache lines");
+
+/// @brief Mixes the bits of an order ID, the upper bits select the shard, the lower bits the bucket
+static uint64_t hash_order_id(int32_t order_id) {
+    uint64_t hash = (uint32_t)order_id;
+    hash ^= hash >> 16;
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 32);
+}
+
+static OrderCacheShard *shard_of(OrderCache *cache, uint64_t hash) {
+    return &cache->shards[(hash >> 56) % ORDER_CACHE_SHARDS];
+}
+
+/// @brief Memory accounted for an entry
+static size_t entry_bytes(const OrderCacheEntry *entry) {
+    return sizeof(*entry) + entry->size;
+}
+
+/// @brief Returns the address of the link pointing to the entry of an order, the shard lock must be held
+static OrderCacheEntry **find_link(OrderCacheShard *shard, uint64_t hash, int32_t order_id) {
+    OrderCacheEntry **link = &shard->buckets[hash & (shard->buckets_length - 1)];
+    while (*link && (*link)->order_id != order_id) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static void lru_unlink(OrderCacheShard *shard, OrderCacheEntry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(OrderCacheShard *shard, OrderCacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+/// @brief Unlinks the entry of a link and drops the reference of the shard, the shard lock must be held
+static void remove_entry(OrderCacheShard *shard, OrderCacheEntry **link) {
+    OrderCacheEntry *entry = *link;
+    *link = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->entries--;
+    shard->bytes -= entry_bytes(entry);
+    order_cache_release(entry);
+}
+
+/// @brief Doubles the buckets of a shard, the shard lock must be held. The shard keeps its
+///        buckets if the memory cannot be allocated, only its chains get longer.
+static void grow_buckets(OrderCacheShard *shard) {
+    size_t length = shard->buckets_length * 2;
+    OrderCacheEntry **buckets = calloc(length, sizeof(*buckets));
+    if (!buckets) {
+        return;
+    }
+    for (size_t i = 0; i < shard->buckets_length; i++) {
+        OrderCacheEntry *entry = shard->buckets[i];
+        while (entry) {
+            OrderCacheEntry *next = entry->hash_next;
+            OrderCacheEntry **bucket = &buckets[hash_order_id(entry->order_id) & (length - 1)];
+            entry->hash_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->buckets_length = length;
+}
+
+int order_cache_init(OrderCache *cache, size_t max_bytes, Error *error) {
+    memset(cache, 0, sizeof(*cache));
+    cache->max_bytes = max_bytes;
+    atomic_init(&cache->enabled, 0);
+    if (max_bytes == 0) {
+        return EXIT_SUCCESS;
+    }
+    for (int i = 0; i < ORDER_CACHE_SHARDS; i++) {
+        OrderCacheShard *shard = &cache->shards[i];
+        shard->buckets = calloc(ORDER_CACHE_MIN_BUCKETS, sizeof(*shard->buckets));
+        if (!shard->buckets) {
+            error_write(error, "cannot allocate %d hash buckets", ORDER_CACHE_MIN_BUCKETS);
+            while (i-- > 0) {
+                free(cache->shards[i].buckets);
+            }
+            return EXIT_FAILURE;
+        }
+        shard->buckets_length = ORDER_CACHE_MIN_BUCKETS;
+        shard->max_bytes = max_bytes / ORDER_CACHE_SHARDS;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Tells whether all listeners receive changes, otherwise the cache is bypassed
+static int cache_enabled(OrderCache *cache) {
+    int listening = atomic_load(&cache->enabled);
+    return listening > 0 && listening == cache->listeners_length;
+}
+
+const OrderCacheEntry *order_cache_get(OrderCache *cache, int32_t order_id, uint64_t *ticket) {
+    *ticket = 0;
+    if (cache->max_bytes == 0) {
+        return NULL;
+    }
+    uint64_t hash = hash_order_id(order_id);
+    OrderCacheShard *shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    OrderCacheEntry *entry = NULL;
+    if (cache_enabled(cache)) {
+        entry = *find_link(shard, hash, order_id);
+    }
+    if (entry) {
+        shard->hits++;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        atomic_fetch_add(&entry->refs, 1);
+    } else {
+        shard->misses++;
+        *ticket = shard->generation;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void order_cache_release(const OrderCacheEntry *entry) {
+    OrderCacheEntry *mutable_entry = (OrderCacheEntry *)entry;
+    if (atomic_fetch_sub(&mutable_entry->refs, 1) == 1) {
+        free(mutable_entry);
+    }
+}
+
+void order_cache_put(OrderCache *cache, int32_t order_id, const void *payload, uint32_t size, uint64_t ticket) {
+    if (cache->max_bytes == 0 || sizeof(OrderCacheEntry) + size > cache->max_bytes / ORDER_CACHE_SHARDS) {
+        return;
+    }
+    OrderCacheEntry *entry = malloc(sizeof(OrderCacheEntry) + size);
+    if (!entry) {
+        return;
+    }
+    atomic_init(&entry->refs, 1);
+    entry->order_id = order_id;
+    entry->size = size;
+    memcpy(entry->payload, payload, size);
+
+    uint64_t hash = hash_order_id(order_id);
+    OrderCacheShard *shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    // the order may have changed while its payload was loaded
+    if (!cache_enabled(cache) || shard->generation != ticket) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+    OrderCacheEntry **link = find_link(shard, hash, order_id);
+    if (*link) {
+        // added by a concurrent miss of the same order
+        remove_entry(shard, link);
+    }
+    while (shard->bytes + entry_bytes(entry) > shard->max_bytes) {
+        OrderCacheEntry *victim = shard->lru_tail;
+        remove_entry(shard, find_link(shard, hash_order_id(victim->order_id), victim->order_id));
+        shard->evictions++;
+    }
+    if (shard->entries >= shard->buckets_length) {
+        grow_buckets(shard);
+    }
+    link = &shard->buckets[hash & (shard->buckets_length - 1)];
+    entry->hash_next = *link;
+    *link = entry;
+    lru_push_front(shard, entry);
+    shard->entries++;
+    shard->bytes += entry_bytes(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void order_cache_invalidate(OrderCache *cache, int32_t order_id) {
+    if (cache->max_bytes == 0) {
+        return;
+    }
+    uint64_t hash = hash_order_id(order_id);
+    OrderCacheShard *shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    shard->generation++;
+    OrderCacheEntry **link = find_link(shard, hash, order_id);
+    if (*link) {
+        remove_entry(shard, link);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void order_cache_clear(OrderCache *cache) {
+    if (cache->max_bytes == 0) {
+        return;
+    }
+    for (int i = 0; i < ORDER_CACHE_SHARDS; i++) {
+        OrderCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->generation++;
+        while (shard->lru_head) {
+            OrderCacheEntry *entry = shard->lru_head;
+            remove_entry(shard, find_link(shard, hash_order_id(entry->order_id), entry->order_id));
+            shard->invalidations++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void order_cache_stats(OrderCache *cache, OrderCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->max_bytes = cache->max_bytes;
+    if (cache->max_bytes == 0) {
+        return;
+    }
+    for (int i = 0; i < ORDER_CACHE_SHARDS; i++) {
+        OrderCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/// @brief Invalidates the orders of all pending notifications. A notification without an
+///        order ID means that any order may have changed, e.g. after an item was renamed.
+static void handle_notifications(OrderCache *cache, PGconn *conn) {
+    PGnotify *notify;
+    int notified = 0;
+    while ((notify = PQnotifies(conn))) {
+        char *end;
+        long order_id = strtol(notify->extra, &end, 10);
+        if (end == notify->extra || *end != '\0') {
+            order_cache_clear(cache);
+            order_id = ORDER_CACHE_ALL_ORDERS;
+        } else {
+            order_cache_invalidate(cache, (int32_t)order_id);
+        }
+        if (cache->observer.changed) {
+            cache->observer.changed(cache->observer.arg, (int32_t)order_id);
+            notified = 1;
+        }
+        PQfreemem(notify);
+    }
+    if (notified) {
+        cache->observer.flush(cache->observer.arg);
+    }
+}
+
+/// @brief Receives notifications until the connection fails
+/// @param cache initialized cache
+/// @param conn connection listening on ORDER_CACHE_CHANNEL
+/// @param error address of error object to set the reason of the failure
+static void receive_notifications(OrderCache *cache, PGconn *conn, Error *error) {
+    struct pollfd pfd = { .fd = PQsocket(conn), .events = POLLIN };
+    while (1) {
+        int ready = poll(&pfd, 1, ORDER_CACHE_PING_MS);
+        if (ready < 0 && errno != EINTR) {
+            strerror_r(errno, error->msg, sizeof(error->msg));
+            return;
+        }
+        if (ready == 0) {
+            // a dead connection is only noticed when something is sent over it
+            PGresult *res = PQexec(conn, "SELECT 1");
+            int alive = PQresultStatus(res) == PGRES_TUPLES_OK;
+            PQclear(res);
+            if (!alive) {
+                error_write(error, "%s", PQerrorMessage(conn));
+                return;
+            }
+        } else if (ready > 0 && !PQconsumeInput(conn)) {
+            error_write(error, "%s", PQerrorMessage(conn));
+            return;
+        }
+        handle_notifications(cache, conn);
+    }
+}
+
+/// @brief Main loop of a listener thread
+static void *listen_loop(void *arg) {
+    OrderCacheListener *listener = arg;
+    OrderCache *cache = listener->cache;
+    while (1) {
+        Error error = {0};
+        PGconn *conn = PQconnectdb(listener->conninfo);
+        if (PQstatus(conn) != CONNECTION_OK) {
+            snprintf(error.msg, sizeof(error.msg), "%s", PQerrorMessage(conn));
+        } else if (db_listen(conn, ORDER_CACHE_CHANNEL, &error) == EXIT_SUCCESS) {
+            // changes made while nobody was listening are unknown
+            order_cache_clear(cache);
+            if (cache->observer.changed) {
+                cache->observer.changed(cache->observer.arg, ORDER_CACHE_ALL_ORDERS);
+                cache->observer.flush(cache->observer.arg);
+            }
+            if (atomic_fetch_add(&cache->enabled, 1) + 1 == cache->listeners_length) {
+                printf("DEBUG: order cache enabled\r\n");
+            }
+            receive_notifications(cache, conn, &error);
+            atomic_fetch_sub(&cache->enabled, 1);
+            order_cache_clear(cache);
+        }
+        fprintf(stderr, "WARNING: order cache disabled: %s\r\n", error.msg);
+        PQfinish(conn);
+        struct timespec delay = {
+            .tv_sec = ORDER_CACHE_RECONNECT_MS / 1000,
+            .tv_nsec = (ORDER_CACHE_RECONNECT_MS % 1000) * 1000000L
+        };
+        nanosleep(&delay, NULL);
+    }
+    return NULL;
+}
+
+void order_cache_set_observer(OrderCache *cache, const OrderCacheObserver *observer) {
+    cache->observer = *observer;
+}
+
+int order_cache_start_listener(OrderCache *cache, const char *const *conninfos, int conninfos_length, Error *error) {
+    if (cache->max_bytes == 0 && !cache->observer.changed) {
+        return EXIT_SUCCESS;
+    }
+    // the cache stays disabled until every listener is connected
+    cache->listeners_length = conninfos_length;
+    for (int i = 0; i < conninfos_length; i++) {
+        OrderCacheListener *listener = &cache->listeners[i];
+        listener->cache = cache;
+        snprintf(listener->conninfo, sizeof(listener->conninfo), "%s", conninfos[i]);
+        int result = pthread_create(&listener->thread, NULL, listen_loop, listener);
+        if (result != 0) {
+            strerror_r(result, error->msg, sizeof(error->msg));
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
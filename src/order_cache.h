@@ -0,0 +1,152 @@
+#ifndef __ORDER_CACHE_H_
+#define __ORDER_CACHE_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "config.h"
+#include "error.h"
+
+#define ORDER_CACHE_SHARDS              16                  // independently locked parts of the cache
+#define ORDER_CACHE_CACHE_LINE          64
+#define ORDER_CACHE_MIN_BUCKETS         64                  // initial hash buckets of a shard
+#define ORDER_CACHE_DEFAULT_MAX_BYTES   (64 * 1024 * 1024)
+#define ORDER_CACHE_CHANNEL             "orders_changed"    // notified by the triggers in sql/create_schema.sql
+#define ORDER_CACHE_RECONNECT_MS        1000                // delay before the listener reconnects
+#define ORDER_CACHE_PING_MS             10000               // how often an idle listener checks its connection
+#define ORDER_CACHE_ALL_ORDERS          -1                  // order ID passed to observers if any order may have changed
+
+/// @brief Receives the changes seen by the listeners of the cache, so that other parts of the
+///        server share their connections. The callbacks run on the listener threads, one per
+///        order shard, and must not block.
+typedef struct {
+    void (*changed)(void *arg, int32_t order_id);   // an order changed, ORDER_CACHE_ALL_ORDERS if any order may have changed
+    void (*flush)(void *arg);                       // all changes received so far were passed to changed
+    void *arg;                                      // argument of the callbacks
+} OrderCacheObserver;
+
+/// @brief Cached payload of an order. Entries are reference counted, so a payload can be sent
+///        while the entry is evicted or invalidated concurrently.
+typedef struct OrderCacheEntry {
+    struct OrderCacheEntry  *hash_next;     // next entry of the hash bucket
+    struct OrderCacheEntry  *lru_prev;      // more recently used entry
+    struct OrderCacheEntry  *lru_next;      // less recently used entry
+    atomic_int              refs;           // reference of the shard and of every reader
+    int32_t                 order_id;       // key of the entry
+    uint32_t                size;           // size of the payload
+    uint8_t                 payload[];      // encoded response payload
+} OrderCacheEntry;
+
+/// @brief Part of the cache with its own lock, hash table and LRU list. Every shard occupies
+///        its own cache lines, so threads working on different shards do not contend.
+typedef struct {
+    _Alignas(ORDER_CACHE_CACHE_LINE)
+    pthread_mutex_t     lock;           // protects all fields below
+    OrderCacheEntry     **buckets;      // hash table of the entries
+    size_t              buckets_length; // amount of buckets, a power of two
+    OrderCacheEntry     *lru_head;      // most recently used entry
+    OrderCacheEntry     *lru_tail;      // least recently used entry, evicted first
+    size_t              entries;        // amount of entries
+    size_t              bytes;          // memory of all entries
+    size_t              max_bytes;      // memory limit of the shard
+    uint64_t            generation;     // incremented on every invalidation, see order_cache_get()
+    uint64_t            hits;
+    uint64_t            misses;
+    uint64_t            evictions;
+    uint64_t            invalidations;
+} OrderCacheShard;
+
+struct OrderCache;
+
+/// @brief Thread receiving the notifications of one database
+typedef struct {
+    struct OrderCache   *cache;                         // cache of the listener
+    char                conninfo[CONFIG_MAX_CONNINFO];  // database of the listener
+    pthread_t           thread;                         // thread receiving notifications
+} OrderCacheListener;
+
+/// @brief Memory limited LRU cache of encoded order payloads keyed by order ID. The orders are
+///        spread over ORDER_CACHE_SHARDS shards by their hash. Listener threads keep the
+///        cache consistent with the databases of all order shards by invalidating orders on
+///        notifications of ORDER_CACHE_CHANNEL. The cache is bypassed while any listener is
+///        not connected.
+typedef struct OrderCache {
+    OrderCacheShard     shards[ORDER_CACHE_SHARDS];
+    size_t              max_bytes;                      // memory limit, 0 disables the cache
+    atomic_int          enabled;                        // amount of listeners receiving all changes
+    OrderCacheListener  listeners[CONFIG_MAX_SHARDS];   // one listener per order shard
+    int                 listeners_length;               // amount of listeners
+    OrderCacheObserver  observer;                       // receives all changes, changed is NULL without an observer
+} OrderCache;
+
+/// @brief Counters of the cache
+typedef struct {
+    uint64_t    hits;           // lookups which found the order
+    uint64_t    misses;         // lookups which did not find the order
+    uint64_t    evictions;      // entries dropped to stay below the memory limit
+    uint64_t    invalidations;  // entries dropped because the order changed
+    uint64_t    entries;        // current amount of entries
+    uint64_t    bytes;          // current memory of all entries
+    uint64_t    max_bytes;      // memory limit
+} OrderCacheStats;
+
+/// @brief Initializes an empty cache. The cache stays disabled until the listener is started.
+/// @param cache cache to initialize
+/// @param max_bytes memory limit of all entries including their bookkeeping, 0 disables the cache
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int order_cache_init(OrderCache *cache, size_t max_bytes, Error *error);
+
+/// @brief Sets the observer of the changes, must be called before the listener is started
+/// @param cache initialized cache
+/// @param observer callbacks for changed orders
+void order_cache_set_observer(OrderCache *cache, const OrderCacheObserver *observer);
+
+/// @brief Starts a thread per database which listens for changed orders. The cache is enabled
+///        as soon as all threads are connected and disabled and cleared whenever a connection
+///        is lost. The threads only run if the cache is enabled or an observer was set.
+/// @param cache initialized cache
+/// @param conninfos connection strings of the primary and the other order shards
+/// @param conninfos_length amount of connection strings, at most CONFIG_MAX_SHARDS
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int order_cache_start_listener(OrderCache *cache, const char *const *conninfos, int conninfos_length, Error *error);
+
+/// @brief Looks up an order. On a miss, the ticket has to be passed to order_cache_put(), which
+///        drops the payload if the order was invalidated after the lookup.
+/// @param cache initialized cache
+/// @param order_id ID of the order
+/// @param ticket address to save the ticket for order_cache_put()
+/// @return the entry, which must be released with order_cache_release(), or NULL on a miss
+const OrderCacheEntry *order_cache_get(OrderCache *cache, int32_t order_id, uint64_t *ticket);
+
+/// @brief Releases an entry returned by order_cache_get()
+/// @param entry entry of the cache
+void order_cache_release(const OrderCacheEntry *entry);
+
+/// @brief Adds the payload of an order after a miss. The least recently used entries are
+///        evicted if the shard exceeds its memory limit.
+/// @param cache initialized cache
+/// @param order_id ID of the order
+/// @param payload encoded payload, copied into the cache
+/// @param size size of the payload
+/// @param ticket ticket of the lookup which missed
+void order_cache_put(OrderCache *cache, int32_t order_id, const void *payload, uint32_t size, uint64_t ticket);
+
+/// @brief Drops an order after it changed
+/// @param cache initialized cache
+/// @param order_id ID of the order
+void order_cache_invalidate(OrderCache *cache, int32_t order_id);
+
+/// @brief Drops all orders
+/// @param cache initialized cache
+void order_cache_clear(OrderCache *cache);
+
+/// @brief Sums up the counters of all shards
+/// @param cache initialized cache
+/// @param stats address to save the counters
+void order_cache_stats(OrderCache *cache, OrderCacheStats *stats);
+
+#endif
@@ -0,0 +1,633 @@
+#define _GNU_SOURCE     // O_DIRECT
+#include "order_export.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libpq-fe.h>
+
+#include "database.h"
+#include "types.h"
+
+#define DICTIONARY_SLOTS    (2 * EXPORT_BLOCK_ROWS)     // open addressing, at most half full
+#define USEC_PER_DAY        86400000000LL
+#define DAYS_1970_TO_2000   10957
+
+_Static_assert(EXPORT_BUFFER_SIZE % EXPORT_DIRECT_ALIGNMENT == 0, "buffer must consist of whole blocks");
+
+/// @brief Buffered output file. With O_DIRECT only whole aligned blocks are written until the
+///        file is closed.
+typedef struct {
+    int         fd;
+    int         direct;         // the file was opened with O_DIRECT
+    uint8_t     *buffer;        // EXPORT_BUFFER_SIZE bytes aligned to EXPORT_DIRECT_ALIGNMENT
+    size_t      length;         // buffered bytes
+    uint64_t    written;        // bytes written to the file
+} ExportOutput;
+
+/// @brief Dictionary of the texts of a column within a block
+typedef struct {
+    uint32_t    slots[DICTIONARY_SLOTS];    // index + 1 of the entry, 0 if the slot is empty
+    uint32_t    *offsets;                   // start of each entry in the data
+    uint32_t    count;                      // amount of entries
+    uint8_t     *data;                      // serialized entries: uint16 length and text
+    size_t      data_length;
+    size_t      data_capacity;
+} Dictionary;
+
+/// @brief Rows of the current block of a columnar file
+typedef struct {
+    uint32_t    rows;
+    int32_t     order_id[EXPORT_BLOCK_ROWS];
+    int64_t     order_date[EXPORT_BLOCK_ROWS];
+    int32_t     order_item_id[EXPORT_BLOCK_ROWS];
+    int32_t     item_id[EXPORT_BLOCK_ROWS];
+    int32_t     quantity[EXPORT_BLOCK_ROWS];
+    int32_t     unit_price[EXPORT_BLOCK_ROWS];
+    uint32_t    status[EXPORT_BLOCK_ROWS];
+    uint32_t    item_name[EXPORT_BLOCK_ROWS];
+    Dictionary  status_dictionary;
+    Dictionary  item_name_dictionary;
+} ColumnarBlock;
+
+/// @brief Snapshot of the orders of a shard, shared by all parts of the shard
+typedef struct {
+    PGconn      *conn;              // connection whose transaction holds the snapshot
+    char        snapshot[64];       // exported snapshot, empty with a single part per shard
+    int64_t     first;              // first order date
+    int64_t     last;               // last order date, less than first without dated orders
+} ExportShard;
+
+/// @brief Time range of orders exported over one connection into one file
+typedef struct {
+    const ExportOptions *options;
+    const char  *conninfo;          // connection string of the shard of the part
+    const char  *snapshot;          // snapshot to import, NULL to use the transaction of conn
+    PGconn      *conn;              // connection of the part, opened by the part if NULL
+    char        path[4096];         // output file
+    int64_t     from;               // first order date of the range
+    int64_t     to;                 // order date after the range
+    int         include_undated;    // also export orders without date
+    ExportOutput output;
+    ColumnarBlock *block;           // current block of a columnar file
+    ExportStats stats;
+    Error       error;
+    pthread_t   thread;
+} ExportPart;
+
+/// @brief Writes the whole buffer to the file
+/// @return EXIT_SUCCESS on success
+static int write_all(int fd, const uint8_t *data, size_t size, Error *error) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_from_errno(error, errno);
+            return EXIT_FAILURE;
+        }
+        data += n;
+        size -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Opens the output file. O_DIRECT falls back to buffered writes if the file system
+///        does not support it.
+/// @return EXIT_SUCCESS on success
+static int output_open(ExportOutput *output, const char *path, int direct, Error *error) {
+    memset(output, 0, sizeof(*output));
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    output->fd = direct ? open(path, flags | O_DIRECT, 0644) : -1;
+    output->direct = output->fd >= 0;
+    if (direct && !output->direct) {
+        fprintf(stderr, "WARNING: O_DIRECT not supported for %s, writing buffered\r\n", path);
+    }
+    if (output->fd < 0) {
+        output->fd = open(path, flags, 0644);
+    }
+    if (output->fd < 0) {
+        char errmsg[256];
+        error_write(error, "cannot open %.200s: %s", path, strerror_r(errno, errmsg, sizeof(errmsg)));
+        return EXIT_FAILURE;
+    }
+    output->buffer = aligned_alloc(EXPORT_DIRECT_ALIGNMENT, EXPORT_BUFFER_SIZE);
+    if (!output->buffer) {
+        close(output->fd);
+        error_write(error, "cannot allocate %d bytes output buffer", EXPORT_BUFFER_SIZE);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Writes the buffered data. With O_DIRECT an unaligned rest stays in the buffer.
+/// @return EXIT_SUCCESS on success
+static int output_flush(ExportOutput *output, Error *error) {
+    size_t size = output->direct ? output->length / EXPORT_DIRECT_ALIGNMENT * EXPORT_DIRECT_ALIGNMENT : output->length;
+    if (write_all(output->fd, output->buffer, size, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    memmove(output->buffer, output->buffer + size, output->length - size);
+    output->length -= size;
+    output->written += size;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Makes room for size bytes in the buffer, size must not exceed half of the buffer
+/// @return start of the free space or NULL on failure
+static uint8_t *output_reserve(ExportOutput *output, size_t size, Error *error) {
+    if (EXPORT_BUFFER_SIZE - output->length < size && output_flush(output, error) != EXIT_SUCCESS) {
+        return NULL;
+    }
+    return output->buffer + output->length;
+}
+
+/// @brief Appends data of any size to the output
+/// @return EXIT_SUCCESS on success
+static int output_append(ExportOutput *output, const void *data, size_t size, Error *error) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        if (output->length == EXPORT_BUFFER_SIZE && output_flush(output, error) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        size_t chunk = EXPORT_BUFFER_SIZE - output->length;
+        chunk = chunk < size ? chunk : size;
+        memcpy(output->buffer + output->length, bytes, chunk);
+        output->length += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Writes the rest of the buffer and closes the file
+/// @return EXIT_SUCCESS on success
+static int output_close(ExportOutput *output, Error *error) {
+    int result = output_flush(output, error);
+    if (result == EXIT_SUCCESS && output->length > 0) {
+        // the unaligned tail of the file is written without O_DIRECT
+        int flags = fcntl(output->fd, F_GETFL);
+        if (flags < 0 || fcntl(output->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            error_from_errno(error, errno);
+            result = EXIT_FAILURE;
+        } else {
+            output->direct = 0;
+            result = output_flush(output, error);
+        }
+    }
+    if (close(output->fd) < 0 && result == EXIT_SUCCESS) {
+        error_from_errno(error, errno);
+        result = EXIT_FAILURE;
+    }
+    free(output->buffer);
+    output->buffer = NULL;
+    return result;
+}
+
+/// @brief Formats an unsigned number
+/// @return end of the formatted number
+static char *format_uint(char *out, uint64_t value) {
+    char digits[20];
+    int length = 0;
+    do {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    while (length > 0) {
+        *out++ = digits[--length];
+    }
+    return out;
+}
+
+/// @brief Formats a signed number
+/// @return end of the formatted number
+static char *format_int(char *out, int64_t value) {
+    if (value < 0) {
+        *out++ = '-';
+        return format_uint(out, -(uint64_t)value);
+    }
+    return format_uint(out, value);
+}
+
+/// @brief Formats a number with leading zeros
+/// @return end of the formatted number
+static char *format_padded(char *out, uint32_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = '0' + value % 10;
+        value /= 10;
+    }
+    return out + width;
+}
+
+/// @brief Formats an order date as "YYYY-MM-DD HH:MM:SS.ffffff", see ExportOrderLine.order_date
+/// @return end of the formatted date
+static char *format_date(char *out, int64_t usec) {
+    int64_t days = usec / USEC_PER_DAY;
+    int64_t time = usec % USEC_PER_DAY;
+    if (time < 0) {
+        time += USEC_PER_DAY;
+        days--;
+    }
+    // civil date from days since 1970-01-01, proleptic Gregorian calendar
+    days += DAYS_1970_TO_2000 + 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t mp = (5 * day_of_year + 2) / 153;
+    uint32_t day = day_of_year - (153 * mp + 2) / 5 + 1;
+    uint32_t month = mp < 10 ? mp + 3 : mp - 9;
+    int64_t year = year_of_era + era * 400 + (month <= 2);
+
+    out = format_padded(out, year, 4);
+    *out++ = '-';
+    out = format_padded(out, month, 2);
+    *out++ = '-';
+    out = format_padded(out, day, 2);
+    *out++ = ' ';
+    out = format_padded(out, time / 3600000000LL, 2);
+    *out++ = ':';
+    out = format_padded(out, time / 60000000LL % 60, 2);
+    *out++ = ':';
+    out = format_padded(out, time / 1000000LL % 60, 2);
+    *out++ = '.';
+    return format_padded(out, time % 1000000LL, 6);
+}
+
+/// @brief Formats a text field, quoted if it contains a separator, quote or line break
+/// @return end of the formatted text
+static char *format_text(char *out, const char *text, uint32_t length) {
+    if (!memchr(text, ',', length) && !memchr(text, '"', length)
+            && !memchr(text, '\n', length) && !memchr(text, '\r', length)) {
+        memcpy(out, text, length);
+        return out + length;
+    }
+    *out++ = '"';
+    for (uint32_t i = 0; i < length; i++) {
+        if (text[i] == '"') {
+            *out++ = '"';
+        }
+        *out++ = text[i];
+    }
+    *out++ = '"';
+    return out;
+}
+
+/// @brief Appends an order line to a CSV file
+/// @return EXIT_SUCCESS on success
+static int csv_write_line(ExportPart *part, const ExportOrderLine *line) {
+    Error *error = &part->error;
+    // 6 numbers, a date, separators and both texts with every character quoted
+    size_t max_size = 6 * 11 + 26 + 8 + 2 * ((size_t)line->status_length + line->item_name_length) + 4;
+    if (max_size > EXPORT_BUFFER_SIZE / 2) {
+        error_write(error, "order line %d too large", line->order_item_id);
+        return EXIT_FAILURE;
+    }
+    char *start = (char *)output_reserve(&part->output, max_size, error);
+    if (!start) {
+        return EXIT_FAILURE;
+    }
+    char *out = format_int(start, line->order_id);
+    *out++ = ',';
+    if (line->order_date != ORDER_DATE_NULL) {
+        out = format_date(out, line->order_date);
+    }
+    *out++ = ',';
+    out = format_text(out, line->status, line->status_length);
+    *out++ = ',';
+    out = format_int(out, line->order_item_id);
+    *out++ = ',';
+    out = format_int(out, line->item_id);
+    *out++ = ',';
+    out = format_text(out, line->item_name, line->item_name_length);
+    *out++ = ',';
+    out = format_int(out, line->quantity);
+    *out++ = ',';
+    out = format_int(out, line->unit_price);
+    *out++ = '\n';
+    part->output.length += out - start;
+    return EXIT_SUCCESS;
+}
+
+/// @brief FNV-1a hash of a text
+static uint32_t hash_text(const char *text, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/// @brief Returns the index of a text in the dictionary, adds it if it is new
+/// @param dictionary dictionary of the current block
+/// @param text text of the row
+/// @param length length of the text, truncated to 65535 bytes
+/// @param index address to save the index
+/// @return EXIT_SUCCESS on success
+static int dictionary_add(Dictionary *dictionary, const char *text, uint32_t length, uint32_t *index) {
+    length = length > UINT16_MAX ? UINT16_MAX : length;
+    uint32_t slot = hash_text(text, length) % DICTIONARY_SLOTS;
+    while (dictionary->slots[slot] != 0) {
+        uint32_t entry = dictionary->slots[slot] - 1;
+        const uint8_t *data = dictionary->data + dictionary->offsets[entry];
+        uint16_t entry_length;
+        memcpy(&entry_length, data, sizeof(entry_length));
+        if (entry_length == length && memcmp(data + sizeof(entry_length), text, length) == 0) {
+            *index = entry;
+            return EXIT_SUCCESS;
+        }
+        slot = (slot + 1) % DICTIONARY_SLOTS;
+    }
+
+    size_t required = dictionary->data_length + sizeof(uint16_t) + length;
+    if (required > dictionary->data_capacity) {
+        size_t capacity = dictionary->data_capacity ? dictionary->data_capacity * 2 : 64 * 1024;
+        while (capacity < required) {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(dictionary->data, capacity);
+        if (!data) {
+            return EXIT_FAILURE;
+        }
+        dictionary->data = data;
+        dictionary->data_capacity = capacity;
+    }
+    uint16_t entry_length = length;
+    dictionary->offsets[dictionary->count] = dictionary->data_length;
+    memcpy(dictionary->data + dictionary->data_length, &entry_length, sizeof(entry_length));
+    memcpy(dictionary->data + dictionary->data_length + sizeof(entry_length), text, length);
+    dictionary->data_length = required;
+    dictionary->slots[slot] = dictionary->count + 1;
+    *index = dictionary->count++;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Empties the dictionary for the next block
+static void dictionary_clear(Dictionary *dictionary) {
+    memset(dictionary->slots, 0, sizeof(dictionary->slots));
+    dictionary->count = 0;
+    dictionary->data_length = 0;
+}
+
+/// @brief Writes the current block of a columnar file
+/// @return EXIT_SUCCESS on success
+static int columnar_flush_block(ExportPart *part) {
+    ColumnarBlock *block = part->block;
+    if (block->rows == 0) {
+        return EXIT_SUCCESS;
+    }
+    size_t rows = block->rows;
+    ColumnarBlockHeader header = {
+        .magic = EXPORT_BLOCK_MAGIC,
+        .rows = block->rows,
+        .status_count = block->status_dictionary.count,
+        .item_name_count = block->item_name_dictionary.count,
+        .size = rows * (7 * sizeof(int32_t) + sizeof(int64_t))
+                + block->status_dictionary.data_length + block->item_name_dictionary.data_length
+    };
+    ExportOutput *output = &part->output;
+    Error *error = &part->error;
+    if (output_append(output, &header, sizeof(header), error) != EXIT_SUCCESS
+            || output_append(output, block->order_id, rows * sizeof(int32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->order_date, rows * sizeof(int64_t), error) != EXIT_SUCCESS
+            || output_append(output, block->order_item_id, rows * sizeof(int32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->item_id, rows * sizeof(int32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->quantity, rows * sizeof(int32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->unit_price, rows * sizeof(int32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->status, rows * sizeof(uint32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->item_name, rows * sizeof(uint32_t), error) != EXIT_SUCCESS
+            || output_append(output, block->status_dictionary.data, block->status_dictionary.data_length, error) != EXIT_SUCCESS
+            || output_append(output, block->item_name_dictionary.data, block->item_name_dictionary.data_length, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    block->rows = 0;
+    dictionary_clear(&block->status_dictionary);
+    dictionary_clear(&block->item_name_dictionary);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Adds an order line to the current block of a columnar file
+/// @return EXIT_SUCCESS on success
+static int columnar_write_line(ExportPart *part, const ExportOrderLine *line) {
+    Error *error = &part->error;
+    ColumnarBlock *block = part->block;
+    uint32_t row = block->rows;
+    if (dictionary_add(&block->status_dictionary, line->status, line->status_length, &block->status[row]) != EXIT_SUCCESS
+            || dictionary_add(&block->item_name_dictionary, line->item_name, line->item_name_length, &block->item_name[row]) != EXIT_SUCCESS) {
+        error_write(error, "%s", "cannot grow dictionary");
+        return EXIT_FAILURE;
+    }
+    block->order_id[row] = line->order_id;
+    block->order_date[row] = line->order_date;
+    block->order_item_id[row] = line->order_item_id;
+    block->item_id[row] = line->item_id;
+    block->quantity[row] = line->quantity;
+    block->unit_price[row] = line->unit_price;
+    if (++block->rows == EXPORT_BLOCK_ROWS) {
+        return columnar_flush_block(part);
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Writes a decoded order line into the file of the part, see db_copy_order_lines
+static int export_line(void *ctx, const ExportOrderLine *line) {
+    ExportPart *part = ctx;
+    part->stats.lines++;
+    if (part->options->format == EXPORT_CSV) {
+        return csv_write_line(part, line);
+    }
+    return columnar_write_line(part, line);
+}
+
+/// @brief Releases the columnar block of a part
+static void free_block(ColumnarBlock *block) {
+    if (block) {
+        free(block->status_dictionary.offsets);
+        free(block->status_dictionary.data);
+        free(block->item_name_dictionary.offsets);
+        free(block->item_name_dictionary.data);
+        free(block);
+    }
+}
+
+/// @brief Opens the output of a part and writes the file header
+/// @return EXIT_SUCCESS on success
+static int open_part(ExportPart *part) {
+    Error *error = &part->error;
+    if (part->options->format == EXPORT_COLUMNAR) {
+        part->block = calloc(1, sizeof(ColumnarBlock));
+        if (!part->block
+                || !(part->block->status_dictionary.offsets = malloc(EXPORT_BLOCK_ROWS * sizeof(uint32_t)))
+                || !(part->block->item_name_dictionary.offsets = malloc(EXPORT_BLOCK_ROWS * sizeof(uint32_t)))) {
+            error_write(error, "%s", "cannot allocate columnar block");
+            return EXIT_FAILURE;
+        }
+    }
+    if (output_open(&part->output, part->path, part->options->direct, &part->error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (part->options->format == EXPORT_CSV) {
+        static const char header[] = "order_id,order_date,order_status,order_item_id,item_id,item_name,quantity,unit_price\n";
+        return output_append(&part->output, header, sizeof(header) - 1, &part->error);
+    }
+    ColumnarFileHeader header = { .version = EXPORT_COLUMNAR_VERSION, .block_rows = EXPORT_BLOCK_ROWS };
+    memcpy(header.magic, EXPORT_COLUMNAR_MAGIC, sizeof(header.magic));
+    return output_append(&part->output, &header, sizeof(header), &part->error);
+}
+
+/// @brief Exports the time range of a part into its file. Parts with their own connection
+///        join the snapshot of the first connection.
+/// @param arg part to export
+/// @return NULL, the result is stored in part->error
+static void *export_part(void *arg) {
+    ExportPart *part = arg;
+    Error *error = &part->error;
+    int own_conn = part->conn == NULL;
+    if (own_conn) {
+        part->conn = PQconnectdb(part->conninfo);
+        if (PQstatus(part->conn) != CONNECTION_OK) {
+            error_write(error, "%s", PQerrorMessage(part->conn));
+            PQfinish(part->conn);
+            part->conn = NULL;
+            return NULL;
+        }
+        if (db_begin_snapshot_transaction(part->conn, &part->error) != EXIT_SUCCESS
+                || db_import_snapshot(part->conn, part->snapshot, &part->error) != EXIT_SUCCESS) {
+            PQfinish(part->conn);
+            part->conn = NULL;
+            return NULL;
+        }
+    }
+    int result = open_part(part);
+    int opened = part->output.buffer != NULL;
+    if (result == EXIT_SUCCESS) {
+        result = db_copy_order_lines(part->conn, part->from, part->to, part->include_undated,
+                export_line, part, &part->error);
+    }
+    if (result == EXIT_SUCCESS && part->block) {
+        result = columnar_flush_block(part);
+    }
+    if (opened) {
+        Error close_error = {0};
+        if (output_close(&part->output, &close_error) != EXIT_SUCCESS && result == EXIT_SUCCESS) {
+            part->error = close_error;
+        }
+        part->stats.bytes = part->output.written;
+    }
+    free_block(part->block);
+    part->block = NULL;
+    if (own_conn) {
+        PQfinish(part->conn);
+        part->conn = NULL;
+    }
+    return NULL;
+}
+
+/// @brief Opens the snapshot of a shard and reads the range of its order dates
+/// @param shard shard to initialize
+/// @param conninfo connection string of the shard
+/// @param parts amount of parts of the shard
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success, shard->conn has to be closed in any case
+static int open_shard(ExportShard *shard, const char *conninfo, int parts, Error *error) {
+    shard->conn = PQconnectdb(conninfo);
+    if (PQstatus(shard->conn) != CONNECTION_OK) {
+        error_write(error, "%s", PQerrorMessage(shard->conn));
+        return EXIT_FAILURE;
+    }
+    if (db_begin_snapshot_transaction(shard->conn, error) != EXIT_SUCCESS
+            || (parts > 1 && db_export_snapshot(shard->conn, shard->snapshot, sizeof(shard->snapshot), error) != EXIT_SUCCESS)
+            || db_get_order_date_range(shard->conn, &shard->first, &shard->last, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int export_orders(const ExportOptions *options, ExportStats *stats, Error *error) {
+    if (options->parts < 1 || options->parts > EXPORT_MAX_PARTS) {
+        error_write(error, "invalid amount of parts %d, expected 1 to %d", options->parts, EXPORT_MAX_PARTS);
+        return EXIT_FAILURE;
+    }
+    if (options->shards < 1 || options->shards > EXPORT_MAX_SHARDS) {
+        error_write(error, "invalid amount of shards %d, expected 1 to %d", options->shards, EXPORT_MAX_SHARDS);
+        return EXIT_FAILURE;
+    }
+    ExportShard shards[EXPORT_MAX_SHARDS] = {0};
+    ExportPart *parts = calloc((size_t)options->shards * options->parts, sizeof(ExportPart));
+    if (!parts) {
+        error_write(error, "%s", "cannot allocate export parts");
+        return EXIT_FAILURE;
+    }
+    int result = EXIT_SUCCESS;
+    int parts_length = 0;
+    for (int s = 0; s < options->shards && result == EXIT_SUCCESS; s++) {
+        ExportShard *shard = &shards[s];
+        Error shard_error = {0};
+        if (open_shard(shard, options->conninfos[s], options->parts, &shard_error) != EXIT_SUCCESS) {
+            error_write(error, "shard %d: %.480s", s, shard_error.msg);
+            result = EXIT_FAILURE;
+            break;
+        }
+        int shard_parts = options->parts;
+        if (shard->first > shard->last) {
+            // no dated orders, a single part exports the orders without date
+            shard->first = 0;
+            shard->last = 0;
+            shard_parts = 1;
+        }
+        int64_t span = shard->last - shard->first + 1;
+        // the first part of the shard runs within the transaction which exported the snapshot
+        parts[parts_length].conn = shard->conn;
+        for (int i = 0; i < shard_parts; i++) {
+            ExportPart *part = &parts[parts_length];
+            part->options = options;
+            part->conninfo = options->conninfos[s];
+            part->snapshot = shard->snapshot;
+            part->from = shard->first + span * i / shard_parts;
+            part->to = shard->first + span * (i + 1) / shard_parts;
+            part->include_undated = i == 0;
+            if (options->parts == 1 && options->shards == 1) {
+                snprintf(part->path, sizeof(part->path), "%s", options->path);
+            } else {
+                snprintf(part->path, sizeof(part->path), "%s.%d", options->path, parts_length);
+            }
+            parts_length++;
+        }
+    }
+
+    if (result == EXIT_SUCCESS) {
+        // the first part runs on this thread
+        int started = 1;
+        for (; started < parts_length; started++) {
+            int create_result = pthread_create(&parts[started].thread, NULL, export_part, &parts[started]);
+            if (create_result != 0) {
+                error_from_errno(&parts[started].error, create_result);
+                break;
+            }
+        }
+        export_part(&parts[0]);
+        for (int i = 1; i < started; i++) {
+            pthread_join(parts[i].thread, NULL);
+        }
+    }
+    for (int s = 0; s < options->shards; s++) {
+        PQfinish(shards[s].conn);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < parts_length; i++) {
+        stats->lines += parts[i].stats.lines;
+        stats->bytes += parts[i].stats.bytes;
+        if (parts[i].error.msg[0] && result == EXIT_SUCCESS) {
+            error_write(error, "part %d: %.480s", i, parts[i].error.msg);
+            result = EXIT_FAILURE;
+        }
+    }
+    free(parts);
+    return result;
+}
@@ -0,0 +1,72 @@
+#ifndef __ORDER_EXPORT_H_
+#define __ORDER_EXPORT_H_
+
+#include <inttypes.h>
+
+#include "error.h"
+
+#define EXPORT_BUFFER_SIZE          (8 * 1024 * 1024)   // output buffer of every part
+#define EXPORT_DIRECT_ALIGNMENT     4096                // block size for O_DIRECT writes
+#define EXPORT_MAX_PARTS            64
+#define EXPORT_MAX_SHARDS           16                  // order shards, see CONFIG_MAX_SHARDS
+#define EXPORT_BLOCK_ROWS           65536               // rows per block of a columnar file
+#define EXPORT_COLUMNAR_MAGIC       "ORDERCOL"
+#define EXPORT_COLUMNAR_VERSION     1
+#define EXPORT_BLOCK_MAGIC          0x4b4c424f          // "OBLK" in little endian
+
+typedef enum {
+    EXPORT_CSV,         // RFC 4180 CSV with a header line
+    EXPORT_COLUMNAR,    // blocks of column arrays, see ColumnarFileHeader
+} ExportFormat;
+
+/// @brief Header of a columnar export file, followed by blocks of up to EXPORT_BLOCK_ROWS rows.
+///        All numbers are little endian. A block consists of a ColumnarBlockHeader followed by
+///        the columns of all rows of the block:
+///          int32 order_id[rows], int64 order_date[rows] (microseconds since 2000-01-01,
+///          INT64_MIN if unknown), int32 order_item_id[rows], int32 item_id[rows],
+///          int32 quantity[rows], int32 unit_price[rows], uint32 status[rows],
+///          uint32 item_name[rows], the status dictionary and the item name dictionary.
+///        Text columns are indexes into the dictionaries of their block. A dictionary is a
+///        sequence of entries with a uint16 length followed by the text without terminator.
+typedef struct {
+    char        magic[8];       // EXPORT_COLUMNAR_MAGIC without terminator
+    uint32_t    version;        // EXPORT_COLUMNAR_VERSION
+    uint32_t    block_rows;     // maximum rows per block
+} ColumnarFileHeader;
+
+/// @brief Header of a block of a columnar export file
+typedef struct {
+    uint32_t    magic;          // EXPORT_BLOCK_MAGIC
+    uint32_t    rows;           // rows of the block
+    uint32_t    status_count;   // entries of the status dictionary
+    uint32_t    item_name_count;// entries of the item name dictionary
+    uint64_t    size;           // size of the block without this header
+} ColumnarBlockHeader;
+
+typedef struct {
+    const char      *conninfos[EXPORT_MAX_SHARDS];  // connection strings of all order shards
+    int             shards;     // amount of order shards
+    const char      *path;      // output file, parts are written to "<path>.<part>"
+    ExportFormat    format;     // format of the output
+    int             direct;     // write with O_DIRECT, bypassing the page cache
+    int             parts;      // parallel connections per shard, each exports a time range
+} ExportOptions;
+
+typedef struct {
+    uint64_t    lines;          // exported order lines
+    uint64_t    bytes;          // written bytes
+} ExportStats;
+
+/// @brief Exports all order lines with binary COPY into a CSV or columnar file. With more
+///        than one part, the range of order dates is split evenly and every part is exported
+///        over its own connection into its own file. All parts of a shard see the same
+///        snapshot of the shard. Every shard is exported into its own parts, which are numbered
+///        across all shards, so with several shards even a single part per shard goes to
+///        "<path>.<part>". Lines are not sorted.
+/// @param options export settings
+/// @param stats address to save the amount of exported lines and bytes
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int export_orders(const ExportOptions *options, ExportStats *stats, Error *error);
+
+#endif
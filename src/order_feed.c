@@ -0,0 +1,563 @@
+#include "order_feed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <libpq-fe.h>
+
+#include "api.h"
+#include "compression.h"
+#include "database.h"
+#include "order_cache.h"
+
+#define ORDER_FEED_RECONNECT_MS 1000    // delay before the feed thread reconnects after a failure
+
+/// @brief Order items read for a chunk of changed orders
+typedef struct {
+    FullOrderItem   *items;
+    int             length;
+    int             capacity;
+} FeedRows;
+
+static void release_update(OrderFeedUpdate *update) {
+    if (atomic_fetch_sub(&update->refs, 1) == 1) {
+        free(update);
+    }
+}
+
+static void release_queue(OrderFeedUpdate **queue, int length) {
+    for (int i = 0; i < length; i++) {
+        release_update(queue[i]);
+    }
+}
+
+/// @brief Calculates the first index entry probed for an order
+/// @param subscriber subscriber of the feed
+/// @param order_id ID of the order
+/// @return position in the index
+static uint32_t index_home(const OrderFeedSubscriber *subscriber, int32_t order_id) {
+    uint32_t hash = (uint32_t)order_id * 0x9e3779b1U;
+    return (hash ^ (hash >> 16)) & subscriber->index_mask;
+}
+
+/// @brief Finds the index entry of an order, the subscriber lock must be held
+/// @param subscriber subscriber of the feed
+/// @param order_id ID of the order
+/// @return entry of the order or the free entry where it belongs
+static OrderFeedIndexEntry *index_lookup(OrderFeedSubscriber *subscriber, int32_t order_id) {
+    uint32_t i = index_home(subscriber, order_id);
+    // the index has twice as many entries as the queue, so a free entry is always found
+    while (subscriber->index[i].slot >= 0 && subscriber->index[i].order_id != order_id) {
+        i = (i + 1) & subscriber->index_mask;
+    }
+    return &subscriber->index[i];
+}
+
+/// @brief Removes an order from the index, the subscriber lock must be held
+/// @param subscriber subscriber of the feed
+/// @param order_id ID of a queued order
+static void index_remove(OrderFeedSubscriber *subscriber, int32_t order_id) {
+    OrderFeedIndexEntry *entry = index_lookup(subscriber, order_id);
+    uint32_t hole = entry - subscriber->index;
+    subscriber->index[hole].slot = -1;
+    // moves the following entries of the probe sequence into the hole, so lookups do not stop early
+    for (uint32_t i = (hole + 1) & subscriber->index_mask; subscriber->index[i].slot >= 0; i = (i + 1) & subscriber->index_mask) {
+        uint32_t home = index_home(subscriber, subscriber->index[i].order_id);
+        if (((i - home) & subscriber->index_mask) >= ((i - hole) & subscriber->index_mask)) {
+            subscriber->index[hole] = subscriber->index[i];
+            subscriber->index[i].slot = -1;
+            hole = i;
+        }
+    }
+}
+
+/// @brief Releases all queued updates of a subscriber, the subscriber lock must be held
+/// @param subscriber subscriber of the feed
+static void clear_queue(OrderFeedSubscriber *subscriber) {
+    int capacity = subscriber->feed->queue_length;
+    for (int i = 0; i < subscriber->queue_length; i++) {
+        OrderFeedUpdate *update = subscriber->queue[(subscriber->queue_head + i) % capacity];
+        index_remove(subscriber, update->order_id);
+        release_update(update);
+    }
+    subscriber->queue_head = 0;
+    subscriber->queue_length = 0;
+}
+
+/// @brief Adds an order item to the rows of a chunk, see db_get_order_items_by_ids()
+static int collect_row(void *ctx, const FullOrderItem *item) {
+    FeedRows *rows = ctx;
+    if (rows->length == rows->capacity) {
+        int capacity = rows->capacity > 0 ? rows->capacity * 2 : ORDER_FEED_QUERY_ORDERS;
+        FullOrderItem *items = realloc(rows->items, capacity * sizeof(*items));
+        if (!items) {
+            return EXIT_FAILURE;
+        }
+        rows->items = items;
+        rows->capacity = capacity;
+    }
+    rows->items[rows->length++] = *item;
+    return EXIT_SUCCESS;
+}
+
+/// @brief Creates the update of an order from its items
+/// @param order_id ID of the order
+/// @param items items of the order, NULL if the order has no items
+/// @param item_count amount of items, at most MAX_ORDER_ITEMS are sent
+/// @return update with a single reference or NULL if out of memory
+static OrderFeedUpdate *create_update(int32_t order_id, const FullOrderItem *items, int item_count) {
+    if (item_count > MAX_ORDER_ITEMS) {
+        item_count = MAX_ORDER_ITEMS;
+    }
+    uint32_t size = sizeof(OrderDelta) + item_count * sizeof(FullOrderItem);
+    OrderFeedUpdate *update = malloc(sizeof(OrderFeedUpdate) + size);
+    if (!update) {
+        return NULL;
+    }
+    atomic_init(&update->refs, 1);
+    update->order_id = order_id;
+    update->size = size;
+    OrderDelta delta = { .order_id = order_id, .item_count = item_count };
+    memcpy(update->payload, &delta, sizeof(delta));
+    if (item_count > 0) {
+        memcpy(update->payload + sizeof(delta), items, item_count * sizeof(FullOrderItem));
+    }
+    return update;
+}
+
+/// @brief Sends the updates of a subscriber in a single frame
+/// @param subscriber subscriber whose updates were taken from the queue
+/// @param updates amount of updates in subscriber->sending
+/// @param resync tell the client to reload all orders
+/// @return EXIT_SUCCESS on success
+static int send_updates(OrderFeedSubscriber *subscriber, int updates, int resync) {
+    uint32_t size = sizeof(OrdersDeltaResponse);
+    for (int i = 0; i < updates; i++) {
+        size += subscriber->sending[i]->size;
+    }
+    uint8_t *payload = malloc(size);
+    if (!payload) {
+        fprintf(stderr, "ERROR: cannot allocate %u bytes for changed orders\r\n", size);
+        return EXIT_FAILURE;
+    }
+    OrdersDeltaResponse response = { .flags = resync ? ORDERS_DELTA_RESYNC : 0, .order_count = updates };
+    memcpy(payload, &response, sizeof(response));
+    uint32_t offset = sizeof(response);
+    for (int i = 0; i < updates; i++) {
+        memcpy(payload + offset, subscriber->sending[i]->payload, subscriber->sending[i]->size);
+        offset += subscriber->sending[i]->size;
+    }
+
+    FrameHeader header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = RESPONSE_ORDERS_DELTA,
+        .payload_size = size,
+        .flags = 0
+    };
+    const uint8_t *data = payload;
+    if (subscriber->compress && size >= COMPRESSION_THRESHOLD) {
+        Error error = {0};
+        const uint8_t *compressed;
+        uint32_t compressed_size;
+        if (compression_compress(payload, size, &compressed, &compressed_size, &error) != EXIT_SUCCESS) {
+            fprintf(stderr, "WARNING: sending uncompressed changed orders: %s\r\n", error.msg);
+        } else if (compressed_size < size) {
+            data = compressed;
+            header.payload_size = compressed_size;
+            header.flags |= HEADER_FLAG_COMPRESSED;
+        }
+    }
+    int result = connection_send_frame(subscriber->client, &header, data);
+    if (result != EXIT_SUCCESS) {
+        char errmsg[512];
+        strerror_r(errno, errmsg, sizeof(errmsg));
+        fprintf(stderr, "ERROR: cannot send changed orders: %s\r\n", errmsg);
+    }
+    free(payload);
+    return result;
+}
+
+/// @brief Sends the queued updates of a subscriber until its queue is empty, see Task
+static void run_subscriber(Task *task) {
+    OrderFeedSubscriber *subscriber = (OrderFeedSubscriber *)task;
+    pthread_mutex_lock(&subscriber->lock);
+    while (!subscriber->failed && (subscriber->queue_length > 0 || subscriber->resync)) {
+        // as many updates as fit into one frame, the updates queued meanwhile follow in the next one
+        uint32_t size = sizeof(OrdersDeltaResponse);
+        int updates = 0;
+        while (updates < subscriber->queue_length) {
+            OrderFeedUpdate *update = subscriber->queue[subscriber->queue_head];
+            if (size + update->size > MAX_PAYLOAD_SIZE) {
+                break;
+            }
+            size += update->size;
+            subscriber->sending[updates++] = update;
+            index_remove(subscriber, update->order_id);
+            subscriber->queue_head = (subscriber->queue_head + 1) % subscriber->feed->queue_length;
+            subscriber->queue_length--;
+        }
+        int resync = subscriber->resync;
+        subscriber->resync = 0;
+        pthread_mutex_unlock(&subscriber->lock);
+
+        int result = send_updates(subscriber, updates, resync);
+        release_queue(subscriber->sending, updates);
+
+        pthread_mutex_lock(&subscriber->lock);
+        if (result == EXIT_SUCCESS) {
+            atomic_fetch_add(&subscriber->feed->updates, updates);
+        } else if (!subscriber->failed) {
+            // the I/O thread notices the shutdown and closes the connection
+            subscriber->failed = 1;
+            shutdown(subscriber->client->fd, SHUT_RDWR);
+        }
+    }
+    clear_queue(subscriber);
+    subscriber->scheduled = 0;
+    pthread_cond_broadcast(&subscriber->idle);
+    pthread_mutex_unlock(&subscriber->lock);
+}
+
+/// @brief Queues an update for a subscriber and starts its task, the feed lock must be held
+/// @param subscriber subscriber of the feed
+/// @param update update of a changed order, NULL to tell the client to reload all orders
+static void push_update(OrderFeedSubscriber *subscriber, OrderFeedUpdate *update) {
+    OrderFeed *feed = subscriber->feed;
+    pthread_mutex_lock(&subscriber->lock);
+    if (subscriber->failed) {
+        pthread_mutex_unlock(&subscriber->lock);
+        return;
+    }
+    if (subscriber->resync) {
+        // the client reloads all orders after the next frame anyway
+    } else if (update) {
+        OrderFeedIndexEntry *entry = index_lookup(subscriber, update->order_id);
+        if (entry->slot >= 0) {
+            release_update(subscriber->queue[entry->slot]);
+            subscriber->queue[entry->slot] = update;
+            atomic_fetch_add(&update->refs, 1);
+            atomic_fetch_add(&feed->coalesced, 1);
+        } else if (subscriber->queue_length < feed->queue_length) {
+            int slot = (subscriber->queue_head + subscriber->queue_length++) % feed->queue_length;
+            subscriber->queue[slot] = update;
+            entry->order_id = update->order_id;
+            entry->slot = slot;
+            atomic_fetch_add(&update->refs, 1);
+        } else {
+            update = NULL;
+        }
+    }
+    if (!update && !subscriber->resync) {
+        // the subscriber fell too far behind, a reload replaces all queued updates
+        clear_queue(subscriber);
+        subscriber->resync = 1;
+        atomic_fetch_add(&feed->resyncs, 1);
+    }
+    if (!subscriber->scheduled) {
+        subscriber->scheduled = 1;
+        executor_submit(feed->executor, &subscriber->task);
+    }
+    pthread_mutex_unlock(&subscriber->lock);
+}
+
+/// @brief Queues updates for all subscribers
+/// @param feed started feed
+/// @param updates updates of changed orders, NULL to tell the clients to reload all orders
+/// @param updates_length amount of updates
+static void publish_updates(OrderFeed *feed, OrderFeedUpdate **updates, int updates_length) {
+    pthread_mutex_lock(&feed->lock);
+    for (OrderFeedSubscriber *subscriber = feed->subscribers; subscriber; subscriber = subscriber->next) {
+        if (!updates) {
+            push_update(subscriber, NULL);
+        }
+        for (int i = 0; updates && i < updates_length; i++) {
+            push_update(subscriber, updates[i]);
+        }
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+static int compare_order_ids(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/// @brief Reads a chunk of changed orders and queues them for all subscribers
+/// @param feed started feed
+/// @param conn connection to the database
+/// @param order_ids sorted IDs of changed orders without duplicates
+/// @param order_ids_length amount of orders, at most ORDER_FEED_QUERY_ORDERS
+/// @param rows buffer for the order items
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int publish_orders(OrderFeed *feed, PGconn *conn, const int32_t *order_ids, int order_ids_length, FeedRows *rows, Error *error) {
+    rows->length = 0;
+    if (db_get_order_items_by_ids(conn, order_ids, order_ids_length, collect_row, rows, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    OrderFeedUpdate *updates[ORDER_FEED_QUERY_ORDERS];
+    int updates_length = 0;
+    int row = 0;
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < order_ids_length; i++) {
+        // the rows are ordered by order ID, orders without rows were deleted
+        int first = row;
+        while (row < rows->length && rows->items[row].order.id == order_ids[i]) {
+            row++;
+        }
+        OrderFeedUpdate *update = create_update(order_ids[i], row > first ? &rows->items[first] : NULL, row - first);
+        if (!update) {
+            error_write(error, "cannot allocate the update of order %d", order_ids[i]);
+            result = EXIT_FAILURE;
+            break;
+        }
+        updates[updates_length++] = update;
+    }
+    if (result == EXIT_SUCCESS) {
+        publish_updates(feed, updates, updates_length);
+    }
+    release_queue(updates, updates_length);
+    return result;
+}
+
+/// @brief Main loop of the feed thread. Changes which cannot be read from the database are
+///        replaced by telling all subscribers to reload.
+/// @param arg feed
+/// @return NULL
+static void *feed_loop(void *arg) {
+    OrderFeed *feed = arg;
+    int32_t *order_ids = malloc(ORDER_FEED_MAX_PENDING * sizeof(*order_ids));
+    int32_t *shard_ids = malloc(ORDER_FEED_MAX_PENDING * sizeof(*shard_ids));
+    if (!order_ids || !shard_ids) {
+        fprintf(stderr, "ERROR: cannot allocate order feed buffers\r\n");
+        free(order_ids);
+        free(shard_ids);
+        return NULL;
+    }
+    FeedRows rows = {0};
+    PGconn *conns[CONFIG_MAX_SHARDS] = {0};
+    while (1) {
+        pthread_mutex_lock(&feed->lock);
+        while (!feed->ready) {
+            pthread_cond_wait(&feed->wakeup, &feed->lock);
+        }
+        int changed_all = feed->changed_all;
+        int order_ids_length = feed->changed_length;
+        memcpy(order_ids, feed->changed, order_ids_length * sizeof(*order_ids));
+        feed->changed_all = 0;
+        feed->changed_length = 0;
+        feed->ready = 0;
+        pthread_mutex_unlock(&feed->lock);
+
+        if (changed_all) {
+            publish_updates(feed, NULL, 0);
+            continue;
+        }
+        qsort(order_ids, order_ids_length, sizeof(*order_ids), compare_order_ids);
+        int unique = 0;
+        for (int i = 0; i < order_ids_length; i++) {
+            if (unique == 0 || order_ids[unique - 1] != order_ids[i]) {
+                order_ids[unique++] = order_ids[i];
+            }
+        }
+
+        Error error = {0};
+        int result = EXIT_SUCCESS;
+        for (int shard = 0; shard < feed->router->shards_length && result == EXIT_SUCCESS; shard++) {
+            // the IDs of a shard stay sorted
+            int shard_length = 0;
+            for (int i = 0; i < unique; i++) {
+                if (db_router_shard_of(feed->router, (uint64_t)order_ids[i]) == shard) {
+                    shard_ids[shard_length++] = order_ids[i];
+                }
+            }
+            if (shard_length == 0) {
+                continue;
+            }
+            if (!conns[shard]) {
+                conns[shard] = PQconnectdb(db_router_shard_conninfo(feed->router, shard));
+            }
+            if (PQstatus(conns[shard]) != CONNECTION_OK) {
+                snprintf(error.msg, sizeof(error.msg), "%s", PQerrorMessage(conns[shard]));
+                result = EXIT_FAILURE;
+            }
+            for (int i = 0; i < shard_length && result == EXIT_SUCCESS; i += ORDER_FEED_QUERY_ORDERS) {
+                int chunk = shard_length - i < ORDER_FEED_QUERY_ORDERS ? shard_length - i : ORDER_FEED_QUERY_ORDERS;
+                result = publish_orders(feed, conns[shard], shard_ids + i, chunk, &rows, &error);
+            }
+        }
+        if (result != EXIT_SUCCESS) {
+            fprintf(stderr, "ERROR: cannot read changed orders: %s\r\n", error.msg);
+            publish_updates(feed, NULL, 0);
+            for (int shard = 0; shard < CONFIG_MAX_SHARDS; shard++) {
+                PQfinish(conns[shard]);
+                conns[shard] = NULL;
+            }
+            struct timespec delay = {
+                .tv_sec = ORDER_FEED_RECONNECT_MS / 1000,
+                .tv_nsec = (ORDER_FEED_RECONNECT_MS % 1000) * 1000000L
+            };
+            nanosleep(&delay, NULL);
+        }
+    }
+    return NULL;
+}
+
+int order_feed_init(OrderFeed *feed, Executor *executor, int queue_length, Error *error) {
+    memset(feed, 0, sizeof(*feed));
+    feed->executor = executor;
+    feed->queue_length = queue_length;
+    if (queue_length == 0) {
+        return EXIT_SUCCESS;
+    }
+    feed->changed = malloc(ORDER_FEED_MAX_PENDING * sizeof(*feed->changed));
+    if (!feed->changed) {
+        error_write(error, "cannot allocate %d changed orders", ORDER_FEED_MAX_PENDING);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&feed->lock, NULL);
+    pthread_cond_init(&feed->wakeup, NULL);
+    atomic_init(&feed->updates, 0);
+    atomic_init(&feed->coalesced, 0);
+    atomic_init(&feed->resyncs, 0);
+    return EXIT_SUCCESS;
+}
+
+int order_feed_start(OrderFeed *feed, DbRouter *router, Error *error) {
+    if (feed->queue_length == 0) {
+        return EXIT_SUCCESS;
+    }
+    feed->router = router;
+    int result = pthread_create(&feed->thread, NULL, feed_loop, feed);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void order_feed_changed(void *arg, int32_t order_id) {
+    OrderFeed *feed = arg;
+    if (feed->queue_length == 0) {
+        return;
+    }
+    pthread_mutex_lock(&feed->lock);
+    // nobody has to be told about changes before subscribing
+    if (feed->subscribers && !feed->changed_all) {
+        if (order_id == ORDER_CACHE_ALL_ORDERS || feed->changed_length == ORDER_FEED_MAX_PENDING) {
+            feed->changed_all = 1;
+            feed->changed_length = 0;
+        } else {
+            feed->changed[feed->changed_length++] = order_id;
+        }
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+void order_feed_flush(void *arg) {
+    OrderFeed *feed = arg;
+    if (feed->queue_length == 0) {
+        return;
+    }
+    pthread_mutex_lock(&feed->lock);
+    if (feed->changed_all || feed->changed_length > 0) {
+        feed->ready = 1;
+        pthread_cond_signal(&feed->wakeup);
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+OrderFeedSubscriber *order_feed_subscribe(OrderFeed *feed, Connection *client, int compress, Error *error) {
+    if (feed->queue_length == 0) {
+        error_write(error, "%s", "order subscriptions are disabled");
+        return NULL;
+    }
+    OrderFeedSubscriber *subscriber = calloc(1, sizeof(OrderFeedSubscriber));
+    OrderFeedUpdate **queue = malloc(feed->queue_length * sizeof(*queue));
+    OrderFeedUpdate **sending = malloc(feed->queue_length * sizeof(*sending));
+    // at most half of the index is used, which keeps the probe sequences short
+    uint32_t index_length = 2;
+    while (index_length < 2 * (uint32_t)feed->queue_length) {
+        index_length *= 2;
+    }
+    OrderFeedIndexEntry *index = malloc(index_length * sizeof(*index));
+    if (!subscriber || !queue || !sending || !index) {
+        error_write(error, "cannot allocate a subscriber with %d queued orders", feed->queue_length);
+        free(subscriber);
+        free(queue);
+        free(sending);
+        free(index);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < index_length; i++) {
+        index[i].slot = -1;
+    }
+    subscriber->task.run = run_subscriber;
+    subscriber->feed = feed;
+    subscriber->client = client;
+    subscriber->compress = compress;
+    subscriber->queue = queue;
+    subscriber->sending = sending;
+    subscriber->index = index;
+    subscriber->index_mask = index_length - 1;
+    pthread_mutex_init(&subscriber->lock, NULL);
+    pthread_cond_init(&subscriber->idle, NULL);
+
+    pthread_mutex_lock(&feed->lock);
+    subscriber->next = feed->subscribers;
+    if (feed->subscribers) {
+        feed->subscribers->prev = subscriber;
+    }
+    feed->subscribers = subscriber;
+    feed->subscribers_length++;
+    pthread_mutex_unlock(&feed->lock);
+    return subscriber;
+}
+
+void order_feed_unsubscribe(OrderFeedSubscriber *subscriber) {
+    OrderFeed *feed = subscriber->feed;
+    pthread_mutex_lock(&feed->lock);
+    if (subscriber->prev) {
+        subscriber->prev->next = subscriber->next;
+    } else {
+        feed->subscribers = subscriber->next;
+    }
+    if (subscriber->next) {
+        subscriber->next->prev = subscriber->prev;
+    }
+    feed->subscribers_length--;
+    pthread_mutex_unlock(&feed->lock);
+
+    // the task may still send to the connection, which is closed afterwards
+    pthread_mutex_lock(&subscriber->lock);
+    subscriber->failed = 1;
+    while (subscriber->scheduled) {
+        pthread_cond_wait(&subscriber->idle, &subscriber->lock);
+    }
+    clear_queue(subscriber);
+    pthread_mutex_unlock(&subscriber->lock);
+    pthread_mutex_destroy(&subscriber->lock);
+    pthread_cond_destroy(&subscriber->idle);
+    free(subscriber->queue);
+    free(subscriber->sending);
+    free(subscriber->index);
+    free(subscriber);
+}
+
+void order_feed_stats(OrderFeed *feed, OrderFeedStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (feed->queue_length == 0) {
+        return;
+    }
+    pthread_mutex_lock(&feed->lock);
+    stats->subscribers = feed->subscribers_length;
+    pthread_mutex_unlock(&feed->lock);
+    stats->updates = atomic_load(&feed->updates);
+    stats->coalesced = atomic_load(&feed->coalesced);
+    stats->resyncs = atomic_load(&feed->resyncs);
+}
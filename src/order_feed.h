@@ -0,0 +1,130 @@
+#ifndef __ORDER_FEED_H_
+#define __ORDER_FEED_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "config.h"
+#include "dbrouter.h"
+#include "error.h"
+#include "executor.h"
+#include "server.h"
+
+#define ORDER_FEED_DEFAULT_QUEUE_LENGTH 1024    // changed orders a subscriber may fall behind before it has to reload all orders
+#define ORDER_FEED_MAX_PENDING          65536   // changed orders waiting to be read before all subscribers have to reload
+#define ORDER_FEED_QUERY_ORDERS         256     // changed orders read from the database with one query
+
+/// @brief Current state of a changed order, shared by the queues of all subscribers
+typedef struct {
+    atomic_int  refs;           // reference of the feed thread and of every queue
+    int32_t     order_id;       // ID of the order
+    uint32_t    size;           // size of the payload
+    uint8_t     payload[];      // OrderDelta followed by its FullOrderItem
+} OrderFeedUpdate;
+
+/// @brief Entry of the index of queued updates by order ID
+typedef struct {
+    int32_t     order_id;       // ID of the order
+    int         slot;           // slot of its update in the queue, -1 if the entry is free
+} OrderFeedIndexEntry;
+
+/// @brief Connection subscribed to changed orders. Updates are queued by the feed thread and
+///        sent by a task on the executor, so a slow client only delays its own updates.
+typedef struct OrderFeedSubscriber {
+    Task                        task;           // sends the queued updates on a worker, must be the first member
+    struct OrderFeed            *feed;          // feed the subscriber belongs to
+    Connection                  *client;        // connection of the client
+    int                         compress;       // the client accepts compressed payloads
+    struct OrderFeedSubscriber  *prev;          // list of subscribers, protected by the feed lock
+    struct OrderFeedSubscriber  *next;
+    pthread_mutex_t             lock;           // protects the fields below
+    pthread_cond_t              idle;           // signalled when the task stopped
+    OrderFeedUpdate             **queue;        // ring of updates not sent yet, at most one per order
+    OrderFeedUpdate             **sending;      // updates taken from the queue by the task
+    int                         queue_head;     // slot of the oldest queued update
+    int                         queue_length;   // amount of queued updates
+    OrderFeedIndexEntry         *index;         // queue slots by order ID, linear probing
+    uint32_t                    index_mask;     // amount of index entries - 1, a power of two - 1
+    int                         resync;         // updates were dropped, the next frame tells the client to reload
+    int                         scheduled;      // the task is queued or running
+    int                         failed;         // sending failed or the client unsubscribed, updates are dropped
+} OrderFeedSubscriber;
+
+/// @brief Pushes changed orders to subscribed connections. The changes are received from the
+///        listeners of the order cache, so the server keeps one LISTEN connection per shard. A thread
+///        of the feed reads the changed orders once for all subscribers and puts them into the
+///        bounded queue of every subscriber. A change of an order which is still queued
+///        replaces the queued change, which is found through an index of the queue. A
+///        subscriber whose queue is full loses all queued changes and is told to reload the
+///        orders instead.
+typedef struct OrderFeed {
+    Executor            *executor;                      // runs the tasks of the subscribers
+    int                 queue_length;                   // limit of queued updates per subscriber, 0 disables the feed
+    DbRouter            *router;                        // shards the changed orders are read from
+    pthread_t           thread;                         // thread reading changed orders
+    pthread_mutex_t     lock;                           // protects the fields below
+    pthread_cond_t      wakeup;                         // signalled when changes are ready
+    OrderFeedSubscriber *subscribers;                   // subscribed connections
+    int                 subscribers_length;             // amount of subscribers
+    int32_t             *changed;                       // ORDER_FEED_MAX_PENDING IDs of changed orders
+    int                 changed_length;                 // amount of changed orders
+    int                 changed_all;                    // any order may have changed
+    int                 ready;                          // the listener passed all changes received so far
+    atomic_ullong       updates;                        // changed orders sent to subscribers
+    atomic_ullong       coalesced;                      // updates which replaced a queued update
+    atomic_ullong       resyncs;                        // subscribers told to reload all orders
+} OrderFeed;
+
+/// @brief Counters of the feed
+typedef struct {
+    uint64_t    subscribers;    // current amount of subscribers
+    uint64_t    updates;        // changed orders sent to subscribers
+    uint64_t    coalesced;      // updates which replaced a queued update of the same order
+    uint64_t    resyncs;        // subscribers told to reload all orders
+} OrderFeedStats;
+
+/// @brief Initializes a feed without subscribers
+/// @param feed feed to initialize
+/// @param executor executor running the tasks of the subscribers
+/// @param queue_length limit of queued updates per subscriber, 0 disables the feed
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int order_feed_init(OrderFeed *feed, Executor *executor, int queue_length, Error *error);
+
+/// @brief Starts the thread reading changed orders. Changes are passed to the feed with
+///        order_feed_changed() and order_feed_flush(), e.g. by an OrderCacheObserver.
+/// @param feed initialized feed
+/// @param router router of the databases, every changed order is read from its shard
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int order_feed_start(OrderFeed *feed, DbRouter *router, Error *error);
+
+/// @brief Notes a changed order, see OrderCacheObserver
+/// @param arg feed
+/// @param order_id ID of the order, ORDER_CACHE_ALL_ORDERS if any order may have changed
+void order_feed_changed(void *arg, int32_t order_id);
+
+/// @brief Wakes the feed thread for the changes noted so far, see OrderCacheObserver
+/// @param arg feed
+void order_feed_flush(void *arg);
+
+/// @brief Subscribes a connection to changed orders. Updates are sent as
+///        RESPONSE_ORDERS_DELTA frames until order_feed_unsubscribe() is called.
+/// @param feed started feed
+/// @param client connection of the client
+/// @param compress the client accepts compressed payloads
+/// @param error address of error object to set an error message on failure
+/// @return the subscriber or NULL on failure
+OrderFeedSubscriber *order_feed_subscribe(OrderFeed *feed, Connection *client, int compress, Error *error);
+
+/// @brief Removes a subscriber and waits until its task stopped sending
+/// @param subscriber subscriber returned by order_feed_subscribe(), freed by the call
+void order_feed_unsubscribe(OrderFeedSubscriber *subscriber);
+
+/// @brief Reads the counters of the feed
+/// @param feed initialized feed
+/// @param stats address to save the counters
+void order_feed_stats(OrderFeed *feed, OrderFeedStats *stats);
+
+#endif
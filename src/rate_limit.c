@@ -0,0 +1,196 @@
+#include "rate_limit.h"
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RATE_LIMIT_MILLI    1000ULL     // thousandths of a token, refilling rate thousandths per ms gives rate tokens per second
+
+_Static_assert(RATE_LIMIT_MAX_BURST * RATE_LIMIT_MILLI <= UINT32_MAX, "a full bucket must fit into the state of a slot");
+
+/// @brief Returns a coarse monotonic clock in ms, which is cheap enough for every request
+static uint64_t clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief Mixes the bits of a key, so neighbouring addresses spread over the table
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/// @brief Returns the rule of a kind, NULL if the kind is not limited
+static const RateLimitRule *rule_of(const RateLimiter *limiter, int kind) {
+    const RateLimitRule *rule = NULL;
+    if (kind == RATE_LIMIT_CONNECT) {
+        rule = &limiter->options.connect;
+    } else if (kind >= 0 && kind < RATE_LIMIT_MAX_KINDS) {
+        rule = &limiter->options.requests[kind];
+    }
+    return rule && rule->rate > 0 ? rule : NULL;
+}
+
+/// @brief Finds the slot of a bucket or claims one, replacing an expired bucket if no slot is free
+/// @param limiter initialized limiter with a table
+/// @param key key of the bucket, not 0
+/// @param now current time of the buckets
+/// @return the slot or NULL if all probed slots hold buckets in use
+static RateLimitSlot *find_slot(RateLimiter *limiter, uint64_t key, uint32_t now) {
+    RateLimitSlot *expired = NULL;
+    uint64_t expired_key = 0;
+    for (uint64_t i = 0; i < RATE_LIMIT_PROBES; i++) {
+        RateLimitSlot *slot = &limiter->slots[(key + i) & limiter->mask];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (current == 0) {
+            // a new bucket starts full, its state is still 0
+            if (atomic_compare_exchange_strong(&slot->key, &current, key) || current == key) {
+                return slot;
+            }
+        }
+        if (current == key) {
+            return slot;
+        }
+        uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+        int32_t idle = (int32_t)(now - (uint32_t)(state >> 32));
+        // a state of 0 belongs to a bucket which was claimed but not updated yet, a time far in
+        // the future means the clock wrapped while the bucket was idle
+        if (!expired && state != 0 && (idle >= limiter->expiry_ms || idle <= -limiter->expiry_ms)) {
+            expired = slot;
+            expired_key = current;
+        }
+    }
+    // an expired bucket is full again, so replacing it loses nothing of its client
+    if (expired && atomic_compare_exchange_strong(&expired->key, &expired_key, key)) {
+        atomic_store_explicit(&expired->state, 0, memory_order_relaxed);
+        return expired;
+    }
+    return NULL;
+}
+
+void rate_limit_options_init(RateLimitOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->table_size = RATE_LIMIT_DEFAULT_TABLE_SIZE;
+}
+
+int rate_limiter_init(RateLimiter *limiter, const RateLimitOptions *options, Error *error) {
+    memset(limiter, 0, sizeof(*limiter));
+    limiter->options = *options;
+    if (options->table_size < RATE_LIMIT_MIN_TABLE_SIZE || options->table_size > RATE_LIMIT_MAX_TABLE_SIZE
+            || (options->table_size & (options->table_size - 1)) != 0) {
+        error_write(error, "invalid rate limit table size %d", options->table_size);
+        return EXIT_FAILURE;
+    }
+    uint64_t expiry_ms = 0;
+    for (int kind = 0; kind <= RATE_LIMIT_CONNECT; kind++) {
+        const RateLimitRule *rule = rule_of(limiter, kind);
+        if (!rule) {
+            continue;
+        }
+        if (rule->rate > RATE_LIMIT_MAX_RATE || rule->burst < 1 || rule->burst > RATE_LIMIT_MAX_BURST) {
+            error_write(error, "invalid rate limit %u per second with a burst of %u", rule->rate, rule->burst);
+            return EXIT_FAILURE;
+        }
+        uint64_t refill_ms = (rule->burst * RATE_LIMIT_MILLI + rule->rate - 1) / rule->rate;
+        if (refill_ms > expiry_ms) {
+            expiry_ms = refill_ms;
+        }
+    }
+    if (expiry_ms == 0) {
+        return EXIT_SUCCESS;
+    }
+    limiter->slots = calloc(options->table_size, sizeof(RateLimitSlot));
+    if (!limiter->slots) {
+        error_write(error, "cannot allocate %d rate limit buckets", options->table_size);
+        return EXIT_FAILURE;
+    }
+    limiter->mask = options->table_size - 1;
+    limiter->expiry_ms = expiry_ms < INT32_MAX ? (int32_t)expiry_ms : INT32_MAX;
+    // bucket times are 32 bits of ms since the start, they are compared by their difference
+    // so the clock may wrap. Concurrent updates differ by less than expiry_ms, a larger
+    // negative difference is a bucket which stayed idle while the clock wrapped.
+    limiter->epoch_ms = clock_ms() - 1;
+    return EXIT_SUCCESS;
+}
+
+uint64_t rate_limit_source(const struct sockaddr_storage *addr) {
+    uint64_t source = 0;
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        source = (1ULL << 32) | ntohl(in->sin_addr.s_addr);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            uint32_t v4;
+            memcpy(&v4, &in6->sin6_addr.s6_addr[12], sizeof(v4));
+            source = (1ULL << 32) | ntohl(v4);
+        } else {
+            memcpy(&source, in6->sin6_addr.s6_addr, sizeof(source));
+            source = mix(source) | 1;
+        }
+    }
+    return source;
+}
+
+int rate_limiter_allow(RateLimiter *limiter, uint64_t source, int kind) {
+    const RateLimitRule *rule;
+    if (!limiter->slots || source == 0 || !(rule = rule_of(limiter, kind))) {
+        return 1;
+    }
+    uint32_t now = (uint32_t)(clock_ms() - limiter->epoch_ms);
+    uint64_t key = mix(source * (RATE_LIMIT_CONNECT + 1) + kind);
+    RateLimitSlot *slot = find_slot(limiter, key ? key : 1, now);
+    if (!slot) {
+        atomic_fetch_add_explicit(&limiter->overflows, 1, memory_order_relaxed);
+        return 1;
+    }
+    uint64_t capacity = rule->burst * RATE_LIMIT_MILLI;
+    uint64_t state = atomic_load_explicit(&slot->state, memory_order_relaxed);
+    int allowed;
+    while (1) {
+        uint64_t tokens = capacity;
+        uint32_t time = now;
+        if (state != 0) {
+            int32_t elapsed = (int32_t)(now - (uint32_t)(state >> 32));
+            if (elapsed <= -limiter->expiry_ms) {
+                // idle for about 2^31 ms or more, the bucket is full
+                elapsed = limiter->expiry_ms;
+            } else if (elapsed < 0) {
+                // another thread stored a later time meanwhile, which is kept
+                elapsed = 0;
+                time = (uint32_t)(state >> 32);
+            }
+            tokens = (uint32_t)state + (uint64_t)elapsed * rule->rate;
+            if (tokens > capacity) {
+                tokens = capacity;
+            }
+        }
+        allowed = tokens >= RATE_LIMIT_MILLI;
+        if (allowed) {
+            tokens -= RATE_LIMIT_MILLI;
+        }
+        uint64_t next = (uint64_t)time << 32 | tokens;
+        next = next != 0 ? next : 1;
+        if (atomic_compare_exchange_weak_explicit(&slot->state, &state, next, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+    if (!allowed) {
+        atomic_fetch_add_explicit(kind == RATE_LIMIT_CONNECT ? &limiter->refused_connections : &limiter->refused_requests,
+                1, memory_order_relaxed);
+    }
+    return allowed;
+}
+
+void rate_limiter_stats(RateLimiter *limiter, RateLimitStats *stats) {
+    stats->refused_connections = atomic_load_explicit(&limiter->refused_connections, memory_order_relaxed);
+    stats->refused_requests = atomic_load_explicit(&limiter->refused_requests, memory_order_relaxed);
+    stats->overflows = atomic_load_explicit(&limiter->overflows, memory_order_relaxed);
+}
@@ -0,0 +1,91 @@
+#ifndef __RATE_LIMIT_H_
+#define __RATE_LIMIT_H_
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "error.h"
+
+#define RATE_LIMIT_MAX_KINDS            16          // request IDs below this value can have their own bucket
+#define RATE_LIMIT_CONNECT              RATE_LIMIT_MAX_KINDS    // kind of the bucket of new connections
+#define RATE_LIMIT_DEFAULT_TABLE_SIZE   65536       // buckets of all clients and kinds
+#define RATE_LIMIT_MIN_TABLE_SIZE       1024
+#define RATE_LIMIT_MAX_TABLE_SIZE       (16 * 1024 * 1024)
+#define RATE_LIMIT_MAX_RATE             1000000     // tokens per second
+#define RATE_LIMIT_MAX_BURST            1000000     // tokens of a full bucket
+#define RATE_LIMIT_PROBES               16          // slots searched for a bucket before the table counts as full
+
+/// @brief Token bucket of one kind, a rate of 0 disables the limit
+typedef struct {
+    uint32_t    rate;       // tokens added per second
+    uint32_t    burst;      // tokens of a full bucket
+} RateLimitRule;
+
+/// @brief Limits per client address
+typedef struct {
+    RateLimitRule   connect;                            // new connections
+    RateLimitRule   requests[RATE_LIMIT_MAX_KINDS];     // requests by request ID
+    int             table_size;                         // slots of the bucket table, a power of two
+} RateLimitOptions;
+
+/// @brief Slot of the bucket table. A free slot is claimed by setting its key, afterwards the
+///        key only changes when an expired bucket is replaced, so probing never stops early.
+typedef struct {
+    atomic_ullong   key;    // hash of client address and kind, 0 for a free slot
+    atomic_ullong   state;  // time of the last update in ms << 32 | thousandths of tokens, 0 for a full bucket
+} RateLimitSlot;
+
+/// @brief Token buckets of all clients in a lock-free open addressing table. Every check
+///        updates its bucket with a compare and swap, so I/O threads never wait for each other.
+///        A bucket which was idle long enough to refill completely behaves like a missing one
+///        and is replaced by the next client which finds no slot of its own.
+typedef struct {
+    RateLimitOptions    options;            // limits
+    RateLimitSlot       *slots;             // table_size slots, NULL if no limit is enabled
+    uint64_t            mask;               // table_size - 1
+    int32_t             expiry_ms;          // time after which every bucket is full again
+    uint64_t            epoch_ms;           // start of the clock of the buckets
+    atomic_ullong       refused_connections;// connections closed right after accept
+    atomic_ullong       refused_requests;   // requests answered with an error
+    atomic_ullong       overflows;          // checks passed because the table had no slot left
+} RateLimiter;
+
+/// @brief Counters of the limiter
+typedef struct {
+    uint64_t    refused_connections;    // connections closed right after accept
+    uint64_t    refused_requests;       // requests answered with an error
+    uint64_t    overflows;              // checks passed because the table had no slot left
+} RateLimitStats;
+
+/// @brief Sets the defaults, i.e. no limits
+/// @param options options to initialize
+void rate_limit_options_init(RateLimitOptions *options);
+
+/// @brief Initializes the limiter, the table is only allocated if a limit is enabled
+/// @param limiter limiter to initialize
+/// @param options limits
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int rate_limiter_init(RateLimiter *limiter, const RateLimitOptions *options, Error *error);
+
+/// @brief Derives the key of a client from its address. IPv6 clients are limited per /64
+///        prefix, since a single host usually owns all addresses of its prefix.
+/// @param addr address returned by accept()
+/// @return key of the client, 0 if the address is not limited, e.g. a Unix socket
+uint64_t rate_limit_source(const struct sockaddr_storage *addr);
+
+/// @brief Takes a token from the bucket of a client. Without a free slot for the bucket the
+///        client passes, so a full table never locks clients out.
+/// @param limiter initialized limiter
+/// @param source key of the client, see rate_limit_source()
+/// @param kind request ID or RATE_LIMIT_CONNECT
+/// @return 1 if the client stays within its limit, 0 if it has to be refused
+int rate_limiter_allow(RateLimiter *limiter, uint64_t source, int kind);
+
+/// @brief Reads the counters of the limiter
+/// @param limiter initialized limiter
+/// @param stats address to save the counters
+void rate_limiter_stats(RateLimiter *limiter, RateLimitStats *stats);
+
+#endif
@@ -0,0 +1,736 @@
+#include "capture.h"
+#include "histogram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define REPLAY_DEFAULT_PORT         8080
+#define REPLAY_MAX_KINDS            16          // request IDs with their own results, higher IDs are counted as "other"
+#define REPLAY_RESPONSE_TIMEOUT_MS  30000       // time a request may take before its connection is given up
+#define REPLAY_STACK_SIZE           (256 * 1024)
+#define REPLAY_RECV_BUFFER_SIZE     (64 * 1024)
+#define REPLAY_MIN_COMPARED         10          // requests of a kind needed before it is compared with the baseline
+
+/// @brief Names of the request IDs in the results
+static const char *request_names[REPLAY_MAX_KINDS + 1] = {
+    [REQUEST_DISPLAY_ORDERS] = "display_orders",
+    [REQUEST_LIST_ITEMS] = "list_items",
+    [REQUEST_ADD_ORDER] = "add_order",
+    [REQUEST_EXPORT_ORDERS] = "export_orders",
+    [REQUEST_GET_ORDER] = "get_order",
+    [REQUEST_STATS] = "stats",
+    [REQUEST_BATCH] = "batch",
+    [REQUEST_SUBSCRIBE_ORDERS] = "subscribe_orders",
+    [REPLAY_MAX_KINDS] = "other"
+};
+
+typedef struct {
+    const char  *host;
+    uint16_t    port;
+    const char  *unix_path;         // connect to the Unix socket instead of the TCP port
+    double      speed;              // factor of the original pace, 0 to send as fast as possible
+    const char  *output_path;       // file to save the results, NULL to only print them
+    const char  *baseline_path;     // results of an earlier run to compare with, may be NULL
+    double      threshold;          // tolerated regression in percent, negative to not fail on regressions
+} ReplayOptions;
+
+/// @brief Results of the requests of one kind
+typedef struct {
+    Histogram   latency;    // time from sending the request until its response was complete
+    uint64_t    errors;     // requests answered with RESPONSE_ERROR
+} ReplayResult;
+
+/// @brief Captured connection which is replayed by its own thread
+typedef struct {
+    struct Replay       *replay;        // replay the connection belongs to
+    uint32_t            id;             // ID of the connection in the capture
+    uint64_t            open_ns;        // time of the connection in the capture
+    uint64_t            close_ns;       // time of the close in the capture, 0 if it was not closed
+    const CaptureRecord **frames;       // captured frames in the order they were received
+    int                 frames_length;  // amount of frames
+    pthread_t           thread;         // thread replaying the connection
+    atomic_int          done;           // the thread finished
+    int                 failed;         // the connection failed before all frames were replayed
+} ReplayConnection;
+
+/// @brief State of a replay shared by all connections
+typedef struct Replay {
+    const ReplayOptions *options;
+    uint64_t            capture_start_ns;   // capture time of the first record
+    uint64_t            start_ns;           // monotonic time the replay started
+    pthread_mutex_t     lock;               // protects the results
+    ReplayResult        results[REPLAY_MAX_KINDS + 1];
+} Replay;
+
+/// @brief Entry of a capture record while the records are grouped by connection
+typedef struct {
+    uint32_t            connection;
+    size_t              index;          // position in the file, keeps the order within a connection
+    const CaptureRecord *record;
+} ReplayRecord;
+
+/// @brief Results of a kind as saved in a results file
+typedef struct {
+    char        name[32];
+    uint64_t    count;
+    uint64_t    errors;
+    double      per_second;
+    uint64_t    p50_ns;
+    uint64_t    p99_ns;
+    uint64_t    p999_ns;
+    uint64_t    max_ns;
+} ReplaySummary;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// @brief Sleeps until the time at which an event of the capture is due in the replay
+/// @param replay running replay
+/// @param capture_ns time of the event in the capture
+static void wait_until(const Replay *replay, uint64_t capture_ns)
+{
+    if (replay->options->speed <= 0)
+    {
+        return;
+    }
+    uint64_t offset = (uint64_t)((capture_ns - replay->capture_start_ns) / replay->options->speed);
+    uint64_t due = replay->start_ns + offset;
+    uint64_t now = now_ns();
+    if (due > now)
+    {
+        struct timespec delay = { .tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000 };
+        nanosleep(&delay, NULL);
+    }
+}
+
+static int kind_of(uint16_t request_id)
+{
+    return request_id < REPLAY_MAX_KINDS ? request_id : REPLAY_MAX_KINDS;
+}
+
+static const char *kind_name(int kind, char *buffer, size_t size)
+{
+    if (request_names[kind])
+    {
+        return request_names[kind];
+    }
+    snprintf(buffer, size, "request_%d", kind);
+    return buffer;
+}
+
+/// @brief Connects to the server
+/// @param options options with the address of the server
+/// @return blocking socket or -1 on failure
+static int replay_connect(const ReplayOptions *options)
+{
+    int fd = socket(options->unix_path ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("ERROR socket");
+        return -1;
+    }
+    int connected;
+    if (options->unix_path)
+    {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", options->unix_path);
+        connected = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    else
+    {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(options->port) };
+        if (inet_pton(AF_INET, options->host, &addr.sin_addr) != 1)
+        {
+            fprintf(stderr, "ERROR: invalid address %s\r\n", options->host);
+            close(fd);
+            return -1;
+        }
+        connected = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (connected < 0)
+    {
+        perror("ERROR connect");
+        close(fd);
+        return -1;
+    }
+    if (!options->unix_path)
+    {
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    return fd;
+}
+
+/// @brief Sends all bytes of a buffer
+/// @return EXIT_SUCCESS on success
+static int send_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0)
+    {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return EXIT_FAILURE;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Receives exactly the given amount of bytes, a NULL buffer discards them
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the connection was closed or timed out
+static int recv_all(int fd, void *data, size_t size, uint8_t *scratch)
+{
+    uint8_t *bytes = data;
+    while (size > 0)
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, REPLAY_RESPONSE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            return EXIT_FAILURE;
+        }
+        size_t chunk = size;
+        if (!bytes && chunk > REPLAY_RECV_BUFFER_SIZE)
+        {
+            chunk = REPLAY_RECV_BUFFER_SIZE;
+        }
+        ssize_t n = recv(fd, bytes ? bytes : scratch, chunk, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return EXIT_FAILURE;
+        }
+        if (bytes)
+        {
+            bytes += n;
+        }
+        size -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Receives the response of a request. Streamed responses end with their last frame,
+///        changed orders pushed to a subscriber meanwhile are skipped.
+/// @param fd socket of the connection
+/// @param scratch buffer of REPLAY_RECV_BUFFER_SIZE bytes for discarded payloads
+/// @param error address to save 1 if the request was answered with an error
+/// @return EXIT_SUCCESS on success
+static int receive_response(int fd, uint8_t *scratch, int *error)
+{
+    while (1)
+    {
+        FrameHeader header;
+        if (recv_all(fd, &header, sizeof(header), scratch) != EXIT_SUCCESS
+                || header.magicnum != API_MAGIC_NUM
+                || recv_all(fd, NULL, header.payload_size, scratch) != EXIT_SUCCESS)
+        {
+            return EXIT_FAILURE;
+        }
+        if (header.id != RESPONSE_ORDERS_CHUNK && header.id != RESPONSE_ORDERS_DELTA)
+        {
+            *error = header.id == RESPONSE_ERROR;
+            return EXIT_SUCCESS;
+        }
+    }
+}
+
+/// @brief Replays the frames of a connection, each request is sent when it is due but not
+///        before the response of the previous one, like the server handles them
+/// @param conn connection to replay
+/// @param replay running replay
+/// @param results results of the connection by kind
+static void replay_frames(ReplayConnection *conn, Replay *replay, ReplayResult *results)
+{
+    wait_until(replay, conn->open_ns);
+    int fd = replay_connect(replay->options);
+    uint8_t *scratch = malloc(REPLAY_RECV_BUFFER_SIZE);
+    if (fd < 0 || !scratch)
+    {
+        conn->failed = 1;
+        goto out;
+    }
+    for (int i = 0; i < conn->frames_length; i++)
+    {
+        const CaptureRecord *record = conn->frames[i];
+        // the shared memory transport cannot be attached over the replay connection
+        if (record->header.id == REQUEST_ATTACH_RING)
+        {
+            continue;
+        }
+        wait_until(replay, record->time_ns);
+        uint64_t start = now_ns();
+        int error = 0;
+        if (send_all(fd, &record->header, sizeof(record->header)) != EXIT_SUCCESS
+                || send_all(fd, record + 1, record->header.payload_size) != EXIT_SUCCESS
+                || receive_response(fd, scratch, &error) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "ERROR: connection %u failed at frame %d of %d\r\n", conn->id, i + 1, conn->frames_length);
+            conn->failed = 1;
+            break;
+        }
+        ReplayResult *result = &results[kind_of(record->header.id)];
+        histogram_record(&result->latency, now_ns() - start);
+        result->errors += error;
+    }
+    if (!conn->failed && conn->close_ns > 0)
+    {
+        wait_until(replay, conn->close_ns);
+    }
+out:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(scratch);
+}
+
+static void *replay_connection_loop(void *arg)
+{
+    ReplayConnection *conn = arg;
+    Replay *replay = conn->replay;
+    ReplayResult *results = calloc(REPLAY_MAX_KINDS + 1, sizeof(ReplayResult));
+    if (!results)
+    {
+        fprintf(stderr, "ERROR: cannot allocate results\r\n");
+        conn->failed = 1;
+    }
+    else
+    {
+        replay_frames(conn, replay, results);
+        pthread_mutex_lock(&replay->lock);
+        for (int i = 0; i <= REPLAY_MAX_KINDS; i++)
+        {
+            histogram_merge(&replay->results[i].latency, &results[i].latency);
+            replay->results[i].errors += results[i].errors;
+        }
+        pthread_mutex_unlock(&replay->lock);
+        free(results);
+    }
+    atomic_store(&conn->done, 1);
+    return NULL;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const ReplayRecord *x = a;
+    const ReplayRecord *y = b;
+    if (x->connection != y->connection)
+    {
+        return (x->connection > y->connection) - (x->connection < y->connection);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int compare_connections(const void *a, const void *b)
+{
+    const ReplayConnection *x = a;
+    const ReplayConnection *y = b;
+    if (x->open_ns != y->open_ns)
+    {
+        return (x->open_ns > y->open_ns) - (x->open_ns < y->open_ns);
+    }
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+/// @brief Groups the records of a capture by connection
+/// @param log mapped capture file
+/// @param connections address to save the connections sorted by the time they were opened
+/// @param frames address to save the frames of all connections, referenced by the connections
+/// @param capture_start_ns address to save the time of the first record
+/// @return amount of connections or -1 on failure
+static int load_connections(const CaptureLog *log, ReplayConnection **connections, const CaptureRecord ***frames, uint64_t *capture_start_ns)
+{
+    size_t records_length = 0;
+    size_t offset = 0;
+    const uint8_t *payload;
+    while (capture_log_next(log, &offset, &payload))
+    {
+        records_length++;
+    }
+    ReplayRecord *records = malloc((records_length + 1) * sizeof(ReplayRecord));
+    *frames = malloc((records_length + 1) * sizeof(const CaptureRecord *));
+    *connections = calloc(records_length + 1, sizeof(ReplayConnection));
+    if (!records || !*frames || !*connections)
+    {
+        fprintf(stderr, "ERROR: cannot allocate %zu records\r\n", records_length);
+        free(records);
+        return -1;
+    }
+    offset = 0;
+    *capture_start_ns = UINT64_MAX;
+    for (size_t i = 0; i < records_length; i++)
+    {
+        const CaptureRecord *record = capture_log_next(log, &offset, &payload);
+        records[i] = (ReplayRecord){ .connection = record->connection, .index = i, .record = record };
+        if (record->time_ns < *capture_start_ns)
+        {
+            *capture_start_ns = record->time_ns;
+        }
+    }
+    qsort(records, records_length, sizeof(ReplayRecord), compare_records);
+
+    int connections_length = 0;
+    size_t frames_length = 0;
+    for (size_t i = 0; i < records_length; i++)
+    {
+        const CaptureRecord *record = records[i].record;
+        if (i == 0 || records[i - 1].connection != record->connection)
+        {
+            ReplayConnection *conn = &(*connections)[connections_length++];
+            conn->id = record->connection;
+            conn->open_ns = record->time_ns;
+            conn->frames = &(*frames)[frames_length];
+        }
+        ReplayConnection *conn = &(*connections)[connections_length - 1];
+        if (record->kind == CAPTURE_FRAME)
+        {
+            (*frames)[frames_length++] = record;
+            conn->frames_length++;
+        }
+        else if (record->kind == CAPTURE_CLOSE)
+        {
+            conn->close_ns = record->time_ns;
+        }
+    }
+    free(records);
+    qsort(*connections, connections_length, sizeof(ReplayConnection), compare_connections);
+    return connections_length;
+}
+
+/// @brief Joins the threads of all finished connections
+/// @param running indexes of the connections whose threads were not joined yet
+/// @param running_length amount of running connections
+/// @param connections all connections
+/// @return amount of connections which are still running
+static int join_finished(int *running, int running_length, ReplayConnection *connections)
+{
+    int still_running = 0;
+    for (int i = 0; i < running_length; i++)
+    {
+        ReplayConnection *conn = &connections[running[i]];
+        if (atomic_load(&conn->done))
+        {
+            pthread_join(conn->thread, NULL);
+        }
+        else
+        {
+            running[still_running++] = running[i];
+        }
+    }
+    return still_running;
+}
+
+/// @brief Reads a results file of an earlier run
+/// @param path path of the file
+/// @param summaries array of REPLAY_MAX_KINDS + 2 summaries
+/// @return amount of summaries or -1 on failure
+static int read_summaries(const char *path, ReplaySummary *summaries)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror("ERROR baseline");
+        return -1;
+    }
+    int length = 0;
+    char line[256];
+    while (length < REPLAY_MAX_KINDS + 2 && fgets(line, sizeof(line), file))
+    {
+        ReplaySummary *s = &summaries[length];
+        if (line[0] == '#')
+        {
+            continue;
+        }
+        if (sscanf(line, "%31s %" SCNu64 " %" SCNu64 " %lf %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+                s->name, &s->count, &s->errors, &s->per_second, &s->p50_ns, &s->p99_ns, &s->p999_ns, &s->max_ns) == 8)
+        {
+            length++;
+        }
+    }
+    fclose(file);
+    return length;
+}
+
+static const ReplaySummary *find_summary(const ReplaySummary *summaries, int length, const char *name)
+{
+    for (int i = 0; i < length; i++)
+    {
+        if (strcmp(summaries[i].name, name) == 0)
+        {
+            return &summaries[i];
+        }
+    }
+    return NULL;
+}
+
+/// @brief Returns the change of a value relative to the baseline in percent
+static double change(double value, double baseline)
+{
+    return baseline > 0 ? (value - baseline) * 100.0 / baseline : 0.0;
+}
+
+/// @brief Prints a summary, compared with its baseline if there is one
+/// @param summary results of a kind
+/// @param baseline results of the kind in the baseline run, may be NULL
+/// @param threshold tolerated regression in percent, negative to ignore regressions
+/// @return 1 if the kind regressed more than the threshold
+static int print_summary(const ReplaySummary *summary, const ReplaySummary *baseline, double threshold)
+{
+    printf("%-18s %8" PRIu64 " %7" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            summary->name, summary->count, summary->errors, summary->per_second,
+            summary->p50_ns / 1e3, summary->p99_ns / 1e3, summary->p999_ns / 1e3, summary->max_ns / 1e3);
+    if (!baseline)
+    {
+        return 0;
+    }
+    double per_second = change(summary->per_second, baseline->per_second);
+    double p99 = change(summary->p99_ns, baseline->p99_ns);
+    printf("%-18s %8s %+7" PRId64 " %+9.1f%% %+9.1f%% %+9.1f%% %+9.1f%% %+9.1f%%\n",
+            "  vs baseline", "",
+            (int64_t)summary->errors - (int64_t)baseline->errors,
+            per_second,
+            change(summary->p50_ns, baseline->p50_ns),
+            p99,
+            change(summary->p999_ns, baseline->p999_ns),
+            change(summary->max_ns, baseline->max_ns));
+    // kinds with few requests are too noisy to gate on
+    return threshold >= 0 && summary->count >= REPLAY_MIN_COMPARED && baseline->count >= REPLAY_MIN_COMPARED
+            && (p99 > threshold || per_second < -threshold || summary->errors > baseline->errors);
+}
+
+/// @brief Prints the results of a replay, compares them with the baseline and saves them
+/// @param replay finished replay
+/// @param elapsed_ns duration of the replay
+/// @return EXIT_SUCCESS if no kind regressed more than the threshold
+static int report(Replay *replay, uint64_t elapsed_ns)
+{
+    const ReplayOptions *options = replay->options;
+    ReplaySummary baseline[REPLAY_MAX_KINDS + 2];
+    int baseline_length = 0;
+    if (options->baseline_path && (baseline_length = read_summaries(options->baseline_path, baseline)) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    FILE *output = NULL;
+    if (options->output_path && !(output = fopen(options->output_path, "w")))
+    {
+        perror("ERROR output");
+        return EXIT_FAILURE;
+    }
+    if (output)
+    {
+        fprintf(output, "# kind count errors per_second p50_ns p99_ns p99.9_ns max_ns\n");
+    }
+    printf("%-18s %8s %7s %10s %10s %10s %10s %10s\n",
+            "request", "count", "errors", "req/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    ReplayResult all = {0};
+    int regressed = 0;
+    for (int kind = 0; kind <= REPLAY_MAX_KINDS + 1; kind++)
+    {
+        const ReplayResult *result = &all;
+        char buffer[32];
+        const char *name = "all";
+        if (kind <= REPLAY_MAX_KINDS)
+        {
+            result = &replay->results[kind];
+            if (result->latency.total == 0)
+            {
+                continue;
+            }
+            histogram_merge(&all.latency, &result->latency);
+            all.errors += result->errors;
+            name = kind_name(kind, buffer, sizeof(buffer));
+        }
+        ReplaySummary summary = {
+            .count = result->latency.total,
+            .errors = result->errors,
+            .per_second = result->latency.total / (elapsed_ns / 1e9),
+            .p50_ns = histogram_percentile(&result->latency, 50),
+            .p99_ns = histogram_percentile(&result->latency, 99),
+            .p999_ns = histogram_percentile(&result->latency, 99.9),
+            .max_ns = result->latency.max_ns
+        };
+        snprintf(summary.name, sizeof(summary.name), "%s", name);
+        if (print_summary(&summary, find_summary(baseline, baseline_length, name), options->threshold))
+        {
+            fprintf(stderr, "ERROR: %s regressed more than %.1f%% against the baseline\r\n", name, options->threshold);
+            regressed = 1;
+        }
+        if (output)
+        {
+            fprintf(output, "%s %" PRIu64 " %" PRIu64 " %.3f %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    summary.name, summary.count, summary.errors, summary.per_second,
+                    summary.p50_ns, summary.p99_ns, summary.p999_ns, summary.max_ns);
+        }
+    }
+    if (output)
+    {
+        fclose(output);
+    }
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/// @brief Replays all connections of a capture with their original concurrency
+/// @param replay replay with options
+/// @param connections connections sorted by the time they were opened
+/// @param connections_length amount of connections
+/// @return EXIT_SUCCESS if all connections were replayed and nothing regressed
+static int run_replay(Replay *replay, ReplayConnection *connections, int connections_length)
+{
+    int *running = malloc((connections_length + 1) * sizeof(int));
+    if (!running)
+    {
+        fprintf(stderr, "ERROR: cannot allocate connections\r\n");
+        return EXIT_FAILURE;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REPLAY_STACK_SIZE);
+    int running_length = 0;
+    int failed = 0;
+    replay->start_ns = now_ns();
+    for (int i = 0; i < connections_length; i++)
+    {
+        ReplayConnection *conn = &connections[i];
+        // threads start when their connection was opened, so finished ones are joined meanwhile
+        wait_until(replay, conn->open_ns);
+        running_length = join_finished(running, running_length, connections);
+        conn->replay = replay;
+        atomic_init(&conn->done, 0);
+        if (pthread_create(&conn->thread, &attr, replay_connection_loop, conn) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot start the thread of connection %u\r\n", conn->id);
+            conn->failed = 1;
+            continue;
+        }
+        running[running_length++] = i;
+    }
+    for (int i = 0; i < running_length; i++)
+    {
+        pthread_join(connections[running[i]].thread, NULL);
+    }
+    uint64_t elapsed = now_ns() - replay->start_ns;
+    pthread_attr_destroy(&attr);
+    free(running);
+
+    uint64_t frames = 0;
+    for (int i = 0; i < connections_length; i++)
+    {
+        failed += connections[i].failed;
+        frames += connections[i].frames_length;
+    }
+    printf("replayed %d connections with %" PRIu64 " frames in %.3f s, %d failed\n",
+            connections_length, frames, elapsed / 1e9, failed);
+    int result = report(replay, elapsed);
+    return failed > 0 ? EXIT_FAILURE : result;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-u unix_path] [-s speed] [-o results] [-b baseline] [-t percent] capture\r\n", program);
+    fprintf(stderr, "Replays the frames of a capture file (see server.capture_path) with their original timing\r\n");
+    fprintf(stderr, "and connections. -s 2 replays twice as fast, -s max as fast as the server answers. -o saves\r\n");
+    fprintf(stderr, "the results, -b compares them with saved results and -t fails if the throughput, p99\r\n");
+    fprintf(stderr, "latency or errors of a request regressed more than percent against the baseline.\r\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ReplayOptions options = {
+        .host = "127.0.0.1",
+        .port = REPLAY_DEFAULT_PORT,
+        .speed = 1.0,
+        .threshold = -1.0
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:s:o:b:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = (uint16_t)atoi(optarg);
+            break;
+        case 'u':
+            options.unix_path = optarg;
+            break;
+        case 's':
+            options.speed = strcmp(optarg, "max") == 0 ? 0.0 : atof(optarg);
+            if (options.speed <= 0 && strcmp(optarg, "max") != 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'o':
+            options.output_path = optarg;
+            break;
+        case 'b':
+            options.baseline_path = optarg;
+            break;
+        case 't':
+            options.threshold = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || isnan(options.speed))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    CaptureLog log;
+    Error error = {0};
+    if (capture_log_open(&log, argv[optind], &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot open capture: %s\r\n", error.msg);
+        return 1;
+    }
+    Replay replay = { .options = &options };
+    pthread_mutex_init(&replay.lock, NULL);
+    ReplayConnection *connections = NULL;
+    const CaptureRecord **frames = NULL;
+    int connections_length = load_connections(&log, &connections, &frames, &replay.capture_start_ns);
+    int result = connections_length < 0 ? EXIT_FAILURE : run_replay(&replay, connections, connections_length);
+    pthread_mutex_destroy(&replay.lock);
+    free(connections);
+    free(frames);
+    capture_log_close(&log);
+    return result;
+}
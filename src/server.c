@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // accept4()
 #include "server.h"
 
 #include <signal.h>
@@ -5,13 +6,20 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <strings.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 
+#define SERVER_EPOLL_EVENTS 64
+#define SERVER_MAX_REFUSALS 16      // requests over the limit answered inline per call of connection_next_request()
+
 /// @brief Callback for receiving a signal (default: SIGINT) to quit the server.
 /// @param signo Signal which was received.
 static void server_exit(int signo) {
@@ -19,48 +27,578 @@ static void server_exit(int signo) {
     exit(0);
 }
 
-/// @brief Accepts new incoming requests
-///        and calls the client callback of the server for each new connection.
-///        This functions is executing by each thread in the thread pool.
-///        In case of a failure the thread is terminated.
-/// @param arg pointer to the Server instance running the thread pool
-/// @return EXIT_SUCCESS on success, EXIT_FAILURE on a failure
-static void *handle_request_loop(void *arg)
+/// @brief Closes the connection and releases its state. The connection must not be watched
+///        by epoll anymore, i.e. it is disarmed or was never armed.
+/// @param client connection of the client
+static void connection_close(Connection *client)
+{
+    if (client->server->close_cb)
+    {
+        client->server->close_cb(client);
+    }
+    capture_event(&client->server->capture, client->id, CAPTURE_CLOSE);
+    TimerWheel *timers = &client->server->timers;
+    timer_cancel(timers, &client->receive_timer);
+    timer_cancel(timers, &client->write_timer);
+    timer_cancel(timers, &client->deadline_timer);
+    // the expired deadline may still wait for its cancel callback
+    Server *server = client->server;
+    pthread_mutex_lock(&server->cancel_queue_lock);
+    if (client->cancel_queued) {
+        Connection **link = &server->cancel_head;
+        Connection *previous = NULL;
+        while (*link != client) {
+            previous = *link;
+            link = &(*link)->cancel_next;
+        }
+        *link = client->cancel_next;
+        if (server->cancel_tail == client) {
+            server->cancel_tail = previous;
+        }
+        client->cancel_queued = 0;
+    }
+    while (server->cancelling == client) {
+        pthread_cond_wait(&server->cancel_cond, &server->cancel_queue_lock);
+    }
+    pthread_mutex_unlock(&server->cancel_queue_lock);
+    pthread_mutex_destroy(&client->cancel_lock);
+    pthread_mutex_destroy(&client->send_lock);
+    close(client->fd);
+    shm_transport_close(&client->ring);
+    frame_decoder_free(&client->decoder);
+    free(client->context);
+    free(client);
+}
+
+/// @brief Arms the one-shot epoll registration of the connection for the next request.
+///        The connection is closed if this fails.
+/// @param client connection of the client
+/// @param op EPOLL_CTL_ADD for new connections, EPOLL_CTL_MOD to re-arm
+static void connection_arm(Connection *client, int op)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = client
+    };
+    if (epoll_ctl(client->epoll_fd, op, client->fd, &event) < 0)
+    {
+        char errmsg[512];
+        fprintf(stderr, "ERROR epoll_ctl: %s\r\n", strerror_r(errno, errmsg, sizeof(errmsg)));
+        connection_close(client);
+    }
+}
+
+/// @brief Shuts the socket down when the client is idle or too slow. The I/O thread or the
+///        worker sending a response notice the shutdown and close the connection.
+/// @param client connection of the client
+/// @param reason reason for the log message
+static void connection_timed_out(Connection *client, const char *reason)
+{
+    printf("DEBUG: client connection timed out (%s)\r\n", reason);
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+/// @brief Expiry of Connection.receive_timer, see Timer
+static void receive_timeout(Timer *timer)
+{
+    Connection *client = (Connection *)((uint8_t *)timer - offsetof(Connection, receive_timer));
+    connection_timed_out(client, client->receiving ? "read" : "idle");
+}
+
+/// @brief Expiry of Connection.write_timer, see Timer
+static void write_timeout(Timer *timer)
+{
+    Connection *client = (Connection *)((uint8_t *)timer - offsetof(Connection, write_timer));
+    connection_timed_out(client, "write");
+}
+
+/// @brief Expiry of Connection.deadline_timer, see Timer. Cancelling may block, e.g. on the
+///        connection to the database, so the callback is left to the cancel thread and the
+///        timer thread only flags the expiry.
+static void request_deadline(Timer *timer)
+{
+    Connection *client = (Connection *)((uint8_t *)timer - offsetof(Connection, deadline_timer));
+    Server *server = client->server;
+    pthread_mutex_lock(&client->cancel_lock);
+    client->expired = 1;
+    int cancel = client->cancel_cb != NULL;
+    pthread_mutex_unlock(&client->cancel_lock);
+    if (!cancel)
+    {
+        return;
+    }
+    // connection_close() cancels this timer first, so the connection is still open
+    pthread_mutex_lock(&server->cancel_queue_lock);
+    if (!client->cancel_queued)
+    {
+        client->cancel_queued = 1;
+        client->cancel_next = NULL;
+        if (server->cancel_tail)
+        {
+            server->cancel_tail->cancel_next = client;
+        }
+        else
+        {
+            server->cancel_head = client;
+        }
+        server->cancel_tail = client;
+        pthread_cond_signal(&server->cancel_cond);
+    }
+    pthread_mutex_unlock(&server->cancel_queue_lock);
+}
+
+/// @brief Main loop of the cancel thread, runs the cancel callbacks of expired requests
+/// @param arg server
+/// @return NULL
+static void *cancel_loop(void *arg)
 {
     Server *server = arg;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    pthread_mutex_lock(&server->cancel_queue_lock);
+    while (1)
+    {
+        while (!server->cancel_head)
+        {
+            pthread_cond_wait(&server->cancel_cond, &server->cancel_queue_lock);
+        }
+        Connection *client = server->cancel_head;
+        server->cancel_head = client->cancel_next;
+        if (!server->cancel_head)
+        {
+            server->cancel_tail = NULL;
+        }
+        client->cancel_queued = 0;
+        server->cancelling = client;
+        pthread_mutex_unlock(&server->cancel_queue_lock);
+
+        // the request may have finished meanwhile, the next one resets expired
+        pthread_mutex_lock(&client->cancel_lock);
+        if (client->expired && client->cancel_cb)
+        {
+            printf("DEBUG: request deadline exceeded, cancelling request %d\r\n", client->header.id);
+            client->cancel_cb(client->cancel_arg);
+        }
+        pthread_mutex_unlock(&client->cancel_lock);
+
+        pthread_mutex_lock(&server->cancel_queue_lock);
+        server->cancelling = NULL;
+        pthread_cond_broadcast(&server->cancel_cond);
+    }
+    return NULL;
+}
 
+/// @brief Waits for the next request: arms the receive timeout and the epoll registration.
+///        The read timeout runs from the first received byte of a request, so a client cannot
+///        keep a connection open by sending a request byte by byte.
+/// @param client connection of the client
+/// @param op EPOLL_CTL_ADD for new connections, EPOLL_CTL_MOD to re-arm
+static void connection_wait(Connection *client, int op)
+{
+    const ServerOptions *options = &client->server->options;
+    if (client->decoder.end > client->decoder.start)
+    {
+        if (!client->receiving && options->read_timeout_ms > 0)
+        {
+            client->receiving = 1;
+            timer_schedule(&client->server->timers, &client->receive_timer, options->read_timeout_ms);
+        }
+    }
+    else if (options->idle_timeout_ms > 0 && !client->pushing)
+    {
+        client->receiving = 0;
+        timer_schedule(&client->server->timers, &client->receive_timer, options->idle_timeout_ms);
+    }
+    connection_arm(client, op);
+}
+
+/// @brief Hands the decoded request to the executor and starts its deadline
+/// @param client connection of the client
+static void connection_dispatch(Connection *client)
+{
+    Server *server = client->server;
+    client->receiving = 0;
+    timer_cancel(&server->timers, &client->receive_timer);
+    // the cancel thread may still look at the deadline of the previous request
+    pthread_mutex_lock(&client->cancel_lock);
+    client->expired = 0;
+    pthread_mutex_unlock(&client->cancel_lock);
+    if (server->options.request_timeout_ms > 0)
+    {
+        timer_schedule(&server->timers, &client->deadline_timer, server->options.request_timeout_ms);
+    }
+    executor_submit(&server->executor, &client->task);
+}
+
+/// @brief Receives the wakeups the client sent over the socket of a shared memory transport
+/// @param client connection of the client
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the client closed the connection
+static int connection_drain_doorbells(Connection *client)
+{
+    char doorbells[64];
+    while (1)
+    {
+        ssize_t n = recv(client->fd, doorbells, sizeof(doorbells), MSG_DONTWAIT);
+        if (n > 0)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+}
+
+/// @brief Copies available request data from the shared memory into the decoder. If the ring
+///        is empty, the client is asked to send a wakeup over the socket for the next request.
+/// @param client connection of the client with attached rings
+/// @param woken the socket reported wakeups of the client
+/// @param error address of error object to set an error message on FRAME_ERROR
+/// @return FRAME_INCOMPLETE if data was copied, FRAME_WOULD_BLOCK, FRAME_CLOSED or FRAME_ERROR
+static FrameStatus connection_fill_ring(Connection *client, int woken, Error *error)
+{
+    ShmRing *ring = &client->ring.shared->requests;
+    if (woken)
+    {
+        shm_ring_end_wait(ring, 1);
+        if (connection_drain_doorbells(client) != EXIT_SUCCESS)
+        {
+            return FRAME_CLOSED;
+        }
+    }
+    while (1)
+    {
+        size_t size;
+        uint8_t *space = frame_decoder_space(&client->decoder, &size, error);
+        if (!space)
+        {
+            return FRAME_ERROR;
+        }
+        size_t n = shm_ring_read(&client->ring, ring, space, size);
+        if (n > 0)
+        {
+            frame_decoder_commit(&client->decoder, n);
+            shm_ring_wake_client(ring, 0);
+            return FRAME_INCOMPLETE;
+        }
+        if (shm_ring_prepare_wait(&client->ring, ring, 1))
+        {
+            return FRAME_WOULD_BLOCK;
+        }
+    }
+}
+
+/// @brief Answers REQUEST_ATTACH_RING: creates the shared memory of the connection and passes
+///        it to the client, all further frames go through its rings. Clients which cannot use
+///        the transport get an error response and keep using the socket.
+/// @param client connection of the client
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the connection has to be closed
+static int connection_attach_ring(Connection *client)
+{
+    int ring_size = client->server->options.ring_size;
+    // frames pushed by other threads would have to wait for wakeups of the client which are
+    // meant for the I/O thread
+    if (!client->local || ring_size == 0 || client->ring.shared || client->pushing)
+    {
+        return connection_send_error(client, "shared memory transport not available");
+    }
+    if (client->decoder.end - client->decoder.start > client->decoder.consumed)
+    {
+        // frames sent before the response would be lost
+        connection_send_error(client, "requests must not follow REQUEST_ATTACH_RING before its response");
+        return EXIT_FAILURE;
+    }
+    Error error = {0};
+    ShmTransport ring;
+    int memfd;
+    if (shm_transport_create(&ring, ring_size, &memfd, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot create shared memory transport: %s\r\n", error.msg);
+        return connection_send_error(client, "shared memory transport not available");
+    }
+    FrameHeader header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = RESPONSE_ATTACH_RING,
+        .payload_size = sizeof(AttachRingResponse),
+        .flags = 0
+    };
+    AttachRingResponse response = { .ring_size = ring_size };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = &response, .iov_len = sizeof(response) }
+    };
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    // the socket of a new connection has room for the small response
+    ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent != (ssize_t)(sizeof(header) + sizeof(response)))
+    {
+        char errmsg[512];
+        fprintf(stderr, "ERROR: cannot send shared memory transport: %s\r\n",
+                sent < 0 ? strerror_r(errno, errmsg, sizeof(errmsg)) : "partial send");
+        shm_transport_close(&ring);
+        return EXIT_FAILURE;
+    }
+    client->ring = ring;
+    printf("DEBUG: client attached shared memory transport with %d bytes per ring\r\n", ring_size);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Answers a request over its rate limit with an error on the I/O thread. Nothing is
+///        sent if another thread is sending or the send buffer is full, so a client which does
+///        not read cannot block the I/O thread.
+/// @param client connection of the client
+/// @return 1 if the error was sent, 0 if a worker has to send it, -1 if the connection has to be closed
+static int connection_refuse(Connection *client)
+{
+    if (client->ring.shared || pthread_mutex_trylock(&client->send_lock) != 0)
+    {
+        return 0;
+    }
+    static const char message[] = SERVER_RATE_LIMIT_ERROR;
+    FrameHeader header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = RESPONSE_ERROR,
+        .payload_size = sizeof(message)
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)message, .iov_len = sizeof(message) }
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    ssize_t n;
+    do
+    {
+        n = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    pthread_mutex_unlock(&client->send_lock);
+    if (n < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    // the rest of a partial frame could only be sent by waiting, the client does not read anyway
+    if ((size_t)n != sizeof(header) + sizeof(message))
+    {
+        return -1;
+    }
+    client->receiving = 0;
+    timer_cancel(&client->server->timers, &client->receive_timer);
+    return 1;
+}
+
+/// @brief Decodes the next request from buffered data and hands it to the executor, or
+///        waits for more data if no whole request was received yet
+/// @param client connection of the client, not watched by epoll
+/// @param receive receive data from the socket before waiting
+static void connection_next_request(Connection *client, int receive)
+{
+    Error error = {0};
+    FrameStatus status;
+    int refusals = 0;
     while (1)
     {
-        pthread_mutex_lock(&server->mlock);
-        int client_socket = accept(
-                server->server_socket,
-                (struct sockaddr *)&client_addr,
-                &client_addr_len);
+        while ((status = frame_decoder_next(&client->decoder, &client->header, &client->payload, &error)) == FRAME_INCOMPLETE)
+        {
+            if (client->ring.shared)
+            {
+                // the shared memory is checked without a wakeup, the client only sends one
+                // after the server announced that it waits
+                status = connection_fill_ring(client, receive, &error);
+                receive = 0;
+            }
+            else if (!receive)
+            {
+                status = FRAME_WOULD_BLOCK;
+            }
+            else
+            {
+                status = frame_decoder_fill(&client->decoder, client->fd, &error);
+            }
+            if (status != FRAME_INCOMPLETE)
+            {
+                break;
+            }
+        }
+        if (status != FRAME_COMPLETE)
+        {
+            break;
+        }
+        capture_frame(&client->server->capture, client->id, &client->header, client->payload);
+        // the transport is negotiated by the server, the application never sees the request
+        if (client->header.id == REQUEST_ATTACH_RING)
+        {
+            if (connection_attach_ring(client) != EXIT_SUCCESS)
+            {
+                connection_close(client);
+                return;
+            }
+            continue;
+        }
+        if (connection_allow_request(client, client->header.id))
+        {
+            break;
+        }
+        // over the limit, the error is sent inline unless it would have to wait. Beyond
+        // SERVER_MAX_REFUSALS a worker sends it, so a client which keeps sending requests over
+        // its limit cannot hold the I/O thread and starve the other connections.
+        int refused = refusals < SERVER_MAX_REFUSALS ? connection_refuse(client) : 0;
+        if (refused < 0)
+        {
+            connection_close(client);
+            return;
+        }
+        if (refused == 0)
+        {
+            client->refused = 1;
+            break;
+        }
+        refusals++;
+        // the requests which are already buffered are refused, new data waits for the next epoll wakeup
+        receive = 0;
+    }
+
+    switch (status)
+    {
+    case FRAME_COMPLETE:
+        connection_dispatch(client);
+        break;
+    case FRAME_WOULD_BLOCK:
+        connection_wait(client, EPOLL_CTL_MOD);
+        break;
+    case FRAME_CLOSED:
+        printf("DEBUG: client closed connection\r\n");
+        connection_close(client);
+        break;
+    default:
+        // the request is invalid, e.g. due to a wrong magic number or version
+        fprintf(stderr, "ERROR recv: %s\r\n", error.msg);
+        connection_send_error(client, error.msg);
+        connection_close(client);
+        break;
+    }
+}
+
+/// @brief Runs the current request of a connection on a worker, see Task
+static void run_request(Task *task)
+{
+    Connection *client = (Connection *)task;
+    int result;
+    if (client->refused)
+    {
+        client->refused = 0;
+        result = connection_send_error(client, SERVER_RATE_LIMIT_ERROR);
+    }
+    else
+    {
+        result = client->server->request_cb(client, &client->header, client->payload);
+    }
+    timer_cancel(&client->server->timers, &client->deadline_timer);
+    if (result != EXIT_SUCCESS)
+    {
+        connection_close(client);
+        return;
+    }
+    // pipelined requests may already be buffered, otherwise epoll reports new data
+    connection_next_request(client, 0);
+}
+
+/// @brief Accepts all pending connections and registers them with the epoll instance of
+///        the calling I/O thread
+/// @param io I/O thread which accepts the connections
+/// @param listening_socket TCP or Unix socket with pending connections
+static void accept_connections(IoThread *io, int listening_socket)
+{
+    Server *server = io->server;
+    while (1)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_length = sizeof(addr);
+        int client_socket = accept4(listening_socket, (struct sockaddr *)&addr, &addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (client_socket == -1) {
-            char errmsg[512];
-            strerror_r(errno, errmsg, sizeof(errmsg));
-            fprintf(stderr, "ERROR recv: %s\r\n", errmsg);
-            return 0;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                char errmsg[512];
+                fprintf(stderr, "ERROR accept: %s\r\n", strerror_r(errno, errmsg, sizeof(errmsg)));
+            }
+            return;
+        }
+        // local clients are trusted, they share the host with the server anyway
+        uint64_t source = listening_socket == server->unix_socket ? 0 : rate_limit_source(&addr);
+        if (!rate_limiter_allow(&server->limiter, source, RATE_LIMIT_CONNECT)) {
+            printf("DEBUG: refused connection over the rate limit\r\n");
+            close(client_socket);
+            continue;
         }
-        pthread_mutex_unlock(&server->mlock);
+        Connection *client = calloc(1, sizeof(Connection));
+        void *context = server->context_size > 0 ? calloc(1, server->context_size) : NULL;
+        if (!client || (server->context_size > 0 && !context)) {
+            fprintf(stderr, "ERROR: cannot allocate connection\r\n");
+            free(client);
+            free(context);
+            close(client_socket);
+            continue;
+        }
+        client->task.run = run_request;
+        client->fd = client_socket;
+        client->epoll_fd = io->epoll_fd;
+        client->server = server;
+        client->id = atomic_fetch_add_explicit(&server->next_connection_id, 1, memory_order_relaxed) + 1;
+        client->context = context;
+        client->local = listening_socket == server->unix_socket;
+        client->source = source;
+        frame_decoder_init(&client->decoder);
+        capture_event(&server->capture, client->id, CAPTURE_OPEN);
+        timer_init(&client->receive_timer, receive_timeout);
+        timer_init(&client->write_timer, write_timeout);
+        timer_init(&client->deadline_timer, request_deadline);
+        pthread_mutex_init(&client->cancel_lock, NULL);
+        pthread_mutex_init(&client->send_lock, NULL);
+        connection_wait(client, EPOLL_CTL_ADD);
+    }
+}
 
-        server->client_cb(client_socket);
+/// @brief Event loop of an I/O thread. Readable connections are disarmed by EPOLLONESHOT
+///        until their request was handled, so a connection is never read by two threads.
+/// @param arg I/O thread
+/// @return NULL if epoll fails
+static void *io_loop(void *arg)
+{
+    IoThread *io = arg;
+    struct epoll_event events[SERVER_EPOLL_EVENTS];
+
+    while (1)
+    {
+        int n = epoll_wait(io->epoll_fd, events, SERVER_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            char errmsg[512];
+            fprintf(stderr, "ERROR epoll_wait: %s\r\n", strerror_r(errno, errmsg, sizeof(errmsg)));
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &io->server->server_socket || events[i].data.ptr == &io->server->unix_socket) {
+                accept_connections(io, *(int *)events[i].data.ptr);
+            } else {
+                connection_next_request(events[i].data.ptr, 1);
+            }
+        }
     }
-    return 0;
+    return NULL;
 }
 
-/// @brief Bind to the given port and starts listening for new connections.
-///        The newly created socket FD is stored in the address of listeningSocket
-/// @param port port number to listen on
-/// @param listeningSocket address to store the socket file descriptor
-/// @param error Error structure to store the error message in case of an failure
-/// @return EXIT_SUCCESS on success, EXIT_FAILURE on a failure
-static int setup_listening_socket(uint16_t port, int *listeningSocket, Error *error) {
-    int sock = socket(PF_INET, SOCK_STREAM, 0);
+int setup_listening_socket(uint16_t port, int *listeningSocket, Error *error) {
+    int sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock == -1) {
-        strerror_r(errno, error->msg, sizeof(error->msg));
+        error_from_errno(error, errno);
         return EXIT_FAILURE;
     }
 
@@ -68,7 +606,7 @@ static int setup_listening_socket(uint16_t port, int *listeningSocket, Error *er
     if (setsockopt(sock,
                    SOL_SOCKET, SO_REUSEADDR,
                    &enable, sizeof(int)) < 0) {
-        strerror_r(errno, error->msg, sizeof(error->msg));
+        error_from_errno(error, errno);
         return EXIT_FAILURE;
     }
 
@@ -80,26 +618,95 @@ static int setup_listening_socket(uint16_t port, int *listeningSocket, Error *er
     if (bind(sock,
              (const struct sockaddr *)&srv_addr,
              sizeof(srv_addr)) < 0) {
-        strerror_r(errno, error->msg, sizeof(error->msg));
+        error_from_errno(error, errno);
         return EXIT_FAILURE;
     }     
 
-    if (listen(sock, 10) < 0) {
-        strerror_r(errno, error->msg, sizeof(error->msg));
+    if (listen(sock, SOMAXCONN) < 0) {
+        error_from_errno(error, errno);
         return EXIT_FAILURE;
     }
 
     *listeningSocket = sock;
     return EXIT_SUCCESS;
 }
- 
-int server_init(Server *server, void (*client_cb)(int client_socket)) {
-    if (!client_cb) {
+
+/// @brief Binds to the path of a Unix socket and starts listening for new connections. A stale
+///        socket file of a previous run is removed.
+/// @param path path of the socket
+/// @param listeningSocket address to store the socket file descriptor
+/// @param error Error structure to store the error message in case of an failure
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE on a failure
+static int setup_unix_socket(const char *path, int *listeningSocket, Error *error) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        error_write(error, "Unix socket path too long: %s", path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    if (bind(sock, (const struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(sock, SOMAXCONN) < 0) {
+        error_from_errno(error, errno);
+        close(sock);
+        return EXIT_FAILURE;
+    }
+    *listeningSocket = sock;
+    return EXIT_SUCCESS;
+}
+
+void server_options_init(ServerOptions *options) {
+    options->io_threads = SERVER_DEFAULT_IO_THREADS;
+    options->min_workers = SERVER_DEFAULT_MIN_WORKERS;
+    options->max_workers = SERVER_DEFAULT_MAX_WORKERS;
+    options->idle_timeout_ms = SERVER_DEFAULT_IDLE_TIMEOUT_MS;
+    options->read_timeout_ms = SERVER_DEFAULT_READ_TIMEOUT_MS;
+    options->write_timeout_ms = SERVER_DEFAULT_WRITE_TIMEOUT_MS;
+    options->request_timeout_ms = SERVER_DEFAULT_REQUEST_TIMEOUT_MS;
+    options->unix_path[0] = '\0';
+    options->ring_size = SHM_DEFAULT_RING_SIZE;
+    rate_limit_options_init(&options->limits);
+    options->capture_path[0] = '\0';
+    options->capture_buffer_size = CAPTURE_DEFAULT_BUFFER_SIZE;
+}
+
+int server_init(Server *server, const ServerOptions *options, ServerRequestCallback request_cb, size_t context_size, Error *error) {
+    if (!request_cb) {
+        error_write(error, "%s", "missing request callback");
+        return EXIT_FAILURE;
+    }
+    if (options->io_threads < 1 || options->io_threads > SERVER_MAX_IO_THREADS) {
+        error_write(error, "invalid amount of I/O threads %d", options->io_threads);
         return EXIT_FAILURE;
     }
     server->server_socket = 0;
-    server->client_cb = client_cb;
-    return pthread_mutex_init(&server->mlock, 0);
+    server->unix_socket = -1;
+    server->options = *options;
+    server->request_cb = request_cb;
+    server->close_cb = NULL;
+    server->context_size = context_size;
+    timer_wheel_init(&server->timers);
+    pthread_mutex_init(&server->cancel_queue_lock, NULL);
+    pthread_cond_init(&server->cancel_cond, NULL);
+    server->cancel_head = NULL;
+    server->cancel_tail = NULL;
+    server->cancelling = NULL;
+    atomic_init(&server->next_connection_id, 0);
+    if (rate_limiter_init(&server->limiter, &options->limits, error) != EXIT_SUCCESS
+            || capture_init(&server->capture, options->capture_path, options->capture_buffer_size, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    return executor_init(&server->executor, options->min_workers, options->max_workers, error);
+}
+
+void server_set_close_callback(Server *server, ServerCloseCallback close_cb) {
+    server->close_cb = close_cb;
 }
 
 Error server_loop(Server *server, uint16_t server_port) {
@@ -112,9 +719,47 @@ Error server_loop(Server *server, uint16_t server_port) {
     if (setup_listening_socket(server_port, &server->server_socket, &error) != EXIT_SUCCESS) {
         return error;
     }
-    for (int i = 0; i < THREADS_COUNT; ++i) {
-        if (pthread_create(&server->threads[i], NULL, &handle_request_loop, server) != 0) {
-            strerror_r(errno, error.msg, sizeof(error.msg));
+    if (server->options.unix_path[0] != '\0') {
+        if (setup_unix_socket(server->options.unix_path, &server->unix_socket, &error) != EXIT_SUCCESS) {
+            return error;
+        }
+        printf("server listening on %s\n", server->options.unix_path);
+    }
+    if (executor_start(&server->executor, &error) != EXIT_SUCCESS
+            || timer_wheel_start(&server->timers, &error) != EXIT_SUCCESS
+            || capture_start(&server->capture, &error) != EXIT_SUCCESS) {
+        return error;
+    }
+    int result = pthread_create(&server->cancel_thread, NULL, cancel_loop, server);
+    if (result != 0) {
+        error_from_errno(&error, result);
+        return error;
+    }
+    if (server->options.capture_path[0] != '\0') {
+        printf("server capturing received frames to %s\n", server->options.capture_path);
+    }
+    for (int i = 0; i < server->options.io_threads; ++i) {
+        IoThread *io = &server->io_threads[i];
+        io->server = server;
+        io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (io->epoll_fd < 0) {
+            error_from_errno(&error, errno);
+            return error;
+        }
+        // every I/O thread accepts, EPOLLEXCLUSIVE wakes only one of them per connection
+        struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &server->server_socket };
+        if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, server->server_socket, &event) < 0) {
+            error_from_errno(&error, errno);
+            return error;
+        }
+        event.data.ptr = &server->unix_socket;
+        if (server->unix_socket >= 0 && epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, server->unix_socket, &event) < 0) {
+            error_from_errno(&error, errno);
+            return error;
+        }
+        result = pthread_create(&io->thread, NULL, &io_loop, io);
+        if (result != 0) {
+            error_from_errno(&error, result);
             return error;
         }
     }
@@ -122,3 +767,151 @@ Error server_loop(Server *server, uint16_t server_port) {
     for (;;)
         pause();
 }
+
+/// @brief Writes a frame into the response ring of a shared memory transport. Waits for a
+///        wakeup of the client while the ring is full, see connection_send_frame()
+/// @param client connection of the client with attached rings
+/// @param header header of the frame
+/// @param payload payload of the frame
+/// @return 0 on success, errno is set on failure
+static int connection_send_ring(Connection *client, const FrameHeader *header, const void *payload) {
+    ShmRing *ring = &client->ring.shared->responses;
+    const uint8_t *parts[2] = { (const uint8_t *)header, payload };
+    size_t sizes[2] = { sizeof(*header), header->payload_size };
+    int write_timer_armed = 0;
+    int result = EXIT_SUCCESS;
+    for (int i = 0; i < 2 && result == EXIT_SUCCESS; i++) {
+        while (sizes[i] > 0) {
+            size_t n = shm_ring_write(&client->ring, ring, parts[i], sizes[i]);
+            if (n > 0) {
+                shm_ring_wake_client(ring, 1);
+                parts[i] += n;
+                sizes[i] -= n;
+                continue;
+            }
+            if (!shm_ring_prepare_wait(&client->ring, ring, 0)) {
+                continue;
+            }
+            // the ring is full, the write timeout shuts the socket down if the client does not read
+            int timeout_ms = client->server->options.write_timeout_ms;
+            if (!write_timer_armed && timeout_ms > 0) {
+                timer_schedule(&client->server->timers, &client->write_timer, timeout_ms);
+                write_timer_armed = 1;
+            }
+            struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+            int polled = poll(&pfd, 1, -1);
+            shm_ring_end_wait(ring, 0);
+            if ((polled < 0 && errno != EINTR) || connection_drain_doorbells(client) != EXIT_SUCCESS) {
+                errno = EPIPE;
+                result = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+    if (write_timer_armed) {
+        int saved_errno = errno;
+        timer_cancel(&client->server->timers, &client->write_timer);
+        errno = saved_errno;
+    }
+    return result;
+}
+
+/// @brief Sends a frame over the socket, see connection_send_frame()
+/// @param client connection of the client
+/// @param header header of the frame
+/// @param payload payload of the frame
+/// @return 0 on success, errno is set on failure
+static int connection_send_socket(Connection *client, const FrameHeader *header, const void *payload) {
+    struct iovec iov[2] = {
+        { .iov_base = (void *)header, .iov_len = sizeof(*header) },
+        { .iov_base = (void *)payload, .iov_len = header->payload_size }
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = header->payload_size > 0 ? 2 : 1 };
+    int write_timer_armed = 0;
+    int result = EXIT_SUCCESS;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the send buffer is full, the write timeout shuts the socket down if the client does not read
+                int timeout_ms = client->server->options.write_timeout_ms;
+                if (!write_timer_armed && timeout_ms > 0) {
+                    timer_schedule(&client->server->timers, &client->write_timer, timeout_ms);
+                    write_timer_armed = 1;
+                }
+                struct pollfd pfd = { .fd = client->fd, .events = POLLOUT };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    result = EXIT_FAILURE;
+                    break;
+                }
+                continue;
+            }
+            result = EXIT_FAILURE;
+            break;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    if (write_timer_armed) {
+        int saved_errno = errno;
+        timer_cancel(&client->server->timers, &client->write_timer);
+        errno = saved_errno;
+    }
+    return result;
+}
+
+int connection_send_frame(Connection *client, const FrameHeader *header, const void *payload) {
+    pthread_mutex_lock(&client->send_lock);
+    int result = client->ring.shared
+        ? connection_send_ring(client, header, payload)
+        : connection_send_socket(client, header, payload);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&client->send_lock);
+    errno = saved_errno;
+    return result;
+}
+
+int connection_set_cancel(Connection *client, void (*cancel_cb)(void *arg), void *arg) {
+    pthread_mutex_lock(&client->cancel_lock);
+    int expired = client->expired && cancel_cb;
+    if (!expired) {
+        client->cancel_cb = cancel_cb;
+        client->cancel_arg = arg;
+    }
+    pthread_mutex_unlock(&client->cancel_lock);
+    return expired ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int connection_allow_request(Connection *client, int request_id) {
+    // other IDs would share the bucket of new connections
+    if (request_id >= RATE_LIMIT_MAX_KINDS) {
+        return 1;
+    }
+    return rate_limiter_allow(&client->server->limiter, client->source, request_id);
+}
+
+int connection_send_error(Connection *client, const char *err_msg) {
+    FrameHeader header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = RESPONSE_ERROR,
+        .payload_size = (strlen(err_msg) + 1) * sizeof(char)   // TODO: handle possible overflow
+    };
+    if (connection_send_frame(client, &header, err_msg) != EXIT_SUCCESS) {
+        char systemcall_err_msg[512];
+        fprintf(stderr, "ERROR: cannot send error response %s\r\n",
+                strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg)));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -3,24 +3,135 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <inttypes.h>
 
+#include "capture.h"
 #include "error.h"
+#include "executor.h"
+#include "frame.h"
+#include "rate_limit.h"
+#include "shm_transport.h"
+#include "timer.h"
 
-#define THREADS_COUNT   100
+#define SERVER_MAX_IO_THREADS       16
+#define SERVER_DEFAULT_IO_THREADS   2
+#define SERVER_DEFAULT_MIN_WORKERS  8       // formerly the fixed THREADS_COUNT
+#define SERVER_DEFAULT_MAX_WORKERS  256
+#define SERVER_DEFAULT_IDLE_TIMEOUT_MS      10000   // formerly SO_RCVTIMEO of the client sockets
+#define SERVER_DEFAULT_READ_TIMEOUT_MS      10000
+#define SERVER_DEFAULT_WRITE_TIMEOUT_MS     10000
+#define SERVER_DEFAULT_REQUEST_TIMEOUT_MS   30000
+#define SERVER_MAX_UNIX_PATH        108     // sun_path of struct sockaddr_un
+#define SERVER_RATE_LIMIT_ERROR     "rate limit exceeded"
 
+/// @brief Tunable thread counts and timeouts of the server, a timeout of 0 disables it
 typedef struct {
-    int       server_socket;              // socket for listening for new clients
-    pthread_t threads[THREADS_COUNT];     // thread pool
-    pthread_mutex_t mlock;                // lock for mutual access to listen()
-    void (*client_cb)(int client_socket); // callback for talking to clients
+    int io_threads;         // threads accepting connections and decoding frames
+    int min_workers;        // workers which are kept running while idle
+    int max_workers;        // upper limit of workers while requests are blocked on the database
+    int idle_timeout_ms;    // time a client may wait between requests
+    int read_timeout_ms;    // time a client may take to send a whole request
+    int write_timeout_ms;   // time a client may not read while the send buffer is full
+    int request_timeout_ms; // deadline for handling a request
+    char unix_path[SERVER_MAX_UNIX_PATH];   // Unix socket to listen on besides the TCP port, empty to disable
+    int ring_size;          // capacity of each ring of the shared memory transport, 0 disables it
+    RateLimitOptions limits;// connections and requests per client address
+    char capture_path[CAPTURE_MAX_PATH];    // file recording all received frames, empty to disable capturing
+    int capture_buffer_size;// frames buffered for the capture file before they are dropped
+} ServerOptions;
+
+struct Server;
+
+/// @brief Client connection. The connection is watched by one I/O thread which decodes
+///        frames and passes each complete request to the executor. The next request of the
+///        connection is not decoded before the previous one was handled.
+typedef struct Connection {
+    Task            task;           // runs the current request on a worker
+    int             fd;             // non-blocking client socket
+    int             epoll_fd;       // epoll instance of the I/O thread watching the connection
+    struct Server   *server;        // server the connection belongs to
+    uint32_t        id;             // number of the connection since the start of the server
+    FrameDecoder    decoder;        // frames received from the client
+    FrameHeader     header;         // header of the current request
+    const uint8_t   *payload;       // payload of the current request, points into the decoder
+    void            *context;       // zero initialized state of the application, e.g. a database session
+    Timer           receive_timer;  // idle timeout between requests, read timeout within a request
+    int             receiving;      // a partial request is buffered and the read timeout is armed
+    Timer           write_timer;    // write timeout while the send buffer is full
+    Timer           deadline_timer; // deadline of the current request
+    pthread_mutex_t cancel_lock;    // protects the fields below
+    int             expired;        // the deadline of the current request expired
+    void (*cancel_cb)(void *arg);   // aborts blocking work of the current request on expiry
+    void            *cancel_arg;    // argument of cancel_cb
+    struct Connection *cancel_next; // next connection of the cancel queue of the server
+    int             cancel_queued;  // the connection waits in the cancel queue of the server
+    int             local;          // the client connected over the Unix socket
+    ShmTransport    ring;           // shared memory transport, frames go through the socket while ring.shared is NULL
+    pthread_mutex_t send_lock;      // keeps frames pushed by other threads from interleaving with responses
+    int             pushing;        // the application pushes frames without requests, the idle timeout does not apply
+    uint64_t        source;         // rate limit key of the client address, 0 for local clients
+    int             refused;        // the current request exceeded its rate limit and is answered with an error
+} Connection;
+
+/// @brief Handles a single request on a worker thread
+/// @param client connection of the client
+/// @param header header of the request
+/// @param payload payload of the request, valid until the callback returns
+/// @return EXIT_SUCCESS to keep the connection open, otherwise it is closed
+typedef int (*ServerRequestCallback)(Connection *client, const FrameHeader *header, const uint8_t *payload);
+
+/// @brief Releases the state of the application before a connection is closed, e.g. stops
+///        threads pushing frames to the client. Runs on the thread closing the connection.
+/// @param client connection of the client
+typedef void (*ServerCloseCallback)(Connection *client);
+
+/// @brief I/O thread with its own epoll instance
+typedef struct {
+    pthread_t       thread;
+    int             epoll_fd;
+    struct Server   *server;
+} IoThread;
+
+typedef struct Server {
+    int             server_socket;                      // socket for listening for new clients
+    int             unix_socket;                        // Unix socket for listening for local clients, -1 if disabled
+    ServerOptions   options;                            // thread counts and timeouts
+    IoThread        io_threads[SERVER_MAX_IO_THREADS];  // threads decoding requests
+    Executor        executor;                           // workers handling requests
+    TimerWheel      timers;                             // timeouts of all connections
+    RateLimiter     limiter;                            // token buckets of the client addresses
+    Capture         capture;                            // recording of the received frames
+    pthread_t       cancel_thread;                      // runs the cancel callbacks of expired requests
+    pthread_mutex_t cancel_queue_lock;                  // protects the fields below and Connection.cancel_next/cancel_queued
+    pthread_cond_t  cancel_cond;                        // signalled when a connection is queued or its callback returned
+    struct Connection *cancel_head;                     // oldest connection waiting for its cancel callback
+    struct Connection *cancel_tail;                     // newest connection waiting for its cancel callback
+    struct Connection *cancelling;                      // connection whose cancel callback is running
+    atomic_uint     next_connection_id;                 // ID of the last accepted connection
+    ServerRequestCallback request_cb;                   // callback for handling requests
+    ServerCloseCallback close_cb;                       // callback for closed connections, may be NULL
+    size_t          context_size;                       // size of Connection.context
 } Server;
 
+/// @brief Sets the default thread counts and timeouts
+/// @param options options to initialize
+void server_options_init(ServerOptions *options);
+
 /// @brief Initializes the server
 /// @param server  pointer to server struct
-/// @param client_cb callback function for talking to clients, must not be null
+/// @param options thread counts and timeouts
+/// @param request_cb callback function for handling requests, must not be null
+/// @param context_size size of the per connection state passed to request_cb, may be 0
+/// @param error address of error object to set an error message on failure
 /// @return 0 on success
-int server_init(Server *server, void (*client_cb)(int client_socket));
+int server_init(Server *server, const ServerOptions *options, ServerRequestCallback request_cb, size_t context_size, Error *error);
+
+/// @brief Sets the callback which is called before a connection is closed
+/// @param server initialized server, the loop must not run yet
+/// @param close_cb callback or NULL
+void server_set_close_callback(Server *server, ServerCloseCallback close_cb);
 
 /// @brief Starts server main loop. The function only returns in case of an error which the server
 ///        cannot recover from. If no failure occurs the server loop is executed unless a signal
@@ -30,4 +141,46 @@ int server_init(Server *server, void (*client_cb)(int client_socket));
 /// @return Error description
 Error server_loop(Server *server, uint16_t server_port);
 
-#endif
\ No newline at end of file
+/// @brief Bind to the given port and starts listening for new connections.
+///        The newly created non-blocking socket FD is stored in the address of listeningSocket
+/// @param port port number to listen on
+/// @param listeningSocket address to store the socket file descriptor
+/// @param error Error structure to store the error message in case of an failure
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE on a failure
+int setup_listening_socket(uint16_t port, int *listeningSocket, Error *error);
+
+/// @brief Sends a frame to the client. Waits until the socket is writable if its send
+///        buffer is full, the connection is shut down if this exceeds the write timeout.
+///        Frames may be sent by other threads than the one handling the current request,
+///        each frame is sent as a whole.
+/// @param client connection of the client
+/// @param header header of the frame, payload_size must be set
+/// @param payload payload of the frame, may be NULL if payload_size is 0
+/// @return 0 on success, errno is set on failure
+int connection_send_frame(Connection *client, const FrameHeader *header, const void *payload);
+
+/// @brief Registers a callback which aborts blocking work of the current request, e.g. by
+///        cancelling a database query, when the request deadline expires. The callback runs
+///        on the cancel thread of the server, so a blocking callback does not delay the
+///        timeouts of other connections. It must be cleared before its argument is released,
+///        clearing it waits for a running callback.
+/// @param client connection of the client
+/// @param cancel_cb callback or NULL to clear it
+/// @param arg argument of the callback
+/// @return 0 on success, EXIT_FAILURE if the deadline already expired and no callback was set
+int connection_set_cancel(Connection *client, void (*cancel_cb)(void *arg), void *arg);
+
+/// @brief Takes a token from the rate limit bucket of a request kind for the client, e.g. for
+///        every sub-request of a batch. The I/O threads already charge each received request.
+/// @param client connection of the client
+/// @param request_id request ID of the bucket
+/// @return 1 if the client stays within its limit, 0 if the request has to be refused with SERVER_RATE_LIMIT_ERROR
+int connection_allow_request(Connection *client, int request_id);
+
+/// @brief Sends an error response with a null terminated message to the client
+/// @param client connection of the client
+/// @param err_msg null terminated error message
+/// @return 0 on success
+int connection_send_error(Connection *client, const char *err_msg);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include "shm_transport.h"
+#include "api.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+_Static_assert(sizeof(ShmRingPair) % SHM_CACHE_LINE == 0, "rings must not share cache lines with the data");
+
+#define SHM_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)   // the size of the shared memory is fixed for good
+
+/// @brief Pauses a spinning thread for a moment
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/// @brief Returns 1 if the consumer can read or the producer can write
+/// @param transport mapped transport
+/// @param ring ring of the transport
+/// @param consumer check for data, otherwise for free space
+static int ring_ready(ShmTransport *transport, ShmRing *ring, int consumer)
+{
+    unsigned long long used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+    return consumer ? used > 0 : used < transport->capacity;
+}
+
+/// @brief Returns the data area of a ring
+/// @param transport mapped transport
+/// @param ring ring of the transport
+static uint8_t *ring_data(ShmTransport *transport, ShmRing *ring)
+{
+    size_t offset = sizeof(ShmRingPair) + (ring == &transport->shared->responses ? transport->capacity : 0);
+    return (uint8_t *)transport->shared + offset;
+}
+
+int shm_transport_create(ShmTransport *transport, uint32_t ring_size, int *fd, Error *error)
+{
+    if (ring_size < SHM_MIN_RING_SIZE || ring_size > SHM_MAX_RING_SIZE || (ring_size & (ring_size - 1)) != 0)
+    {
+        error_write(error, "invalid ring size %u, expected a power of two", ring_size);
+        return EXIT_FAILURE;
+    }
+    size_t size = sizeof(ShmRingPair) + 2 * (size_t)ring_size;
+    int memfd = memfd_create("shop_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+    {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+    // the client gets the memfd too, a truncated file would fault the mapping of the server
+    if (ftruncate(memfd, size) < 0 || fcntl(memfd, F_ADD_SEALS, SHM_SEALS) < 0)
+    {
+        error_from_errno(error, errno);
+        close(memfd);
+        return EXIT_FAILURE;
+    }
+    ShmRingPair *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shared == MAP_FAILED)
+    {
+        error_from_errno(error, errno);
+        close(memfd);
+        return EXIT_FAILURE;
+    }
+    // the memfd is zero filled, only the layout has to be set
+    shared->magic = SHM_MAGIC;
+    shared->size = size;
+    shared->requests.capacity = ring_size;
+    shared->requests.data_offset = sizeof(ShmRingPair);
+    shared->responses.capacity = ring_size;
+    shared->responses.data_offset = sizeof(ShmRingPair) + ring_size;
+    transport->shared = shared;
+    transport->size = size;
+    transport->capacity = ring_size;
+    transport->spin_count = 0;
+    *fd = memfd;
+    return EXIT_SUCCESS;
+}
+
+int shm_transport_map(ShmTransport *transport, int fd, Error *error)
+{
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0)
+    {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+    if ((seals & SHM_SEALS) != SHM_SEALS)
+    {
+        error_write(error, "%s", "size of the shared memory is not sealed");
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+    if ((size_t)st.st_size < sizeof(ShmRingPair))
+    {
+        error_write(error, "shared memory too small (%ld bytes)", (long)st.st_size);
+        return EXIT_FAILURE;
+    }
+    ShmRingPair *shared = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
+    {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+    uint32_t capacity = shared->requests.capacity;
+    if (shared->magic != SHM_MAGIC || shared->size != (size_t)st.st_size
+            || capacity == 0 || (capacity & (capacity - 1)) != 0
+            || shared->responses.capacity != capacity
+            || shared->requests.data_offset != sizeof(ShmRingPair)
+            || shared->responses.data_offset != sizeof(ShmRingPair) + capacity
+            || sizeof(ShmRingPair) + 2 * (size_t)capacity > (size_t)st.st_size)
+    {
+        error_write(error, "%s", "invalid shared memory layout");
+        munmap(shared, st.st_size);
+        return EXIT_FAILURE;
+    }
+    transport->shared = shared;
+    transport->size = st.st_size;
+    transport->capacity = capacity;
+    // spinning only helps if the server runs on another CPU meanwhile
+    transport->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_COUNT : 0;
+    return EXIT_SUCCESS;
+}
+
+void shm_transport_close(ShmTransport *transport)
+{
+    if (transport->shared)
+    {
+        munmap(transport->shared, transport->size);
+        transport->shared = NULL;
+    }
+}
+
+size_t shm_ring_read(ShmTransport *transport, ShmRing *ring, void *buffer, size_t size)
+{
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    // positions beyond the capacity can only come from a broken peer, treat the ring as empty
+    unsigned long long available = tail - head;
+    size_t n = available > transport->capacity ? 0 : (size < available ? size : available);
+    if (n == 0)
+    {
+        return 0;
+    }
+    const uint8_t *data = ring_data(transport, ring);
+    size_t offset = head & (transport->capacity - 1);
+    size_t first = transport->capacity - offset < n ? transport->capacity - offset : n;
+    memcpy(buffer, data + offset, first);
+    memcpy((uint8_t *)buffer + first, data, n - first);
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    return n;
+}
+
+size_t shm_ring_write(ShmTransport *transport, ShmRing *ring, const void *data, size_t size)
+{
+    unsigned long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    // positions beyond the capacity can only come from a broken peer, treat the ring as full
+    unsigned long long used = tail - head;
+    size_t space = used > transport->capacity ? 0 : transport->capacity - used;
+    size_t n = size < space ? size : space;
+    if (n == 0)
+    {
+        return 0;
+    }
+    uint8_t *area = ring_data(transport, ring);
+    size_t offset = tail & (transport->capacity - 1);
+    size_t first = transport->capacity - offset < n ? transport->capacity - offset : n;
+    memcpy(area + offset, data, first);
+    memcpy(area, (const uint8_t *)data + first, n - first);
+    atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+    return n;
+}
+
+int shm_ring_prepare_wait(ShmTransport *transport, ShmRing *ring, int consumer)
+{
+    atomic_int *waiting = consumer ? &ring->consumer_waiting : &ring->producer_waiting;
+    // the announcement must be visible before the ring is checked again, the other side
+    // checks the announcement after changing the ring
+    atomic_store(waiting, 1);
+    if (ring_ready(transport, ring, consumer))
+    {
+        atomic_store(waiting, 0);
+        return 0;
+    }
+    return 1;
+}
+
+void shm_ring_end_wait(ShmRing *ring, int consumer)
+{
+    atomic_store(consumer ? &ring->consumer_waiting : &ring->producer_waiting, 0);
+}
+
+void shm_ring_wake_client(ShmRing *ring, int consumer)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(consumer ? &ring->consumer_waiting : &ring->producer_waiting))
+    {
+        atomic_fetch_add(&ring->wakeups, 1);
+        syscall(SYS_futex, &ring->wakeups, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/// @brief Wakes the server if it sleeps on the ring by sending a byte over the socket
+/// @param ring ring of the transport
+/// @param consumer the server consumes the ring, otherwise it produces into the ring
+/// @param fd Unix socket of the connection
+static void wake_server(ShmRing *ring, int consumer, int fd)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(consumer ? &ring->consumer_waiting : &ring->producer_waiting))
+    {
+        // a full socket buffer already holds enough wakeups
+        char doorbell = 0;
+        send(fd, &doorbell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+int shm_client_attach(ShmTransport *transport, int fd, Error *error)
+{
+    RequestHeader request = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .request_id = REQUEST_ATTACH_RING,
+        .payload_size = 0,
+        .flags = 0
+    };
+    if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+    {
+        error_from_errno(error, errno);
+        return EXIT_FAILURE;
+    }
+
+    // the memfd arrives together with the header
+    ResponseHeader header;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (n != sizeof(header))
+    {
+        error_write(error, "%s", n < 0 ? strerror(errno) : "connection closed");
+        return EXIT_FAILURE;
+    }
+    int memfd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(memfd));
+    }
+
+    char payload[256];
+    if (header.payload_size > sizeof(payload)
+            || (header.payload_size > 0 && recv(fd, payload, header.payload_size, MSG_WAITALL) != (ssize_t)header.payload_size))
+    {
+        error_write(error, "%s", "invalid attach response");
+        goto fail;
+    }
+    if (header.response_id == RESPONSE_ERROR)
+    {
+        error_write(error, "%.*s", (int)header.payload_size, payload);
+        goto fail;
+    }
+    AttachRingResponse response;
+    if (header.response_id != RESPONSE_ATTACH_RING || header.payload_size != sizeof(response) || memfd < 0)
+    {
+        error_write(error, "%s", "invalid attach response");
+        goto fail;
+    }
+    memcpy(&response, payload, sizeof(response));
+    if (shm_transport_map(transport, memfd, error) != EXIT_SUCCESS)
+    {
+        goto fail;
+    }
+    close(memfd);
+    return EXIT_SUCCESS;
+
+fail:
+    if (memfd >= 0)
+    {
+        close(memfd);
+    }
+    return EXIT_FAILURE;
+}
+
+size_t shm_client_try_write(ShmTransport *transport, int fd, const void *data, size_t size)
+{
+    ShmRing *ring = &transport->shared->requests;
+    size_t n = shm_ring_write(transport, ring, data, size);
+    if (n > 0)
+    {
+        wake_server(ring, 1, fd);
+    }
+    return n;
+}
+
+size_t shm_client_try_read(ShmTransport *transport, int fd, void *buffer, size_t size)
+{
+    ShmRing *ring = &transport->shared->responses;
+    size_t n = shm_ring_read(transport, ring, buffer, size);
+    if (n > 0)
+    {
+        wake_server(ring, 0, fd);
+    }
+    return n;
+}
+
+int shm_client_wait(ShmTransport *transport, int fd, int readable)
+{
+    ShmRing *ring = readable ? &transport->shared->responses : &transport->shared->requests;
+    for (int i = 0; i < transport->spin_count; i++)
+    {
+        if (ring_ready(transport, ring, readable))
+        {
+            return EXIT_SUCCESS;
+        }
+        cpu_relax();
+    }
+    int result = EXIT_SUCCESS;
+    while (1)
+    {
+        unsigned int wakeups = atomic_load(&ring->wakeups);
+        if (!shm_ring_prepare_wait(transport, ring, readable))
+        {
+            break;
+        }
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = SHM_WAIT_MS * 1000000L };
+        if (syscall(SYS_futex, &ring->wakeups, FUTEX_WAIT, wakeups, &timeout, NULL, 0) < 0 && errno == ETIMEDOUT)
+        {
+            // the server only closes the socket after the rings were attached
+            char byte;
+            if (recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+            {
+                result = EXIT_FAILURE;
+                break;
+            }
+        }
+        shm_ring_end_wait(ring, readable);
+    }
+    shm_ring_end_wait(ring, readable);
+    return result;
+}
+
+int shm_client_writev(ShmTransport *transport, int fd, const struct iovec *parts, int count)
+{
+    ShmRing *ring = &transport->shared->requests;
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *data = parts[i].iov_base;
+        size_t size = parts[i].iov_len;
+        while (size > 0)
+        {
+            // the server is only woken once the whole frame is in the ring, unless it does not fit
+            size_t n = shm_ring_write(transport, ring, data, size);
+            data += n;
+            size -= n;
+            if (size > 0)
+            {
+                wake_server(ring, 1, fd);
+                if (shm_client_wait(transport, fd, 0) != EXIT_SUCCESS)
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    wake_server(ring, 1, fd);
+    return EXIT_SUCCESS;
+}
+
+int shm_client_write(ShmTransport *transport, int fd, const void *data, size_t size)
+{
+    struct iovec part = { .iov_base = (void *)data, .iov_len = size };
+    return shm_client_writev(transport, fd, &part, 1);
+}
+
+size_t shm_client_read(ShmTransport *transport, int fd, void *buffer, size_t size)
+{
+    while (1)
+    {
+        size_t n = shm_client_try_read(transport, fd, buffer, size);
+        if (n > 0)
+        {
+            return n;
+        }
+        if (shm_client_wait(transport, fd, 1) != EXIT_SUCCESS)
+        {
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,168 @@
+#ifndef __SHM_TRANSPORT_H_
+#define __SHM_TRANSPORT_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "error.h"
+
+#define SHM_CACHE_LINE          64
+#define SHM_MAGIC               0x53484d52      // "SHMR"
+#define SHM_MIN_RING_SIZE       (4 * 1024)
+#define SHM_MAX_RING_SIZE       (64 * 1024 * 1024)
+#define SHM_DEFAULT_RING_SIZE   (1024 * 1024)
+#define SHM_SPIN_COUNT          2000            // checks of a ring before the client sleeps on the futex
+#define SHM_WAIT_MS             100             // how often a sleeping client checks whether the server is gone
+
+/// @brief Single producer single consumer byte ring in shared memory. Producer and consumer
+///        positions grow monotonically, the position in the data area is the position modulo
+///        the capacity. Every side announces when it goes to sleep, so the other side only
+///        makes a system call to wake it if it really sleeps.
+typedef struct {
+    _Alignas(SHM_CACHE_LINE)
+    atomic_ullong   tail;               // bytes written by the producer
+    atomic_int      producer_waiting;   // the producer waits for free space
+    _Alignas(SHM_CACHE_LINE)
+    atomic_ullong   head;               // bytes read by the consumer
+    atomic_int      consumer_waiting;   // the consumer waits for data
+    _Alignas(SHM_CACHE_LINE)
+    atomic_uint     wakeups;            // futex word of the client, incremented on every wakeup
+    uint32_t        capacity;           // size of the data area, a power of two
+    uint32_t        data_offset;        // offset of the data area from the start of the shared memory
+} ShmRing;
+
+/// @brief Start of the shared memory of a connection, followed by the data areas of both rings
+typedef struct {
+    uint32_t    magic;
+    uint32_t    size;           // size of the shared memory
+    ShmRing     requests;       // frames from the client to the server
+    ShmRing     responses;      // frames from the server to the client
+} ShmRingPair;
+
+/// @brief Mapping of the shared memory of a connection in one process. The client wakes the
+///        server by sending a byte over the Unix socket of the connection, which the server
+///        watches with epoll anyway. The server wakes the client with a futex on the ring.
+///        The geometry of the rings is kept outside of the shared memory, so the other
+///        process cannot redirect reads and writes out of the mapping.
+typedef struct {
+    ShmRingPair *shared;    // mapped shared memory
+    size_t      size;       // size of the mapping
+    uint32_t    capacity;   // capacity of each ring
+    int         spin_count; // checks of a ring before sleeping, 0 on a single CPU
+} ShmTransport;
+
+/// @brief Creates the shared memory of a connection in a memfd, whose size is sealed
+/// @param transport transport to initialize
+/// @param ring_size capacity of each ring, a power of two between SHM_MIN_RING_SIZE and SHM_MAX_RING_SIZE
+/// @param fd address to save the memfd, which has to be closed by the caller
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int shm_transport_create(ShmTransport *transport, uint32_t ring_size, int *fd, Error *error);
+
+/// @brief Maps the shared memory received from the server, its size has to be sealed
+/// @param transport transport to initialize
+/// @param fd memfd of the shared memory
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int shm_transport_map(ShmTransport *transport, int fd, Error *error);
+
+/// @brief Unmaps the shared memory
+/// @param transport mapped transport
+void shm_transport_close(ShmTransport *transport);
+
+/// @brief Reads available bytes from a ring without blocking
+/// @param transport mapped transport
+/// @param ring ring of the transport
+/// @param buffer address to copy the bytes to
+/// @param size size of the buffer
+/// @return amount of bytes read
+size_t shm_ring_read(ShmTransport *transport, ShmRing *ring, void *buffer, size_t size);
+
+/// @brief Writes as many bytes into a ring as fit without blocking
+/// @param transport mapped transport
+/// @param ring ring of the transport
+/// @param data bytes to write
+/// @param size amount of bytes
+/// @return amount of bytes written
+size_t shm_ring_write(ShmTransport *transport, ShmRing *ring, const void *data, size_t size);
+
+/// @brief Announces that the consumer or the producer of a ring goes to sleep
+/// @param transport mapped transport
+/// @param ring ring of the transport
+/// @param consumer the consumer waits for data, otherwise the producer waits for space
+/// @return 1 if the caller has to sleep, 0 if the ring changed meanwhile and the caller
+///         continues, in which case the announcement was withdrawn
+int shm_ring_prepare_wait(ShmTransport *transport, ShmRing *ring, int consumer);
+
+/// @brief Withdraws the announcement of shm_ring_prepare_wait() after waking up
+/// @param ring ring of the transport
+/// @param consumer the consumer waited, otherwise the producer
+void shm_ring_end_wait(ShmRing *ring, int consumer);
+
+/// @brief Wakes the client if it sleeps on the ring, called by the server after writing to
+///        the response ring or reading from the request ring
+/// @param ring ring of the transport
+/// @param consumer the client consumes the ring, otherwise it produces into the ring
+void shm_ring_wake_client(ShmRing *ring, int consumer);
+
+/// @brief Requests the shared memory transport on a connected Unix socket and maps it
+/// @param transport transport to initialize
+/// @param fd connected Unix socket
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success, the connection keeps using the socket on failure
+int shm_client_attach(ShmTransport *transport, int fd, Error *error);
+
+/// @brief Writes a frame or a part of it into the request ring, waiting while the ring is full
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param data bytes to write
+/// @param size amount of bytes
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the server closed the connection
+int shm_client_write(ShmTransport *transport, int fd, const void *data, size_t size);
+
+/// @brief Writes the parts of a frame into the request ring, waiting while the ring is full.
+///        The server is woken once for the whole frame.
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param parts parts of the frame
+/// @param count amount of parts
+/// @return EXIT_SUCCESS on success, EXIT_FAILURE if the server closed the connection
+int shm_client_writev(ShmTransport *transport, int fd, const struct iovec *parts, int count);
+
+/// @brief Reads available bytes from the response ring, waiting while the ring is empty
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param buffer address to copy the bytes to
+/// @param size size of the buffer
+/// @return amount of bytes read, 0 if the server closed the connection
+size_t shm_client_read(ShmTransport *transport, int fd, void *buffer, size_t size);
+
+/// @brief Reads available bytes from the response ring without blocking and wakes the server
+///        if it waits for space
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param buffer address to copy the bytes to
+/// @param size size of the buffer
+/// @return amount of bytes read
+size_t shm_client_try_read(ShmTransport *transport, int fd, void *buffer, size_t size);
+
+/// @brief Writes as many bytes into the request ring as fit without blocking and wakes the
+///        server if it waits for requests
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param data bytes to write
+/// @param size amount of bytes
+/// @return amount of bytes written
+size_t shm_client_try_write(ShmTransport *transport, int fd, const void *data, size_t size);
+
+/// @brief Waits until the response ring has data or the request ring has space, spinning
+///        before the client sleeps on the futex
+/// @param transport mapped transport
+/// @param fd Unix socket of the connection
+/// @param readable wait for data in the response ring, otherwise for space in the request ring
+/// @return EXIT_SUCCESS when the ring is ready, EXIT_FAILURE if the server closed the connection
+int shm_client_wait(ShmTransport *transport, int fd, int readable);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
@@ -12,168 +14,1599 @@
 #include "api.h"
 #include "error.h"
 #include "database.h"
+#include "catalog.h"
+#include "compression.h"
+#include "journal.h"
+#include "frame.h"
+#include "config.h"
+#include "dbrouter.h"
+#include "order_cache.h"
+#include "order_feed.h"
+#include "stock.h"
 
 #define DEFAULT_SERVER_PORT 8080
+#define DEFAULT_CATALOG_SNAPSHOT "catalog.snapshot"
+
+/// @brief memory mapped catalog snapshot, shared by all threads until it is replaced
+typedef struct {
+    Catalog catalog;    // loaded snapshot
+    int users;          // requests using the snapshot, plus one while it is the current snapshot
+} SharedCatalog;
+
+/// @brief current catalog snapshot, NULL if the catalog is not available
+static SharedCatalog *current_catalog;
+
+/// @brief protects current_catalog and the users of all snapshots
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief path of the catalog snapshot file
+static const char *catalog_path;
+
+/// @brief order journal, NULL if orders are stored directly in the database
+static Journal *journal;
+
+/// @brief routes queries to the primary database or to hot standbys
+static DbRouter db_router;
+
+/// @brief payloads of RESPONSE_GET_ORDER by order ID
+static OrderCache order_cache;
+
+/// @brief reservable stock of the items, items are not limited if the stock is not loaded
+static Stock stock;
+
+/// @brief pushes changed orders to the clients of REQUEST_SUBSCRIBE_ORDERS
+static OrderFeed order_feed;
+
+/// @brief catalog version of the primary whose items were last copied to all order shards
+static int64_t shard_catalog_version;
+
+/// @brief state of a client connection
+typedef struct {
+    DbSession db_session;               // read-your-writes state of the client
+    OrderFeedSubscriber *subscriber;    // subscription to changed orders, NULL if not subscribed
+} ClientSession;
+
+/// @brief database connection of a request, the running query is cancelled when the
+///        deadline of the request expires
+typedef struct {
+    DbLease lease;          // borrowed connection
+    PGcancel *cancel;       // cancel handle of the connection
+    int shared;             // the connection belongs to the batch of the request
+} RequestDb;
+
+/// @brief database connections of a request reading from all order shards
+typedef struct {
+    RequestDb shards[CONFIG_MAX_SHARDS];    // connection of every shard
+    PGconn *conns[CONFIG_MAX_SHARDS];       // connections passed to the queries
+    int length;                             // amount of borrowed connections
+} RequestShards;
+
+/// @brief response of a sub-request of a batch
+typedef struct {
+    uint16_t response_id;   // id of the response
+    uint32_t payload_size;  // size of the payload
+    uint8_t *payload;       // copy of the payload, NULL if payload_size is 0
+} BatchResult;
+
+/// @brief sub-requests of a REQUEST_BATCH which share one database connection
+typedef struct {
+    pthread_mutex_t db_lock;    // held while a sub-request uses the database connection
+    DbQueryKind db_kind;        // kind of the shared connection, DB_WRITE if any sub-request needs the primary
+    int db_acquired;            // the shared connection is borrowed
+    RequestDb db;               // shared connection
+} Batch;
+
+/// @brief destination of the responses of a request. Responses of a request of the client
+///        are sent to the connection, responses of a sub-request are collected in its result.
+typedef struct {
+    Connection *client;     // connection of the client
+    Batch *batch;           // batch of a sub-request, NULL for requests of the client
+    BatchResult *result;    // result of a sub-request, NULL for requests of the client
+} Responder;
+
+/// @brief stores the response of a sub-request
+/// @param result result of the sub-request
+/// @param response_id id of the response
+/// @param payload payload of the response, may be NULL if payload_size is 0
+/// @param payload_size size of the payload
+/// @return 0 on success
+static int store_batch_result(BatchResult *result, uint16_t response_id, const void *payload, uint32_t payload_size)
+{
+    if (result->payload || result->response_id != RESPONSE_ERROR)
+    {
+        fprintf(stderr, "ERROR: sub-request sent more than one response\r\n");
+        return EXIT_FAILURE;
+    }
+    if (payload_size > 0)
+    {
+        result->payload = malloc(payload_size);
+        if (!result->payload)
+        {
+            fprintf(stderr, "ERROR: cannot allocate %u bytes for sub-response\r\n", payload_size);
+            return EXIT_FAILURE;
+        }
+        memcpy(result->payload, payload, payload_size);
+    }
+    result->response_id = response_id;
+    result->payload_size = payload_size;
+    return EXIT_SUCCESS;
+}
+
+/// @brief sends a response to the client. The payload is compressed if the client accepts
+///        compressed payloads and the payload exceeds COMPRESSION_THRESHOLD.
+/// @param responder destination of the responses
+/// @param req_header header of the request which is answered
+/// @param response_id id of the response
+/// @param payload payload of the response, may be NULL if payload_size is 0
+/// @param payload_size size of the payload
+/// @return 0 on success
+int send_response(Responder *responder, const RequestHeader *req_header, uint16_t response_id, const void *payload, uint32_t payload_size)
+{
+    if (responder->result)
+    {
+        // the whole batch response is compressed instead
+        return store_batch_result(responder->result, response_id, payload, payload_size);
+    }
+    FrameHeader res_header = {
+        .magicnum = API_MAGIC_NUM,
+        .version = API_VERSION,
+        .id = response_id,
+        .payload_size = payload_size,
+        .flags = 0
+    };
+    if ((req_header->flags & HEADER_FLAG_ACCEPT_COMPRESSION) && payload_size >= COMPRESSION_THRESHOLD)
+    {
+        Error error = {0};
+        const uint8_t *compressed;
+        uint32_t compressed_size;
+        if (compression_compress(payload, payload_size, &compressed, &compressed_size, &error) != EXIT_SUCCESS)
+        {
+            fprintf(stderr, "WARNING: sending uncompressed response: %s\r\n", error.msg);
+        }
+        else if (compressed_size < payload_size)
+        {
+            payload = compressed;
+            res_header.payload_size = compressed_size;
+            res_header.flags |= HEADER_FLAG_COMPRESSED;
+        }
+    }
+    if (connection_send_frame(responder->client, &res_header, payload) != EXIT_SUCCESS)
+    {
+        char systemcall_err_msg[512];
+        strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg));
+        fprintf(stderr, "ERROR: cannot send response %d: %s\r\n", response_id, systemcall_err_msg);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
 /// @brief sends a error response to the client
-/// @param client_socket socket to send response
+/// @param responder destination of the responses
 /// @param err_msg null terminated error message
 /// @return 0 on success
-int send_error_response(int client_socket, char *err_msg)
+int send_error_response(Responder *responder, char *err_msg)
+{
+    printf("INFO: send error response \"%s\"\r\n", err_msg);
+    if (responder->result)
+    {
+        return store_batch_result(responder->result, RESPONSE_ERROR, err_msg, strlen(err_msg) + 1);
+    }
+    return connection_send_error(responder->client, err_msg);
+}
+
+/// @brief cancels the running query of a request, see connection_set_cancel
+/// @param arg cancel handle of the database connection
+static void cancel_query(void *arg)
+{
+    char errbuf[256];
+    if (!PQcancel(arg, errbuf, sizeof(errbuf)))
+    {
+        fprintf(stderr, "WARNING: cannot cancel query: %s\r\n", errbuf);
+    }
+}
+
+/// @brief cancels the running queries of a request on all shards, see connection_set_cancel
+/// @param arg connections of the request
+static void cancel_shard_queries(void *arg)
+{
+    RequestShards *shards = arg;
+    for (int i = 0; i < shards->length; i++)
+    {
+        if (shards->shards[i].cancel)
+        {
+            cancel_query(shards->shards[i].cancel);
+        }
+    }
+}
+
+/// @brief borrows a database connection and cancels its queries when the request deadline expires
+/// @param client connection of the client
+/// @param shard shard of the queries, 0 for everything but orders
+/// @param kind kind of the queries
+/// @param db address to save the borrowed connection
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int acquire_client_db(Connection *client, int shard, DbQueryKind kind, RequestDb *db, Error *error)
+{
+    ClientSession *session = client->context;
+    if (db_router_acquire_shard(&db_router, shard, kind, &session->db_session, &db->lease, error) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    db->shared = 0;
+    db->cancel = PQgetCancel(db->lease.conn);
+    if (db->cancel && connection_set_cancel(client, cancel_query, db->cancel) != EXIT_SUCCESS)
+    {
+        error_write(error, "%s", "request deadline exceeded");
+        PQfreeCancel(db->cancel);
+        db_router_release(&db_router, &db->lease);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief returns a database connection borrowed with acquire_client_db()
+/// @param client connection of the client
+/// @param db borrowed connection
+static void release_client_db(Connection *client, RequestDb *db)
+{
+    if (db->cancel)
+    {
+        connection_set_cancel(client, NULL, NULL);
+        PQfreeCancel(db->cancel);
+        db->cancel = NULL;
+    }
+    db_router_release(&db_router, &db->lease);
+}
+
+/// @brief borrows a database connection for a request. Sub-requests of a batch take turns
+///        on the connection of the batch, which is borrowed by the first sub-request needing it.
+///        Connections to the other order shards are borrowed by every sub-request on its own.
+/// @param responder destination of the responses
+/// @param shard shard of the queries, 0 for everything but orders
+/// @param kind kind of the queries
+/// @param db address to save the borrowed connection
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int acquire_request_db(Responder *responder, int shard, DbQueryKind kind, RequestDb *db, Error *error)
+{
+    Batch *batch = responder->batch;
+    if (!batch)
+    {
+        return acquire_client_db(responder->client, shard, kind, db, error);
+    }
+    if (shard != 0)
+    {
+        // the deadline of the batch only cancels queries on the shared connection
+        ClientSession *session = responder->client->context;
+        db->shared = 0;
+        db->cancel = NULL;
+        return db_router_acquire_shard(&db_router, shard, kind, &session->db_session, &db->lease, error);
+    }
+    pthread_mutex_lock(&batch->db_lock);
+    if (!batch->db_acquired)
+    {
+        if (acquire_client_db(responder->client, 0, batch->db_kind, &batch->db, error) != EXIT_SUCCESS)
+        {
+            pthread_mutex_unlock(&batch->db_lock);
+            return EXIT_FAILURE;
+        }
+        batch->db_acquired = 1;
+    }
+    // the cancel handle stays with the batch
+    db->lease = batch->db.lease;
+    db->cancel = NULL;
+    db->shared = 1;
+    return EXIT_SUCCESS;
+}
+
+/// @brief returns the database connection of a request
+/// @param responder destination of the responses
+/// @param db borrowed connection
+static void release_request_db(Responder *responder, RequestDb *db)
+{
+    if (db->shared)
+    {
+        // a failed transaction must not affect the next sub-request
+        if (PQtransactionStatus(db->lease.conn) != PQTRANS_IDLE)
+        {
+            PQclear(PQexec(db->lease.conn, "ROLLBACK"));
+        }
+        pthread_mutex_unlock(&responder->batch->db_lock);
+        return;
+    }
+    release_client_db(responder->client, db);
+}
+
+/// @brief returns the database connections borrowed with acquire_request_shards()
+/// @param responder destination of the responses
+/// @param shards borrowed connections
+static void release_request_shards(Responder *responder, RequestShards *shards)
+{
+    for (int i = 0; i < shards->length; i++)
+    {
+        release_request_db(responder, &shards->shards[i]);
+    }
+    shards->length = 0;
+}
+
+/// @brief borrows a database connection of every order shard for a request. The queries on
+///        all shards are cancelled together when the request deadline expires.
+/// @param responder destination of the responses
+/// @param kind kind of the queries
+/// @param shards address to save the borrowed connections
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int acquire_request_shards(Responder *responder, DbQueryKind kind, RequestShards *shards, Error *error)
+{
+    ClientSession *session = responder->client->context;
+    // a single shard or a batch needs no cancel callback of its own
+    int cancel_all = !responder->batch && db_router.shards_length > 1;
+    shards->length = 0;
+    for (int i = 0; i < db_router.shards_length; i++)
+    {
+        RequestDb *db = &shards->shards[i];
+        int result;
+        if (cancel_all)
+        {
+            db->shared = 0;
+            result = db_router_acquire_shard(&db_router, i, kind, &session->db_session, &db->lease, error);
+            db->cancel = result == EXIT_SUCCESS ? PQgetCancel(db->lease.conn) : NULL;
+        }
+        else
+        {
+            result = acquire_request_db(responder, i, kind, db, error);
+        }
+        if (result != EXIT_SUCCESS)
+        {
+            release_request_shards(responder, shards);
+            return EXIT_FAILURE;
+        }
+        shards->conns[i] = db->lease.conn;
+        shards->length++;
+    }
+    if (cancel_all && connection_set_cancel(responder->client, cancel_shard_queries, shards) != EXIT_SUCCESS)
+    {
+        error_write(error, "%s", "request deadline exceeded");
+        release_request_shards(responder, shards);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief latest order items collected from all shards
+typedef struct {
+    FullOrderItem items[10];    // collected order items
+    int length;                 // amount of collected order items
+} LatestOrderItems;
+
+/// @brief adds a merged order item to the latest order items, see db_merge_order_items
+static int collect_latest_order_item(void *ctx, const FullOrderItem *item)
+{
+    LatestOrderItems *latest = ctx;
+    latest->items[latest->length++] = *item;
+    return EXIT_SUCCESS;
+}
+
+/// @brief sends the latest order items to the client
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @return 0 on success
+int send_display_order_response(Responder *responder, const RequestHeader *req_header)
+{
+    Error error = {0};
+    printf("DEBUG: display orders\r\n");
+    RequestShards shards;
+    if (acquire_request_shards(responder, DB_READ, &shards, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: cannot connect to database: %s\r\n", error.msg);
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    LatestOrderItems latest = { .length = 0 };
+    int result = db_merge_order_items(shards.conns, shards.length, 10, collect_latest_order_item, &latest, &error);
+    release_request_shards(responder, &shards);
+    if (result != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: failed getting latest order items: %s\r\n", error.msg);
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    printf("DEBUG: found %d order items\r\n", latest.length);
+    return send_response(responder, req_header, RESPONSE_DISPLAY_ORDERS,
+            latest.items, sizeof(latest.items[0]) * latest.length);
+}
+
+/// @brief takes the current catalog snapshot, which stays mapped until it is released
+/// @return the snapshot or NULL if the catalog is not available
+static SharedCatalog *acquire_catalog(void)
+{
+    pthread_mutex_lock(&catalog_lock);
+    SharedCatalog *shared = current_catalog;
+    if (shared)
+    {
+        shared->users++;
+    }
+    pthread_mutex_unlock(&catalog_lock);
+    return shared;
+}
+
+/// @brief releases a catalog snapshot, the last user of a replaced snapshot unmaps it
+/// @param shared snapshot of acquire_catalog(), may be NULL
+static void release_catalog(SharedCatalog *shared)
+{
+    if (!shared)
+    {
+        return;
+    }
+    pthread_mutex_lock(&catalog_lock);
+    int unused = --shared->users == 0;
+    pthread_mutex_unlock(&catalog_lock);
+    if (unused)
+    {
+        catalog_close(&shared->catalog);
+        free(shared);
+    }
+}
+
+/// @brief sends all items of the catalog snapshot to the client
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @return 0 on success
+int send_list_items_response(Responder *responder, const RequestHeader *req_header)
+{
+    printf("DEBUG: list items\r\n");
+    SharedCatalog *shared = acquire_catalog();
+    if (!shared) {
+        send_error_response(responder, "catalog not available");
+        return EXIT_FAILURE;
+    }
+    // the items are sent straight from the mapped snapshot
+    int result = send_response(responder, req_header, RESPONSE_LIST_ITEMS,
+            shared->catalog.items, shared->catalog.header->item_count * sizeof(CatalogItem));
+    release_catalog(shared);
+    return result;
+}
+
+/// @brief state of a streamed order export
+typedef struct {
+    Responder *responder;                           // destination of the responses
+    const RequestHeader *req_header;                // header of the request
+    FullOrderItem items[ORDERS_CHUNK_ITEMS];        // order items of the current chunk
+    int items_length;                               // amount of order items in the current chunk
+    long total_items;                               // amount of order items sent so far
+} OrderExport;
+
+/// @brief sends the current chunk of an order export to the client
+/// @param export state of the export
+/// @return 0 on success
+static int flush_order_export(OrderExport *export)
+{
+    if (export->items_length == 0)
+    {
+        return EXIT_SUCCESS;
+    }
+    int result = send_response(export->responder, export->req_header, RESPONSE_ORDERS_CHUNK,
+            export->items, export->items_length * sizeof(FullOrderItem));
+    export->total_items += export->items_length;
+    export->items_length = 0;
+    return result;
+}
+
+/// @brief adds a streamed order item to the current chunk, called for every row of the query
+static int export_order_item(void *ctx, const FullOrderItem *item)
+{
+    OrderExport *export = ctx;
+    export->items[export->items_length++] = *item;
+    if (export->items_length == ORDERS_CHUNK_ITEMS)
+    {
+        return flush_order_export(export);
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief streams all order items to the client. The rows are sent in chunks while the query
+///        is still running, so memory usage does not depend on the amount of orders. The
+///        rows of all shards are merged into the order of a single database.
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @return 0 on success
+int send_export_orders_response(Responder *responder, const RequestHeader *req_header)
+{
+    Error error = {0};
+    printf("DEBUG: export orders\r\n");
+    RequestShards shards;
+    if (acquire_request_shards(responder, DB_READ, &shards, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: cannot connect to database: %s\r\n", error.msg);
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    OrderExport *export = malloc(sizeof(OrderExport));
+    if (!export) {
+        release_request_shards(responder, &shards);
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    export->responder = responder;
+    export->req_header = req_header;
+    export->items_length = 0;
+    export->total_items = 0;
+
+    int result = db_merge_order_items(shards.conns, shards.length, 0, export_order_item, export, &error);
+    release_request_shards(responder, &shards);
+    if (result == EXIT_SUCCESS) {
+        result = flush_order_export(export);
+    } else {
+        fprintf(stderr, "ERROR: failed exporting order items: %s\r\n", error.msg);
+    }
+    printf("DEBUG: exported %ld order items\r\n", export->total_items + export->items_length);
+    free(export);
+    if (result != EXIT_SUCCESS) {
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    return send_response(responder, req_header, RESPONSE_END_OF_STREAM, NULL, 0);
+}
+
+/// @brief loads an order with its items from the database
+/// @param responder destination of the responses
+/// @param order_id ID of the order
+/// @param response address to save the order, must have room for MAX_ORDER_ITEMS items
+/// @param found address to save 1 if the order exists, otherwise 0
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int load_order(Responder *responder, int32_t order_id, GetOrderResponse *response, int *found, Error *error)
+{
+    // the order is read from the primary, a lagging standby could return a version which
+    // is older than the notification that invalidated the cached order
+    RequestDb db;
+    if (acquire_request_db(responder, db_router_shard_of(&db_router, (uint64_t)order_id), DB_WRITE, &db, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    int item_count = 0;
+    int result = db_get_order(db.lease.conn, order_id, &response->order, found, error);
+    if (result == EXIT_SUCCESS && *found) {
+        result = db_get_order_item_by_order_id(db.lease.conn, order_id, response->items, &item_count, MAX_ORDER_ITEMS, error);
+    }
+    release_request_db(responder, &db);
+    response->item_count = item_count;
+    return result;
+}
+
+/// @brief sends an order with its items to the client, the order is answered from the
+///        order cache if possible
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @param payload payload of the request
+/// @return 0 on success
+int send_get_order_response(Responder *responder, const RequestHeader *req_header, const uint8_t *payload)
+{
+    if (req_header->payload_size != sizeof(GetOrderRequest))
+    {
+        send_error_response(responder, "Invalid get order payload");
+        return EXIT_FAILURE;
+    }
+    GetOrderRequest request;
+    memcpy(&request, payload, sizeof(request));
+    printf("DEBUG: get order %d\r\n", request.order_id);
+
+    uint64_t ticket;
+    const OrderCacheEntry *entry = order_cache_get(&order_cache, request.order_id, &ticket);
+    if (entry)
+    {
+        int result = send_response(responder, req_header, RESPONSE_GET_ORDER, entry->payload, entry->size);
+        order_cache_release(entry);
+        return result;
+    }
+
+    Error error = {0};
+    // zeroed, so that padding and unused name bytes of the cached payload are deterministic
+    GetOrderResponse *response = calloc(1, sizeof(GetOrderResponse) + MAX_ORDER_ITEMS * sizeof(OrderItem));
+    if (!response)
+    {
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    int found;
+    if (load_order(responder, request.order_id, response, &found, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot load order %d: %s\r\n", request.order_id, error.msg);
+        free(response);
+        send_error_response(responder, "internal server error");
+        return EXIT_FAILURE;
+    }
+    if (!found)
+    {
+        free(response);
+        char err_msg[32];
+        snprintf(err_msg, sizeof(err_msg), "Unknown order %d", request.order_id);
+        send_error_response(responder, err_msg);
+        return EXIT_FAILURE;
+    }
+    uint32_t size = sizeof(GetOrderResponse) + response->item_count * sizeof(OrderItem);
+    order_cache_put(&order_cache, request.order_id, response, size, ticket);
+    int result = send_response(responder, req_header, RESPONSE_GET_ORDER, response, size);
+    free(response);
+    return result;
+}
+
+/// @brief sends the counters of the server to the client
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @return 0 on success
+int send_stats_response(Responder *responder, const RequestHeader *req_header)
+{
+    OrderCacheStats cache_stats;
+    order_cache_stats(&order_cache, &cache_stats);
+    OrderFeedStats feed_stats;
+    order_feed_stats(&order_feed, &feed_stats);
+    RateLimitStats limit_stats;
+    rate_limiter_stats(&responder->client->server->limiter, &limit_stats);
+    CaptureStats capture_counters;
+    capture_stats(&responder->client->server->capture, &capture_counters);
+    StatsResponse response = {
+        .order_cache_hits = cache_stats.hits,
+        .order_cache_misses = cache_stats.misses,
+        .order_cache_evictions = cache_stats.evictions,
+        .order_cache_invalidations = cache_stats.invalidations,
+        .order_cache_entries = cache_stats.entries,
+        .order_cache_bytes = cache_stats.bytes,
+        .order_cache_max_bytes = cache_stats.max_bytes,
+        .order_feed_subscribers = feed_stats.subscribers,
+        .order_feed_updates = feed_stats.updates,
+        .order_feed_coalesced = feed_stats.coalesced,
+        .order_feed_resyncs = feed_stats.resyncs,
+        .rate_limited_connections = limit_stats.refused_connections,
+        .rate_limited_requests = limit_stats.refused_requests,
+        .rate_limit_overflows = limit_stats.overflows,
+        .captured_records = capture_counters.records,
+        .capture_dropped = capture_counters.dropped
+    };
+    return send_response(responder, req_header, RESPONSE_STATS, &response, sizeof(response));
+}
+
+/// @brief subscribes the client to changed orders. The subscription ends when the connection
+///        is closed, the client keeps sending other requests meanwhile.
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @return 0 on success
+static int send_subscribe_orders_response(Responder *responder, const RequestHeader *req_header)
+{
+    Connection *client = responder->client;
+    ClientSession *session = client->context;
+    if (session->subscriber)
+    {
+        return send_error_response(responder, "already subscribed to changed orders");
+    }
+    if (client->ring.shared)
+    {
+        return send_error_response(responder, "subscriptions are not available over the shared memory transport");
+    }
+    // a subscriber waits for changes without sending requests
+    client->pushing = 1;
+    // the response is sent first, so that no changed orders precede it
+    if (send_response(responder, req_header, RESPONSE_SUBSCRIBE_ORDERS, NULL, 0) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+    Error error = {0};
+    session->subscriber = order_feed_subscribe(&order_feed, client, (req_header->flags & HEADER_FLAG_ACCEPT_COMPRESSION) != 0, &error);
+    if (!session->subscriber)
+    {
+        fprintf(stderr, "ERROR: cannot subscribe to changed orders: %s\r\n", error.msg);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief checks the payload of an add order request
+/// @param payload payload of the request
+/// @param payload_size size of the payload
+/// @param err_msg buffer for a description of the problem
+/// @param err_msg_size size of err_msg
+/// @return the request or NULL if the payload is invalid
+static const AddOrderRequest *validate_add_order_request(const uint8_t *payload, uint32_t payload_size, char *err_msg, size_t err_msg_size)
+{
+    const AddOrderRequest *request = (const AddOrderRequest *)payload;
+    if (payload_size < sizeof(AddOrderRequest)
+            || request->item_count == 0
+            || request->item_count > MAX_ORDER_ITEMS
+            || payload_size != sizeof(AddOrderRequest) + request->item_count * sizeof(AddOrderItem))
+    {
+        snprintf(err_msg, err_msg_size, "Invalid add order payload");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < request->item_count; i++)
+    {
+        if (request->items[i].quantity <= 0)
+        {
+            snprintf(err_msg, err_msg_size, "Invalid quantity for item %d", request->items[i].item_id);
+            return NULL;
+        }
+    }
+    return request;
+}
+
+/// @brief checks that all items of an order are in the catalog. Journaled orders are
+///        acknowledged before they reach the database, so their items are checked at intake.
+/// @param request validated add order request
+/// @param err_msg buffer for a description of the problem
+/// @param err_msg_size size of err_msg
+/// @return 0 if all items exist
+static int check_catalog_items(const AddOrderRequest *request, char *err_msg, size_t err_msg_size)
+{
+    // the journal cannot be opened without a catalog, see open_journal()
+    SharedCatalog *shared = acquire_catalog();
+    int result = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < request->item_count && result == EXIT_SUCCESS; i++)
+    {
+        if (shared && !catalog_find_item(&shared->catalog, request->items[i].item_id))
+        {
+            snprintf(err_msg, err_msg_size, "Unknown item %d", request->items[i].item_id);
+            result = EXIT_FAILURE;
+        }
+    }
+    release_catalog(shared);
+    return result;
+}
+
+/// @brief returns the stock reserved for the first items of an order
+/// @param request validated add order request
+/// @param reservations handles of the reservations of the items, see stock_reserve()
+/// @param item_count amount of items whose stock was reserved
+static void release_order_stock(const AddOrderRequest *request, const uint32_t *reservations, uint32_t item_count)
+{
+    for (uint32_t i = 0; i < item_count; i++)
+    {
+        stock_release(&stock, request->items[i].item_id, request->items[i].quantity, reservations[i]);
+    }
+}
+
+/// @brief reserves the stock of all items of an order, nothing is reserved if an item is
+///        out of stock
+/// @param request validated add order request
+/// @param reservations address to save the handles of the reservations of all items
+/// @param err_msg buffer for a description of the problem
+/// @param err_msg_size size of err_msg
+/// @return 0 on success
+static int reserve_order_stock(const AddOrderRequest *request, uint32_t *reservations, char *err_msg, size_t err_msg_size)
+{
+    for (uint32_t i = 0; i < request->item_count; i++)
+    {
+        if (stock_reserve(&stock, request->items[i].item_id, request->items[i].quantity, &reservations[i]) != EXIT_SUCCESS)
+        {
+            release_order_stock(request, reservations, i);
+            snprintf(err_msg, err_msg_size, "Item %d out of stock", request->items[i].item_id);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief stores a new order in a single database transaction on the next shard. The prices
+///        are read inside the transaction, so unknown items are rejected by the database.
+/// @param request validated add order request
+/// @param responder destination of the responses
+/// @param order_id address to save the ID of the new order
+/// @param err_msg buffer for the description sent to the client
+/// @param err_msg_size size of err_msg
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int store_order(const AddOrderRequest *request, Responder *responder, int32_t *order_id,
+        char *err_msg, size_t err_msg_size, Error *error)
+{
+    RequestDb db;
+    if (acquire_request_db(responder, db_router_next_shard(&db_router), DB_WRITE, &db, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    PGconn *conn = db.lease.conn;
+    if (db_begin_transaction(conn, error) != EXIT_SUCCESS
+            || db_insert_order(conn, order_id, error) != EXIT_SUCCESS) {
+        release_request_db(responder, &db);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < request->item_count; i++) {
+        const AddOrderItem *item = &request->items[i];
+        int32_t price;
+        if (db_get_price_from_item(conn, item->item_id, &price, error) != EXIT_SUCCESS) {
+            // a failed query aborts the transaction, an empty result leaves it intact
+            if (PQtransactionStatus(conn) == PQTRANS_INTRANS) {
+                snprintf(err_msg, err_msg_size, "Unknown item %d", item->item_id);
+            }
+            release_request_db(responder, &db);
+            return EXIT_FAILURE;
+        }
+        if (db_add_item_to_order(conn, *order_id, item->item_id, item->quantity, price, error) != EXIT_SUCCESS) {
+            release_request_db(responder, &db);
+            return EXIT_FAILURE;
+        }
+    }
+    int result = db_commit_transaction(conn, error);
+    if (result == EXIT_SUCCESS) {
+        db_router_note_write(&db_router, &((ClientSession *)responder->client->context)->db_session, &db.lease);
+    }
+    release_request_db(responder, &db);
+    return result;
+}
+
+/// @brief adds a new order. In journal mode the order is acknowledged as soon as it is
+///        durable in the journal, otherwise after it was committed to the database.
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @param payload payload of the request
+/// @return 0 on success
+int send_add_order_response(Responder *responder, const RequestHeader *req_header, const uint8_t *payload)
+{
+    char err_msg[64];
+    const AddOrderRequest *request = validate_add_order_request(payload, req_header->payload_size, err_msg, sizeof(err_msg));
+    if (!request || (journal && check_catalog_items(request, err_msg, sizeof(err_msg)) != EXIT_SUCCESS))
+    {
+        send_error_response(responder, err_msg);
+        return EXIT_FAILURE;
+    }
+    uint32_t reservations[MAX_ORDER_ITEMS];
+    if (reserve_order_stock(request, reservations, err_msg, sizeof(err_msg)) != EXIT_SUCCESS)
+    {
+        send_error_response(responder, err_msg);
+        return EXIT_FAILURE;
+    }
+
+    Error error = {0};
+    AddOrderResponse response = {0};
+    if (journal)
+    {
+        if (journal_append(journal, payload, req_header->payload_size, &response.journal_seq, &error) != EXIT_SUCCESS)
+        {
+            release_order_stock(request, reservations, request->item_count);
+            fprintf(stderr, "ERROR: cannot write order into journal: %s\r\n", error.msg);
+            send_error_response(responder, "internal server error");
+            return EXIT_FAILURE;
+        }
+        printf("DEBUG: journaled order %" PRIu64 "\r\n", response.journal_seq);
+    }
+    else
+    {
+        snprintf(err_msg, sizeof(err_msg), "internal server error");
+        if (store_order(request, responder, &response.order_id, err_msg, sizeof(err_msg), &error) != EXIT_SUCCESS)
+        {
+            release_order_stock(request, reservations, request->item_count);
+            fprintf(stderr, "ERROR: cannot store order: %s\r\n", error.msg);
+            send_error_response(responder, err_msg);
+            return EXIT_FAILURE;
+        }
+        printf("DEBUG: stored order %d\r\n", response.order_id);
+    }
+    return send_response(responder, req_header, RESPONSE_ADD_ORDER, &response, sizeof(response));
+}
+
+/// @brief sub-request of a batch
+typedef struct {
+    Task task;                  // runs the sub-request on a worker, must be the first member
+    TaskGroup *group;           // group of the sub-requests running concurrently, NULL if not forked
+    Responder responder;        // collects the response in result
+    RequestHeader header;       // header of the sub-request
+    const uint8_t *payload;     // payload of the sub-request, points into the payload of the batch
+    int refused;                // the sub-request exceeded the rate limit of its request ID
+    BatchResult result;         // response of the sub-request
+} SubRequest;
+
+/// @brief handles a single request, see handle_shop_request
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @param payload payload of the request
+/// @return 0 on success
+static int dispatch_request(Responder *responder, const RequestHeader *req_header, const uint8_t *payload);
+
+/// @brief handles a sub-request of a batch
+/// @param sub sub-request with initialized responder
+static void execute_sub_request(SubRequest *sub)
 {
-    printf("INFO: send error response \"%s\"\r\n", err_msg);
-    ResponseHeader res_header = {
-        .magicnum = API_MAGIC_NUM,
-        .version = 1,
-        .response_id = RESPONSE_ERROR,
-        .payload_size = (strlen(err_msg) + 1) * sizeof(char)   // TODO: handle possible overflow
-    };
-    if (send(client_socket, &res_header, sizeof(res_header), 0) < 0)
+    char err_msg[48];
+    if (sub->header.request_id == REQUEST_EXPORT_ORDERS || sub->header.request_id == REQUEST_BATCH
+            || sub->header.request_id == REQUEST_SUBSCRIBE_ORDERS)
     {
-        char systemcall_err_msg[512];
-        strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg));
-        fprintf(stderr, "ERROR: cannot send error response %s\r\n", systemcall_err_msg);
+        snprintf(err_msg, sizeof(err_msg), "Request id %d not allowed in a batch", sub->header.request_id);
+        send_error_response(&sub->responder, err_msg);
+        return;
+    }
+    if (sub->refused)
+    {
+        send_error_response(&sub->responder, SERVER_RATE_LIMIT_ERROR);
+        return;
+    }
+    dispatch_request(&sub->responder, &sub->header, sub->payload);
+}
+
+/// @brief runs a forked sub-request, see Task
+static void run_sub_request(Task *task)
+{
+    SubRequest *sub = (SubRequest *)task;
+    execute_sub_request(sub);
+    task_group_done(sub->group);
+}
+
+/// @brief splits the payload of a batch request into its sub-requests
+/// @param payload payload of the request
+/// @param payload_size size of the payload
+/// @param subs array of MAX_BATCH_REQUESTS sub-requests to initialize
+/// @param subs_length address to save the amount of sub-requests
+/// @param err_msg buffer for a description of the problem
+/// @param err_msg_size size of err_msg
+/// @return 0 on success
+static int parse_batch_request(const uint8_t *payload, uint32_t payload_size, SubRequest *subs, uint32_t *subs_length, char *err_msg, size_t err_msg_size)
+{
+    BatchRequest request;
+    if (payload_size < sizeof(request))
+    {
+        snprintf(err_msg, err_msg_size, "Invalid batch payload");
         return EXIT_FAILURE;
     }
-    if (res_header.payload_size > 0)
+    memcpy(&request, payload, sizeof(request));
+    if (request.request_count == 0 || request.request_count > MAX_BATCH_REQUESTS)
     {
-        if (send(client_socket, err_msg, res_header.payload_size, 0) < 0)
+        snprintf(err_msg, err_msg_size, "Batch must contain 1 to %d requests", MAX_BATCH_REQUESTS);
+        return EXIT_FAILURE;
+    }
+    uint32_t offset = sizeof(request);
+    for (uint32_t i = 0; i < request.request_count; i++)
+    {
+        BatchEntry entry;
+        if (payload_size - offset < sizeof(entry))
+        {
+            snprintf(err_msg, err_msg_size, "Invalid batch payload");
+            return EXIT_FAILURE;
+        }
+        memcpy(&entry, payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.payload_size > payload_size - offset
+                || BATCH_PADDED_SIZE(entry.payload_size) > payload_size - offset)
         {
-            char systemcall_err_msg[512];
-            strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg));
-            fprintf(stderr, "ERROR: cannot send error response %s\r\n", systemcall_err_msg);
+            snprintf(err_msg, err_msg_size, "Invalid batch payload");
             return EXIT_FAILURE;
         }
+        subs[i].header.magicnum = API_MAGIC_NUM;
+        subs[i].header.version = API_VERSION;
+        subs[i].header.request_id = entry.id;
+        subs[i].header.payload_size = entry.payload_size;
+        subs[i].header.flags = 0;
+        subs[i].payload = payload + offset;
+        offset += BATCH_PADDED_SIZE(entry.payload_size);
+    }
+    if (offset != payload_size)
+    {
+        snprintf(err_msg, err_msg_size, "Invalid batch payload");
+        return EXIT_FAILURE;
     }
+    *subs_length = request.request_count;
     return EXIT_SUCCESS;
 }
 
-/// @brief sends a error response to the client
-/// @param client_socket socket to send response
+/// @brief encodes the results of all sub-requests into the payload of a batch response
+/// @param subs sub-requests of the batch
+/// @param subs_length amount of sub-requests
+/// @param payload_size address to save the size of the payload
+/// @return newly allocated payload or NULL if it is too large or out of memory
+static uint8_t *encode_batch_response(const SubRequest *subs, uint32_t subs_length, uint32_t *payload_size)
+{
+    size_t size = sizeof(BatchResponse);
+    for (uint32_t i = 0; i < subs_length; i++)
+    {
+        size += sizeof(BatchEntry) + BATCH_PADDED_SIZE(subs[i].result.payload_size);
+    }
+    if (size > MAX_PAYLOAD_SIZE)
+    {
+        return NULL;
+    }
+    // zeroed, so that the padding does not leak memory contents
+    uint8_t *payload = calloc(1, size);
+    if (!payload)
+    {
+        return NULL;
+    }
+    BatchResponse response = { .response_count = subs_length };
+    memcpy(payload, &response, sizeof(response));
+    size_t offset = sizeof(response);
+    for (uint32_t i = 0; i < subs_length; i++)
+    {
+        BatchEntry entry = {
+            .id = subs[i].result.response_id,
+            .payload_size = subs[i].result.payload_size
+        };
+        memcpy(payload + offset, &entry, sizeof(entry));
+        offset += sizeof(entry);
+        if (entry.payload_size > 0)
+        {
+            memcpy(payload + offset, subs[i].result.payload, entry.payload_size);
+        }
+        offset += BATCH_PADDED_SIZE(entry.payload_size);
+    }
+    *payload_size = size;
+    return payload;
+}
+
+/// @brief handles all sub-requests of a batch and sends their results in a single response.
+///        Consecutive sub-requests which do not modify data run concurrently, sub-requests
+///        which add orders run alone, so every sub-request sees the orders added before it.
+///        The sub-requests take turns on a single database connection.
+/// @param responder destination of the responses
+/// @param req_header header of the request
+/// @param payload payload of the request
 /// @return 0 on success
-int send_display_order_response(int client_socket)
+int send_batch_response(Responder *responder, const RequestHeader *req_header, const uint8_t *payload)
 {
-    Error error = {0};
-    printf("DEBUG: display orders\r\n");
-    // TODO: read connection data from configuration
-    PGconn *conn = PQconnectdb("dbname=shopdb user=shopuser password=shopuser host=localhost port=5432");
-    if (PQstatus(conn) != CONNECTION_OK) {
-        send_error_response(client_socket, "internal server error");
+    SubRequest *subs = calloc(MAX_BATCH_REQUESTS, sizeof(SubRequest));
+    if (!subs)
+    {
+        send_error_response(responder, "internal server error");
         return EXIT_FAILURE;
     }
-    int order_item_count = 10;
-    FullOrderItem order_items[order_item_count];
-    order_item_count = db_get_order_items_latest(conn, order_items, order_item_count, &error);
-    if (order_item_count < 0) {
-        fprintf(stderr, "ERROR: failed getting latest order items: %s\r\n", error.msg);
-        send_error_response(client_socket, "internal server error");
-        PQfinish(conn);
+    char err_msg[64];
+    uint32_t subs_length;
+    if (parse_batch_request(payload, req_header->payload_size, subs, &subs_length, err_msg, sizeof(err_msg)) != EXIT_SUCCESS)
+    {
+        free(subs);
+        send_error_response(responder, err_msg);
         return EXIT_FAILURE;
     }
-    PQfinish(conn);
-    printf("DEBUG: found %d order items\r\n", order_item_count);
-    ResponseHeader res_header = {
-        .magicnum = API_MAGIC_NUM,
-        .version = 1,
-        .response_id = RESPONSE_DISPLAY_ORDERS,
-        .payload_size = sizeof(order_items[0]) * order_item_count
-    };
-    if (send(client_socket, &res_header, sizeof(res_header), 0) < 0)
+    printf("DEBUG: batch of %u requests\r\n", subs_length);
+
+    Batch batch = { .db_kind = DB_READ };
+    pthread_mutex_init(&batch.db_lock, NULL);
+    for (uint32_t i = 0; i < subs_length; i++)
     {
-        char systemcall_err_msg[512];
-        strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg));
-        fprintf(stderr, "ERROR: cannot send 'display order' response header %s\r\n", systemcall_err_msg);
-        return EXIT_FAILURE;
+        if (subs[i].header.request_id == REQUEST_ADD_ORDER || subs[i].header.request_id == REQUEST_GET_ORDER)
+        {
+            batch.db_kind = DB_WRITE;
+        }
+        subs[i].task.run = run_sub_request;
+        subs[i].responder.client = responder->client;
+        subs[i].responder.batch = &batch;
+        subs[i].responder.result = &subs[i].result;
+        subs[i].result.response_id = RESPONSE_ERROR;
+        // the batch only took a token of limit.batch, every sub-request counts like a request of its own
+        subs[i].refused = !connection_allow_request(responder->client, subs[i].header.request_id);
     }
-    if (order_item_count > 0) {
-        if (send(client_socket, order_items, res_header.payload_size, 0) < 0) {
-            char systemcall_err_msg[512];
-            strerror_r(errno, systemcall_err_msg, sizeof(systemcall_err_msg));
-            fprintf(stderr, "ERROR: cannot send 'display order' response payload: %s\r\n", systemcall_err_msg);
-            return EXIT_FAILURE;
+
+    Executor *executor = &responder->client->server->executor;
+    uint32_t start = 0;
+    while (start < subs_length)
+    {
+        uint32_t end = start + 1;
+        if (subs[start].header.request_id != REQUEST_ADD_ORDER)
+        {
+            while (end < subs_length && subs[end].header.request_id != REQUEST_ADD_ORDER)
+            {
+                end++;
+            }
         }
+        // the first sub-request runs on this worker, idle workers steal the others
+        TaskGroup group;
+        task_group_init(&group);
+        for (uint32_t i = start + 1; i < end; i++)
+        {
+            subs[i].group = &group;
+            executor_fork(executor, &group, &subs[i].task);
+        }
+        execute_sub_request(&subs[start]);
+        executor_join(executor, &group);
+        task_group_destroy(&group);
+        start = end;
+    }
+    if (batch.db_acquired)
+    {
+        release_client_db(responder->client, &batch.db);
+    }
+    pthread_mutex_destroy(&batch.db_lock);
+
+    uint32_t response_size = 0;
+    uint8_t *response = encode_batch_response(subs, subs_length, &response_size);
+    for (uint32_t i = 0; i < subs_length; i++)
+    {
+        free(subs[i].result.payload);
+    }
+    free(subs);
+    if (!response)
+    {
+        send_error_response(responder, "Batch response too large");
+        return EXIT_FAILURE;
+    }
+    int result = send_response(responder, req_header, RESPONSE_BATCH, response, response_size);
+    free(response);
+    return result;
+}
+
+static int dispatch_request(Responder *responder, const RequestHeader *req_header, const uint8_t *payload)
+{
+    char err_msg[32];
+    int result = EXIT_SUCCESS;
+    switch (req_header->request_id)
+    {
+    case REQUEST_DISPLAY_ORDERS:
+        result = send_display_order_response(responder, req_header);
+        break;
+
+    case REQUEST_LIST_ITEMS:
+        result = send_list_items_response(responder, req_header);
+        break;
+
+    case REQUEST_ADD_ORDER:
+        result = send_add_order_response(responder, req_header, payload);
+        break;
+
+    case REQUEST_EXPORT_ORDERS:
+        result = send_export_orders_response(responder, req_header);
+        break;
+
+    case REQUEST_GET_ORDER:
+        result = send_get_order_response(responder, req_header, payload);
+        break;
+
+    case REQUEST_STATS:
+        result = send_stats_response(responder, req_header);
+        break;
+
+    case REQUEST_BATCH:
+        result = send_batch_response(responder, req_header, payload);
+        break;
+
+    case REQUEST_SUBSCRIBE_ORDERS:
+        result = send_subscribe_orders_response(responder, req_header);
+        break;
+
+    default:
+        snprintf(err_msg, 32, "Unknown request id %d", req_header->request_id);
+        send_error_response(responder, err_msg);
+        result = EXIT_FAILURE;
+        break;
+    }
+    return result;
+}
+
+/// @brief handles a single request of a client on a worker thread, see ServerRequestCallback
+int handle_shop_request(Connection *client, const FrameHeader *header, const uint8_t *payload)
+{
+    RequestHeader req_header;
+    memcpy(&req_header, header, sizeof(req_header));
+    Responder responder = { .client = client };
+    return dispatch_request(&responder, &req_header, payload);
+}
+
+/// @brief ends the subscription of a closed connection, see ServerCloseCallback
+void close_shop_connection(Connection *client)
+{
+    ClientSession *session = client->context;
+    if (session->subscriber)
+    {
+        order_feed_unsubscribe(session->subscriber);
+        session->subscriber = NULL;
+    }
+}
+
+/// @brief Loads the catalog snapshot and replaces the current snapshot. Requests which still
+///        use the replaced snapshot keep it mapped until they release it.
+/// @param conn connection to the primary
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int reload_catalog(PGconn *conn, Error *error)
+{
+    SharedCatalog *shared = malloc(sizeof(*shared));
+    if (!shared)
+    {
+        error_write(error, "%s", "cannot allocate catalog");
+        return EXIT_FAILURE;
+    }
+    if (catalog_load(&shared->catalog, catalog_path, conn, error) != EXIT_SUCCESS)
+    {
+        free(shared);
+        return EXIT_FAILURE;
     }
+    shared->users = 1;
+    pthread_mutex_lock(&catalog_lock);
+    SharedCatalog *replaced = current_catalog;
+    current_catalog = shared;
+    pthread_mutex_unlock(&catalog_lock);
+    release_catalog(replaced);
     return EXIT_SUCCESS;
 }
 
-void handle_shop_request(int client_socket)
+/// @brief Loads the catalog snapshot. The server keeps running without a catalog
+///        if neither the snapshot nor the database is available.
+/// @param snapshot_path path of the snapshot file
+void load_catalog(const char *snapshot_path)
 {
-    RequestHeader req_header = {0};
+    Error error = {0};
+    catalog_path = snapshot_path;
+    // the snapshot has to match the latest catalog version, so it is loaded from the primary
+    PGconn *conn = PQconnectdb(db_router.primary.conninfo);
+    if (reload_catalog(conn, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "WARNING: catalog not available: %s\r\n", error.msg);
+    }
+    PQfinish(conn);
+}
 
-    /*
-     * Setup a timeout on recv() on the client socket
-     * */
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
+/// @brief Loads the stock of the items and starts writing reservations to the database. The
+///        server keeps running without stock limits if the stock cannot be loaded.
+/// @param config configuration with the hot items
+void load_stock(const Config *config)
+{
+    Error error = {0};
+    PGconn *conn = PQconnectdb(db_router.primary.conninfo);
+    if (stock_load(&stock, conn, config->stock_hot_items, config->stock_hot_items_length, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "WARNING: stock not available, items are not limited: %s\r\n", error.msg);
+    } else if (stock_start_reconciler(&stock, db_router.primary.conninfo, config->stock_reconcile_ms, &error) != EXIT_SUCCESS) {
+        fprintf(stderr, "WARNING: reservations are not written to the database: %s\r\n", error.msg);
+    }
+    PQfinish(conn);
+}
 
-    while (1)
+/// @brief stores a batch of journaled orders in the database, see JournalDrainCallback.
+///        Every order goes to the shard of its journal sequence number, a batch which failed
+///        on one shard is stored again on all shards, which skip the orders they already have.
+///        A batch with an order which cannot be stored, e.g. because its item was deleted,
+///        is rejected, so the journal finds that order and moves it into its dead letter file.
+static int drain_orders(void *ctx, const JournalRecord *records, int records_length, Error *error)
+{
+    DbRouter *router = ctx;
+    JournalOrderLine *lines = malloc((size_t)records_length * MAX_ORDER_ITEMS * sizeof(JournalOrderLine));
+    JournalOrderLine *shard_lines = router->shards_length > 1
+            ? malloc((size_t)records_length * MAX_ORDER_ITEMS * sizeof(JournalOrderLine)) : lines;
+    if (!lines || !shard_lines)
+    {
+        error_write(error, "cannot allocate order lines for %d orders", records_length);
+        free(lines);
+        if (shard_lines != lines)
+        {
+            free(shard_lines);
+        }
+        return EXIT_FAILURE;
+    }
+    int lines_length = 0;
+    for (int i = 0; i < records_length; i++)
     {
-        ssize_t n = recv(client_socket, &req_header, sizeof(req_header), 0);
-        // check if receive was successful
-        if (n < 0)
+        const AddOrderRequest *request = (const AddOrderRequest *)records[i].payload;
+        if (records[i].size < sizeof(*request)
+                || request->item_count > MAX_ORDER_ITEMS
+                || records[i].size != sizeof(*request) + request->item_count * sizeof(AddOrderItem))
+        {
+            fprintf(stderr, "WARNING: skipping invalid journal record %" PRIu64 "\r\n", records[i].seq);
+            continue;
+        }
+        for (uint32_t j = 0; j < request->item_count; j++)
         {
-            char errmsg[512];
-            strerror_r(errno, errmsg, sizeof(errmsg));
-            fprintf(stderr, "ERROR recv: %s\r\n", errmsg);
-            close(client_socket);
-            return;
+            lines[lines_length].journal_seq = records[i].seq;
+            lines[lines_length].item_id = request->items[j].item_id;
+            lines[lines_length].quantity = request->items[j].quantity;
+            lines_length++;
         }
-        else if (n == 0)
+    }
+    int result = EXIT_SUCCESS;
+    for (int shard = 0; shard < router->shards_length && result == EXIT_SUCCESS; shard++)
+    {
+        int shard_lines_length = lines_length;
+        if (shard_lines != lines)
         {
-            printf("DEBUG: client closed connection\r\n");
-            close(client_socket);
-            return;
+            shard_lines_length = 0;
+            for (int i = 0; i < lines_length; i++)
+            {
+                if (db_router_shard_of(router, lines[i].journal_seq) == shard)
+                {
+                    shard_lines[shard_lines_length++] = lines[i];
+                }
+            }
         }
-        // check if receiving data is correct
-        if (req_header.magicnum != API_MAGIC_NUM)
+        if (shard_lines_length == 0)
         {
-            send_error_response(client_socket, "Invalid magic number");
-            return;
+            continue;
         }
-        if (req_header.version != 1)
+        DbLease lease;
+        result = db_router_acquire_shard(router, shard, DB_WRITE, NULL, &lease, error);
+        if (result == EXIT_SUCCESS)
         {
-            char err_msg[32];
-            snprintf(err_msg, 32, "Invalid request version %d", req_header.version);
-            send_error_response(client_socket, err_msg);
-            return;
+            result = db_insert_journal_orders(lease.conn, shard_lines, shard_lines_length, error);
+            db_router_release(router, &lease);
         }
+    }
+    if (shard_lines != lines)
+    {
+        free(shard_lines);
+    }
+    free(lines);
+    if (result == EXIT_SUCCESS)
+    {
+        printf("DEBUG: drained %d journaled orders\r\n", records_length);
+    }
+    return result == DB_REJECTED ? JOURNAL_DRAIN_REJECTED : result;
+}
 
-        char err_msg[32];
-        switch (req_header.request_id)
+/// @brief Checks that every order shard generates its own order IDs and copies the items
+///        of the primary to the other shards, so their orders can refer to the items
+/// @return 0 on success
+static int prepare_shards(void)
+{
+    Error shard_error = {0};
+    Error *error = &shard_error;
+    PGconn *conns[CONFIG_MAX_SHARDS] = {0};
+    int result = EXIT_SUCCESS;
+    for (int shard = 0; shard < db_router.shards_length && result == EXIT_SUCCESS; shard++)
+    {
+        conns[shard] = PQconnectdb(db_router_shard_conninfo(&db_router, shard));
+        int64_t start;
+        int64_t increment;
+        if (PQstatus(conns[shard]) != CONNECTION_OK)
+        {
+            error_write(error, "shard %d: %s", shard, PQerrorMessage(conns[shard]));
+            result = EXIT_FAILURE;
+        }
+        else if (db_get_order_id_sequence(conns[shard], &start, &increment, error) != EXIT_SUCCESS)
+        {
+            result = EXIT_FAILURE;
+        }
+        else if (increment != db_router.shards_length || start % db_router.shards_length != shard)
+        {
+            error_write(error, "order IDs of shard %d start with %" PRId64 " and increment by %" PRId64
+                    ", see sql/shard_orders.sql", shard, start, increment);
+            result = EXIT_FAILURE;
+        }
+    }
+    // the version is read first, so a change during the copy is copied again later
+    if (result == EXIT_SUCCESS)
+    {
+        result = db_get_catalog_version(conns[0], &shard_catalog_version, error);
+    }
+    for (int shard = 1; shard < db_router.shards_length && result == EXIT_SUCCESS; shard++)
+    {
+        result = db_replicate_items(conns[0], conns[shard], error);
+    }
+    for (int shard = 0; shard < db_router.shards_length; shard++)
+    {
+        PQfinish(conns[shard]);
+    }
+    if (result != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot prepare order shards: %s\r\n", error->msg);
+        return EXIT_FAILURE;
+    }
+    printf("DEBUG: prepared %d order shards\r\n", db_router.shards_length);
+    return EXIT_SUCCESS;
+}
+
+/// @brief reloads the catalog snapshot and copies the items of the primary to the other shards
+///        whenever the catalog version of the primary changed, so new items, renames and price
+///        changes reach the order intake and every shard
+/// @param arg interval of the check in ms
+/// @return NULL
+static void *sync_catalog_loop(void *arg)
+{
+    int sync_ms = *(const int *)arg;
+    struct timespec interval = {
+        .tv_sec = sync_ms / 1000,
+        .tv_nsec = (sync_ms % 1000) * 1000000L
+    };
+    PGconn *conns[CONFIG_MAX_SHARDS] = {0};
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+        Error sync_error = {0};
+        Error *error = &sync_error;
+        int64_t version;
+        int result = EXIT_SUCCESS;
+        for (int shard = 0; shard < db_router.shards_length && result == EXIT_SUCCESS; shard++)
         {
-        case REQUEST_DISPLAY_ORDERS:
-            if (send_display_order_response(client_socket) != EXIT_SUCCESS)
+            if (!conns[shard])
             {
-                return;
+                conns[shard] = PQconnectdb(db_router_shard_conninfo(&db_router, shard));
             }
-            break;
+            if (PQstatus(conns[shard]) != CONNECTION_OK)
+            {
+                error_write(error, "shard %d: %s", shard, PQerrorMessage(conns[shard]));
+                result = EXIT_FAILURE;
+            }
+        }
+        if (result == EXIT_SUCCESS)
+        {
+            result = db_get_catalog_version(conns[0], &version, error);
+        }
+        if (result == EXIT_SUCCESS)
+        {
+            SharedCatalog *shared = acquire_catalog();
+            int outdated = !shared || shared->catalog.header->catalog_version != version;
+            release_catalog(shared);
+            if (outdated)
+            {
+                result = reload_catalog(conns[0], error);
+            }
+        }
+        if (result == EXIT_SUCCESS && (db_router.shards_length == 1 || version == shard_catalog_version))
+        {
+            continue;
+        }
+        for (int shard = 1; shard < db_router.shards_length && result == EXIT_SUCCESS; shard++)
+        {
+            result = db_replicate_items(conns[0], conns[shard], error);
+        }
+        if (result == EXIT_SUCCESS)
+        {
+            shard_catalog_version = version;
+            printf("DEBUG: copied catalog version %" PRId64 " to the order shards\r\n", version);
+            continue;
+        }
+        fprintf(stderr, "ERROR: cannot update the catalog: %s\r\n", error->msg);
+        for (int shard = 0; shard < db_router.shards_length; shard++)
+        {
+            PQfinish(conns[shard]);
+            conns[shard] = NULL;
+        }
+        sleep(1);
+    }
+    return NULL;
+}
 
-        default:
-            snprintf(err_msg, 32, "Unknown request id %d", req_header.request_id);
-            send_error_response(client_socket, err_msg);
-            return;
+/// @brief starts reloading a changed catalog and copying it to the order shards
+/// @param sync_ms interval of the check in ms
+/// @return 0 on success
+static int start_catalog_sync(const int *sync_ms)
+{
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, sync_catalog_loop, (void *)sync_ms);
+    if (result != 0)
+    {
+        char errmsg[256];
+        strerror_r(result, errmsg, sizeof(errmsg));
+        fprintf(stderr, "ERROR: cannot start updating the catalog: %s\r\n", errmsg);
+        return EXIT_FAILURE;
+    }
+    pthread_detach(thread);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Reads the highest journal sequence number stored on any shard
+/// @param journal_seq address to save the sequence number
+/// @param error address of error object to set an error message on failure
+/// @return 0 on success
+static int get_stored_journal_seq(uint64_t *journal_seq, Error *error)
+{
+    *journal_seq = 0;
+    for (int shard = 0; shard < db_router.shards_length; shard++)
+    {
+        PGconn *conn = PQconnectdb(db_router_shard_conninfo(&db_router, shard));
+        uint64_t shard_seq;
+        if (PQstatus(conn) != CONNECTION_OK)
+        {
+            error_write(error, "shard %d: %s", shard, PQerrorMessage(conn));
+            PQfinish(conn);
+            return EXIT_FAILURE;
+        }
+        if (db_get_max_journal_seq(conn, &shard_seq, error) != EXIT_SUCCESS)
+        {
+            PQfinish(conn);
+            return EXIT_FAILURE;
+        }
+        PQfinish(conn);
+        if (shard_seq > *journal_seq)
+        {
+            *journal_seq = shard_seq;
         }
     }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Opens the order journal and starts draining it into the database
+/// @param journal_path path of the journal file
+/// @return 0 on success
+int open_journal(const char *journal_path)
+{
+    static Journal order_journal;
+    Error error = {0};
+    // journaled orders are acknowledged before they reach the database, so their items
+    // have to be checked against the catalog at intake
+    if (!current_catalog)
+    {
+        fprintf(stderr, "ERROR: cannot open order journal without the catalog\r\n");
+        return EXIT_FAILURE;
+    }
+    uint64_t stored_seq;
+    if (get_stored_journal_seq(&stored_seq, &error) != EXIT_SUCCESS
+            || journal_open(&order_journal, journal_path, stored_seq, drain_orders, &db_router, &error) != EXIT_SUCCESS
+            || journal_start_drainer(&order_journal, &error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot open order journal: %s\r\n", error.msg);
+        return EXIT_FAILURE;
+    }
+    journal = &order_journal;
+    return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
 {
     u_int16_t server_port;
+    const char *snapshot_path = DEFAULT_CATALOG_SNAPSHOT;
+    const char *journal_path = NULL;
+    const char *config_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            config_path = optarg;
+            break;
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c config] [-s catalog_snapshot] [-j order_journal] [port]\r\n", argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc > 1)
-        server_port = (u_int16_t)atoi(argv[1]); // TODO: handle possible overflow
+    if (optind < argc)
+        server_port = (u_int16_t)atoi(argv[optind]); // TODO: handle possible overflow
     else
         server_port = DEFAULT_SERVER_PORT;
 
+    Config config;
+    config_init(&config);
+    Error config_error = {0};
+    if (config_path && config_load(&config, config_path, &config_error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot read configuration: %s\r\n", config_error.msg);
+        return 1;
+    }
+    db_router_init(&db_router, &config);
+
+    load_catalog(snapshot_path);
+    if (db_router.shards_length > 1 && prepare_shards() != EXIT_SUCCESS)
+    {
+        return 1;
+    }
+    if (config.db_catalog_sync_ms > 0 && start_catalog_sync(&config.db_catalog_sync_ms) != EXIT_SUCCESS)
+    {
+        return 1;
+    }
+    load_stock(&config);
+    if (journal_path && open_journal(journal_path) != EXIT_SUCCESS)
+    {
+        return 1;
+    }
+
     Server server;
-    if (server_init(&server, handle_shop_request) != 0)
+    Error error = {0};
+    // every connection keeps a DbSession for reading its own writes
+    if (server_init(&server, &config.server, handle_shop_request, sizeof(ClientSession), &error) != 0)
+    {
+        fprintf(stderr, "ERROR: cannot initialize server: %s\r\n", error.msg);
+        return 1;
+    }
+    server_set_close_callback(&server, close_shop_connection);
+
+    // the feed receives the changed orders from the listener of the cache
+    Error cache_error = {0};
+    OrderCacheObserver observer = { .changed = order_feed_changed, .flush = order_feed_flush, .arg = &order_feed };
+    if (order_cache_init(&order_cache, config.order_cache_max_bytes, &cache_error) != EXIT_SUCCESS
+            || order_feed_init(&order_feed, &server.executor, config.feed_queue_length, &cache_error) != EXIT_SUCCESS
+            || order_feed_start(&order_feed, &db_router, &cache_error) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ERROR: cannot create order cache and feed: %s\r\n", cache_error.msg);
+        return 1;
+    }
+    if (config.feed_queue_length > 0)
+    {
+        order_cache_set_observer(&order_cache, &observer);
+    }
+    // every shard notifies the changes of its own orders
+    const char *shard_conninfos[CONFIG_MAX_SHARDS];
+    for (int i = 0; i < db_router.shards_length; i++)
+    {
+        shard_conninfos[i] = db_router_shard_conninfo(&db_router, i);
+    }
+    if (order_cache_start_listener(&order_cache, shard_conninfos, db_router.shards_length, &cache_error) != EXIT_SUCCESS)
     {
-        printf("ERROR: cannot initalize mutex\r\n");
+        fprintf(stderr, "ERROR: cannot create order cache: %s\r\n", cache_error.msg);
         return 1;
     }
-    Error error = server_loop(&server, server_port);
+    error = server_loop(&server, server_port);
     fprintf(stderr, "ERROR: cannot enter server loop: %s\r\n", error.msg);
     return 1;
 }
\ No newline at end of file
@@ -0,0 +1,331 @@
+#include "stock.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "database.h"
+#include "types.h"
+
+_Static_assert(sizeof(StockCell) == STOCK_CACHE_LINE, "stock cells must fill one cache line");
+
+/// @brief source of the shard indexes of the threads
+static atomic_uint next_thread_shard;
+
+/// @brief index of the cell of a hot item which the current thread reserves from, -1 if not assigned yet
+static _Thread_local int thread_shard = -1;
+
+/// @brief Returns the cell of the item which the current thread reserves from
+static StockCell *local_cell(StockCounter *counter) {
+    if (!counter->shards) {
+        return &counter->cell;
+    }
+    if (thread_shard < 0) {
+        thread_shard = atomic_fetch_add(&next_thread_shard, 1) % STOCK_HOT_SHARDS;
+    }
+    return &counter->shards[thread_shard];
+}
+
+/// @brief Takes the whole quantity from a cell if it is available
+/// @return 1 if the quantity was taken
+static int take(StockCell *cell, int64_t quantity) {
+    long long available = atomic_load_explicit(&cell->available, memory_order_relaxed);
+    while (available >= quantity) {
+        if (atomic_compare_exchange_weak_explicit(&cell->available, &available, available - quantity,
+                memory_order_relaxed, memory_order_relaxed)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/// @brief Takes as much as possible of a quantity from a cell
+/// @return quantity which was taken
+static int64_t take_up_to(StockCell *cell, int64_t quantity) {
+    long long available = atomic_load_explicit(&cell->available, memory_order_relaxed);
+    while (available > 0) {
+        int64_t taken = available < quantity ? available : quantity;
+        if (atomic_compare_exchange_weak_explicit(&cell->available, &available, available - taken,
+                memory_order_relaxed, memory_order_relaxed)) {
+            return taken;
+        }
+    }
+    return 0;
+}
+
+/// @brief Collects a quantity from all cells of a hot item, after the cell of the thread ran
+///        out of stock. Everything taken is put back into the local cell if the quantity
+///        cannot be collected.
+/// @return 1 if the quantity was taken
+static int take_from_shards(StockCounter *counter, StockCell *local, int64_t quantity) {
+    int first = local - counter->shards;
+    int64_t taken = 0;
+    for (int i = 0; i < STOCK_HOT_SHARDS && taken < quantity; i++) {
+        taken += take_up_to(&counter->shards[(first + i) % STOCK_HOT_SHARDS], quantity - taken);
+    }
+    if (taken < quantity) {
+        atomic_fetch_add_explicit(&local->available, taken, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/// @brief Spreads the stock of a hot item evenly over its cells after adding a correction.
+///        Concurrent reservations are not blocked, they may leave a cell negative for a while
+///        which only makes them take from the other cells.
+/// @param shards cells of the item
+/// @param correction quantity to add to the stock
+static void rebalance(StockCell *shards, int64_t correction) {
+    long long loads[STOCK_HOT_SHARDS];
+    int64_t total = correction;
+    for (int i = 0; i < STOCK_HOT_SHARDS; i++) {
+        loads[i] = atomic_load_explicit(&shards[i].available, memory_order_relaxed);
+        total += loads[i];
+    }
+    int64_t share = total / STOCK_HOT_SHARDS;
+    for (int i = 0; i < STOCK_HOT_SHARDS; i++) {
+        int64_t target = i == 0 ? total - share * (STOCK_HOT_SHARDS - 1) : share;
+        atomic_fetch_add_explicit(&shards[i].available, target - loads[i], memory_order_relaxed);
+    }
+}
+
+/// @brief Adds a quantity to the available stock of an item
+static void add_available(StockCounter *counter, int64_t quantity) {
+    if (counter->shards) {
+        rebalance(counter->shards, quantity);
+    } else {
+        atomic_fetch_add_explicit(&counter->cell.available, quantity, memory_order_relaxed);
+    }
+}
+
+/// @brief Returns the available stock of an item
+static int64_t sum_available(StockCounter *counter) {
+    if (!counter->shards) {
+        return atomic_load_explicit(&counter->cell.available, memory_order_relaxed);
+    }
+    int64_t sum = 0;
+    for (int i = 0; i < STOCK_HOT_SHARDS; i++) {
+        sum += atomic_load_explicit(&counter->shards[i].available, memory_order_relaxed);
+    }
+    return sum;
+}
+
+/// @brief Takes the reserved quantity of an item which is not yet subtracted in the database
+static int64_t take_pending(StockCounter *counter) {
+    if (!counter->shards) {
+        return atomic_exchange_explicit(&counter->cell.pending, 0, memory_order_relaxed);
+    }
+    int64_t sum = 0;
+    for (int i = 0; i < STOCK_HOT_SHARDS; i++) {
+        sum += atomic_exchange_explicit(&counter->shards[i].pending, 0, memory_order_relaxed);
+    }
+    return sum;
+}
+
+/// @brief Adds a reserved quantity which is not yet subtracted in the database
+static void add_pending(StockCounter *counter, int64_t quantity) {
+    StockCell *cell = counter->shards ? &counter->shards[0] : &counter->cell;
+    atomic_fetch_add_explicit(&cell->pending, quantity, memory_order_relaxed);
+}
+
+/// @brief Applies the available quantity in the database to the counters of an item
+/// @param counter counters of the item
+/// @param available available quantity in the database after the reserved quantity was subtracted
+static void apply_stock_level(StockCounter *counter, int64_t available) {
+    if (!(atomic_load(&counter->tracking) & 1)) {
+        add_available(counter, available - sum_available(counter));
+        counter->synced = available;
+        atomic_fetch_add(&counter->tracking, 1);
+        return;
+    }
+    // anything besides our own reservations was changed by others
+    int64_t correction = available - (counter->synced - counter->reconciling);
+    counter->synced = available;
+    add_available(counter, correction);
+}
+
+int stock_load(Stock *stock, PGconn *conn, const int32_t *hot_items, int hot_items_length, Error *error) {
+    memset(stock, 0, sizeof(*stock));
+    int32_t max_item_id;
+    StockLevel *levels;
+    int levels_length;
+    if (db_get_max_item_id(conn, &max_item_id, error) != EXIT_SUCCESS
+            || db_get_stock(conn, &levels, &levels_length, error) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < levels_length; i++) {
+        if (levels[i].item_id > max_item_id) {
+            max_item_id = levels[i].item_id;
+        }
+    }
+    int32_t length = max_item_id + 1 + STOCK_SPARE_ITEMS;
+    StockCounter *counters = aligned_alloc(STOCK_CACHE_LINE, length * sizeof(StockCounter));
+    if (!counters) {
+        error_write(error, "cannot allocate stock counters for %d items", length);
+        free(levels);
+        return EXIT_FAILURE;
+    }
+    memset(counters, 0, length * sizeof(StockCounter));
+    for (int i = 0; i < hot_items_length; i++) {
+        if (hot_items[i] < 0 || hot_items[i] >= length || counters[hot_items[i]].shards) {
+            continue;
+        }
+        StockCell *shards = aligned_alloc(STOCK_CACHE_LINE, STOCK_HOT_SHARDS * sizeof(StockCell));
+        if (!shards) {
+            error_write(error, "cannot allocate stock counters for hot item %d", hot_items[i]);
+            for (int32_t j = 0; j < length; j++) {
+                free(counters[j].shards);
+            }
+            free(counters);
+            free(levels);
+            return EXIT_FAILURE;
+        }
+        memset(shards, 0, STOCK_HOT_SHARDS * sizeof(StockCell));
+        counters[hot_items[i]].shards = shards;
+    }
+    for (int i = 0; i < levels_length; i++) {
+        if (levels[i].item_id >= 0) {
+            apply_stock_level(&counters[levels[i].item_id], levels[i].quantity);
+        }
+    }
+    free(levels);
+    stock->counters = counters;
+    stock->counters_length = length;
+    return EXIT_SUCCESS;
+}
+
+int stock_reserve(Stock *stock, int32_t item_id, int32_t quantity, uint32_t *reservation) {
+    *reservation = 0;
+    if (item_id < 0 || item_id >= stock->counters_length) {
+        return EXIT_SUCCESS;
+    }
+    StockCounter *counter = &stock->counters[item_id];
+    uint32_t tracking = atomic_load_explicit(&counter->tracking, memory_order_acquire);
+    if (!(tracking & 1)) {
+        return EXIT_SUCCESS;
+    }
+    StockCell *cell = local_cell(counter);
+    if (!take(cell, quantity) && (!counter->shards || !take_from_shards(counter, cell, quantity))) {
+        return EXIT_FAILURE;
+    }
+    atomic_fetch_add_explicit(&cell->pending, quantity, memory_order_relaxed);
+    *reservation = tracking;
+    return EXIT_SUCCESS;
+}
+
+void stock_release(Stock *stock, int32_t item_id, int32_t quantity, uint32_t reservation) {
+    if (reservation == 0 || item_id < 0 || item_id >= stock->counters_length) {
+        return;
+    }
+    // a reservation from an earlier tracking was dropped together with the pending quantities
+    StockCounter *counter = &stock->counters[item_id];
+    if (atomic_load_explicit(&counter->tracking, memory_order_acquire) != reservation) {
+        return;
+    }
+    // the pending quantity may turn negative if it was already taken by the reconciliation,
+    // the next reconciliation then returns the quantity to the database
+    StockCell *cell = local_cell(counter);
+    atomic_fetch_add_explicit(&cell->available, quantity, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&cell->pending, quantity, memory_order_relaxed);
+}
+
+/// @brief Subtracts the reserved quantities in the database and applies changes of others
+/// @param stock loaded stock
+/// @param conn connection to the primary database
+/// @param reserved buffer for a stock level of every counter
+/// @param seen buffer for a flag of every counter
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+static int reconcile(Stock *stock, PGconn *conn, StockLevel *reserved, uint8_t *seen, Error *error) {
+    int reserved_length = 0;
+    for (int32_t i = 0; i < stock->counters_length; i++) {
+        StockCounter *counter = &stock->counters[i];
+        counter->reconciling = 0;
+        if (atomic_load(&counter->tracking) & 1) {
+            counter->reconciling = take_pending(counter);
+            if (counter->reconciling != 0) {
+                reserved[reserved_length].item_id = i;
+                reserved[reserved_length].quantity = counter->reconciling;
+                reserved_length++;
+            }
+        }
+    }
+    StockLevel *levels;
+    int levels_length;
+    if (db_reconcile_stock(conn, reserved, reserved_length, &levels, &levels_length, error) != EXIT_SUCCESS) {
+        // keep the reservations for the next attempt
+        for (int i = 0; i < reserved_length; i++) {
+            add_pending(&stock->counters[reserved[i].item_id], reserved[i].quantity);
+        }
+        return EXIT_FAILURE;
+    }
+    memset(seen, 0, stock->counters_length);
+    for (int i = 0; i < levels_length; i++) {
+        // items added after the start beyond STOCK_SPARE_ITEMS stay unlimited until a restart
+        if (levels[i].item_id >= 0 && levels[i].item_id < stock->counters_length) {
+            seen[levels[i].item_id] = 1;
+            apply_stock_level(&stock->counters[levels[i].item_id], levels[i].quantity);
+        }
+    }
+    free(levels);
+    for (int32_t i = 0; i < stock->counters_length; i++) {
+        StockCounter *counter = &stock->counters[i];
+        if (!seen[i] && (atomic_load(&counter->tracking) & 1)) {
+            // the stock row was deleted, the item is no longer limited
+            atomic_fetch_add(&counter->tracking, 1);
+            take_pending(counter);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Main loop of the reconciliation thread. Failed reconciliations are retried with
+///        a new connection.
+/// @param arg stock
+/// @return NULL
+static void *reconcile_loop(void *arg) {
+    Stock *stock = arg;
+    StockLevel *reserved = malloc(stock->counters_length * sizeof(StockLevel));
+    uint8_t *seen = malloc(stock->counters_length);
+    if (!reserved || !seen) {
+        fprintf(stderr, "ERROR: cannot allocate stock reconciliation buffers\r\n");
+        free(reserved);
+        free(seen);
+        return NULL;
+    }
+    struct timespec interval = {
+        .tv_sec = stock->reconcile_ms / 1000,
+        .tv_nsec = (stock->reconcile_ms % 1000) * 1000000L
+    };
+    PGconn *conn = NULL;
+    while (1) {
+        nanosleep(&interval, NULL);
+        Error error = {0};
+        if (!conn) {
+            conn = PQconnectdb(stock->conninfo);
+        }
+        if (PQstatus(conn) != CONNECTION_OK) {
+            snprintf(error.msg, sizeof(error.msg), "%s", PQerrorMessage(conn));
+        } else if (reconcile(stock, conn, reserved, seen, &error) == EXIT_SUCCESS) {
+            continue;
+        }
+        fprintf(stderr, "ERROR: cannot reconcile stock: %s\r\n", error.msg);
+        PQfinish(conn);
+        conn = NULL;
+        sleep(1);
+    }
+    return NULL;
+}
+
+int stock_start_reconciler(Stock *stock, const char *conninfo, int reconcile_ms, Error *error) {
+    snprintf(stock->conninfo, sizeof(stock->conninfo), "%s", conninfo);
+    stock->reconcile_ms = reconcile_ms;
+    int result = pthread_create(&stock->reconciler, NULL, reconcile_loop, stock);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
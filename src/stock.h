@@ -0,0 +1,85 @@
+#ifndef __STOCK_H_
+#define __STOCK_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <libpq-fe.h>
+
+#include "config.h"
+#include "error.h"
+
+#define STOCK_CACHE_LINE            64
+#define STOCK_HOT_SHARDS            16      // counters of a hot item, each thread reserves from one of them
+#define STOCK_SPARE_ITEMS           1024    // counters for items which are added after the start
+#define STOCK_DEFAULT_RECONCILE_MS  100
+
+/// @brief Counters of an item on their own cache line
+typedef struct {
+    _Alignas(STOCK_CACHE_LINE)
+    atomic_llong    available;  // quantity which can be reserved
+    atomic_llong    pending;    // reserved quantity which is not yet subtracted in the database
+} StockCell;
+
+/// @brief Stock of a single item. A hot item spreads its stock over STOCK_HOT_SHARDS cells,
+///        so concurrent reservations of the same item do not contend on a single cache line.
+typedef struct {
+    StockCell       cell;       // counters of the item, unused for hot items
+    StockCell       *shards;    // STOCK_HOT_SHARDS counters of a hot item, NULL otherwise
+    atomic_uint     tracking;   // odd while the item has a row in the stock table, other items are not limited,
+                                // incremented whenever this changes
+    int64_t         synced;     // available quantity in the database after the last reconciliation
+    int64_t         reconciling;// reserved quantity passed to the database in the current reconciliation
+} StockCounter;
+
+/// @brief In-memory stock of all items. Reservations only touch atomic counters, a background
+///        thread subtracts the reserved quantities from the stock table in batches and applies
+///        changes made by others, e.g. restocking, to the counters.
+///        Reservations are exact within one server. Several servers sharing a database each
+///        reserve from the full stock, so they may oversell by what is reserved between two
+///        reconciliations.
+typedef struct {
+    StockCounter    *counters;                      // indexed by item ID
+    int32_t         counters_length;                // items with a higher ID are not limited
+    int             reconcile_ms;                   // interval of the reconciliation
+    char            conninfo[CONFIG_MAX_CONNINFO];  // database of the reconciliation
+    pthread_t       reconciler;                     // thread of the reconciliation
+} Stock;
+
+/// @brief Loads the stock table into memory
+/// @param stock stock to initialize
+/// @param conn connection to the database
+/// @param hot_items IDs of items which are reserved by many clients at once
+/// @param hot_items_length amount of hot items
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int stock_load(Stock *stock, PGconn *conn, const int32_t *hot_items, int hot_items_length, Error *error);
+
+/// @brief Starts the thread which reconciles the counters with the stock table
+/// @param stock loaded stock
+/// @param conninfo connection string of the primary database
+/// @param reconcile_ms interval of the reconciliation
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int stock_start_reconciler(Stock *stock, const char *conninfo, int reconcile_ms, Error *error);
+
+/// @brief Reserves a quantity of an item
+/// @param stock loaded stock
+/// @param item_id ID of the item
+/// @param quantity quantity to reserve, must be positive
+/// @param reservation address to save the handle of the reservation for stock_release(),
+///        0 if nothing was reserved because the item is not limited
+/// @return EXIT_SUCCESS if the quantity was reserved or the item is not limited,
+///         EXIT_FAILURE if it is not in stock
+int stock_reserve(Stock *stock, int32_t item_id, int32_t quantity, uint32_t *reservation);
+
+/// @brief Returns a reservation, e.g. if the order could not be stored. Nothing is returned
+///        if nothing was reserved or the item stopped being limited since the reservation,
+///        which dropped the reserved quantities.
+/// @param stock loaded stock
+/// @param item_id ID of the item
+/// @param quantity reserved quantity
+/// @param reservation handle saved by stock_reserve()
+void stock_release(Stock *stock, int32_t item_id, int32_t quantity, uint32_t reservation);
+
+#endif
@@ -0,0 +1,166 @@
+#include "timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define LEVEL_MASK      (TIMER_LEVEL_SLOTS - 1)
+#define MAX_TICKS       ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+/// @brief Returns the time of a monotonic clock in milliseconds
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief Links the timer into the slot covering its expiry, the wheel lock must be held
+static void link_timer(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires <= wheel->current) {
+        // already due, expire on the next tick
+        timer->expires = wheel->current + 1;
+    }
+    uint64_t delta = timer->expires - wheel->current;
+    if (delta >= MAX_TICKS) {
+        timer->expires = wheel->current + MAX_TICKS - 1;
+        delta = MAX_TICKS - 1;
+    }
+    int level = 0;
+    while (delta >= ((uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    Timer *head = &wheel->slots[level][(timer->expires >> (TIMER_LEVEL_BITS * level)) & LEVEL_MASK];
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = 1;
+}
+
+/// @brief Removes the timer from its slot, the wheel lock must be held
+static void unlink_timer(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->armed = 0;
+}
+
+/// @brief Moves all timers of a slot to lower levels, the wheel lock must be held
+/// @return index of the slot
+static int cascade(TimerWheel *wheel, int level) {
+    int index = (wheel->current >> (TIMER_LEVEL_BITS * level)) & LEVEL_MASK;
+    Timer *head = &wheel->slots[level][index];
+    while (head->next != head) {
+        Timer *timer = head->next;
+        unlink_timer(timer);
+        link_timer(wheel, timer);
+    }
+    return index;
+}
+
+/// @brief Advances the wheel by one tick and runs the callbacks of expired timers. The wheel
+///        lock must be held, it is released while a callback runs.
+static void advance(TimerWheel *wheel) {
+    wheel->current++;
+    int index = wheel->current & LEVEL_MASK;
+    for (int level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+        index = cascade(wheel, level);
+    }
+    Timer *head = &wheel->slots[0][wheel->current & LEVEL_MASK];
+    while (head->next != head) {
+        Timer *timer = head->next;
+        unlink_timer(timer);
+        wheel->armed--;
+        wheel->running = timer;
+        pthread_mutex_unlock(&wheel->lock);
+        timer->expire(timer);
+        pthread_mutex_lock(&wheel->lock);
+        wheel->running = NULL;
+        pthread_cond_broadcast(&wheel->done);
+    }
+}
+
+/// @brief Main loop of the wheel thread. The thread sleeps until the next tick while timers
+///        are armed and until a timer is armed otherwise.
+static void *wheel_loop(void *arg) {
+    TimerWheel *wheel = arg;
+    pthread_mutex_lock(&wheel->lock);
+    while (1) {
+        if (wheel->armed == 0) {
+            pthread_cond_wait(&wheel->changed, &wheel->lock);
+            continue;
+        }
+        uint64_t now = (now_ms() - wheel->start_ms) / TIMER_TICK_MS;
+        while (wheel->current < now) {
+            advance(wheel);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+        struct timespec tick = { .tv_sec = 0, .tv_nsec = TIMER_TICK_MS * 1000000L };
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&wheel->lock);
+    }
+    return NULL;
+}
+
+void timer_wheel_init(TimerWheel *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int i = 0; i < TIMER_LEVEL_SLOTS; i++) {
+            wheel->slots[level][i].prev = &wheel->slots[level][i];
+            wheel->slots[level][i].next = &wheel->slots[level][i];
+        }
+    }
+    wheel->start_ms = now_ms();
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_cond_init(&wheel->changed, NULL);
+    pthread_cond_init(&wheel->done, NULL);
+}
+
+int timer_wheel_start(TimerWheel *wheel, Error *error) {
+    int result = pthread_create(&wheel->thread, NULL, wheel_loop, wheel);
+    if (result != 0) {
+        strerror_r(result, error->msg, sizeof(error->msg));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void timer_init(Timer *timer, void (*expire)(Timer *timer)) {
+    memset(timer, 0, sizeof(*timer));
+    timer->expire = expire;
+}
+
+void timer_schedule(TimerWheel *wheel, Timer *timer, uint32_t timeout_ms) {
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->armed) {
+        unlink_timer(timer);
+        wheel->armed--;
+    }
+    int64_t elapsed = now_ms() - wheel->start_ms;
+    if (wheel->armed == 0 && !wheel->running) {
+        // the wheel does not tick while it is empty, skip the ticks which passed meanwhile
+        wheel->current = elapsed / TIMER_TICK_MS;
+    }
+    // round up, a timer never expires early
+    timer->expires = (elapsed + timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    link_timer(wheel, timer);
+    if (wheel->armed++ == 0) {
+        pthread_cond_signal(&wheel->changed);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->armed) {
+        unlink_timer(timer);
+        wheel->armed--;
+    }
+    while (wheel->running == timer) {
+        pthread_cond_wait(&wheel->done, &wheel->lock);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
@@ -0,0 +1,68 @@
+#ifndef __TIMER_H_
+#define __TIMER_H_
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "error.h"
+
+#define TIMER_TICK_MS       10      // resolution of the timing wheel
+#define TIMER_LEVEL_BITS    6
+#define TIMER_LEVEL_SLOTS   (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS        4       // 64^4 ticks, about 31 days at 10ms per tick
+
+/// @brief Timer embedded into the structure it belongs to. The expire callback runs on the
+///        thread of the timing wheel and must not schedule or cancel the same timer.
+typedef struct Timer {
+    struct Timer    *prev;              // neighbours in the slot of the wheel
+    struct Timer    *next;
+    uint64_t        expires;            // tick at which the timer expires
+    int             armed;              // the timer is linked into a slot
+    void (*expire)(struct Timer *timer);
+} Timer;
+
+/// @brief Hashed hierarchical timing wheel. Every level has 64 slots, a slot of a level spans
+///        all 64 slots of the level below. Timers are linked into the slot of the lowest level
+///        which covers their expiry and move down a level when the wheel reaches their slot,
+///        so inserting and cancelling a timer is O(1) independent of the amount of timers.
+///        A single thread advances the wheel and runs the expire callbacks.
+typedef struct {
+    Timer           slots[TIMER_LEVELS][TIMER_LEVEL_SLOTS];    // list heads of the slots
+    int64_t         start_ms;           // monotonic time of tick 0
+    uint64_t        current;            // last processed tick
+    long            armed;              // amount of armed timers
+    Timer           *running;           // timer whose callback is running
+    pthread_mutex_t lock;               // protects all fields above
+    pthread_cond_t  changed;            // signalled when the first timer is armed
+    pthread_cond_t  done;               // signalled when a callback finished
+    pthread_t       thread;             // thread advancing the wheel
+} TimerWheel;
+
+/// @brief Initializes the wheel without starting its thread
+/// @param wheel wheel to initialize
+void timer_wheel_init(TimerWheel *wheel);
+
+/// @brief Starts the thread which advances the wheel
+/// @param wheel initialized wheel
+/// @param error address of error object to set an error message on failure
+/// @return EXIT_SUCCESS on success
+int timer_wheel_start(TimerWheel *wheel, Error *error);
+
+/// @brief Initializes a disarmed timer
+/// @param timer timer to initialize
+/// @param expire callback which is called when the timer expires
+void timer_init(Timer *timer, void (*expire)(Timer *timer));
+
+/// @brief Arms the timer, a timer which is already armed is moved to the new expiry
+/// @param wheel initialized wheel
+/// @param timer initialized timer
+/// @param timeout_ms time until the timer expires
+void timer_schedule(TimerWheel *wheel, Timer *timer, uint32_t timeout_ms);
+
+/// @brief Disarms the timer. If the callback of the timer is running, waits until it returned,
+///        so the structure of the timer can be released afterwards.
+/// @param wheel initialized wheel
+/// @param timer initialized timer
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+#endif
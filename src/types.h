@@ -13,6 +13,14 @@ typedef struct {
     char        name[255];  // item name
 } OrderItem;
 
+/// @brief Item of the shop catalog
+typedef struct {
+    int32_t     id;         // item id
+    int32_t     price;      // price of a single item
+    size_t      name_count; // length of name
+    char        name[255];  // item name
+} Item;
+
 /// @brief Single Order
 typedef struct {
     int32_t     id;         // order id
@@ -26,4 +34,34 @@ typedef struct {
     OrderItem order_item;
 } FullOrderItem;
 
+/// @brief Line of an order which was written into the order journal
+typedef struct {
+    int64_t     journal_seq;    // sequence number of the order in the journal
+    int32_t     item_id;        // item id
+    int32_t     quantity;       // amount of items ordered
+} JournalOrderLine;
+
+/// @brief Quantity of an item in stock
+typedef struct {
+    int32_t     item_id;        // item id
+    int64_t     quantity;       // amount of items
+} StockLevel;
+
+#define ORDER_DATE_NULL INT64_MIN   // order_date of an ExportOrderLine without date
+
+/// @brief Order line decoded from a bulk export. Text fields are not null terminated and
+///        point into the buffer of the database row.
+typedef struct {
+    int32_t     order_id;           // order id
+    int64_t     order_date;         // microseconds since 2000-01-01 00:00:00, ORDER_DATE_NULL if unknown
+    const char  *status;            // name of the status of the order
+    uint32_t    status_length;
+    int32_t     order_item_id;      // order item id
+    int32_t     item_id;            // item id
+    const char  *item_name;         // name of the item
+    uint32_t    item_name_length;
+    int32_t     quantity;           // amount of items ordered
+    int32_t     unit_price;         // price of a single item
+} ExportOrderLine;
+
 #endif
\ No newline at end of file